@@ -0,0 +1,100 @@
+#pragma once
+
+#include "bench_scene.h"
+
+#include "tp_device.h"
+#include "tp_draw_list.h"
+#include "tp_geometry_arena.h"
+#include "tp_renderer.h"
+#include "tp_virtual_texture_cache.h"
+#include "tp_window.h"
+
+// std
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace tpBench {
+
+using namespace teapot;
+
+struct BenchOptions {
+  SceneParams scene{};
+  uint32_t frames = 600;
+  uint32_t warmupFrames = 60;
+  int width = 1280;
+  int height = 720;
+  // throughput runs should not be capped by v-sync; falls back to fifo when unsupported
+  TpSwapChainConfig swapChain{TpPresentMode::Immediate};
+  TpDrawSortMode sortMode = TpDrawSortMode::State;
+  bool depthPrePass = false;
+  bool meshLods = true;
+  bool clusterCulling = true;
+  bool occlusionCulling = true;
+  bool softwareOcclusion = false;
+  bool vertexPulling = false;
+  bool virtualTexturing = false;
+  VkDeviceSize memoryCap = 0;  // caps device local budgets to exercise eviction, 0 for none
+  bool defragment = true;
+  unsigned workerThreads = 0;  // 0 picks one per core
+  std::string tracePath;
+};
+
+struct BenchResult {
+  std::string deviceName;
+  uint32_t visibleObjectsPerFrame = 0;  // the last measured frame
+  uint32_t transformsUpdatedPerFrame = 0;
+  uint32_t recordedDrawsPerFrame = 0;  // including indirect draws the GPU culled
+  uint32_t trianglesPerFrame = 0;
+  uint32_t clusteredDrawsPerFrame = 0;
+  uint32_t clustersTestedPerFrame = 0;
+  uint32_t materialBindsPerFrame = 0;
+  uint32_t meshBindsPerFrame = 0;
+  uint32_t bindsSavedPerFrame = 0;
+  uint32_t softwareCulledPerFrame = 0;
+  float softwareCullRate = 0.f;
+  std::vector<double> cpuFrameMs;
+  std::vector<double> softwareOcclusionMs;  // rasterization and tests, empty when off
+  std::vector<double> gpuFrameMs;
+  uint64_t memoryBlockBytes = 0;
+  uint64_t memoryUsedBytes = 0;
+  uint32_t allocationCount = 0;
+  TpGeometryStats geometry{};
+  TpTextureAtlasStats textures{};
+  TpVirtualTextureStats virtualTextures{};  // the last measured frame
+  bool memoryBudgetExtension = false;
+  VkDeviceSize deviceLocalBudget = 0;  // summed over device local heaps, at the end of the run
+  VkDeviceSize deviceLocalUsage = 0;
+  TpMemoryPressureStats memoryPressure{};
+  std::vector<TpMemoryPoolStats> memoryPools;  // per memory class, at the end of the run
+  TpDefragmentationStats defragmentation{};
+};
+
+/*
+ * Runs a synthetic scene for a fixed number of frames in a hidden window, with no input and a
+ * deterministic camera path.
+ */
+class BenchApp {
+ public:
+  explicit BenchApp(const BenchOptions &options);
+  ~BenchApp();
+
+  BenchApp(const BenchApp &) = delete;
+  BenchApp &operator=(const BenchApp &) = delete;
+
+  BenchResult run();
+
+ private:
+  BenchOptions options;
+
+  teapot::TpWindow tpWindow;
+  teapot::TpDevice tpDevice{tpWindow};
+  teapot::TpRenderer tpRenderer{tpWindow, tpDevice, options.swapChain};
+  teapot::TpGeometryArena geometry{tpDevice, sizeof(teapot::Vertex)};
+  teapot::TpTextureAtlas textures{tpDevice};
+};
+
+void writeResultJson(std::ostream &out, const BenchOptions &options, const BenchResult &result);
+
+}  // namespace tpBench
@@ -0,0 +1,28 @@
+#pragma once
+
+// std
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace tpBench {
+
+// Just enough JSON to read back the reports and baselines the benchmark writes.
+struct JsonValue {
+  enum class Type { Null, Bool, Number, String, Array, Object };
+
+  Type type = Type::Null;
+  bool boolean = false;
+  double number = 0.0;
+  std::string string;
+  std::vector<JsonValue> array;
+  std::vector<std::pair<std::string, JsonValue>> object;
+
+  const JsonValue *find(const std::string &key) const;
+  std::vector<double> numbers() const;
+};
+
+JsonValue parseJson(const std::string &text);
+JsonValue readJsonFile(const std::string &filePath);
+
+}  // namespace tpBench
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "bench_scene.h"
+
+// std
+#include <string>
+#include <vector>
+
+namespace tpBench {
+
+struct Scenario {
+  const char *name;
+  const char *description;
+  SceneParams scene;
+};
+
+// Named scenes that baselines are recorded against. Changing one invalidates its baselines.
+const std::vector<Scenario> &scenarios();
+const Scenario *findScenario(const std::string &name);
+
+}  // namespace tpBench
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "tp_camera.h"
+#include "tp_device.h"
+#include "tp_model.h"
+#include "tp_scene.h"
+#include "tp_virtual_texture_cache.h"
+
+// std
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace tpBench {
+
+using namespace teapot;
+
+struct SceneParams {
+  uint32_t objectCount = 1000;
+  uint32_t modelCount = 8;
+  uint32_t textureCount = 8;
+  uint32_t textureSize = 256;
+  uint32_t seed = 1;
+};
+
+struct BenchScene {
+  TpScene world;
+  glm::vec3 center{0.f};
+  float radius = 1.f;
+};
+
+/*
+ * Builds a synthetic stress scene: modelCount procedural meshes, textureCount procedural
+ * textures and objectCount instances with randomized transforms. The same params always give
+ * the same scene.
+ */
+BenchScene buildScene(TpDevice &device, TpGeometryArena &geometry, TpTextureAtlas &textures,
+                      const SceneParams &params);
+
+// Writes a VIRTUAL_TEXTURE_SIZE checker to a tiled image at path and textures every model of
+// the scene with it through the cache.
+constexpr uint32_t VIRTUAL_TEXTURE_SIZE = 4096;
+void useVirtualTexture(BenchScene &scene, TpVirtualTextureCache &cache, const std::string &path);
+
+// Deterministic orbit around the scene, one full revolution over frameCount frames.
+void orbitCamera(TpCamera &camera, const BenchScene &scene, float aspect,
+                 uint32_t frame, uint32_t frameCount);
+
+}  // namespace tpBench
@@ -0,0 +1,44 @@
+#pragma once
+
+// std
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace tpBench {
+
+struct SampleSummary {
+  double mean = 0.0;
+  double p50 = 0.0;
+  double p95 = 0.0;
+  double p99 = 0.0;
+  double min = 0.0;
+  double max = 0.0;
+  size_t count = 0;
+};
+
+struct MannWhitneyResult {
+  double u = 0.0;
+  double z = 0.0;
+  // one-sided: probability of seeing this shift if current is not slower than baseline
+  double pValue = 1.0;
+};
+
+struct ConfidenceInterval {
+  double lower = 0.0;
+  double upper = 0.0;
+};
+
+SampleSummary summarize(const std::vector<double> &samples);
+double median(std::vector<double> samples);
+
+// Mann-Whitney U test for "current > baseline": exact for up to 30 samples per side without ties,
+// otherwise the normal approximation with tie correction. The samples must be independent, so
+// test one value per run rather than the frames of a run.
+MannWhitneyResult mannWhitneyGreater(const std::vector<double> &baseline, const std::vector<double> &current);
+
+// Bootstrapped confidence interval of median(current) / median(baseline) - 1.
+ConfidenceInterval bootstrapMedianShift(const std::vector<double> &baseline, const std::vector<double> &current,
+                                        double confidence, uint32_t iterations, uint32_t seed);
+
+}  // namespace tpBench
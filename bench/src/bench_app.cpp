@@ -0,0 +1,305 @@
+#include "bench_app.h"
+#include "bench_stats.h"
+
+#include "simple_render_system.h"
+#include "tp_cpu_profiler.h"
+#include "tp_occlusion_buffer.h"
+#include "tp_thread_pool.h"
+
+// std
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+namespace tpBench {
+
+namespace {
+
+// the classes with a pool of their own
+constexpr TpMemoryClass MEMORY_POOL_CLASSES[] = {TpMemoryClass::StaticGeometry, TpMemoryClass::Textures,
+                                                 TpMemoryClass::Dynamic, TpMemoryClass::Staging};
+
+}  // namespace
+
+BenchApp::BenchApp(const BenchOptions &options)
+    : options{options}, tpWindow{options.width, options.height, "teapotBench", false} {
+}
+
+BenchApp::~BenchApp() = default;
+
+BenchResult BenchApp::run() {
+  tpDevice.setMemoryBudgetCap(options.memoryCap);
+  tpDevice.setAutomaticDefragmentation(options.defragment);
+  SimpleRenderSystem simpleRenderSystem{tpDevice, tpRenderer.getSwapChainRenderPass()};
+  simpleRenderSystem.setSortMode(options.sortMode);
+  simpleRenderSystem.setDepthPrePassEnabled(options.depthPrePass);
+  simpleRenderSystem.setLodEnabled(options.meshLods);
+  simpleRenderSystem.setClusterCullingEnabled(options.clusterCulling);
+  simpleRenderSystem.setOcclusionCullingEnabled(options.occlusionCulling);
+  simpleRenderSystem.setVertexPullingEnabled(options.vertexPulling);
+  BenchScene scene = buildScene(tpDevice, geometry, textures, options.scene);
+  std::unique_ptr<TpVirtualTextureCache> virtualTextures;
+  if (options.virtualTexturing) {
+    virtualTextures = std::make_unique<TpVirtualTextureCache>(tpDevice);
+    useVirtualTexture(scene, *virtualTextures, "teapot_bench_virtual.tiles");
+  }
+  TpThreadPool threadPool{options.workerThreads};
+  TpOcclusionBuffer occlusionBuffer;
+  std::vector<uint32_t> visible;
+
+  bool gpuTimings = tpRenderer.setGpuProfilingEnabled(true);
+  if (!gpuTimings) {
+    std::cerr << "GPU timestamps not supported, gpu times will be empty" << std::endl;
+  }
+
+  BenchResult result{};
+  result.deviceName = tpDevice.properties.deviceName;
+  result.cpuFrameMs.reserve(options.frames);
+  result.gpuFrameMs.reserve(options.frames);
+  if (options.softwareOcclusion) result.softwareOcclusionMs.reserve(options.frames);
+
+  TpCpuProfiler::setEnabled(!options.tracePath.empty());
+
+  TpCamera camera{};
+  uint32_t totalFrames = options.warmupFrames + options.frames;
+  uint64_t resolvedFrames = 0;
+
+  // the same passes as the demo: the main pass, then the occlusion test and the second phase
+  bool secondPhase = false;
+  tpRenderer.setFrameGraph([&](TpRenderGraph &graph, TpRgResource color, TpRgResource depth) {
+    VkClearValue clearColor{};
+    clearColor.color = {0.1f, 0.1f, 0.1f, 1.0f};
+    VkClearValue clearDepth{};
+    clearDepth.depthStencil = {1.0f, 0};
+    TpRgPass mainPass = graph.addPass("MainPass", [&](const TpRgPassContext &context) {
+      TpGpuZone zone{tpRenderer.getGpuProfiler(), context.commandBuffer, "SimpleRenderSystem"};
+      simpleRenderSystem.renderScene(context.commandBuffer, scene.world, camera);
+    });
+    graph.write(mainPass, color, TpRgAccess::ColorAttachment, clearColor);
+    graph.write(mainPass, depth, TpRgAccess::DepthAttachment, clearDepth);
+    if (!options.occlusionCulling) return;
+
+    TpRgPass occlusionPass = graph.addPass("OcclusionCulling", [&, depth](const TpRgPassContext &context) {
+      TpGpuZone zone{tpRenderer.getGpuProfiler(), context.commandBuffer, "OcclusionCulling"};
+      secondPhase = simpleRenderSystem.cullOccluded(context.commandBuffer, graph.getImageView(depth),
+                                                    tpRenderer.getSwapChainExtent());
+    });
+    graph.read(occlusionPass, depth, TpRgAccess::SampledCompute);
+    graph.setSideEffect(occlusionPass);
+
+    TpRgPass secondPhasePass = graph.addPass("MainPassResumed", [&](const TpRgPassContext &context) {
+      if (!secondPhase) return;
+      TpGpuZone zone{tpRenderer.getGpuProfiler(), context.commandBuffer, "SimpleRenderSystemSecondPhase"};
+      simpleRenderSystem.renderScene(context.commandBuffer, scene.world, camera);
+    });
+    graph.write(secondPhasePass, color, TpRgAccess::ColorAttachment);
+    graph.write(secondPhasePass, depth, TpRgAccess::DepthAttachment);
+  });
+
+  for (uint32_t frame = 0; frame < totalFrames; frame++) {
+    glfwPollEvents();
+    bool measured = frame >= options.warmupFrames;
+    orbitCamera(camera, scene, tpRenderer.getAspectRatio(), frame, totalFrames);
+
+    auto frameStart = std::chrono::steady_clock::now();
+    size_t transformsUpdated = scene.world.updateTransforms(&threadPool);
+    scene.world.cull(TpFrustum{camera.getProjection() * camera.getView()}, visible, &threadPool);
+    if (options.softwareOcclusion) {
+      occlusionBuffer.render(scene.world, visible, camera, &threadPool);
+      occlusionBuffer.cull(scene.world, visible, &threadPool);
+    }
+
+    // no frame while the swap chain is out of date or the window minimized
+    auto commandBuffer = tpRenderer.beginFrame();
+    if (commandBuffer) {
+      auto profiler = tpRenderer.getGpuProfiler();
+      if (measured && profiler != nullptr && profiler->getResolvedFrameCount() != resolvedFrames) {
+        for (const auto &timing : profiler->getLastFrameTimings()) {
+          if (timing.first == TpGpuProfiler::FRAME_ZONE_NAME) result.gpuFrameMs.push_back(timing.second);
+        }
+      }
+      if (profiler != nullptr) resolvedFrames = profiler->getResolvedFrameCount();
+
+      if (virtualTextures) {
+        TpGpuZone zone{profiler, commandBuffer, "VirtualTextureUpdate"};
+        virtualTextures->update(commandBuffer, tpRenderer.getFrameIndex());
+      }
+      {
+        TpGpuZone zone{profiler, commandBuffer, "ClusterCulling"};
+        simpleRenderSystem.prepareFrame(commandBuffer, tpRenderer.getFrameIndex(), scene.world, visible, camera);
+      }
+      tpRenderer.executeFrameGraph(commandBuffer);
+      if (virtualTextures) {
+        virtualTextures->finishFrame(commandBuffer);
+      }
+      tpRenderer.endFrame();
+    }
+    auto frameEnd = std::chrono::steady_clock::now();
+
+    if (measured && commandBuffer) {
+      result.cpuFrameMs.push_back(std::chrono::duration<double, std::milli>(frameEnd - frameStart).count());
+      const auto &renderStats = simpleRenderSystem.getStats();
+      result.visibleObjectsPerFrame = static_cast<uint32_t>(visible.size());
+      result.transformsUpdatedPerFrame = static_cast<uint32_t>(transformsUpdated);
+      result.recordedDrawsPerFrame = renderStats.recordedDraws;
+      result.trianglesPerFrame = renderStats.triangles;
+      result.clusteredDrawsPerFrame = renderStats.clusteredDrawCalls;
+      result.clustersTestedPerFrame = renderStats.clustersTested;
+      result.materialBindsPerFrame = renderStats.materialBinds;
+      result.meshBindsPerFrame = renderStats.meshBinds;
+      result.bindsSavedPerFrame = renderStats.bindsSaved();
+      if (virtualTextures) result.virtualTextures = virtualTextures->getStats();
+      if (options.softwareOcclusion) {
+        const auto &occlusionStats = occlusionBuffer.getStats();
+        result.softwareCulledPerFrame = occlusionStats.culled;
+        result.softwareCullRate = occlusionStats.cullRate();
+        result.softwareOcclusionMs.push_back(occlusionStats.rasterizeMs + occlusionStats.testMs);
+      }
+    }
+  }
+
+  vkDeviceWaitIdle(tpDevice.device());
+  tpRenderer.setFrameGraph(nullptr);
+
+  if (!options.tracePath.empty() && !TpCpuProfiler::exportChromeTrace(options.tracePath)) {
+    std::cerr << "failed to write trace to " << options.tracePath << std::endl;
+  }
+
+  VmaStats stats{};
+  vmaCalculateStats(tpDevice.allocator(), &stats);
+  result.memoryBlockBytes = stats.total.usedBytes + stats.total.unusedBytes;
+  result.memoryUsedBytes = stats.total.usedBytes;
+  result.allocationCount = stats.total.allocationCount;
+  result.geometry = geometry.getStats();
+  result.textures = textures.getStats();
+  result.memoryBudgetExtension = tpDevice.supportsMemoryBudget();
+  for (const auto &heap : tpDevice.getMemoryBudget()) {
+    if (!heap.deviceLocal) continue;
+    result.deviceLocalBudget += heap.budget;
+    result.deviceLocalUsage += heap.usage;
+  }
+  result.memoryPressure = tpDevice.getMemoryPressureStats();
+  for (TpMemoryClass memoryClass : MEMORY_POOL_CLASSES) {
+    result.memoryPools.push_back(tpDevice.getMemoryPoolStats(memoryClass));
+  }
+  result.defragmentation = tpDevice.getDefragmentationStats();
+
+  return result;
+}
+
+namespace {
+
+void writeSummary(std::ostream &out, const std::vector<double> &samples) {
+  SampleSummary summary = summarize(samples);
+  out << "{\"mean\": " << summary.mean << ", \"p50\": " << summary.p50
+      << ", \"p95\": " << summary.p95 << ", \"p99\": " << summary.p99
+      << ", \"min\": " << summary.min << ", \"max\": " << summary.max
+      << ", \"count\": " << summary.count << "}";
+}
+
+void writeSamples(std::ostream &out, const std::vector<double> &samples) {
+  out << "[";
+  for (size_t i = 0; i < samples.size(); i++) {
+    out << (i == 0 ? "" : ", ") << samples[i];
+  }
+  out << "]";
+}
+
+}  // namespace
+
+void writeResultJson(std::ostream &out, const BenchOptions &options, const BenchResult &result) {
+  const auto &scene = options.scene;
+  out << "{\n"
+      << "  \"device\": \"" << result.deviceName << "\",\n"
+      << "  \"scene\": {\"objects\": " << scene.objectCount << ", \"models\": " << scene.modelCount
+      << ", \"textures\": " << scene.textureCount << ", \"textureSize\": " << scene.textureSize
+      << ", \"seed\": " << scene.seed << "},\n"
+      << "  \"frames\": " << options.frames << ",\n"
+      << "  \"warmupFrames\": " << options.warmupFrames << ",\n"
+      << "  \"resolution\": [" << options.width << ", " << options.height << "],\n"
+      << "  \"swapChain\": {\"presentMode\": \"" << presentModeName(options.swapChain.presentMode)
+      << "\", \"framesInFlight\": " << options.swapChain.framesInFlight
+      << ", \"minImageCount\": " << options.swapChain.minImageCount << "},\n"
+      << "  \"sortMode\": \"" << drawSortModeName(options.sortMode) << "\",\n"
+      << "  \"depthPrePass\": " << (options.depthPrePass ? "true" : "false") << ",\n"
+      << "  \"meshLods\": " << (options.meshLods ? "true" : "false") << ",\n"
+      << "  \"clusterCulling\": " << (options.clusterCulling ? "true" : "false") << ",\n"
+      << "  \"occlusionCulling\": " << (options.occlusionCulling ? "true" : "false") << ",\n"
+      << "  \"softwareOcclusion\": " << (options.softwareOcclusion ? "true" : "false") << ",\n"
+      << "  \"vertexPulling\": " << (options.vertexPulling ? "true" : "false") << ",\n"
+      << "  \"virtualTexturing\": " << (options.virtualTexturing ? "true" : "false") << ",\n"
+      << "  \"workerThreads\": " << options.workerThreads << ",\n"
+      << "  \"visibleObjectsPerFrame\": " << result.visibleObjectsPerFrame << ",\n"
+      << "  \"transformsUpdatedPerFrame\": " << result.transformsUpdatedPerFrame << ",\n"
+      << "  \"recordedDrawsPerFrame\": " << result.recordedDrawsPerFrame << ",\n"
+      << "  \"trianglesPerFrame\": " << result.trianglesPerFrame << ",\n"
+      << "  \"clusters\": {\"drawsPerFrame\": " << result.clusteredDrawsPerFrame
+      << ", \"testedPerFrame\": " << result.clustersTestedPerFrame << "},\n"
+      << "  \"softwareCulling\": {\"culledPerFrame\": " << result.softwareCulledPerFrame
+      << ", \"cullRate\": " << result.softwareCullRate << ", \"ms\": ";
+  writeSummary(out, result.softwareOcclusionMs);
+  out << "},\n"
+      << "  \"bindsPerFrame\": {\"material\": " << result.materialBindsPerFrame
+      << ", \"mesh\": " << result.meshBindsPerFrame << ", \"saved\": " << result.bindsSavedPerFrame << "},\n"
+      << "  \"memory\": {\"blockBytes\": " << result.memoryBlockBytes
+      << ", \"usedBytes\": " << result.memoryUsedBytes
+      << ", \"allocations\": " << result.allocationCount << "},\n"
+      << "  \"geometry\": {\"meshes\": " << result.geometry.meshes
+      << ", \"vertexUsed\": " << result.geometry.vertexUsed
+      << ", \"vertexCapacity\": " << result.geometry.vertexCapacity
+      << ", \"indexUsed\": " << result.geometry.indexUsed
+      << ", \"indexCapacity\": " << result.geometry.indexCapacity
+      << ", \"grows\": " << result.geometry.grows
+      << ", \"trims\": " << result.geometry.trims << "},\n"
+      << "  \"textureAtlas\": {\"textures\": " << result.textures.textures
+      << ", \"arrays\": " << result.textures.arrays
+      << ", \"layers\": " << result.textures.layers
+      << ", \"bytes\": " << result.textures.bytes << "},\n"
+      << "  \"virtualTextures\": {\"residentPages\": " << result.virtualTextures.residentPages
+      << ", \"requestedPages\": " << result.virtualTextures.requestedPages
+      << ", \"pendingLoads\": " << result.virtualTextures.pendingLoads
+      << ", \"uploads\": " << result.virtualTextures.uploads
+      << ", \"evictions\": " << result.virtualTextures.evictions
+      << ", \"cacheBytes\": " << result.virtualTextures.cacheBytes
+      << ", \"shrinks\": " << result.virtualTextures.shrinks << "},\n"
+      << "  \"memoryBudget\": {\"extension\": " << (result.memoryBudgetExtension ? "true" : "false")
+      << ", \"cap\": " << options.memoryCap
+      << ", \"deviceLocalBudget\": " << result.deviceLocalBudget
+      << ", \"deviceLocalUsage\": " << result.deviceLocalUsage
+      << ", \"pressureEvents\": " << result.memoryPressure.events
+      << ", \"requestedBytes\": " << result.memoryPressure.requestedBytes
+      << ", \"releasedBytes\": " << result.memoryPressure.releasedBytes
+      << ", \"failedAllocations\": " << result.memoryPressure.failedAllocations
+      << ", \"recoveredAllocations\": " << result.memoryPressure.recoveredAllocations << "},\n"
+      << "  \"memoryPools\": {";
+  for (size_t i = 0; i < result.memoryPools.size(); i++) {
+    const auto &pool = result.memoryPools[i];
+    out << (i == 0 ? "" : ", ") << "\"" << memoryClassName(MEMORY_POOL_CLASSES[i]) << "\": {"
+        << "\"blockBytes\": " << pool.blockBytes
+        << ", \"usedBytes\": " << pool.usedBytes
+        << ", \"allocations\": " << pool.allocations
+        << ", \"blocks\": " << pool.blocks
+        << ", \"freeRanges\": " << pool.freeRanges
+        << ", \"largestFreeRange\": " << pool.largestFreeRange
+        << ", \"fragmentation\": " << pool.fragmentation << "}";
+  }
+  out << "},\n"
+      << "  \"defragmentation\": {\"enabled\": " << (options.defragment ? "true" : "false")
+      << ", \"passes\": " << result.defragmentation.passes
+      << ", \"allocationsMoved\": " << result.defragmentation.allocationsMoved
+      << ", \"bytesMoved\": " << result.defragmentation.bytesMoved
+      << ", \"bytesFreed\": " << result.defragmentation.bytesFreed
+      << ", \"blocksFreed\": " << result.defragmentation.blocksFreed << "},\n"
+      << "  \"cpuFrameMs\": ";
+  writeSummary(out, result.cpuFrameMs);
+  out << ",\n  \"gpuFrameMs\": ";
+  writeSummary(out, result.gpuFrameMs);
+  out << ",\n  \"samples\": {\n    \"cpuFrameMs\": ";
+  writeSamples(out, result.cpuFrameMs);
+  out << ",\n    \"gpuFrameMs\": ";
+  writeSamples(out, result.gpuFrameMs);
+  out << "\n  }\n}\n";
+}
+
+}  // namespace tpBench
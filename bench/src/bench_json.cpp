@@ -0,0 +1,164 @@
+#include "bench_json.h"
+
+// std
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace tpBench {
+
+namespace {
+
+class JsonParser {
+ public:
+  explicit JsonParser(const std::string &text) : text{text} {}
+
+  JsonValue parseDocument() {
+    JsonValue value = parseValue();
+    skipWhitespace();
+    if (pos != text.size()) fail("trailing characters");
+    return value;
+  }
+
+ private:
+  [[noreturn]] void fail(const char *message) const {
+    throw std::runtime_error("json parse error at offset " + std::to_string(pos) + ": " + message);
+  }
+
+  void skipWhitespace() {
+    while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) pos++;
+  }
+
+  bool consume(char c) {
+    skipWhitespace();
+    if (pos < text.size() && text[pos] == c) {
+      pos++;
+      return true;
+    }
+    return false;
+  }
+
+  void expect(char c) {
+    if (!consume(c)) fail("unexpected character");
+  }
+
+  JsonValue parseValue() {
+    skipWhitespace();
+    if (pos >= text.size()) fail("unexpected end of input");
+
+    JsonValue value;
+    char c = text[pos];
+    if (c == '{') {
+      value.type = JsonValue::Type::Object;
+      pos++;
+      if (consume('}')) return value;
+      do {
+        skipWhitespace();
+        std::string key = parseString();
+        expect(':');
+        value.object.emplace_back(std::move(key), parseValue());
+      } while (consume(','));
+      expect('}');
+    } else if (c == '[') {
+      value.type = JsonValue::Type::Array;
+      pos++;
+      if (consume(']')) return value;
+      do {
+        value.array.push_back(parseValue());
+      } while (consume(','));
+      expect(']');
+    } else if (c == '"') {
+      value.type = JsonValue::Type::String;
+      value.string = parseString();
+    } else if (text.compare(pos, 4, "true") == 0) {
+      value.type = JsonValue::Type::Bool;
+      value.boolean = true;
+      pos += 4;
+    } else if (text.compare(pos, 5, "false") == 0) {
+      value.type = JsonValue::Type::Bool;
+      pos += 5;
+    } else if (text.compare(pos, 4, "null") == 0) {
+      pos += 4;
+    } else {
+      const char *begin = text.c_str() + pos;
+      char *end = nullptr;
+      value.type = JsonValue::Type::Number;
+      value.number = std::strtod(begin, &end);
+      if (end == begin) fail("invalid value");
+      pos += static_cast<size_t>(end - begin);
+    }
+    return value;
+  }
+
+  std::string parseString() {
+    if (pos >= text.size() || text[pos] != '"') fail("expected string");
+    pos++;
+
+    std::string result;
+    while (pos < text.size() && text[pos] != '"') {
+      char c = text[pos++];
+      if (c != '\\') {
+        result += c;
+        continue;
+      }
+      if (pos >= text.size()) break;
+      char escaped = text[pos++];
+      switch (escaped) {
+        case 'n': result += '\n'; break;
+        case 't': result += '\t'; break;
+        case 'r': result += '\r'; break;
+        case 'b': result += '\b'; break;
+        case 'f': result += '\f'; break;
+        case 'u':
+          // only ASCII escapes are ever produced by our writers
+          if (pos + 4 > text.size()) fail("truncated unicode escape");
+          result += static_cast<char>(std::strtol(text.substr(pos, 4).c_str(), nullptr, 16));
+          pos += 4;
+          break;
+        default: result += escaped;
+      }
+    }
+    if (pos >= text.size()) fail("unterminated string");
+    pos++;
+    return result;
+  }
+
+  const std::string &text;
+  size_t pos = 0;
+};
+
+}  // namespace
+
+const JsonValue *JsonValue::find(const std::string &key) const {
+  for (const auto &entry : object) {
+    if (entry.first == key) return &entry.second;
+  }
+  return nullptr;
+}
+
+std::vector<double> JsonValue::numbers() const {
+  std::vector<double> result;
+  result.reserve(array.size());
+  for (const auto &element : array) {
+    if (element.type == Type::Number) result.push_back(element.number);
+  }
+  return result;
+}
+
+JsonValue parseJson(const std::string &text) {
+  return JsonParser{text}.parseDocument();
+}
+
+JsonValue readJsonFile(const std::string &filePath) {
+  std::ifstream file{filePath};
+  if (!file.is_open()) {
+    throw std::runtime_error("failed to open file: " + filePath);
+  }
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  return parseJson(buffer.str());
+}
+
+}  // namespace tpBench
@@ -0,0 +1,23 @@
+#include "bench_scenarios.h"
+
+namespace tpBench {
+
+const std::vector<Scenario> &scenarios() {
+  static const std::vector<Scenario> list = {
+      //  name              description                               objects models textures size seed
+      {"default",        "1k objects, a few meshes and textures",     {1000,   8,  8,   256, 1}},
+      {"many_objects",   "10k objects sharing 4 meshes/textures",     {10000,  4,  4,   256, 2}},
+      {"many_textures",  "2k objects with 256 small textures",        {2000,   16, 256, 64,  3}},
+      {"large_textures", "200 objects, 32 meshes, 512px textures",    {200,    32, 8,   512, 4}},
+  };
+  return list;
+}
+
+const Scenario *findScenario(const std::string &name) {
+  for (const auto &scenario : scenarios()) {
+    if (name == scenario.name) return &scenario;
+  }
+  return nullptr;
+}
+
+}  // namespace tpBench
@@ -0,0 +1,154 @@
+#include "bench_scene.h"
+
+// GLM Configuration
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+// std
+#include <algorithm>
+#include <random>
+#include <utility>
+
+namespace tpBench {
+
+namespace {
+
+struct MeshData {
+  std::vector<Vertex> vertices;
+  std::vector<uint32_t> indices;
+};
+
+// UV sphere whose tessellation grows with the model index so every mesh is unique.
+MeshData createSphereMesh(uint32_t rings, uint32_t segments, glm::vec3 color) {
+  MeshData mesh;
+  for (uint32_t ring = 0; ring <= rings; ring++) {
+    float v = static_cast<float>(ring) / static_cast<float>(rings);
+    float phi = v * glm::pi<float>();
+    for (uint32_t segment = 0; segment <= segments; segment++) {
+      float u = static_cast<float>(segment) / static_cast<float>(segments);
+      float theta = u * glm::two_pi<float>();
+
+      Vertex vertex{};
+      vertex.position = {glm::sin(phi) * glm::cos(theta), glm::cos(phi), glm::sin(phi) * glm::sin(theta)};
+      vertex.color = color;
+      vertex.texCoord = {u * 4.f, v * 2.f};
+      mesh.vertices.push_back(vertex);
+    }
+  }
+
+  for (uint32_t ring = 0; ring < rings; ring++) {
+    for (uint32_t segment = 0; segment < segments; segment++) {
+      uint32_t a = ring * (segments + 1) + segment;
+      uint32_t b = a + segments + 1;
+      mesh.indices.insert(mesh.indices.end(), {a, b, a + 1, a + 1, b, b + 1});
+    }
+  }
+  return mesh;
+}
+
+std::vector<unsigned char> createCheckerTexture(uint32_t size, uint32_t checkSize,
+                                                glm::u8vec3 colorA, glm::u8vec3 colorB) {
+  std::vector<unsigned char> pixels(static_cast<size_t>(size) * size * 4);
+  for (uint32_t y = 0; y < size; y++) {
+    for (uint32_t x = 0; x < size; x++) {
+      bool odd = ((x / checkSize) + (y / checkSize)) % 2 == 1;
+      glm::u8vec3 color = odd ? colorA : colorB;
+      size_t offset = (static_cast<size_t>(y) * size + x) * 4;
+      pixels[offset + 0] = color.r;
+      pixels[offset + 1] = color.g;
+      pixels[offset + 2] = color.b;
+      pixels[offset + 3] = 255;
+    }
+  }
+  return pixels;
+}
+
+}  // namespace
+
+BenchScene buildScene(TpDevice &device, TpGeometryArena &geometry, TpTextureAtlas &textureAtlas,
+                      const SceneParams &params) {
+  std::mt19937 rng{params.seed};
+  std::uniform_real_distribution<float> unit{0.f, 1.f};
+  std::uniform_int_distribution<int> byte{0, 255};
+
+  BenchScene scene;
+
+  std::vector<MeshData> meshes;
+  for (uint32_t i = 0; i < std::max(params.modelCount, 1u); i++) {
+    uint32_t rings = 6 + 2 * (i % 16);
+    uint32_t segments = 8 + 4 * (i % 16) + i / 16;
+    meshes.push_back(createSphereMesh(rings, segments, {unit(rng), unit(rng), unit(rng)}));
+  }
+
+  std::vector<TpTextureRef> textures;
+  for (uint32_t i = 0; i < std::max(params.textureCount, 1u); i++) {
+    glm::u8vec3 colorA{byte(rng), byte(rng), byte(rng)};
+    glm::u8vec3 colorB{byte(rng), byte(rng), byte(rng)};
+    uint32_t checkSize = std::max(params.textureSize / (4u << (i % 4)), 1u);
+    auto pixels = createCheckerTexture(params.textureSize, checkSize, colorA, colorB);
+    textures.push_back(textureAtlas.add(pixels.data(), params.textureSize, params.textureSize));
+  }
+
+  // A TpModel owns its mesh and refers to one texture of the atlas, so max(M, K) models cover
+  // every unique mesh and every unique texture.
+  size_t modelCount = std::max(meshes.size(), textures.size());
+  for (size_t i = 0; i < modelCount; i++) {
+    const auto &mesh = meshes[i % meshes.size()];
+    auto model = std::make_shared<TpModel>(
+        device, geometry, textureAtlas, mesh.vertices, mesh.indices, textures[i % textures.size()]);
+    auto occluderMesh = std::make_shared<TpOccluderMesh>();
+    occluderMesh->positions.reserve(mesh.vertices.size());
+    for (const auto &vertex : mesh.vertices) occluderMesh->positions.push_back(vertex.position);
+    occluderMesh->indices = mesh.indices;
+    model->setOccluderMesh(std::move(occluderMesh));
+    scene.world.addModel(std::move(model));
+  }
+
+  // Objects are scattered in a cube that grows with the object count to keep density constant.
+  float extent = std::max(2.f, std::cbrt(static_cast<float>(params.objectCount)) * 0.6f);
+  scene.center = {0.f, 0.f, 0.f};
+  scene.radius = extent;
+
+  scene.world.reserve(params.objectCount);
+  for (uint32_t i = 0; i < params.objectCount; i++) {
+    TpEntity entity = scene.world.createEntity(static_cast<TpModelHandle>(i % modelCount));
+    scene.world.setTranslation(entity, {
+        (unit(rng) * 2.f - 1.f) * extent,
+        (unit(rng) * 2.f - 1.f) * extent,
+        (unit(rng) * 2.f - 1.f) * extent});
+    scene.world.setRotation(entity, {
+        unit(rng) * glm::two_pi<float>(),
+        unit(rng) * glm::two_pi<float>(),
+        unit(rng) * glm::two_pi<float>()});
+    float scale = 0.05f + unit(rng) * 0.2f;
+    scene.world.setScale(entity, {scale, scale, scale});
+  }
+
+  return scene;
+}
+
+void useVirtualTexture(BenchScene &scene, TpVirtualTextureCache &cache, const std::string &path) {
+  // fine checks so that every mip differs and the whole chain gets requested
+  auto pixels = createCheckerTexture(VIRTUAL_TEXTURE_SIZE, 8, {230, 120, 40}, {30, 60, 140});
+  TpTiledImage::write(path, pixels.data(), VIRTUAL_TEXTURE_SIZE, VIRTUAL_TEXTURE_SIZE);
+  uint32_t texture = cache.add(path);
+  for (TpModelHandle handle = 0; handle < scene.world.modelCount(); handle++) {
+    scene.world.getModel(handle).setVirtualTexture(cache, texture);
+  }
+}
+
+void orbitCamera(TpCamera &camera, const BenchScene &scene, float aspect,
+                 uint32_t frame, uint32_t frameCount) {
+  float t = static_cast<float>(frame) / static_cast<float>(std::max(frameCount, 1u));
+  float angle = t * glm::two_pi<float>();
+  float distance = scene.radius * 2.5f;
+
+  glm::vec3 position = scene.center + glm::vec3{
+      glm::cos(angle) * distance, -scene.radius * 0.5f, glm::sin(angle) * distance};
+  camera.setViewTarget(position, scene.center);
+  camera.setPerspectiveProjection(glm::radians(50.f), aspect, .1f, distance + scene.radius * 2.f);
+}
+
+}  // namespace tpBench
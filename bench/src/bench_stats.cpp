@@ -0,0 +1,161 @@
+#include "bench_stats.h"
+
+// std
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <utility>
+
+namespace tpBench {
+
+namespace {
+
+// up to this many samples per side, tie-free tests use the exact distribution of U
+constexpr size_t EXACT_MANN_WHITNEY_SAMPLES = 30;
+
+// P(U >= u) when nothing ties and current and baseline come from one distribution. Counts the
+// orderings of the pooled samples by U: the largest sample is either a current one, which beats
+// every baseline sample, or a baseline one, which adds nothing.
+double exactUpperTail(size_t baselineCount, size_t currentCount, double u) {
+  // previous[n] and row[n]: counts by U for m - 1 and m current and n baseline samples
+  std::vector<std::vector<double>> previous(baselineCount + 1, std::vector<double>{1.0});
+  std::vector<std::vector<double>> row = previous;
+  for (size_t m = 1; m <= currentCount; m++) {
+    row[0] = {1.0};
+    for (size_t n = 1; n <= baselineCount; n++) {
+      std::vector<double> counts(m * n + 1, 0.0);
+      for (size_t v = 0; v < previous[n].size(); v++) counts[v + n] += previous[n][v];
+      for (size_t v = 0; v < row[n - 1].size(); v++) counts[v] += row[n - 1][v];
+      row[n] = std::move(counts);
+    }
+    std::swap(previous, row);
+  }
+
+  const std::vector<double> &counts = previous[baselineCount];
+  double total = 0.0;
+  double tail = 0.0;
+  for (size_t v = 0; v < counts.size(); v++) {
+    total += counts[v];
+    if (static_cast<double>(v) >= u) tail += counts[v];
+  }
+  return tail / total;
+}
+
+}  // namespace
+
+SampleSummary summarize(const std::vector<double> &samples) {
+  SampleSummary summary{};
+  if (samples.empty()) return summary;
+
+  std::vector<double> sorted = samples;
+  std::sort(sorted.begin(), sorted.end());
+
+  double sum = 0.0;
+  for (double sample : sorted) sum += sample;
+
+  // nearest-rank percentiles
+  auto percentile = [&](double p) {
+    size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * static_cast<double>(sorted.size())));
+    return sorted[std::max<size_t>(rank, 1) - 1];
+  };
+
+  summary.count = sorted.size();
+  summary.mean = sum / static_cast<double>(sorted.size());
+  summary.p50 = percentile(50.0);
+  summary.p95 = percentile(95.0);
+  summary.p99 = percentile(99.0);
+  summary.min = sorted.front();
+  summary.max = sorted.back();
+  return summary;
+}
+
+double median(std::vector<double> samples) {
+  if (samples.empty()) return 0.0;
+  size_t middle = samples.size() / 2;
+  std::nth_element(samples.begin(), samples.begin() + middle, samples.end());
+  double upper = samples[middle];
+  if (samples.size() % 2 == 1) return upper;
+  double lower = *std::max_element(samples.begin(), samples.begin() + middle);
+  return (lower + upper) * 0.5;
+}
+
+MannWhitneyResult mannWhitneyGreater(const std::vector<double> &baseline, const std::vector<double> &current) {
+  MannWhitneyResult result{};
+  if (baseline.empty() || current.empty()) return result;
+
+  // rank the pooled samples, ties get their average rank
+  std::vector<std::pair<double, bool>> pooled;
+  pooled.reserve(baseline.size() + current.size());
+  for (double sample : baseline) pooled.emplace_back(sample, false);
+  for (double sample : current) pooled.emplace_back(sample, true);
+  std::sort(pooled.begin(), pooled.end(),
+            [](const auto &a, const auto &b) { return a.first < b.first; });
+
+  double n = static_cast<double>(pooled.size());
+  double currentRankSum = 0.0;
+  double tieCorrection = 0.0;
+  for (size_t i = 0; i < pooled.size();) {
+    size_t j = i;
+    while (j < pooled.size() && pooled[j].first == pooled[i].first) j++;
+    double averageRank = (static_cast<double>(i + 1) + static_cast<double>(j)) * 0.5;
+    for (size_t k = i; k < j; k++) {
+      if (pooled[k].second) currentRankSum += averageRank;
+    }
+    double ties = static_cast<double>(j - i);
+    tieCorrection += ties * ties * ties - ties;
+    i = j;
+  }
+
+  double n1 = static_cast<double>(baseline.size());
+  double n2 = static_cast<double>(current.size());
+  result.u = currentRankSum - n2 * (n2 + 1.0) * 0.5;
+
+  double meanU = n1 * n2 * 0.5;
+  double variance = n1 * n2 / 12.0 * ((n + 1.0) - tieCorrection / (n * (n - 1.0)));
+  if (variance <= 0.0) return result;
+
+  // continuity correction towards the null hypothesis
+  result.z = (result.u - meanU - 0.5) / std::sqrt(variance);
+  // the approximation is poor for the handful of samples a test of whole runs has
+  if (tieCorrection == 0.0 && baseline.size() <= EXACT_MANN_WHITNEY_SAMPLES &&
+      current.size() <= EXACT_MANN_WHITNEY_SAMPLES) {
+    result.pValue = exactUpperTail(baseline.size(), current.size(), result.u);
+  } else {
+    result.pValue = 0.5 * std::erfc(result.z / std::sqrt(2.0));
+  }
+  return result;
+}
+
+ConfidenceInterval bootstrapMedianShift(const std::vector<double> &baseline, const std::vector<double> &current,
+                                        double confidence, uint32_t iterations, uint32_t seed) {
+  ConfidenceInterval interval{};
+  if (baseline.empty() || current.empty() || iterations == 0) return interval;
+
+  std::mt19937 rng{seed};
+  std::uniform_int_distribution<size_t> pickBaseline{0, baseline.size() - 1};
+  std::uniform_int_distribution<size_t> pickCurrent{0, current.size() - 1};
+
+  std::vector<double> shifts;
+  shifts.reserve(iterations);
+  std::vector<double> resampledBaseline(baseline.size());
+  std::vector<double> resampledCurrent(current.size());
+  for (uint32_t i = 0; i < iterations; i++) {
+    for (auto &sample : resampledBaseline) sample = baseline[pickBaseline(rng)];
+    for (auto &sample : resampledCurrent) sample = current[pickCurrent(rng)];
+    double baselineMedian = median(resampledBaseline);
+    if (baselineMedian <= 0.0) continue;
+    shifts.push_back(median(resampledCurrent) / baselineMedian - 1.0);
+  }
+  if (shifts.empty()) return interval;
+
+  std::sort(shifts.begin(), shifts.end());
+  double tail = (1.0 - confidence) * 0.5;
+  auto index = [&](double q) {
+    return std::min(shifts.size() - 1, static_cast<size_t>(q * static_cast<double>(shifts.size())));
+  };
+  interval.lower = shifts[index(tail)];
+  interval.upper = shifts[index(1.0 - tail)];
+  return interval;
+}
+
+}  // namespace tpBench
@@ -0,0 +1,188 @@
+#include "bench_app.h"
+#include "bench_scenarios.h"
+
+// std
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+void printUsage(const char *program) {
+  std::cerr << "usage: " << program << " [options]\n"
+            << "  --scenario NAME    start from a named scenario (see teapotPerfGate list)\n"
+            << "  --objects N        number of objects (default 1000)\n"
+            << "  --models M         number of unique meshes (default 8)\n"
+            << "  --textures K       number of unique textures (default 8)\n"
+            << "  --texture-size S   texture edge length in pixels (default 256)\n"
+            << "  --seed S           scene seed (default 1)\n"
+            << "  --frames F         measured frames (default 600)\n"
+            << "  --warmup W         unmeasured warmup frames (default 60)\n"
+            << "  --width W          framebuffer width (default 1280)\n"
+            << "  --height H         framebuffer height (default 720)\n"
+            << "  --present-mode M   fifo, mailbox or immediate (default immediate)\n"
+            << "  --frames-in-flight N  1 to 4 (default 2)\n"
+            << "  --min-images N     minimum swap chain image count (default surface minimum + 1)\n"
+            << "  --sort MODE        draw order: state or front-to-back (default state)\n"
+            << "  --depth-prepass B  on or off: depth-only pass before shading (default off)\n"
+            << "  --threads N        scene worker threads, 0 for one per core (default 0)\n"
+            << "  --lods B           on or off: screen-error based mesh LOD selection (default on)\n"
+            << "  --clusters B       on or off: GPU meshlet culling of LOD 0 draws (default on)\n"
+            << "  --occlusion B      on or off: two-phase depth pyramid occlusion culling (default on)\n"
+            << "  --software-occlusion B  on or off: CPU occlusion culling before recording (default off)\n"
+            << "  --vertex-pulling B on or off: fetch vertices from storage buffers in the shader (default off)\n"
+            << "  --virtual-texturing B  on or off: texture every model from one streamed 4096^2 virtual\n"
+            << "                     texture (default off)\n"
+            << "  --memory-cap MB    cap device local memory budgets to exercise eviction (default none)\n"
+            << "  --defragment B     on or off: move fragmented static geometry between frames (default on)\n"
+            << "  --output FILE      write the JSON report to FILE instead of stdout\n"
+            << "  --trace FILE       write a Chrome trace of the run to FILE\n";
+}
+
+bool parseArgs(int argc, char **argv, tpBench::BenchOptions &options, std::string &outputPath) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--help" || arg == "-h") return false;
+    if (i + 1 >= argc) {
+      std::cerr << "missing value for " << arg << std::endl;
+      return false;
+    }
+    std::string value = argv[++i];
+
+    if (arg == "--scenario") {
+      const auto *scenario = tpBench::findScenario(value);
+      if (scenario == nullptr) {
+        std::cerr << "unknown scenario " << value << std::endl;
+        return false;
+      }
+      options.scene = scenario->scene;
+    } else if (arg == "--objects") {
+      options.scene.objectCount = static_cast<uint32_t>(std::stoul(value));
+    } else if (arg == "--models") {
+      options.scene.modelCount = static_cast<uint32_t>(std::stoul(value));
+    } else if (arg == "--textures") {
+      options.scene.textureCount = static_cast<uint32_t>(std::stoul(value));
+    } else if (arg == "--texture-size") {
+      options.scene.textureSize = static_cast<uint32_t>(std::stoul(value));
+    } else if (arg == "--seed") {
+      options.scene.seed = static_cast<uint32_t>(std::stoul(value));
+    } else if (arg == "--frames") {
+      options.frames = static_cast<uint32_t>(std::stoul(value));
+    } else if (arg == "--warmup") {
+      options.warmupFrames = static_cast<uint32_t>(std::stoul(value));
+    } else if (arg == "--width") {
+      options.width = std::stoi(value);
+    } else if (arg == "--height") {
+      options.height = std::stoi(value);
+    } else if (arg == "--present-mode") {
+      if (!teapot::parsePresentMode(value, options.swapChain.presentMode)) {
+        std::cerr << "unknown present mode " << value << std::endl;
+        return false;
+      }
+    } else if (arg == "--frames-in-flight") {
+      options.swapChain.framesInFlight = std::stoi(value);
+    } else if (arg == "--min-images") {
+      options.swapChain.minImageCount = static_cast<uint32_t>(std::stoul(value));
+    } else if (arg == "--sort") {
+      if (!teapot::parseDrawSortMode(value, options.sortMode)) {
+        std::cerr << "unknown sort mode " << value << std::endl;
+        return false;
+      }
+    } else if (arg == "--depth-prepass") {
+      if (value != "on" && value != "off") {
+        std::cerr << "--depth-prepass takes on or off" << std::endl;
+        return false;
+      }
+      options.depthPrePass = value == "on";
+    } else if (arg == "--lods") {
+      if (value != "on" && value != "off") {
+        std::cerr << "--lods takes on or off" << std::endl;
+        return false;
+      }
+      options.meshLods = value == "on";
+    } else if (arg == "--clusters") {
+      if (value != "on" && value != "off") {
+        std::cerr << "--clusters takes on or off" << std::endl;
+        return false;
+      }
+      options.clusterCulling = value == "on";
+    } else if (arg == "--occlusion") {
+      if (value != "on" && value != "off") {
+        std::cerr << "--occlusion takes on or off" << std::endl;
+        return false;
+      }
+      options.occlusionCulling = value == "on";
+    } else if (arg == "--software-occlusion") {
+      if (value != "on" && value != "off") {
+        std::cerr << "--software-occlusion takes on or off" << std::endl;
+        return false;
+      }
+      options.softwareOcclusion = value == "on";
+    } else if (arg == "--vertex-pulling") {
+      if (value != "on" && value != "off") {
+        std::cerr << "--vertex-pulling takes on or off" << std::endl;
+        return false;
+      }
+      options.vertexPulling = value == "on";
+    } else if (arg == "--virtual-texturing") {
+      if (value != "on" && value != "off") {
+        std::cerr << "--virtual-texturing takes on or off" << std::endl;
+        return false;
+      }
+      options.virtualTexturing = value == "on";
+    } else if (arg == "--defragment") {
+      if (value != "on" && value != "off") {
+        std::cerr << "--defragment takes on or off" << std::endl;
+        return false;
+      }
+      options.defragment = value == "on";
+    } else if (arg == "--memory-cap") {
+      options.memoryCap = static_cast<VkDeviceSize>(std::stoull(value)) * 1024 * 1024;
+    } else if (arg == "--threads") {
+      options.workerThreads = static_cast<unsigned>(std::stoul(value));
+    } else if (arg == "--output") {
+      outputPath = value;
+    } else if (arg == "--trace") {
+      options.tracePath = value;
+    } else {
+      std::cerr << "unknown option " << arg << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  tpBench::BenchOptions options{};
+  std::string outputPath;
+
+  try {
+    if (!parseArgs(argc, argv, options, outputPath)) {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    tpBench::BenchApp app{options};
+    auto result = app.run();
+
+    if (outputPath.empty()) {
+      tpBench::writeResultJson(std::cout, options, result);
+    } else {
+      std::ofstream out{outputPath};
+      if (!out.is_open()) {
+        throw std::runtime_error("failed to open " + outputPath);
+      }
+      tpBench::writeResultJson(out, options, result);
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << '\n';
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,278 @@
+#include "bench_app.h"
+#include "bench_json.h"
+#include "bench_scenarios.h"
+#include "bench_stats.h"
+
+// std
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Performance regression gate. "record" stores the median frame time of every repetition of
+ * named scenarios, "check" reruns them and exits non-zero when a metric got significantly slower:
+ * the one-sided Mann-Whitney p-value of the repetition medians must be below --alpha and their
+ * median must have moved by more than --threshold. Frames within one run share warmup, clocks
+ * and driver state, so only whole repetitions count as independent samples. A baseline is only
+ * compared with runs of the frames, warmup and repetitions it was recorded with.
+ */
+
+namespace {
+
+using namespace tpBench;
+
+enum GateResult { GATE_OK = 0, GATE_REGRESSION = 1, GATE_ERROR = 2 };
+
+struct GateOptions {
+  std::string command;
+  std::vector<std::string> scenarioNames;
+  std::string baselineDir = "baselines";
+  uint32_t repetitions = 5;
+  uint32_t frames = 300;
+  uint32_t warmupFrames = 60;
+  double alpha = 0.01;
+  double threshold = 0.03;
+};
+
+struct ScenarioRun {
+  std::string deviceName;
+  std::vector<double> cpuRepetitionMedians;
+  std::vector<double> gpuRepetitionMedians;
+};
+
+void printUsage(const char *program) {
+  std::cerr << "usage: " << program << " <record|check|list> [scenario...] [options]\n"
+            << "  record             run the scenarios and store them as baselines\n"
+            << "  check              run the scenarios and compare against stored baselines\n"
+            << "  list               print the available scenarios\n"
+            << "options:\n"
+            << "  --baseline-dir DIR baseline directory (default baselines)\n"
+            << "  --repetitions R    runs per scenario, the samples of the test (default 5)\n"
+            << "  --frames F         measured frames per run (default 300)\n"
+            << "  --warmup W         warmup frames per run (default 60)\n"
+            << "  --alpha A          significance level (default 0.01)\n"
+            << "  --threshold T      minimum relative median slowdown to fail (default 0.03)\n"
+            << "All scenarios are used when none are named.\n";
+}
+
+bool parseArgs(int argc, char **argv, GateOptions &options) {
+  if (argc < 2) return false;
+  options.command = argv[1];
+  if (options.command != "record" && options.command != "check" && options.command != "list") {
+    return false;
+  }
+
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.rfind("--", 0) != 0) {
+      options.scenarioNames.push_back(arg);
+      continue;
+    }
+    if (i + 1 >= argc) {
+      std::cerr << "missing value for " << arg << std::endl;
+      return false;
+    }
+    std::string value = argv[++i];
+
+    if (arg == "--baseline-dir") {
+      options.baselineDir = value;
+    } else if (arg == "--repetitions") {
+      options.repetitions = static_cast<uint32_t>(std::stoul(value));
+    } else if (arg == "--frames") {
+      options.frames = static_cast<uint32_t>(std::stoul(value));
+    } else if (arg == "--warmup") {
+      options.warmupFrames = static_cast<uint32_t>(std::stoul(value));
+    } else if (arg == "--alpha") {
+      options.alpha = std::stod(value);
+    } else if (arg == "--threshold") {
+      options.threshold = std::stod(value);
+    } else {
+      std::cerr << "unknown option " << arg << std::endl;
+      return false;
+    }
+  }
+  return options.repetitions > 0 && options.frames > 0;
+}
+
+ScenarioRun runScenario(const Scenario &scenario, const GateOptions &options) {
+  ScenarioRun run{};
+  for (uint32_t repetition = 0; repetition < options.repetitions; repetition++) {
+    std::cerr << scenario.name << ": repetition " << repetition + 1 << "/" << options.repetitions
+              << std::endl;
+
+    BenchOptions benchOptions{};
+    benchOptions.scene = scenario.scene;
+    benchOptions.frames = options.frames;
+    benchOptions.warmupFrames = options.warmupFrames;
+
+    // every repetition gets a fresh device so allocator and driver state do not carry over
+    BenchResult result = BenchApp{benchOptions}.run();
+    run.deviceName = result.deviceName;
+    run.cpuRepetitionMedians.push_back(median(result.cpuFrameMs));
+    // no timestamps on this device
+    if (!result.gpuFrameMs.empty()) run.gpuRepetitionMedians.push_back(median(result.gpuFrameMs));
+  }
+  return run;
+}
+
+std::string baselinePath(const GateOptions &options, const Scenario &scenario) {
+  return options.baselineDir + "/" + scenario.name + ".json";
+}
+
+void writeArray(std::ostream &out, const std::vector<double> &values) {
+  out << "[";
+  for (size_t i = 0; i < values.size(); i++) {
+    out << (i == 0 ? "" : ", ") << values[i];
+  }
+  out << "]";
+}
+
+void writeBaseline(const std::string &path, const Scenario &scenario, const GateOptions &options,
+                   const ScenarioRun &run) {
+  std::ofstream out{path};
+  if (!out.is_open()) {
+    throw std::runtime_error("failed to open " + path + " (does the baseline directory exist?)");
+  }
+  out.precision(9);
+  out << "{\n"
+      << "  \"scenario\": \"" << scenario.name << "\",\n"
+      << "  \"device\": \"" << run.deviceName << "\",\n"
+      << "  \"frames\": " << options.frames << ",\n"
+      << "  \"warmupFrames\": " << options.warmupFrames << ",\n"
+      << "  \"repetitions\": " << options.repetitions << ",\n"
+      << "  \"cpuRepetitionMedians\": ";
+  writeArray(out, run.cpuRepetitionMedians);
+  out << ",\n  \"gpuRepetitionMedians\": ";
+  writeArray(out, run.gpuRepetitionMedians);
+  out << "\n}\n";
+}
+
+// Throws when the baseline was recorded with other run settings, whose medians are not comparable.
+void checkBaselineSettings(const JsonValue &baseline, const std::string &path, const GateOptions &options) {
+  const std::pair<const char *, uint32_t> settings[] = {
+      {"frames", options.frames}, {"warmupFrames", options.warmupFrames}, {"repetitions", options.repetitions}};
+  for (const auto &setting : settings) {
+    const JsonValue *value = baseline.find(setting.first);
+    if (value == nullptr || value->type != JsonValue::Type::Number) {
+      throw std::runtime_error(path + " has no " + setting.first + ", record it again");
+    }
+    auto recorded = static_cast<uint32_t>(value->number);
+    if (recorded != setting.second) {
+      throw std::runtime_error(path + " was recorded with " + setting.first + " " + std::to_string(recorded) +
+                               ", this run uses " + std::to_string(setting.second) +
+                               "; pass the same settings or record the baseline again");
+    }
+  }
+}
+
+// Returns true when the metric regressed.
+bool compareMetric(const char *metric, const std::vector<double> &baseline,
+                   const std::vector<double> &current, const GateOptions &options) {
+  if (baseline.empty() || current.empty()) {
+    std::printf("  %-4s skipped (no samples)\n", metric);
+    return false;
+  }
+
+  // one tie-free ordering in C(n1 + n2, n1) is the smallest p-value the samples can give
+  double smallestP = 1.0;
+  for (size_t i = 1; i <= current.size(); i++) {
+    smallestP *= static_cast<double>(i) / static_cast<double>(baseline.size() + i);
+  }
+  if (smallestP >= options.alpha) {
+    std::printf("  %-4s warning: %zu and %zu repetitions cannot reach p < %g\n", metric, baseline.size(),
+                current.size(), options.alpha);
+  }
+
+  // every sample is the median of one repetition; resampling them resamples whole runs
+  double baselineMedian = median(baseline);
+  double currentMedian = median(current);
+  double shift = baselineMedian > 0.0 ? currentMedian / baselineMedian - 1.0 : 0.0;
+  MannWhitneyResult test = mannWhitneyGreater(baseline, current);
+  ConfidenceInterval interval = bootstrapMedianShift(baseline, current, 0.95, 1000, 1);
+
+  bool regressed = test.pValue < options.alpha && shift > options.threshold;
+  bool improved = mannWhitneyGreater(current, baseline).pValue < options.alpha && -shift > options.threshold;
+  std::printf("  %-4s median %8.3f -> %8.3f ms  %+6.2f%% [95%% CI %+6.2f%%, %+6.2f%%]  p=%.2e  %s\n",
+              metric, baselineMedian, currentMedian, shift * 100.0, interval.lower * 100.0,
+              interval.upper * 100.0, test.pValue,
+              regressed ? "REGRESSION" : (improved ? "improved" : "ok"));
+  return regressed;
+}
+
+int record(const std::vector<const Scenario *> &selected, const GateOptions &options) {
+  for (const auto *scenario : selected) {
+    ScenarioRun run = runScenario(*scenario, options);
+    std::string path = baselinePath(options, *scenario);
+    writeBaseline(path, *scenario, options, run);
+    std::printf("%s: baseline written to %s\n", scenario->name, path.c_str());
+  }
+  return GATE_OK;
+}
+
+int check(const std::vector<const Scenario *> &selected, const GateOptions &options) {
+  bool anyRegression = false;
+  for (const auto *scenario : selected) {
+    JsonValue baseline = readJsonFile(baselinePath(options, *scenario));
+    checkBaselineSettings(baseline, baselinePath(options, *scenario), options);
+    ScenarioRun run = runScenario(*scenario, options);
+
+    std::printf("%s:\n", scenario->name);
+    const JsonValue *device = baseline.find("device");
+    if (device != nullptr && device->string != run.deviceName) {
+      std::printf("  warning: baseline was recorded on \"%s\", running on \"%s\"\n",
+                  device->string.c_str(), run.deviceName.c_str());
+    }
+
+    const JsonValue *cpu = baseline.find("cpuRepetitionMedians");
+    const JsonValue *gpu = baseline.find("gpuRepetitionMedians");
+    if (cpu == nullptr) {
+      throw std::runtime_error(baselinePath(options, *scenario) + " has no repetition medians, record it again");
+    }
+    anyRegression |= compareMetric("cpu", cpu->numbers(), run.cpuRepetitionMedians, options);
+    anyRegression |= compareMetric("gpu", gpu ? gpu->numbers() : std::vector<double>{}, run.gpuRepetitionMedians,
+                                   options);
+  }
+  return anyRegression ? GATE_REGRESSION : GATE_OK;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  GateOptions options{};
+  if (!parseArgs(argc, argv, options)) {
+    printUsage(argv[0]);
+    return GATE_ERROR;
+  }
+
+  if (options.command == "list") {
+    for (const auto &scenario : scenarios()) {
+      std::printf("%-16s %s\n", scenario.name, scenario.description);
+    }
+    return GATE_OK;
+  }
+
+  std::vector<const Scenario *> selected;
+  if (options.scenarioNames.empty()) {
+    for (const auto &scenario : scenarios()) selected.push_back(&scenario);
+  }
+  for (const auto &name : options.scenarioNames) {
+    const Scenario *scenario = findScenario(name);
+    if (scenario == nullptr) {
+      std::cerr << "unknown scenario " << name << std::endl;
+      return GATE_ERROR;
+    }
+    selected.push_back(scenario);
+  }
+
+  try {
+    return options.command == "record" ? record(selected, options) : check(selected, options);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << '\n';
+    return GATE_ERROR;
+  }
+}
@@ -0,0 +1,120 @@
+#include "tp_transform.h"
+
+#include <glm/gtc/constants.hpp>
+
+// std
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+/*
+ * Micro-benchmark for the batched TRS kernel: objects composed per microsecond for the glm
+ * reference, the scalar batch path and the SIMD batch path, plus the largest difference
+ * against the reference.
+ */
+
+namespace {
+
+struct Inputs {
+  std::vector<glm::vec3> translations;
+  std::vector<glm::vec3> rotations;
+  std::vector<glm::vec3> scales;
+};
+
+Inputs makeInputs(size_t count, uint32_t seed) {
+  std::mt19937 rng{seed};
+  std::uniform_real_distribution<float> position{-100.f, 100.f};
+  std::uniform_real_distribution<float> angle{-glm::two_pi<float>(), glm::two_pi<float>()};
+  std::uniform_real_distribution<float> scale{0.05f, 4.f};
+
+  Inputs inputs;
+  for (size_t i = 0; i < count; i++) {
+    inputs.translations.emplace_back(position(rng), position(rng), position(rng));
+    inputs.rotations.emplace_back(angle(rng), angle(rng), angle(rng));
+    inputs.scales.emplace_back(scale(rng), scale(rng), scale(rng));
+  }
+  return inputs;
+}
+
+// best of `repeats` runs, in objects per microsecond
+double measure(size_t count, int repeats, const std::function<void()> &run) {
+  double bestUs = 1e300;
+  for (int i = 0; i < repeats; i++) {
+    auto start = std::chrono::steady_clock::now();
+    run();
+    auto end = std::chrono::steady_clock::now();
+    bestUs = std::min(bestUs, std::chrono::duration<double, std::micro>(end - start).count());
+  }
+  return static_cast<double>(count) / bestUs;
+}
+
+// relative to the size of the entry, translations are in the hundreds
+float maxError(const std::vector<glm::mat4> &reference, const std::vector<glm::mat4> &result) {
+  float error = 0.f;
+  for (size_t i = 0; i < reference.size(); i++) {
+    for (int c = 0; c < 4; c++) {
+      for (int r = 0; r < 4; r++) {
+        float expected = reference[i][c][r];
+        float difference = std::abs(expected - result[i][c][r]) / std::max(1.f, std::abs(expected));
+        error = std::max(error, difference);
+      }
+    }
+  }
+  return error;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  size_t count = 100000;
+  int repeats = 20;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    if (arg == "--objects") {
+      count = std::stoul(argv[i + 1]);
+    } else if (arg == "--repeats") {
+      repeats = std::stoi(argv[i + 1]);
+    } else {
+      std::cerr << "usage: " << argv[0] << " [--objects N] [--repeats R]" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  Inputs inputs = makeInputs(count, 1);
+  std::vector<glm::mat4> reference(count);
+  std::vector<glm::mat4> scalar(count);
+  std::vector<glm::mat4> batch(count);
+
+  double referenceRate = measure(count, repeats, [&] {
+    for (size_t i = 0; i < count; i++) {
+      reference[i] = teapot::composeTransform(inputs.translations[i], inputs.rotations[i], inputs.scales[i]);
+    }
+  });
+  double scalarRate = measure(count, repeats, [&] {
+    teapot::composeTransformsScalar(inputs.translations.data(), inputs.rotations.data(), inputs.scales.data(),
+                                    scalar.data(), count);
+  });
+  double batchRate = measure(count, repeats, [&] {
+    teapot::composeTransforms(inputs.translations.data(), inputs.rotations.data(), inputs.scales.data(),
+                              batch.data(), count);
+  });
+
+  std::cout << std::fixed << std::setprecision(2)
+            << "{\n"
+            << "  \"objects\": " << count << ",\n"
+            << "  \"kernel\": \"" << teapot::transformKernelName() << "\",\n"
+            << "  \"objectsPerUs\": {\"glm\": " << referenceRate << ", \"scalar\": " << scalarRate
+            << ", \"batch\": " << batchRate << "},\n"
+            << std::scientific << std::setprecision(3)
+            << "  \"maxError\": {\"scalar\": " << maxError(reference, scalar)
+            << ", \"batch\": " << maxError(reference, batch) << "}\n"
+            << "}" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -1,3 +1,5 @@
+# add_shader(TARGET SHADER [SHADER_DIR])
+# SHADER_DIR defaults to the shaders/ folder next to the calling CMakeLists.txt.
 function(add_shader TARGET SHADER)
 
   # Find glslc shader compiler.
@@ -10,7 +12,11 @@ function(add_shader TARGET SHADER)
   endif()
 
   # All shaders for a sample are found here.
-  set(current-shader-path ${CMAKE_CURRENT_SOURCE_DIR}/shaders/${SHADER})
+  if(ARGC GREATER 2)
+    set(current-shader-path ${ARGV2}/${SHADER})
+  else()
+    set(current-shader-path ${CMAKE_CURRENT_SOURCE_DIR}/shaders/${SHADER})
+  endif()
 
   # For Android, write SPIR-V files to app/assets which is then packaged into the APK.
   # Otherwise, output in the binary directory.
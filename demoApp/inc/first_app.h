@@ -1,9 +1,12 @@
 #pragma once
 
 #include "tp_device.h"
+#include "tp_model.h"
 #include "tp_renderer.h"
 #include "tp_window.h"
-#include "tp_gameobject.h"
+#include "tp_scene.h"
+#include "tp_thread_pool.h"
+#include "tp_virtual_texture_cache.h"
 
 // std
 #include <memory>
@@ -18,7 +21,7 @@ class FirstApp {
   static constexpr int WIDTH = 800;
   static constexpr int HEIGHT = 600;
 
-  FirstApp();
+  explicit FirstApp(const TpSwapChainConfig &swapChainConfig = {});
   ~FirstApp();
 
   FirstApp(const FirstApp &) = delete;
@@ -27,12 +30,21 @@ class FirstApp {
   void run();
 
  private:
-  void loadGameObjects(VkDescriptorSetLayout layout);
+  void loadScene();
+  void printGpuTimings();
+  void printMemoryBudget();
+  void cyclePresentMode();
 
   teapot::TpWindow tpWindow{WIDTH, HEIGHT, "Hello Vulkan!"};
   teapot::TpDevice tpDevice{tpWindow};
   teapot::TpRenderer tpRenderer{tpWindow, tpDevice};
-
-  std::vector<TpGameObject> gameObjects;
+  teapot::TpGeometryArena geometry{tpDevice, sizeof(teapot::Vertex)};
+  teapot::TpTextureAtlas textures{tpDevice};
+  // streams the room texture; null when the device cannot write feedback from fragment shaders
+  std::unique_ptr<teapot::TpVirtualTextureCache> virtualTextures;
+
+  TpScene scene;
+  TpThreadPool threadPool;
+  TpEntity chest;
 };
 }  // namespace teapot
\ No newline at end of file
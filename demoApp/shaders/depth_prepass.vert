@@ -0,0 +1,23 @@
+#version 450
+
+// Position-only copy of simple_shader.vert for the depth pre-pass. The main pass tests depth
+// with EQUAL, so both shaders must compute gl_Position identically.
+layout(location = 0) in vec3 position;
+
+layout(push_constant) uniform Push {
+    mat4 viewProj;
+    vec4 modelRows[3];
+} push;
+
+// the world matrix comes as its top three rows
+vec4 toClip(vec3 objectPosition) {
+    vec4 p = vec4(objectPosition, 1.0);
+    vec3 world = vec3(dot(push.modelRows[0], p), dot(push.modelRows[1], p), dot(push.modelRows[2], p));
+    return push.viewProj * vec4(world, 1.0);
+}
+
+invariant gl_Position;
+
+void main() {
+    gl_Position = toClip(position);
+}
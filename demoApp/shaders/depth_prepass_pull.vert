@@ -0,0 +1,28 @@
+#version 450
+
+// Position-only copy of simple_shader_pull.vert for the depth pre-pass, reading the arena's
+// position stream. The main pass tests depth with EQUAL, so both shaders must compute
+// gl_Position identically.
+layout(set = 1, binding = 1) readonly buffer Positions {
+    float positions[];
+};
+
+layout(push_constant) uniform Push {
+    mat4 viewProj;
+    vec4 modelRows[3];
+} push;
+
+// the world matrix comes as its top three rows
+vec4 toClip(vec3 objectPosition) {
+    vec4 p = vec4(objectPosition, 1.0);
+    vec3 world = vec3(dot(push.modelRows[0], p), dot(push.modelRows[1], p), dot(push.modelRows[2], p));
+    return push.viewProj * vec4(world, 1.0);
+}
+
+invariant gl_Position;
+
+void main() {
+    uint base = uint(gl_VertexIndex) * 3;
+    vec3 position = vec3(positions[base], positions[base + 1], positions[base + 2]);
+    gl_Position = toClip(position);
+}
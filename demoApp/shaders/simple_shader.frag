@@ -2,18 +2,18 @@
 
 layout(location = 0) in vec3 fragColor;
 layout(location = 1) in vec2 fragTexCoord;
+layout(location = 2) flat in vec4 fragUvRect;
+layout(location = 3) flat in uint fragTextureLayer;
 
 // Layout qualifier; multiple output location (we are using 0 here)
 layout(location = 0) out vec4 outColor;
 
-layout(push_constant) uniform Push {
-    mat4 model;
-    mat4 view;
-} push;
-
-layout(binding = 1) uniform sampler2D texSampler;
+// set 0 is the material, one texture array of the atlas
+layout(set = 0, binding = 0) uniform sampler2DArray texSampler;
 
 void main() {
 //    outColor = vec4(push.color, 1.0); // R,G,B,A
-    outColor = texture(texSampler, fragTexCoord);
+    // a texture packed with others repeats within its rect; a whole layer repeats by itself
+    vec2 uv = fragUvRect.z < 1.0 ? fragUvRect.xy + fract(fragTexCoord) * fragUvRect.zw : fragTexCoord;
+    outColor = texture(texSampler, vec3(uv, float(fragTextureLayer)));
 }
\ No newline at end of file
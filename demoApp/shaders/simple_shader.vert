@@ -4,24 +4,36 @@ layout(location = 0) in vec3 position;
 layout(location = 1) in vec3 color;
 layout(location = 2) in vec2 inTexCoord;
 
+// uvOffset and uvScale are the texture's rect in its atlas layer, as unorm16 pairs
 layout(push_constant) uniform Push {
-    mat4 proj;
-    mat4 view;
+    mat4 viewProj;
+    vec4 modelRows[3];
+    uint uvOffset;
+    uint uvScale;
+    uint textureLayer;
 } push;
 
-layout (binding = 0) uniform UniformBufferObject {
-    mat4 model;
-    mat4 view;
-    mat4 projection;
-} ubo;
+// the world matrix comes as its top three rows
+vec4 toClip(vec3 objectPosition) {
+    vec4 p = vec4(objectPosition, 1.0);
+    vec3 world = vec3(dot(push.modelRows[0], p), dot(push.modelRows[1], p), dot(push.modelRows[2], p));
+    return push.viewProj * vec4(world, 1.0);
+}
+
+// must match depth_prepass.vert for the EQUAL depth test
+invariant gl_Position;
 
 layout(location = 0) out vec3 fragColor;
 layout(location = 1) out vec2 fragTexCoord;
+layout(location = 2) flat out vec4 fragUvRect;
+layout(location = 3) flat out uint fragTextureLayer;
 
 void main() {
 //    gl_Position = vec4(push.transform * position + push.offset, 0.0, 1.0); // x, y, z, scale?
 //    gl_Position = ubo.projection * ubo.view * ubo.model * vec4(position, 1.0);
-    gl_Position = push.proj * push.view * ubo.model * vec4(position, 1.0);
+    gl_Position = toClip(position);
     fragColor = color;
     fragTexCoord = inTexCoord;
+    fragUvRect = vec4(unpackUnorm2x16(push.uvOffset), unpackUnorm2x16(push.uvScale));
+    fragTextureLayer = push.textureLayer;
 }
\ No newline at end of file
@@ -0,0 +1,46 @@
+#version 450
+
+// simple_shader.vert with vertex pulling: the vertex is read from the geometry arena by
+// gl_VertexIndex instead of coming through vertex input. Indexed draws add their vertexOffset to
+// gl_VertexIndex, so a mesh's arena range needs no offset of its own.
+
+// Vertex in tp_model.h: position, color and texCoord, 8 tightly packed floats
+const uint VERTEX_FLOATS = 8;
+
+layout(set = 1, binding = 0) readonly buffer Vertices {
+    float vertices[];
+};
+
+// uvOffset and uvScale are the texture's rect in its atlas layer, as unorm16 pairs
+layout(push_constant) uniform Push {
+    mat4 viewProj;
+    vec4 modelRows[3];
+    uint uvOffset;
+    uint uvScale;
+    uint textureLayer;
+} push;
+
+// the world matrix comes as its top three rows
+vec4 toClip(vec3 objectPosition) {
+    vec4 p = vec4(objectPosition, 1.0);
+    vec3 world = vec3(dot(push.modelRows[0], p), dot(push.modelRows[1], p), dot(push.modelRows[2], p));
+    return push.viewProj * vec4(world, 1.0);
+}
+
+// must match depth_prepass_pull.vert for the EQUAL depth test
+invariant gl_Position;
+
+layout(location = 0) out vec3 fragColor;
+layout(location = 1) out vec2 fragTexCoord;
+layout(location = 2) flat out vec4 fragUvRect;
+layout(location = 3) flat out uint fragTextureLayer;
+
+void main() {
+    uint base = uint(gl_VertexIndex) * VERTEX_FLOATS;
+    vec3 position = vec3(vertices[base], vertices[base + 1], vertices[base + 2]);
+    gl_Position = toClip(position);
+    fragColor = vec3(vertices[base + 3], vertices[base + 4], vertices[base + 5]);
+    fragTexCoord = vec2(vertices[base + 6], vertices[base + 7]);
+    fragUvRect = vec4(unpackUnorm2x16(push.uvOffset), unpackUnorm2x16(push.uvScale));
+    fragTextureLayer = push.textureLayer;
+}
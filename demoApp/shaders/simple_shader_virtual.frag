@@ -0,0 +1,82 @@
+#version 450
+
+// simple_shader.frag for models with a virtual texture (TpVirtualTextureCache): the texel comes
+// from whichever page of the physical cache holds the wanted mip, or its closest resident
+// ancestor, and a sparse subset of pixels reports the page it wanted.
+
+layout(location = 0) in vec3 fragColor;
+layout(location = 1) in vec2 fragTexCoord;
+layout(location = 2) flat in vec4 fragUvRect;
+layout(location = 3) flat in uint fragTextureLayer;  // the virtual texture
+
+layout(location = 0) out vec4 outColor;
+
+// must match TpVirtualTextureCache::FEEDBACK_STRIDE
+const uint FEEDBACK_STRIDE = 8;
+const uint ENTRY_VALID = 0x80000000u;
+
+layout(set = 0, binding = 0) uniform sampler2D pageCache;
+
+layout(set = 0, binding = 1) readonly buffer PageTable {
+    uvec4 cache;             // slots per side, tile size, border, feedback phase
+    uvec4 textures[16];      // first page, width, height, mip count
+    uint entries[];
+};
+
+layout(set = 0, binding = 2) writeonly buffer Feedback {
+    uint requests[];
+};
+
+uvec2 mipSize(uvec4 texture, uint mip) {
+    return max(texture.yz >> mip, uvec2(1));
+}
+
+uvec2 tileCount(uvec4 texture, uint mip) {
+    return (mipSize(texture, mip) + cache.y - 1) / cache.y;
+}
+
+void main() {
+    uvec4 texture = textures[fragTextureLayer];
+    uint tileSize = cache.y;
+    vec2 uv = fract(fragTexCoord);
+
+    // the cache has no mips, so the mip comes from the texel footprint
+    vec2 texels = fragTexCoord * vec2(texture.yz);
+    vec2 dx = dFdx(texels);
+    vec2 dy = dFdy(texels);
+    float lod = 0.5 * log2(max(dot(dx, dx), dot(dy, dy)));
+    uint mip = uint(clamp(floor(lod), 0.0, float(texture.w - 1)));
+
+    uint page = texture.x;
+    for (uint m = 0; m < mip; m++) {
+        uvec2 tiles = tileCount(texture, m);
+        page += tiles.x * tiles.y;
+    }
+    uvec2 tiles = tileCount(texture, mip);
+    uvec2 tile = min(uvec2(uv * vec2(mipSize(texture, mip))) / tileSize, tiles - 1);
+    page += tile.y * tiles.x + tile.x;
+
+    uvec2 phase = uvec2(cache.w % FEEDBACK_STRIDE, cache.w / FEEDBACK_STRIDE);
+    if (all(equal(uvec2(gl_FragCoord.xy) % FEEDBACK_STRIDE, phase))) {
+        requests[page] = 1u;
+    }
+
+    uint entry = entries[page];
+    if ((entry & ENTRY_VALID) == 0u) {
+        outColor = vec4(fragColor, 1.0);
+        return;
+    }
+
+    // walk up to the resident mip the same way the page table fell back to it
+    uint residentMip = (entry >> 16) & 0xffu;
+    for (uint m = mip; m < residentMip; m++) {
+        tile = min(tile / 2u, tileCount(texture, m + 1) - 1);
+    }
+    vec2 inTile = uv * vec2(mipSize(texture, residentMip)) - vec2(tile * tileSize);
+    inTile = clamp(inTile, vec2(0.0), vec2(tileSize));
+
+    uvec2 slot = uvec2(entry & 0xffu, (entry >> 8) & 0xffu);
+    float slotSize = float(tileSize + 2 * cache.z);
+    vec2 texel = vec2(slot) * slotSize + float(cache.z) + inTile;
+    outColor = textureLod(pageCache, texel / (float(cache.x) * slotSize), 0.0);
+}
@@ -1,5 +1,7 @@
 #include "first_app.h"
 #include "simple_render_system.h"
+#include "tp_cpu_profiler.h"
+#include "tp_occlusion_buffer.h"
 
 // GLM Configuration
 #define GLM_FORCE_RADIANS
@@ -9,12 +11,15 @@
 
 // std
 #include <array>
+#include <fstream>
+#include <iostream>
 #include <stdexcept>
 
 namespace tpApp {
 using namespace teapot;
 
-FirstApp::FirstApp() {
+FirstApp::FirstApp(const TpSwapChainConfig &swapChainConfig)
+    : tpRenderer{tpWindow, tpDevice, swapChainConfig} {
 }
 
 FirstApp::~FirstApp() = default;
@@ -25,7 +30,59 @@ void FirstApp::run() {
   TpCamera camera{};
   camera.setViewDirection(glm::vec3{0.f, 0.f, 0.f}, glm::vec3{0.0, 0.f, 1.f});
 
-  loadGameObjects(simpleRenderSystem.getDescriptorSetLayout());
+  loadScene();
+
+  TpCpuProfiler::setEnabled(true);
+  bool traceKeyDown = false;
+  bool presentKeyDown = false;
+  bool prePassKeyDown = false;
+  bool lodKeyDown = false;
+  bool clusterKeyDown = false;
+  bool occlusionKeyDown = false;
+  bool softwareOcclusionKeyDown = false;
+  bool vertexPullingKeyDown = false;
+  bool memoryKeyDown = false;
+  bool softwareOcclusion = false;
+  TpOcclusionBuffer occlusionBuffer;
+  std::vector<uint32_t> visible;
+
+  if (!tpRenderer.setGpuProfilingEnabled(true)) {
+    std::cout << "GPU timestamps not supported, profiler disabled" << std::endl;
+  }
+
+  // The main pass, then with occlusion culling the test against its depth and the second phase
+  // drawn on top. Rebuilt by the renderer on resize and below when occlusion culling is toggled.
+  bool secondPhase = false;
+  tpRenderer.setFrameGraph([&](TpRenderGraph &graph, TpRgResource color, TpRgResource depth) {
+    VkClearValue clearColor{};
+    clearColor.color = {0.1f, 0.1f, 0.1f, 1.0f};
+    VkClearValue clearDepth{};
+    clearDepth.depthStencil = {1.0f, 0};
+    TpRgPass mainPass = graph.addPass("MainPass", [&](const TpRgPassContext &context) {
+      TpGpuZone zone{tpRenderer.getGpuProfiler(), context.commandBuffer, "SimpleRenderSystem"};
+      simpleRenderSystem.renderScene(context.commandBuffer, scene, camera);
+    });
+    graph.write(mainPass, color, TpRgAccess::ColorAttachment, clearColor);
+    graph.write(mainPass, depth, TpRgAccess::DepthAttachment, clearDepth);
+    if (!simpleRenderSystem.isOcclusionCullingEnabled()) return;
+
+    TpRgPass occlusionPass = graph.addPass("OcclusionCulling", [&, depth](const TpRgPassContext &context) {
+      TpGpuZone zone{tpRenderer.getGpuProfiler(), context.commandBuffer, "OcclusionCulling"};
+      secondPhase = simpleRenderSystem.cullOccluded(context.commandBuffer, graph.getImageView(depth),
+                                                    tpRenderer.getSwapChainExtent());
+    });
+    graph.read(occlusionPass, depth, TpRgAccess::SampledCompute);
+    // its results are the indirect commands of the second phase, which the graph does not track
+    graph.setSideEffect(occlusionPass);
+
+    TpRgPass secondPhasePass = graph.addPass("MainPassResumed", [&](const TpRgPassContext &context) {
+      if (!secondPhase) return;
+      TpGpuZone zone{tpRenderer.getGpuProfiler(), context.commandBuffer, "SimpleRenderSystemSecondPhase"};
+      simpleRenderSystem.renderScene(context.commandBuffer, scene, camera);
+    });
+    graph.write(secondPhasePass, color, TpRgAccess::ColorAttachment);
+    graph.write(secondPhasePass, depth, TpRgAccess::DepthAttachment);
+  });
 
   while (!tpWindow.shouldClose()) {
     glfwPollEvents();
@@ -34,24 +91,163 @@ void FirstApp::run() {
 
 
     if (glfwGetKey(tpWindow.getWindow(), GLFW_KEY_W) == GLFW_PRESS) {
-      gameObjects[0].transform.translation.y -= 0.01;
+      scene.setTranslation(chest, scene.getTranslation(chest) - glm::vec3{0.f, 0.01f, 0.f});
     } else if (glfwGetKey(tpWindow.getWindow(), GLFW_KEY_S) == GLFW_PRESS) {
-      gameObjects[0].transform.translation.y += 0.01;
+      scene.setTranslation(chest, scene.getTranslation(chest) + glm::vec3{0.f, 0.01f, 0.f});
     } else if (glfwGetKey(tpWindow.getWindow(), GLFW_KEY_LEFT) == GLFW_PRESS) {
-      gameObjects[0].transform.rotation.y = glm::mod(gameObjects[0].transform.rotation.y + 0.01f, glm::two_pi<float>());
+      glm::vec3 rotation = scene.getRotation(chest);
+      rotation.y = glm::mod(rotation.y + 0.01f, glm::two_pi<float>());
+      scene.setRotation(chest, rotation);
+    }
+
+    // T dumps the recently captured frames as a chrome://tracing file
+    bool traceKeyPressed = glfwGetKey(tpWindow.getWindow(), GLFW_KEY_T) == GLFW_PRESS;
+    if (traceKeyPressed && !traceKeyDown) {
+      if (TpCpuProfiler::exportChromeTrace("teapot_trace.json")) {
+        std::cout << "Wrote teapot_trace.json" << std::endl;
+      }
+    }
+    traceKeyDown = traceKeyPressed;
+
+    // P cycles fifo -> mailbox -> immediate
+    bool presentKeyPressed = glfwGetKey(tpWindow.getWindow(), GLFW_KEY_P) == GLFW_PRESS;
+    if (presentKeyPressed && !presentKeyDown) {
+      cyclePresentMode();
+    }
+    presentKeyDown = presentKeyPressed;
+
+    // Z toggles the depth pre-pass
+    bool prePassKeyPressed = glfwGetKey(tpWindow.getWindow(), GLFW_KEY_Z) == GLFW_PRESS;
+    if (prePassKeyPressed && !prePassKeyDown) {
+      simpleRenderSystem.setDepthPrePassEnabled(!simpleRenderSystem.isDepthPrePassEnabled());
+      std::cout << "Depth pre-pass " << (simpleRenderSystem.isDepthPrePassEnabled() ? "on" : "off") << std::endl;
+    }
+    prePassKeyDown = prePassKeyPressed;
+
+    bool lodKeyPressed = glfwGetKey(tpWindow.getWindow(), GLFW_KEY_L) == GLFW_PRESS;
+    if (lodKeyPressed && !lodKeyDown) {
+      simpleRenderSystem.setLodEnabled(!simpleRenderSystem.isLodEnabled());
+      std::cout << "Mesh LODs " << (simpleRenderSystem.isLodEnabled() ? "on" : "off") << std::endl;
+    }
+    lodKeyDown = lodKeyPressed;
+
+    bool clusterKeyPressed = glfwGetKey(tpWindow.getWindow(), GLFW_KEY_C) == GLFW_PRESS;
+    if (clusterKeyPressed && !clusterKeyDown) {
+      simpleRenderSystem.setClusterCullingEnabled(!simpleRenderSystem.isClusterCullingEnabled());
+      std::cout << "Cluster culling " << (simpleRenderSystem.isClusterCullingEnabled() ? "on" : "off") << std::endl;
+    }
+    clusterKeyDown = clusterKeyPressed;
+
+    bool occlusionKeyPressed = glfwGetKey(tpWindow.getWindow(), GLFW_KEY_O) == GLFW_PRESS;
+    if (occlusionKeyPressed && !occlusionKeyDown) {
+      simpleRenderSystem.setOcclusionCullingEnabled(!simpleRenderSystem.isOcclusionCullingEnabled());
+      tpRenderer.rebuildFrameGraph();
+      std::cout << "Occlusion culling " << (simpleRenderSystem.isOcclusionCullingEnabled() ? "on" : "off")
+                << std::endl;
+    }
+    occlusionKeyDown = occlusionKeyPressed;
+
+    bool softwareOcclusionKeyPressed = glfwGetKey(tpWindow.getWindow(), GLFW_KEY_X) == GLFW_PRESS;
+    if (softwareOcclusionKeyPressed && !softwareOcclusionKeyDown) {
+      if (softwareOcclusion) {
+        const auto &stats = occlusionBuffer.getStats();
+        std::cout << "Software occlusion off, last frame culled " << stats.culled << " / " << stats.tested
+                  << " in " << stats.rasterizeMs + stats.testMs << " ms" << std::endl;
+      } else {
+        std::cout << "Software occlusion on" << std::endl;
+      }
+      softwareOcclusion = !softwareOcclusion;
+    }
+    softwareOcclusionKeyDown = softwareOcclusionKeyPressed;
+
+    bool vertexPullingKeyPressed = glfwGetKey(tpWindow.getWindow(), GLFW_KEY_V) == GLFW_PRESS;
+    if (vertexPullingKeyPressed && !vertexPullingKeyDown) {
+      simpleRenderSystem.setVertexPullingEnabled(!simpleRenderSystem.isVertexPullingEnabled());
+      std::cout << "Vertex pulling " << (simpleRenderSystem.isVertexPullingEnabled() ? "on" : "off") << std::endl;
+    }
+    vertexPullingKeyDown = vertexPullingKeyPressed;
+
+    // M prints the memory budget of every heap
+    bool memoryKeyPressed = glfwGetKey(tpWindow.getWindow(), GLFW_KEY_M) == GLFW_PRESS;
+    if (memoryKeyPressed && !memoryKeyDown) {
+      printMemoryBudget();
+    }
+    memoryKeyDown = memoryKeyPressed;
+
+    scene.updateTransforms(&threadPool);
+    scene.cull(TpFrustum{camera.getProjection() * camera.getView()}, visible, &threadPool);
+    if (softwareOcclusion) {
+      occlusionBuffer.render(scene, visible, camera, &threadPool);
+      occlusionBuffer.cull(scene, visible, &threadPool);
     }
 
     if (auto commandBuffer = tpRenderer.beginFrame()) {
-      tpRenderer.beginSwapChainRenderPass(commandBuffer);
-      simpleRenderSystem.renderGameObjects(tpRenderer.getFrameIndex(), commandBuffer,
-                                           gameObjects, camera);
-      tpRenderer.endSwapChainRenderPass(commandBuffer);
+      if (virtualTextures) {
+        virtualTextures->update(commandBuffer, tpRenderer.getFrameIndex());
+      }
+      {
+        TpGpuZone zone{tpRenderer.getGpuProfiler(), commandBuffer, "ClusterCulling"};
+        simpleRenderSystem.prepareFrame(commandBuffer, tpRenderer.getFrameIndex(), scene, visible, camera);
+      }
+      tpRenderer.executeFrameGraph(commandBuffer);
+      if (virtualTextures) {
+        virtualTextures->finishFrame(commandBuffer);
+      }
       tpRenderer.endFrame();
     }
 
   }
 
   vkDeviceWaitIdle(tpDevice.device());
+  // the passes reference the render system and camera of this scope
+  tpRenderer.setFrameGraph(nullptr);
+  printGpuTimings();
+}
+
+void FirstApp::printGpuTimings() {
+  auto profiler = tpRenderer.getGpuProfiler();
+  if (profiler == nullptr) return;
+
+  std::cout << "GPU timings (avg / p50 / p95 / p99 ms):" << std::endl;
+  for (const auto &name : profiler->getZoneNames()) {
+    auto stats = profiler->getStats(name);
+    std::cout << "\t" << name << ": " << stats.averageMs << " / " << stats.p50Ms << " / "
+              << stats.p95Ms << " / " << stats.p99Ms << std::endl;
+  }
+}
+
+void FirstApp::printMemoryBudget() {
+  std::cout << "Memory budget (usage / budget MiB)"
+            << (tpDevice.supportsMemoryBudget() ? ":" : ", estimated:") << std::endl;
+  auto heaps = tpDevice.getMemoryBudget();
+  for (size_t i = 0; i < heaps.size(); i++) {
+    std::cout << "\theap " << i << (heaps[i].deviceLocal ? " (device local): " : ": ")
+              << heaps[i].usage / (1024 * 1024) << " / " << heaps[i].budget / (1024 * 1024) << std::endl;
+  }
+  const auto &pressure = tpDevice.getMemoryPressureStats();
+  std::cout << "\tpressure events: " << pressure.events << ", released MiB: "
+            << pressure.releasedBytes / (1024 * 1024) << std::endl;
+  for (auto memoryClass : {TpMemoryClass::StaticGeometry, TpMemoryClass::Textures, TpMemoryClass::Dynamic,
+                           TpMemoryClass::Staging}) {
+    TpMemoryPoolStats pool = tpDevice.getMemoryPoolStats(memoryClass);
+    std::cout << "\tpool " << memoryClassName(memoryClass) << ": " << pool.usedBytes / (1024 * 1024) << " / "
+              << pool.blockBytes / (1024 * 1024) << " MiB in " << pool.blocks << " blocks, fragmentation "
+              << pool.fragmentation << std::endl;
+  }
+  const auto &defragmentation = tpDevice.getDefragmentationStats();
+  std::cout << "\tdefragmentation passes: " << defragmentation.passes << ", moved MiB: "
+            << defragmentation.bytesMoved / (1024 * 1024) << ", freed MiB: "
+            << defragmentation.bytesFreed / (1024 * 1024) << std::endl;
+}
+
+void FirstApp::cyclePresentMode() {
+  auto config = tpRenderer.getSwapChainConfig();
+  switch (config.presentMode) {
+    case TpPresentMode::Fifo: config.presentMode = TpPresentMode::Mailbox; break;
+    case TpPresentMode::Mailbox: config.presentMode = TpPresentMode::Immediate; break;
+    case TpPresentMode::Immediate: config.presentMode = TpPresentMode::Fifo; break;
+  }
+  tpRenderer.setSwapChainConfig(config);
 }
 
 // temporary helper function, creates a 1x1x1 cube centered at offset
@@ -80,23 +276,29 @@ void FirstApp::run() {
 //  return std::make_unique<TpModel>(device, vertices, indexLMAO, "");
 //}
 
-void FirstApp::loadGameObjects(VkDescriptorSetLayout layout) {
+void FirstApp::loadScene() {
 //  std::shared_ptr<TpModel> tpModel = createCubeModel(tpDevice, {0,0,0});
-  std::shared_ptr<TpModel> tpModel = TpModel::loadObjFile(tpDevice, "../../demoApp/models/chest/chest.obj",
+  std::shared_ptr<TpModel> tpModel = TpModel::loadObjFile(tpDevice, geometry, textures, "../../demoApp/models/chest/chest.obj",
                                                           "../../demoApp/models/chest/Scene_-_Root_baseColor.png");
-  auto cube = TpGameObject::createGameObject(tpDevice, layout, tpModel);
-  cube.transform.translation = {0,-0.5,2};
-  cube.transform.scale = {0.2,0.2,0.2};
-  cube.transform.rotation.z = glm::radians<float>(180);
-  gameObjects.push_back(std::move(cube));
-
-  auto roomModel = TpModel::loadObjFile(tpDevice, "../../demoApp/models/room/room.obj",
-                                        "../../demoApp/models/room/room.png");
-  auto cube2 = TpGameObject::createGameObject(tpDevice, layout, roomModel);
-  cube2.transform.translation = {-1.7,1,4};
-  cube2.transform.scale = {1,1,1};
-  cube2.transform.rotation.x = glm::radians<float>(90);
-  gameObjects.push_back(std::move(cube2));
+  chest = scene.createEntity(scene.addModel(tpModel));
+  scene.setTranslation(chest, {0,-0.5,2});
+  scene.setScale(chest, {0.2,0.2,0.2});
+  scene.setRotation(chest, {0,0,glm::radians<float>(180)});
+
+  auto roomModel = TpModel::loadObjFile(tpDevice, geometry, textures, "../../demoApp/models/room/room.obj",
+                                        "../../demoApp/models/room/room.png", true);
+  if (tpDevice.supportsFragmentStores()) {
+    // converted once; later runs stream the tiles straight from disk
+    const std::string tiles = "../../demoApp/models/room/room.tiles";
+    if (!std::ifstream{tiles} && !TpTiledImage::convert("../../demoApp/models/room/room.png", tiles)) {
+      throw std::runtime_error("failed to convert room texture");
+    }
+    virtualTextures = std::make_unique<TpVirtualTextureCache>(tpDevice);
+    roomModel->setVirtualTexture(*virtualTextures, virtualTextures->add(tiles));
+  }
+  auto room = scene.createEntity(scene.addModel(roomModel));
+  scene.setTranslation(room, {-1.7,1,4});
+  scene.setRotation(room, {glm::radians<float>(90),0,0});
 }
 
 }  // namespace teapot
\ No newline at end of file
@@ -1,15 +1,58 @@
-
 #include "first_app.h"
 
 // std
 #include <cstdlib>
 #include <iostream>
 #include <stdexcept>
+#include <string>
+
+namespace {
+
+void printUsage(const char *program) {
+  std::cerr << "usage: " << program << " [options]\n"
+            << "  --present-mode M      fifo, mailbox or immediate (default fifo)\n"
+            << "  --frames-in-flight N  1 to 4 (default 2)\n"
+            << "  --min-images N        minimum swap chain image count (default surface minimum + 1)\n";
+}
 
-int main() {
-  tpApp::FirstApp app{};
+bool parseArgs(int argc, char **argv, teapot::TpSwapChainConfig &config) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--help" || arg == "-h") return false;
+    if (i + 1 >= argc) {
+      std::cerr << "missing value for " << arg << std::endl;
+      return false;
+    }
+    std::string value = argv[++i];
+
+    if (arg == "--present-mode") {
+      if (!teapot::parsePresentMode(value, config.presentMode)) {
+        std::cerr << "unknown present mode " << value << std::endl;
+        return false;
+      }
+    } else if (arg == "--frames-in-flight") {
+      config.framesInFlight = std::stoi(value);
+    } else if (arg == "--min-images") {
+      config.minImageCount = static_cast<uint32_t>(std::stoul(value));
+    } else {
+      std::cerr << "unknown option " << arg << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  teapot::TpSwapChainConfig swapChainConfig{};
+  if (!parseArgs(argc, argv, swapChainConfig)) {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
 
   try {
+    tpApp::FirstApp app{swapChainConfig};
     app.run();
   } catch (const std::exception &e) {
     std::cerr << e.what() << '\n';
@@ -17,4 +60,4 @@ int main() {
   }
 
   return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -7,16 +7,39 @@
 
 #include "tp_device.h"
 #include "tp_camera.h"
+#include "tp_depth_pyramid.h"
+#include "tp_draw_list.h"
 #include "tp_pipeline.h"
-#include "tp_gameobject.h"
+#include "tp_scene.h"
 #include "tp_renderer.h"
+#include "tp_virtual_texture_cache.h"
 
 // std
+#include <map>
 #include <memory>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace teapot {
 
+struct TpRenderStats {
+  // draws recorded in the shaded passes; indirect ones the GPU culls to no instances count too
+  uint32_t recordedDraws = 0;
+  uint32_t pipelineBinds = 0;
+  uint32_t materialBinds = 0;
+  uint32_t meshBinds = 0;  // vertex and index buffer binds, one per geometry arena change
+  uint32_t prePassDrawCalls = 0;
+  uint32_t prePassMeshBinds = 0;
+  uint32_t triangles = 0;  // shaded pass only, clustered draws count before cluster culling
+  uint32_t clusteredDrawCalls = 0;
+  uint32_t clustersTested = 0;
+  uint32_t occlusionTested = 0;  // draws tested against the depth pyramid
+
+  // binds skipped compared to binding the material and mesh of every draw
+  uint32_t bindsSaved() const { return 2 * recordedDraws - materialBinds - meshBinds; }
+};
+
 class SimpleRenderSystem {
 public:
   SimpleRenderSystem(TpDevice &device, VkRenderPass renderPass);
@@ -25,29 +48,222 @@ public:
   SimpleRenderSystem(const SimpleRenderSystem &) = delete;
   SimpleRenderSystem &operator=(const SimpleRenderSystem &) = delete;
 
-  VkDescriptorSetLayout getDescriptorSetLayout() const { return descriptorSetLayout; }
+  const TpRenderStats &getStats() const { return stats; }
+
+  void setSortMode(TpDrawSortMode mode) { sortMode = mode; }
+  TpDrawSortMode getSortMode() const { return sortMode; }
+
+  // Lays down depth with a position-only pass first; the shaded pass then tests EQUAL without
+  // writing depth, so every pixel is shaded once however much the scene overdraws.
+  void setDepthPrePassEnabled(bool enabled) { depthPrePass = enabled; }
+  bool isDepthPrePassEnabled() const { return depthPrePass; }
+
+  // Each draw uses the coarsest LOD whose error projects to at most `screenError` of the
+  // viewport height (the default is about a pixel at 1080p).
+  void setLodEnabled(bool enabled) { lodEnabled = enabled; }
+  bool isLodEnabled() const { return lodEnabled; }
+  void setLodScreenError(float screenError) { lodScreenError = screenError; }
 
-  void run();
+  // LOD 0 draws of models with meshlets are culled per cluster by a compute pass, which writes
+  // the surviving triangles to a per-frame index buffer drawn with one indirect draw per entity.
+  // The cone test drops clusters that back-face culling would drop entirely; turn it off for
+  // two-sided meshes, as the pipelines do not cull back faces themselves.
+  void setClusterCullingEnabled(bool enabled) { clusterCulling = enabled; }
+  bool isClusterCullingEnabled() const { return clusterCulling; }
+  void setClusterConeCullingEnabled(bool enabled) { clusterConeCulling = enabled; }
 
-  void renderGameObjects(int FrameIndex, VkCommandBuffer commandBuffer,
-                         std::vector<TpGameObject> &gameObjects, const TpCamera &camera);
+  // Two-phase occlusion culling against a depth pyramid: the first renderScene draws what was
+  // visible last frame, cullOccluded tests the whole draw list against the depth that left, and
+  // a second renderScene draws what the test found newly visible. Every draw becomes an indirect
+  // draw; culled ones are still recorded, with an instance count of 0.
+  void setOcclusionCullingEnabled(bool enabled) { occlusionCulling = enabled; }
+  bool isOcclusionCullingEnabled() const { return occlusionCulling; }
+
+  // Vertex shaders fetch their vertices from the geometry arena's storage buffers by
+  // gl_VertexIndex instead of through fixed vertex input; only the index buffer stays bound.
+  void setVertexPullingEnabled(bool enabled) { vertexPulling = enabled; }
+  bool isVertexPullingEnabled() const { return vertexPulling; }
+
+  // Builds and sorts the draws of the entities at the given dense indices (e.g. from
+  // TpScene::cull) and records the cluster culling and occlusion history dispatches. Must be
+  // called outside a render pass, before renderScene. frameIndex selects the per-frame buffers
+  // (TpRenderer::getFrameIndex).
+  void prepareFrame(VkCommandBuffer commandBuffer, int frameIndex, const TpScene &scene,
+                    const std::vector<uint32_t> &visible, const TpCamera &camera);
+  // Draws what prepareFrame prepared, or after cullOccluded the second phase of it, with the
+  // world matrices of the last updateTransforms.
+  // Draws are sorted by TpSortKey each frame and binds that match the previous draw are skipped.
+  void renderScene(VkCommandBuffer commandBuffer, const TpScene &scene, const TpCamera &camera);
+  // Call outside a render pass once the first renderScene's depth is written, with that depth as
+  // a frame graph pass reads it with TpRgAccess::SampledCompute. Returns false when occlusion
+  // culling is off for the frame; otherwise render into the same color and depth again (a pass
+  // that writes both without clearing) and call renderScene for the second phase.
+  bool cullOccluded(VkCommandBuffer commandBuffer, VkImageView depthView, VkExtent2D depthExtent);
 private:
+  static constexpr uint32_t MATERIALS_PER_POOL = 256;
+  // the pipeline byte of the sort keys, one per fragment shader
+  static constexpr uint32_t ATLAS_PIPELINE = 0;
+  static constexpr uint32_t VIRTUAL_TEXTURE_PIPELINE = 1;
+  static constexpr uint32_t PIPELINE_COUNT = 2;
+  static constexpr uint32_t COMPUTE_SETS_PER_POOL = 64;
+
+  // Indirect draws of one frame in flight and the compute output they read. The buffers the GPU
+  // reads and writes are device local; the CPU's part reaches them through the upload buffer.
+  struct IndirectFrame {
+    VkBuffer indexBuffer = VK_NULL_HANDLE;
+    VmaAllocation indexAllocation = nullptr;
+    VkDeviceSize indexCapacity = 0;
+    VkBuffer commandBuffer = VK_NULL_HANDLE;
+    VmaAllocation commandAllocation = nullptr;
+    uint32_t commandCapacity = 0;
+    VkBuffer boundsBuffer = VK_NULL_HANDLE;
+    VmaAllocation boundsAllocation = nullptr;
+    uint32_t boundsCapacity = 0;
+    VkBuffer uploadBuffer = VK_NULL_HANDLE;  // the bounds, then the first phase's commands
+    VmaAllocation uploadAllocation = nullptr;
+    VkDeviceSize uploadCapacity = 0;
+    VkDescriptorSet clusterSet = VK_NULL_HANDLE;
+    VkDescriptorSet occlusionSet = VK_NULL_HANDLE;
+    VkDescriptorSet pyramidSet = VK_NULL_HANDLE;
+  };
+
+  struct Material {
+    uint32_t id;
+    VkDescriptorSet descriptorSet;
+    VkImageView view;  // the texture array view the set was written with
+  };
+
+  // a set per frame in flight, rewritten when the cache has a new view since the frame used it
+  struct VirtualMaterial {
+    uint32_t id;
+    VkDescriptorSet descriptorSets[TpSwapChain::MAX_FRAMES_IN_FLIGHT];
+    VkImageView views[TpSwapChain::MAX_FRAMES_IN_FLIGHT];
+  };
+
+  // a model's texture in the atlas array of its material, as pushed to the shaders
+  struct ModelTexture {
+    uint32_t uvOffset;
+    uint32_t uvScale;
+    uint32_t layer;
+  };
+
   void createPipelineLayout();
   void createPipeline(VkRenderPass renderPass);
 
   void createDescriptorSetLayout();
+  // Descriptor set 0 holds a texture array of an atlas, so every model whose texture is in the
+  // same array shares the material; a set is retired when its array gets a new view.
+  const Material &getMaterial(const TpModel &model);
+  // set 0 of the virtual texture pipelines, up to date for currentFrameIndex
+  const VirtualMaterial &getVirtualMaterial(const TpVirtualTextureCache &cache);
+  VkDescriptorSet allocateMaterialSet();
+  // frees a set through the device's deferred destruction, once no frame in flight uses it
+  void retireSet(VkDescriptorSet set);
+  void buildDrawList(const TpScene &scene, const std::vector<uint32_t> &visible, const TpCamera &camera);
+  uint8_t selectLod(const TpModel &model, const glm::mat4 &world, const TpAabb &worldBounds,
+                    const TpCamera &camera, uint8_t currentLod) const;
+  void renderDepthPrePass(VkCommandBuffer commandBuffer, const TpScene &scene, const glm::mat4 &viewProj);
+  // binds the vertex input or, with vertex pulling, the storage buffers of the arena, and its indices
+  void bindGeometry(VkCommandBuffer commandBuffer, const TpGeometryArena &geometry, bool positionsOnly);
+  // Set 1 of the graphics pipelines: the arena's vertex and position streams.
+  VkDescriptorSet getGeometrySet(const TpGeometryArena &geometry);
+  // binds the model's or the cluster output's index buffer, whichever the draw needs
+  void bindDrawIndices(VkCommandBuffer commandBuffer, const TpModel &model, bool clustered);
+  void drawItem(VkCommandBuffer commandBuffer, TpModel &model, uint32_t index);
 
-  void updateUbo(VkCommandBuffer commandBuffer,
-                 VkBuffer uboBuffer, VmaAllocation uboAllocation,
-                 VkDescriptorSet descSet,
-                 const TpGameObject &obj, const TpCamera &camera);
-
+  void createClusterCulling();
+  void createOcclusionCulling();
+  // storage buffer sets, for the compute passes and the vertex pulling geometry sets
+  VkDescriptorSet allocateComputeSet(VkDescriptorSetLayout layout);
+  // Set 0 of the cluster pass holds a model's meshlets and indices, set 1 a frame's output.
+  VkDescriptorSet getClusterModelSet(const TpModel &model);
+  void reserveIndirectFrame(IndirectFrame &frame, VkDeviceSize indexCount, uint32_t commandCount,
+                            uint32_t boundsCount, VkDeviceSize uploadSize);
+  void reserveVisibility(VkCommandBuffer commandBuffer, uint32_t entityCount);
+  // picks the clustered draws and uploads the initial indirect commands
+  void writeDrawCommands(VkCommandBuffer commandBuffer, IndirectFrame &frame, const TpScene &scene);
+  void cullClusters(VkCommandBuffer commandBuffer, IndirectFrame &frame, const TpScene &scene,
+                    const TpCamera &camera);
+  // first phase: each draw's instance count becomes its visibility last frame
+  void applyVisibilityHistory(VkCommandBuffer commandBuffer, IndirectFrame &frame);
 
   teapot::TpDevice &tpDevice;
-  std::unique_ptr<teapot::TpPipeline> tpPipeline;
+  // [pipeline][vertex pulling][after the depth pre-pass]
+  std::unique_ptr<teapot::TpPipeline> shadedPipelines[PIPELINE_COUNT][2][2];
+  std::unique_ptr<teapot::TpPipeline> depthPrePassPipeline;
 
   VkPipelineLayout pipelineLayout{};
   VkDescriptorSetLayout descriptorSetLayout{};
+  VkDescriptorSetLayout geometrySetLayout{};
+
+  std::vector<VkDescriptorPool> materialPools;
+  std::unordered_map<VkDescriptorSet, VkDescriptorPool> setPools;  // every set still allocated
+  std::map<std::pair<const TpTextureAtlas *, uint32_t>, Material> materials;  // by atlas and array
+  std::unordered_map<const TpVirtualTextureCache *, VirtualMaterial> virtualMaterials;
+  uint32_t nextMaterialId = 0;
+
+  TpDrawSortMode sortMode = TpDrawSortMode::State;
+  TpDrawList drawList;
+  bool depthPrePass = false;
+  TpDrawList depthDrawList;  // always front to back, only mesh changes cost a bind
+  std::vector<VkDescriptorSet> modelMaterials;  // indexed by TpModelHandle
+  std::vector<uint32_t> modelMaterialIds;
+  std::vector<ModelTexture> modelTextures;
+  std::vector<uint8_t> modelPipelines;
+
+  bool lodEnabled = true;
+  float lodScreenError = 0.001f;
+  // per dense index; last frame's choice feeds the hysteresis and both passes draw the same LOD
+  std::vector<uint8_t> lodSelection;
+
+  bool clusterCulling = true;
+  bool clusterConeCulling = true;
+  std::unique_ptr<teapot::TpPipeline> clusterCullPipeline;
+  VkPipelineLayout clusterPipelineLayout{};
+  VkDescriptorSetLayout clusterModelSetLayout{};
+  VkDescriptorSetLayout clusterFrameSetLayout{};
+  std::vector<VkDescriptorPool> computePools;
+  struct ClusterModelSet {
+    VkDescriptorSet set;
+    VkBuffer indexBuffer;  // the arena index buffer the set was written with
+    VkBuffer meshletBuffer;
+  };
+  std::unordered_map<uint32_t, ClusterModelSet> clusterModelSets;  // by model id
+  std::vector<IndirectFrame> indirectFrames;
+  IndirectFrame *currentIndirectFrame = nullptr;
+  int currentFrameIndex = 0;
+  // per dense index, the first phase indirect command of the draw or UINT32_MAX, and whether
+  // it draws cluster culling output
+  std::vector<uint32_t> drawCommands;
+  std::vector<uint8_t> clusteredIndices;
+  std::vector<uint32_t> clusteredDraws;  // dense indices, in draw order
+  VkBuffer boundIndexBuffer = VK_NULL_HANDLE;
+
+  bool vertexPulling = false;
+  std::unique_ptr<teapot::TpPipeline> pullDepthPrePassPipeline;
+  struct GeometrySet {
+    VkDescriptorSet set;
+    VkBuffer vertexBuffer;  // the arena buffers the set was written with
+    VkBuffer positionBuffer;
+  };
+  std::unordered_map<const TpGeometryArena *, GeometrySet> geometrySets;
+
+  bool occlusionCulling = true;
+  bool frameOcclusion = false;  // occlusionCulling as it was at prepareFrame
+  uint32_t occlusionPhase = 0;
+  glm::mat4 frameViewProj{1.f};
+  std::unique_ptr<TpDepthPyramid> depthPyramid;
+  std::unique_ptr<teapot::TpPipeline> occlusionHistoryPipeline;
+  std::unique_ptr<teapot::TpPipeline> occlusionCullPipeline;
+  VkPipelineLayout occlusionPipelineLayout{};
+  VkDescriptorSetLayout occlusionSetLayout{};
+  VkDescriptorSetLayout pyramidSetLayout{};
+  // per dense index, 1 when the entity passed the last occlusion test; shared by all frames
+  VkBuffer visibilityBuffer = VK_NULL_HANDLE;
+  VmaAllocation visibilityAllocation = nullptr;
+  uint32_t visibilityCapacity = 0;
+
+  TpRenderStats stats{};
 };
 }  // namespace teapot
 
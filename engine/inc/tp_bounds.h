@@ -0,0 +1,70 @@
+#pragma once
+
+// GLM Configuration
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+
+// std lib headers
+#include <array>
+#include <limits>
+
+namespace teapot {
+
+struct TpAabb {
+  glm::vec3 min{std::numeric_limits<float>::max()};
+  glm::vec3 max{std::numeric_limits<float>::lowest()};
+
+  bool isEmpty() const { return min.x > max.x; }
+  glm::vec3 center() const { return (min + max) * 0.5f; }
+  glm::vec3 extent() const { return (max - min) * 0.5f; }
+
+  void expand(const glm::vec3 &point) {
+    min = glm::min(min, point);
+    max = glm::max(max, point);
+  }
+  void expand(const TpAabb &other) {
+    min = glm::min(min, other.min);
+    max = glm::max(max, other.max);
+  }
+
+  // Bounds of the transformed box (Arvo): exact for the box, not for what it contains.
+  TpAabb transformed(const glm::mat4 &transform) const;
+
+  bool overlaps(const TpAabb &other) const {
+    return glm::all(glm::lessThanEqual(min, other.max)) && glm::all(glm::lessThanEqual(other.min, max));
+  }
+  float surfaceArea() const {
+    if (isEmpty()) return 0.f;
+    glm::vec3 size = max - min;
+    return 2.f * (size.x * size.y + size.y * size.z + size.z * size.x);
+  }
+
+  // Slab test. distance receives the entry distance along the ray, 0 when the origin is inside.
+  bool intersectRay(const glm::vec3 &origin, const glm::vec3 &inverseDirection, float maxDistance,
+                    float &distance) const;
+};
+
+enum class TpFrustumTest { Outside, Intersects, Inside };
+
+/*
+ * The six planes of a view-projection matrix (Gribb/Hartmann), for the engine's [0, 1] depth
+ * range. Planes point inwards and are normalized.
+ */
+class TpFrustum {
+ public:
+  TpFrustum() = default;
+  explicit TpFrustum(const glm::mat4 &viewProj);
+
+  // false only when the box is certainly outside; boxes near corners can pass
+  bool intersects(const TpAabb &box) const;
+  // same test, also telling whether the box is entirely inside
+  TpFrustumTest classify(const TpAabb &box) const;
+
+  const std::array<glm::vec4, 6> &getPlanes() const { return planes; }
+
+ private:
+  std::array<glm::vec4, 6> planes{};
+};
+
+}  // namespace teapot
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "tp_bounds.h"
+#include "tp_thread_pool.h"
+
+// std lib headers
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace teapot {
+
+struct TpRayHit {
+  uint32_t index = UINT32_MAX;  // primitive index, UINT32_MAX when nothing was hit
+  float distance = 0.f;         // in units of the ray direction
+};
+
+/*
+ * Bounding volume hierarchy over a caller-owned array of boxes; queries report indices into
+ * that array. build uses binned SAH. refit only recomputes node bounds bottom-up for moved
+ * primitives, so the tree degrades as objects drift; needsRebuild tells when it has become
+ * noticeably worse than a fresh build.
+ *
+ * Nodes are a flat array where the two children of a node are adjacent and always come after
+ * their parent.
+ */
+class TpBvh {
+ public:
+  static constexpr uint32_t MAX_LEAF_SIZE = 4;
+
+  void build(const TpAabb *bounds, size_t count);
+  void refit(const TpAabb *bounds);
+  bool needsRebuild() const { return sahCost > builtSahCost * 1.5f; }
+  void clear();
+
+  size_t primitiveCount() const { return primitives.size(); }
+  size_t nodeCount() const { return nodes.size(); }
+
+  // Appends the primitives whose boxes touch the frustum. Subtrees entirely inside are not
+  // tested further. With a pool, the top of the tree is split into independent tasks.
+  void cullFrustum(const TpFrustum &frustum, const TpAabb *bounds, std::vector<uint32_t> &out,
+                   TpThreadPool *pool = nullptr) const;
+  // nearest primitive box hit within maxDistance
+  bool raycast(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, const TpAabb *bounds,
+               TpRayHit &hit) const;
+  // appends the primitives whose boxes overlap box
+  void overlap(const TpAabb &box, const TpAabb *bounds, std::vector<uint32_t> &out) const;
+
+ private:
+  struct Node {
+    TpAabb bounds;
+    uint32_t first;  // leaf: first entry in primitives; interior: left child, right is first + 1
+    uint32_t count;  // 0 for interior nodes
+  };
+
+  void appendSubtree(uint32_t node, std::vector<uint32_t> &out) const;
+  void cullSubtree(uint32_t root, const TpFrustum &frustum, const TpAabb *bounds,
+                   std::vector<uint32_t> &out) const;
+  float computeSahCost() const;
+
+  std::vector<Node> nodes;
+  std::vector<uint32_t> primitives;
+  float sahCost = 0.f;
+  float builtSahCost = 0.f;
+};
+
+}  // namespace teapot
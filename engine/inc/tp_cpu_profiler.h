@@ -0,0 +1,68 @@
+#pragma once
+
+// std lib headers
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace teapot {
+
+/*
+ * Lightweight CPU instrumentation. Zones are recorded into a per-thread ring buffer with
+ * steady_clock timestamps, without locks, and can be exported as Chrome trace JSON
+ * (chrome://tracing, Perfetto).
+ * Recording is off until setEnabled(true); building with TEAPOT_DISABLE_CPU_PROFILER removes
+ * the macros entirely.
+ */
+class TpCpuProfiler {
+ public:
+  static constexpr size_t EVENTS_PER_THREAD = 1 << 16;
+
+  static void setEnabled(bool enabled) { enabledFlag.store(enabled, std::memory_order_relaxed); }
+  static bool isEnabled() { return enabledFlag.load(std::memory_order_relaxed); }
+
+  static uint64_t now() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+  }
+
+  static void recordZone(const char *name, uint64_t startNs, uint64_t endNs);
+  static void markFrame();
+
+  static bool exportChromeTrace(const std::string &filePath);
+  static void clear();
+
+ private:
+  static std::atomic<bool> enabledFlag;
+};
+
+class TpCpuZone {
+ public:
+  explicit TpCpuZone(const char *name) : name{name} {
+    if (TpCpuProfiler::isEnabled()) startNs = TpCpuProfiler::now();
+  }
+  ~TpCpuZone() {
+    if (startNs != 0) TpCpuProfiler::recordZone(name, startNs, TpCpuProfiler::now());
+  }
+
+  TpCpuZone(const TpCpuZone &) = delete;
+  TpCpuZone &operator=(const TpCpuZone &) = delete;
+
+ private:
+  const char *name;
+  uint64_t startNs = 0;
+};
+
+}  // namespace teapot
+
+#define TP_PROFILE_CONCAT_INNER(a, b) a##b
+#define TP_PROFILE_CONCAT(a, b) TP_PROFILE_CONCAT_INNER(a, b)
+
+#ifndef TEAPOT_DISABLE_CPU_PROFILER
+#define TP_PROFILE_SCOPE(name) ::teapot::TpCpuZone TP_PROFILE_CONCAT(tpCpuZone, __LINE__){name}
+#define TP_PROFILE_FRAME() ::teapot::TpCpuProfiler::markFrame()
+#else
+#define TP_PROFILE_SCOPE(name) ((void)0)
+#define TP_PROFILE_FRAME() ((void)0)
+#endif
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "tp_device.h"
+#include "tp_pipeline.h"
+
+// std lib headers
+#include <array>
+#include <memory>
+#include <vector>
+
+namespace teapot {
+
+/*
+ * Hierarchical-Z pyramid: a mip chain where every texel holds the farthest depth of the area it
+ * covers, built by compute from a depth attachment. Level 0 is the largest power of two that
+ * fits in the depth extent, so every further level exactly halves the one before and any screen
+ * rectangle is covered by at most 2x2 texels of one level.
+ *
+ * There is one pyramid per frame in flight; each is built and read within its own frame.
+ */
+class TpDepthPyramid {
+ public:
+  static constexpr uint32_t MAX_LEVELS = 16;
+
+  explicit TpDepthPyramid(TpDevice &device);
+  ~TpDepthPyramid();
+
+  TpDepthPyramid(const TpDepthPyramid &) = delete;
+  TpDepthPyramid &operator=(const TpDepthPyramid &) = delete;
+
+  // depthView must be in SHADER_READ_ONLY_OPTIMAL (a TpRgAccess::SampledCompute read) with its
+  // writes visible to compute.
+  // Afterwards the pyramid is in GENERAL layout and its writes are visible to compute shaders.
+  void build(VkCommandBuffer commandBuffer, int frameIndex, VkImageView depthView, VkExtent2D depthExtent);
+
+  // all levels, for sampling with textureLod / texelFetch
+  VkImageView getView(int frameIndex) const { return frames[frameIndex].view; }
+  VkSampler getSampler() const { return sampler; }
+  VkExtent2D getExtent(int frameIndex) const { return frames[frameIndex].extent; }
+  uint32_t getLevelCount(int frameIndex) const { return frames[frameIndex].levelCount; }
+
+ private:
+  struct Frame {
+    VkImage image = VK_NULL_HANDLE;
+    VmaAllocation allocation = nullptr;
+    VkImageView view = VK_NULL_HANDLE;
+    std::vector<VkImageView> levelViews;
+    VkExtent2D extent{0, 0};
+    uint32_t levelCount = 0;
+    // level i reads level i - 1 (level 0 reads depth) and writes level i
+    std::array<VkDescriptorSet, MAX_LEVELS> descriptorSets{};
+  };
+
+  void createDescriptorSetLayout();
+  void createPipeline();
+  void createSampler();
+  void allocateDescriptorSets(Frame &frame);
+  void createImage(Frame &frame, VkExtent2D extent);
+  void destroyImage(Frame &frame);
+
+  TpDevice &tpDevice;
+  VkDescriptorSetLayout descriptorSetLayout{};
+  VkDescriptorPool descriptorPool{};
+  VkPipelineLayout pipelineLayout{};
+  std::unique_ptr<TpPipeline> reducePipeline;
+  VkSampler sampler{};
+  std::vector<Frame> frames;
+};
+
+}  // namespace teapot
@@ -3,7 +3,9 @@
 #include "tp_window.h"
 #include <vk_mem_alloc.h>
 // std lib headers
+#include <functional>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace teapot {
@@ -14,6 +16,49 @@ struct SwapChainSupportDetails {
   std::vector<VkPresentModeKHR> presentModes;
 };
 
+// one VkMemoryHeap as VMA sees it
+struct TpMemoryHeapBudget {
+  VkDeviceSize budget = 0;           // what the process may use; estimated without VK_EXT_memory_budget
+  VkDeviceSize usage = 0;            // includes memory not allocated through VMA, like the swap chain
+  VkDeviceSize blockBytes = 0;       // VkDeviceMemory blocks of VMA
+  VkDeviceSize allocationBytes = 0;  // allocations within those blocks
+  bool deviceLocal = false;
+};
+
+struct TpMemoryPressureStats {
+  uint32_t events = 0;           // soft limit overruns and failed allocations that asked the handlers
+  uint64_t requestedBytes = 0;
+  uint64_t releasedBytes = 0;    // as reported by the handlers
+  uint32_t failedAllocations = 0;
+  uint32_t recoveredAllocations = 0;  // failed allocations that succeeded after relieving pressure
+};
+
+// What an allocation is used for. Every class but Default allocates from its own VMA pool, so
+// long lived geometry and textures do not share blocks with buffers that come and go every few
+// frames, and each class can be measured and defragmented on its own.
+enum class TpMemoryClass { Default, StaticGeometry, Textures, Dynamic, Staging };
+
+const char *memoryClassName(TpMemoryClass memoryClass);
+
+struct TpMemoryPoolStats {
+  VkDeviceSize blockBytes = 0;
+  VkDeviceSize usedBytes = 0;
+  uint32_t allocations = 0;
+  uint32_t blocks = 0;
+  uint32_t freeRanges = 0;
+  VkDeviceSize largestFreeRange = 0;
+  // 1 - largest free range / free bytes: 0 when the free space is in one piece
+  float fragmentation = 0.f;
+};
+
+struct TpDefragmentationStats {
+  uint32_t passes = 0;
+  uint32_t allocationsMoved = 0;
+  uint64_t bytesMoved = 0;
+  uint64_t bytesFreed = 0;  // empty blocks given back to the driver
+  uint32_t blocksFreed = 0;
+};
+
 struct QueueFamilyIndices {
   uint32_t graphicsFamily;
   uint32_t presentFamily;
@@ -49,30 +94,99 @@ class TpDevice {
   SwapChainSupportDetails getSwapChainSupport() { return querySwapChainSupport(physicalDevices[0]); }
   uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties);
   QueueFamilyIndices findPhysicalQueueFamilies() { return findQueueFamilies(physicalDevices[0]); }
+  uint32_t graphicsTimestampValidBits();
+  // true on tile based gpus that can back transient attachments with on-chip memory only
+  bool supportsLazilyAllocatedMemory();
+  // storage buffer writes from fragment shaders, enabled when the device has them
+  bool supportsFragmentStores() const { return fragmentStores; }
+  // VK_EXT_memory_budget, enabled when the device has it; otherwise VMA estimates the budgets
+  bool supportsMemoryBudget() const { return memoryBudget; }
   VkFormat findSupportedFormat(
       const std::vector<VkFormat> &candidates, VkImageTiling tiling, VkFormatFeatureFlags features);
 
-  // Buffer Helper Functions
+  // Buffer Helper Functions. An allocation of a memory class comes from the class's pool when the
+  // pool's memory type suits the resource and vmaUsage, and from the default pools otherwise.
   void createBuffer(
       VkDeviceSize size,
       VkBufferUsageFlags usage,
       VmaMemoryUsage vmaUsage,
       VkBuffer &buffer,
-      VmaAllocation &allocation);
+      VmaAllocation &allocation,
+      TpMemoryClass memoryClass = TpMemoryClass::Default);
   VkImageView createImageView(VkImage image, VkFormat format);
 
+  // Graphics queue timeline (VK_KHR_timeline_semaphore). Every submitGraphics call signals the
+  // next value, so uploads, readbacks and deferred deletions can wait for or poll "submission N
+  // complete" without owning a fence. Binary semaphores are only used for the swap chain.
+  uint64_t submitGraphics(
+      const VkCommandBuffer *commandBuffers,
+      uint32_t commandBufferCount,
+      VkSemaphore waitSemaphore = VK_NULL_HANDLE,
+      VkPipelineStageFlags waitStage = 0,
+      VkSemaphore signalSemaphore = VK_NULL_HANDLE);
+  void waitForGraphicsValue(uint64_t value);
+  bool isGraphicsValueComplete(uint64_t value);
+  uint64_t completedGraphicsValue();
+  uint64_t lastSubmittedGraphicsValue() const { return graphicsTimelineValue; }
+
+  // Runs destroy once the graphics timeline reaches graphicsValue. Pending entries are checked by
+  // collectDeferredDestruction (called by the renderer every frame) and flushed on destruction.
+  void deferDestroy(uint64_t graphicsValue, std::function<void()> destroy);
+  void collectDeferredDestruction();
+
+  // Memory budget. Every frame the renderer calls updateMemoryBudget, which asks the pressure
+  // handlers to release memory while a device local heap uses more than the soft limit of its
+  // budget. Failed allocations ask them too and retry once before throwing.
+  using MemoryPressureHandler = std::function<VkDeviceSize(VkDeviceSize bytes)>;
+  std::vector<TpMemoryHeapBudget> getMemoryBudget() const;
+  void updateMemoryBudget();
+  // fraction of the budget above which the handlers are asked for memory, 0.9 by default
+  void setMemorySoftLimit(float fractionOfBudget);
+  float getMemorySoftLimit() const { return memorySoftLimit; }
+  // caps the budget of every device local heap, 0 for none; mostly for testing eviction
+  void setMemoryBudgetCap(VkDeviceSize bytes) { memoryBudgetCap = bytes; }
+  // A handler releases up to bytes of memory it can do without, through deferDestroy, and
+  // returns how much it released. Handlers are asked in the order they were added until enough
+  // is released, so add those that lose nothing but spare capacity first.
+  uint32_t addMemoryPressureHandler(MemoryPressureHandler handler);
+  void removeMemoryPressureHandler(uint32_t handler);
+  VkDeviceSize relieveMemoryPressure(VkDeviceSize bytes);
+  const TpMemoryPressureStats &getMemoryPressureStats() const { return memoryPressureStats; }
+
+  TpMemoryPoolStats getMemoryPoolStats(TpMemoryClass memoryClass) const;
+
+  // Defragmentation. Buffers whose owner can rebind them are tracked as movable; while the
+  // static geometry pool is fragmented, defragmentStep (called by the renderer every frame
+  // before recording) moves a few of them on the GPU on frames where all earlier work has
+  // retired, recreates them at their new place and hands the new buffer to moved. Owners must
+  // rewrite whatever refers to the old buffer before their next draw, and untrack a buffer
+  // before destroying it.
+  using MovedBufferHandler = std::function<void(VkBuffer buffer)>;
+  void trackMovableBuffer(VkBuffer buffer, VmaAllocation allocation, VkDeviceSize size, VkBufferUsageFlags usage,
+                          MovedBufferHandler moved);
+  void untrackMovableBuffer(VmaAllocation allocation);
+  // defragments until a pass moves nothing, whatever the fragmentation
+  void requestDefragmentation() { defragmenting = true; }
+  // starts defragmenting on its own when the static geometry pool is fragmented, on by default
+  void setAutomaticDefragmentation(bool enabled) { automaticDefragmentation = enabled; }
+  void defragmentStep();
+  const TpDefragmentationStats &getDefragmentationStats() const { return defragmentationStats; }
+
+  // Single time commands are submitted without waiting. End returns the graphics value they
+  // signal; release what they read, such as staging buffers, through deferDestroy with it.
   VkCommandBuffer beginSingleTimeCommands();
-  void endSingleTimeCommands(VkCommandBuffer commandBuffer);
-  void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
-  void copyBufferToImage(
+  uint64_t endSingleTimeCommands(VkCommandBuffer commandBuffer);
+  uint64_t copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
+  uint64_t copyBufferToImage(
       VkBuffer buffer, VkImage image, uint32_t width, uint32_t height, uint32_t layerCount);
-  void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout);
+  uint64_t transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout);
 
   void createImageWithInfo(
       const VkImageCreateInfo &imageInfo,
       VmaMemoryUsage properties,
       VkImage &image,
-      VmaAllocation &imageAllocation);
+      VmaAllocation &imageAllocation,
+      TpMemoryClass memoryClass = TpMemoryClass::Default);
 
   VkPhysicalDeviceProperties properties{};
 
@@ -83,6 +197,7 @@ class TpDevice {
   void pickPhysicalDevice();
   void createLogicalDevice();
   void createCommandPool();
+  void createGraphicsTimeline();
 
   // helper functions
   bool isDeviceSuitable(VkPhysicalDevice device);
@@ -92,6 +207,11 @@ class TpDevice {
   void populateDebugMessengerCreateInfo(VkDebugUtilsMessengerCreateInfoEXT &createInfo);
   void hasGflwRequiredInstanceExtensions();
   bool checkDeviceExtensionSupport(VkPhysicalDevice device);
+  bool checkTimelineSemaphoreSupport(VkPhysicalDevice device);
+  bool checkOptionalExtensionSupport(VkPhysicalDevice device, const char *extension);
+  // relieves pressure after a failed allocation of about bytes and waits until the released
+  // memory is free; false when there is nothing to retry
+  bool recoverFailedAllocation(VkDeviceSize bytes);
   SwapChainSupportDetails querySwapChainSupport(VkPhysicalDevice device);
 
   VkInstance instance{};
@@ -107,10 +227,54 @@ class TpDevice {
   VkQueue graphicsQueue_{};
   VkQueue presentQueue_{};
 
+  VkSemaphore graphicsTimeline{};
+  uint64_t graphicsTimelineValue = 0;
+  bool fragmentStores = false;
+  bool memoryBudget = false;
+  uint64_t graphicsCompletedValue = 0;
+  std::vector<std::pair<uint64_t, std::function<void()>>> deferredDestruction;
+  PFN_vkWaitSemaphoresKHR waitSemaphoresKHR = nullptr;
+  PFN_vkGetSemaphoreCounterValueKHR getSemaphoreCounterValueKHR = nullptr;
+
   const std::vector<const char *> validationLayers = {"VK_LAYER_KHRONOS_validation"};
-  const std::vector<const char *> deviceExtensions = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
+  const std::vector<const char *> deviceExtensions = {
+      VK_KHR_SWAPCHAIN_EXTENSION_NAME, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME};
 
   void initializeAllocator();
+  void createMemoryPools();
+  // the pool of the class, or null when its memory type is not the one VMA picks for the resource
+  VmaPool findBufferPool(TpMemoryClass memoryClass, const VkBufferCreateInfo &bufferInfo, VmaMemoryUsage usage);
+  VmaPool findImagePool(TpMemoryClass memoryClass, const VkImageCreateInfo &imageInfo, VmaMemoryUsage usage);
+
+  float memorySoftLimit = 0.9f;
+  VkDeviceSize memoryBudgetCap = 0;
+  uint32_t memoryFrame = 0;
+  // released memory is only free once the frames in flight are done, so the soft limit is not
+  // checked again before this value completes
+  uint64_t memoryReleaseValue = 0;
+  bool relievingMemory = false;
+  uint32_t nextMemoryPressureHandler = 0;
+  std::vector<std::pair<uint32_t, MemoryPressureHandler>> memoryPressureHandlers;
+  TpMemoryPressureStats memoryPressureStats;
+
+  static constexpr size_t MEMORY_CLASS_COUNT = static_cast<size_t>(TpMemoryClass::Staging) + 1;
+  // indexed by memory class, Default has none
+  VmaPool memoryPools[MEMORY_CLASS_COUNT]{};
+  uint32_t memoryPoolTypes[MEMORY_CLASS_COUNT]{};
+
+  struct MovableBuffer {
+    VkBuffer buffer;
+    VmaAllocation allocation;
+    VkDeviceSize size;
+    VkBufferUsageFlags usage;
+    MovedBufferHandler moved;
+  };
+  std::vector<MovableBuffer> movableBuffers;
+  bool defragmenting = false;
+  bool automaticDefragmentation = true;
+  uint32_t framesSinceFragmentationCheck = 0;
+  TpMemoryPoolStats defragmentedPool;  // when the last passes stopped moving anything
+  TpDefragmentationStats defragmentationStats;
 };
 
 }  // namespace teapot
\ No newline at end of file
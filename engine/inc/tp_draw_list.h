@@ -0,0 +1,61 @@
+#pragma once
+
+// std lib headers
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace teapot {
+
+enum class TpDrawSortMode {
+  State,       // pipeline > material > mesh > depth: fewest rebinds
+  FrontToBack  // pipeline > depth > material > mesh: most early-Z rejection for opaque draws
+};
+
+const char *drawSortModeName(TpDrawSortMode mode);
+bool parseDrawSortMode(const std::string &name, TpDrawSortMode &mode);
+
+struct TpDrawItem {
+  uint64_t key;
+  uint32_t index;  // the caller's object index
+};
+
+/*
+ * 64-bit draw sort keys. The pipeline always takes the top byte so that pipelines are never
+ * interleaved; material and mesh ids get 20 bits each and the depth bucket 16 bits, ordered
+ * according to the sort mode.
+ */
+struct TpSortKey {
+  static constexpr uint32_t MAX_PIPELINES = 1u << 8;
+  static constexpr uint32_t MAX_MATERIALS = 1u << 20;
+  static constexpr uint32_t MAX_MESHES = 1u << 20;
+
+  static uint64_t make(TpDrawSortMode mode, uint32_t pipeline, uint32_t material, uint32_t mesh,
+                       uint16_t depthBucket);
+  static uint32_t pipeline(uint64_t key) { return static_cast<uint32_t>(key >> 56); }
+  // Monotonic in the view distance without needing the camera range: the top bits of a positive
+  // float are its exponent and leading mantissa. Negative distances (behind the eye) map to 0.
+  static uint16_t depthBucket(float viewDistance);
+};
+
+/*
+ * Per-frame list of draws, sorted by key with an LSD radix sort (8 bits per pass). Passes whose
+ * byte is the same for every key are skipped, which is the common case for the pipeline byte.
+ */
+class TpDrawList {
+ public:
+  void clear() { drawItems.clear(); }
+  void reserve(size_t count) { drawItems.reserve(count); }
+  void add(uint64_t key, uint32_t index) { drawItems.push_back({key, index}); }
+  void sort();
+
+  const std::vector<TpDrawItem> &items() const { return drawItems; }
+  size_t size() const { return drawItems.size(); }
+
+ private:
+  std::vector<TpDrawItem> drawItems;
+  std::vector<TpDrawItem> scratch;
+};
+
+}  // namespace teapot
@@ -0,0 +1,157 @@
+#pragma once
+
+#include "tp_device.h"
+
+// GLM Configuration
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+
+// std lib headers
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace teapot {
+
+using TpMeshHandle = uint32_t;
+
+// where a mesh lives in its arena, as vkCmdDrawIndexed takes it
+struct TpMeshRange {
+  int32_t vertexOffset;
+  uint32_t firstIndex;
+  uint32_t vertexCount;
+  uint32_t indexCount;
+};
+
+struct TpGeometryStats {
+  uint32_t meshes = 0;
+  uint32_t vertexCapacity = 0;
+  uint32_t vertexUsed = 0;
+  uint32_t indexCapacity = 0;
+  uint32_t indexUsed = 0;
+  uint32_t freeBlocks = 0;  // vertex and index free list entries, at most 2 when nothing is fragmented
+  uint32_t grows = 0;
+  uint32_t defragmentations = 0;
+  uint32_t trims = 0;
+};
+
+/*
+ * Shared device-local buffers that every mesh is suballocated from: interleaved vertices,
+ * positions for depth-only passes, and 32-bit indices. A scene drawn from one arena binds its
+ * geometry once and every draw is just a (vertexOffset, firstIndex, indexCount) range, which is
+ * what indirect draws need.
+ *
+ * Vertex and index ranges come from best-fit free lists. When a mesh does not fit, the arena
+ * first compacts its live meshes if that frees enough contiguous space and grows otherwise; both
+ * copy into new buffers and retire the old ones through the device's deferred destruction, so
+ * frames in flight keep drawing from what they recorded. Ranges therefore move: look them up
+ * with getRange when recording, and compare getGeneration to detect that buffers were replaced.
+ * The buffers come from the device's static geometry pool, and device defragmentation may also
+ * replace them between frames, which changes the generation as well.
+ * Under memory pressure (TpDevice::addMemoryPressureHandler) the arena gives up its spare
+ * capacity the same way.
+ *
+ * Not thread safe; uploads wait for the graphics queue like TpDevice::copyBuffer.
+ */
+class TpGeometryArena {
+ public:
+  static constexpr uint32_t DEFAULT_VERTEX_CAPACITY = 1u << 18;
+  static constexpr uint32_t DEFAULT_INDEX_CAPACITY = 1u << 20;
+
+  // vertexStride is the size of one interleaved vertex (sizeof(Vertex))
+  TpGeometryArena(TpDevice &device, uint32_t vertexStride,
+                  uint32_t vertexCapacity = DEFAULT_VERTEX_CAPACITY,
+                  uint32_t indexCapacity = DEFAULT_INDEX_CAPACITY);
+  ~TpGeometryArena();
+
+  TpGeometryArena(const TpGeometryArena &) = delete;
+  TpGeometryArena &operator=(const TpGeometryArena &) = delete;
+
+  // Uploads a mesh. Indices are relative to the mesh's first vertex, so they are stored as given
+  // and drawn with the range's vertexOffset.
+  TpMeshHandle allocate(const void *vertices, const glm::vec3 *positions, uint32_t vertexCount,
+                        const uint32_t *indices, uint32_t indexCount);
+  // The space is reused once the draws already submitted are complete.
+  void free(TpMeshHandle mesh);
+  const TpMeshRange &getRange(TpMeshHandle mesh) const { return meshes[mesh].range; }
+
+  // Moves every live mesh to the start of new buffers, leaving one free block per buffer.
+  void defragment();
+  // Like defragment, but the new buffers only just hold the live meshes. Returns the bytes
+  // released, 0 when there was no spare capacity. Runs as the arena's memory pressure handler.
+  VkDeviceSize trim();
+
+  void bind(VkCommandBuffer commandBuffer) const;
+  void bindPositions(VkCommandBuffer commandBuffer) const;
+  // all three are also storage buffers, for shaders that fetch vertices themselves
+  VkBuffer getVertexBuffer() const { return buffers.vertex; }
+  VkBuffer getPositionBuffer() const { return buffers.position; }
+  VkBuffer getIndexBuffer() const { return buffers.index; }
+  // changes whenever the buffers are replaced and ranges may have moved
+  uint32_t getGeneration() const { return generation; }
+  TpGeometryStats getStats() const;
+
+ private:
+  // best-fit ranges of one buffer, in elements
+  class FreeList {
+   public:
+    void reset(uint32_t capacity, uint32_t used);
+    bool allocate(uint32_t count, uint32_t &offset);
+    void release(uint32_t offset, uint32_t count);
+
+    uint32_t capacity() const { return capacity_; }
+    uint32_t freeCount() const { return freeCount_; }
+    uint32_t largestBlock() const;
+    uint32_t blockCount() const { return static_cast<uint32_t>(blocks.size()); }
+
+   private:
+    std::map<uint32_t, uint32_t> blocks;  // offset to size
+    uint32_t capacity_ = 0;
+    uint32_t freeCount_ = 0;
+  };
+
+  struct Mesh {
+    TpMeshRange range;
+    bool live;
+  };
+
+  struct Buffers {
+    VkBuffer vertex = VK_NULL_HANDLE;
+    VmaAllocation vertexAllocation = nullptr;
+    VkBuffer position = VK_NULL_HANDLE;
+    VmaAllocation positionAllocation = nullptr;
+    VkBuffer index = VK_NULL_HANDLE;
+    VmaAllocation indexAllocation = nullptr;
+  };
+
+  Buffers createBuffers(uint32_t vertexCapacity, uint32_t indexCapacity);
+  void destroyBuffers(const Buffers &old);
+  // registers the current buffers with the device's defragmentation, sized by the free lists
+  void trackBuffers();
+  void untrackBuffers(const Buffers &tracked);
+  // compacts or grows until both ranges fit in one block
+  void reserve(uint32_t vertexCount, uint32_t indexCount);
+  // copies the live meshes, packed, into new buffers of the given capacities
+  void rebuild(uint32_t vertexCapacity, uint32_t indexCapacity);
+  void reclaimFrees();
+  void countLive(uint32_t &vertices, uint32_t &indices) const;
+
+  TpDevice &tpDevice;
+  uint32_t vertexStride;
+  Buffers buffers;
+  FreeList vertexFreeList;
+  FreeList indexFreeList;
+  std::vector<Mesh> meshes;
+  std::vector<TpMeshHandle> freeHandles;
+  // freed meshes and the graphics timeline value after which nothing draws them
+  std::vector<std::pair<uint64_t, TpMeshHandle>> pendingFrees;
+  uint32_t generation = 0;
+  uint32_t growCount = 0;
+  uint32_t defragmentCount = 0;
+  uint32_t trimCount = 0;
+  uint32_t memoryPressureHandler;
+};
+
+}  // namespace teapot
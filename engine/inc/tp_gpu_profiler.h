@@ -0,0 +1,112 @@
+#pragma once
+
+#include "tp_device.h"
+
+// std lib headers
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace teapot {
+
+struct TpGpuTimingStats {
+  double averageMs = 0.0;
+  double p50Ms = 0.0;
+  double p95Ms = 0.0;
+  double p99Ms = 0.0;
+  size_t sampleCount = 0;
+};
+
+/*
+ * GPU timestamp profiler. Every frame in flight owns its own query pool, so the results of a
+ * frame are read back when its slot comes around again (after the slot's timeline value has been
+ * waited on) and never stall the queue.
+ */
+class TpGpuProfiler {
+ public:
+  static constexpr uint32_t MAX_ZONES_PER_FRAME = 64;
+  static constexpr size_t HISTORY_LENGTH = 240;
+  static constexpr uint32_t INVALID_ZONE = UINT32_MAX;
+  static constexpr const char *FRAME_ZONE_NAME = "Frame";
+
+  TpGpuProfiler(TpDevice &device, int framesInFlight);
+  ~TpGpuProfiler();
+
+  TpGpuProfiler(const TpGpuProfiler &) = delete;
+  TpGpuProfiler &operator=(const TpGpuProfiler &) = delete;
+
+  static bool isSupported(TpDevice &device);
+
+  void beginFrame(VkCommandBuffer commandBuffer, int frameIndex);
+  void endFrame(VkCommandBuffer commandBuffer);
+
+  uint32_t beginZone(VkCommandBuffer commandBuffer, const char *name);
+  void endZone(VkCommandBuffer commandBuffer, uint32_t zone);
+
+  TpGpuTimingStats getStats(const std::string &name) const;
+  std::vector<std::string> getZoneNames() const;
+  const std::vector<std::pair<std::string, double>> &getLastFrameTimings() const { return lastFrameTimings; }
+  uint64_t getResolvedFrameCount() const { return resolvedFrameCount; }
+
+ private:
+  struct Zone {
+    const char *name;
+    uint32_t beginQuery;
+    uint32_t endQuery;
+  };
+
+  struct FrameQueries {
+    VkQueryPool queryPool = VK_NULL_HANDLE;
+    std::vector<Zone> zones;
+    uint32_t queryCount = 0;
+    bool pending = false;
+  };
+
+  struct History {
+    std::vector<double> samples;
+    size_t next = 0;
+  };
+
+  void createQueryPools(int framesInFlight);
+  void collectResults(FrameQueries &frame);
+  void recordSample(const std::string &name, double ms);
+
+  TpDevice &tpDevice;
+  double nsPerTick;
+  uint64_t timestampMask;
+
+  std::vector<FrameQueries> frames;
+  FrameQueries *currentFrame = nullptr;
+  uint32_t frameZone = INVALID_ZONE;
+
+  std::map<std::string, History> histories;
+  std::vector<std::pair<std::string, double>> lastFrameTimings;
+  uint64_t resolvedFrameCount = 0;
+};
+
+/*
+ * RAII marker around a GPU workload. A null profiler means profiling is disabled and the zone
+ * does nothing.
+ */
+class TpGpuZone {
+ public:
+  TpGpuZone(TpGpuProfiler *profiler, VkCommandBuffer commandBuffer, const char *name)
+      : profiler{profiler}, commandBuffer{commandBuffer} {
+    if (profiler != nullptr) zone = profiler->beginZone(commandBuffer, name);
+  }
+  ~TpGpuZone() {
+    if (profiler != nullptr) profiler->endZone(commandBuffer, zone);
+  }
+
+  TpGpuZone(const TpGpuZone &) = delete;
+  TpGpuZone &operator=(const TpGpuZone &) = delete;
+
+ private:
+  TpGpuProfiler *profiler;
+  VkCommandBuffer commandBuffer;
+  uint32_t zone = TpGpuProfiler::INVALID_ZONE;
+};
+
+}  // namespace teapot
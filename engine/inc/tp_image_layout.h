@@ -0,0 +1,19 @@
+#pragma once
+
+// vulkan headers
+#include <vulkan/vulkan.h>
+
+namespace teapot {
+
+// Stages and accesses an image is typically used with while it sits in a given layout.
+struct TpImageLayoutInfo {
+  VkPipelineStageFlags stages;
+  VkAccessFlags access;
+};
+
+// Throws std::invalid_argument for layouts the engine never uses.
+TpImageLayoutInfo getImageLayoutInfo(VkImageLayout layout);
+
+VkImageAspectFlags getImageAspect(VkFormat format);
+
+}  // namespace teapot
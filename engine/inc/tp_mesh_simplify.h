@@ -0,0 +1,44 @@
+#pragma once
+
+// GLM Configuration
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+
+// std lib headers
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace teapot {
+
+struct TpMeshLod {
+  uint32_t firstIndex;
+  uint32_t indexCount;
+  float error;  // object space distance from the full resolution surface, 0 for LOD 0
+};
+
+/*
+ * Quadric error metric simplification (Garland/Heckbert) by half-edge collapses: vertices only
+ * move onto existing vertices, so the result indexes the same vertex buffer. Vertices sharing a
+ * position are collapsed together and keep their own attributes where a seam runs through
+ * them; collapses that would tear a seam or flip a triangle are skipped. Open borders are kept
+ * in place by extra planes along them.
+ *
+ * Stops at targetIndexCount or when nothing can be collapsed. error receives the largest
+ * collapse error, as a distance.
+ */
+std::vector<uint32_t> simplifyMesh(const glm::vec3 *positions, size_t vertexCount,
+                                   const std::vector<uint32_t> &indices, size_t targetIndexCount, float &error);
+
+/*
+ * LOD 0 is indices; each following level halves the triangle count of the one before, until
+ * MAX_MESH_LODS levels, fewer than MIN_LOD_TRIANGLES triangles or a level that barely shrinks.
+ * lodIndices receives every level back to back.
+ */
+constexpr uint32_t MAX_MESH_LODS = 6;
+constexpr size_t MIN_LOD_TRIANGLES = 32;
+void buildMeshLods(const glm::vec3 *positions, size_t vertexCount, const std::vector<uint32_t> &indices,
+                   std::vector<uint32_t> &lodIndices, std::vector<TpMeshLod> &lods);
+
+}  // namespace teapot
@@ -0,0 +1,43 @@
+#pragma once
+
+// GLM Configuration
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+
+// std lib headers
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace teapot {
+
+constexpr uint32_t MESHLET_MAX_VERTICES = 64;
+constexpr uint32_t MESHLET_MAX_TRIANGLES = 124;
+
+// std430 layout, read as-is by meshlet_cull.comp
+struct TpMeshlet {
+  glm::vec4 sphere;  // object space center and radius
+  // Normal cone: axis and cutoff. Every triangle faces away from a viewer at p when
+  // dot(center - p, axis) >= cutoff * length(center - p) + radius; a cutoff of 1 never culls.
+  glm::vec4 cone;
+  uint32_t firstIndex;
+  uint32_t indexCount;
+  uint32_t padding[2];
+};
+static_assert(sizeof(TpMeshlet) == 48, "TpMeshlet must match the std430 struct in meshlet_cull.comp");
+
+/*
+ * Splits a triangle list into clusters of at most maxVertices distinct vertices and maxTriangles
+ * triangles. Clusters grow greedily across shared edges, preferring the triangle that adds the
+ * fewest new vertices, so they stay compact and their bounds tight. Vertices sharing a position
+ * count as connected, so UV seams do not cut clusters short.
+ *
+ * meshletIndices receives the triangles of indices regrouped cluster by cluster; every meshlet
+ * refers to a range of it.
+ */
+void buildMeshlets(const glm::vec3 *positions, size_t vertexCount, const std::vector<uint32_t> &indices,
+                   uint32_t maxVertices, uint32_t maxTriangles,
+                   std::vector<TpMeshlet> &meshlets, std::vector<uint32_t> &meshletIndices);
+
+}  // namespace teapot
@@ -5,7 +5,12 @@
 #ifndef TEAPOT_TP_MODEL_H
 #define TEAPOT_TP_MODEL_H
 
+#include "tp_bounds.h"
 #include "tp_device.h"
+#include "tp_geometry_arena.h"
+#include "tp_mesh_simplify.h"
+#include "tp_meshlet.h"
+#include "tp_texture_atlas.h"
 
 #include <memory>
 
@@ -15,6 +20,8 @@
 #include <glm/glm.hpp>
 
 namespace teapot {
+class TpVirtualTextureCache;
+
 struct Vertex {
   glm::vec3 position;
   glm::vec3 color;
@@ -22,48 +29,102 @@ struct Vertex {
 
   static std::vector<VkVertexInputBindingDescription> getBindingDescriptions();
   static std::vector<VkVertexInputAttributeDescription> getAttributeDescriptions();
+  // the position-only stream bound by bindPositions
+  static std::vector<VkVertexInputBindingDescription> getPositionBindingDescriptions();
+  static std::vector<VkVertexInputAttributeDescription> getPositionAttributeDescriptions();
+};
+
+// CPU copy of a mesh for TpOcclusionBuffer, in the object space of its model
+struct TpOccluderMesh {
+  std::vector<glm::vec3> positions;
+  std::vector<uint32_t> indices;
 };
 
+// The mesh is suballocated from a geometry arena created with sizeof(Vertex) as its stride and the
+// texture is added to a texture atlas; both must outlive the model.
 class TpModel {
 public:
-  TpModel(TpDevice &device,
+  TpModel(TpDevice &device, TpGeometryArena &geometry, TpTextureAtlas &textures,
           const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices,
           const std::string &texture);
+  TpModel(TpDevice &device, TpGeometryArena &geometry, TpTextureAtlas &textures,
+          const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices,
+          const unsigned char *rgbaPixels, uint32_t texWidth, uint32_t texHeight);
+  // shares a texture already in the atlas
+  TpModel(TpDevice &device, TpGeometryArena &geometry, TpTextureAtlas &textures,
+          const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices,
+          const TpTextureRef &texture);
   ~TpModel();
 
-  static std::shared_ptr<TpModel> loadObjFile(TpDevice &device,
-                                              const std::string& objFilePath, const std::string &texturePath);
+  // occluder keeps the loaded triangles on the CPU as the model's occluder mesh
+  static std::shared_ptr<TpModel> loadObjFile(TpDevice &device, TpGeometryArena &geometry, TpTextureAtlas &textures,
+                                              const std::string& objFilePath, const std::string &texturePath,
+                                              bool occluder = false);
 
   TpModel(const TpModel &) = delete;
   TpModel &operator=(const TpModel &) = delete;
 
+  // bind the whole arena, so models of the same arena need no rebind between draws
   void bind(VkCommandBuffer commandBuffer);
-  void draw(VkCommandBuffer commandBuffer);
+  void bindPositions(VkCommandBuffer commandBuffer);
+  void draw(VkCommandBuffer commandBuffer, uint32_t lod = 0);
+
+  // unique per model, used as the mesh id of draw sort keys
+  uint32_t getId() const { return id; }
+  bool hasTexture() const { return textured; }
+  TpTextureAtlas &getTextures() const { return textures; }
+  // where the texture sits in the atlas; only valid with hasTexture
+  const TpTextureRef &getTexture() const { return texture; }
+  // Samples a texture of a virtual texture cache instead of the atlas one; the cache must outlive
+  // the model.
+  void setVirtualTexture(TpVirtualTextureCache &cache, uint32_t virtualTexture) {
+    virtualTextures = &cache;
+    this->virtualTexture = virtualTexture;
+  }
+  TpVirtualTextureCache *getVirtualTextureCache() const { return virtualTextures; }
+  uint32_t getVirtualTexture() const { return virtualTexture; }
+  // object space bounds of the vertices
+  const TpAabb &getBounds() const { return bounds; }
+  TpGeometryArena &getGeometry() const { return geometry; }
+  // the model's current place in the arena; it moves when the arena compacts or grows
+  const TpMeshRange &getMeshRange() const { return geometry.getRange(mesh); }
+  // LOD 0 is the mesh as loaded; the coarser levels are generated at load and share its range.
+  // LOD index ranges are relative to the start of the model's range.
+  uint32_t getLodCount() const { return static_cast<uint32_t>(lods.size()); }
+  const TpMeshLod &getLod(uint32_t lod) const { return lods[lod]; }
+  // LOD 0 of larger meshes is also split into meshlets; their ranges are relative to the model's
+  // range of the arena index buffer, which doubles as a storage buffer for cluster culling. The
+  // meshlet buffer is replaced when device defragmentation moves it.
+  bool hasMeshlets() const { return meshletCount > 0; }
+  uint32_t getMeshletCount() const { return meshletCount; }
+  VkBuffer getMeshletBuffer() const { return meshletBuffer; }
+  VkBuffer getIndexBuffer() const { return geometry.getIndexBuffer(); }
+  // Entities of a model with an occluder mesh hide what is behind them from TpOcclusionBuffer.
+  // The mesh must not reach outside the rendered one, or visible geometry gets culled.
+  void setOccluderMesh(std::shared_ptr<const TpOccluderMesh> mesh) { occluderMesh = std::move(mesh); }
+  const TpOccluderMesh *getOccluderMesh() const { return occluderMesh.get(); }
 
 private:
-  void createVertexBuffers(const std::vector<Vertex> &vertices);
-  void createIndexBuffer(const std::vector<uint32_t> &indices);
-
-  void createTextureImage(const std::string& imagePath);
-  void createTextureImageView();
-  void createTextureSampler();
-
+  void createDeviceBuffer(const void *data, VkDeviceSize size, VkBufferUsageFlags usage,
+                          VkBuffer &buffer, VmaAllocation &allocation);
+  void createMesh(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices);
 
   TpDevice& tpDevice;
-  VkBuffer vertexBuffer;
-  VmaAllocation vertexBufferAllocation;
-
-  uint32_t vertexCount;
-  VkBuffer indexBuffer;
-  VmaAllocation indexBufferAllocation;
-
-  uint32_t indexCount;
-  VkImage textureImage = nullptr;
-  VmaAllocation textureImageAllocation = nullptr;
-public:
-  VkImageView textureImageView;
-  VkSampler textureSampler;
-private:
+  TpGeometryArena &geometry;
+  TpTextureAtlas &textures;
+  uint32_t id;
+  TpMeshHandle mesh;
+  TpAabb bounds;
+
+  std::vector<TpMeshLod> lods;
+  uint32_t meshletCount = 0;
+  VkBuffer meshletBuffer = VK_NULL_HANDLE;
+  VmaAllocation meshletBufferAllocation = nullptr;
+  std::shared_ptr<const TpOccluderMesh> occluderMesh;
+  bool textured = false;
+  TpTextureRef texture{};
+  TpVirtualTextureCache *virtualTextures = nullptr;
+  uint32_t virtualTexture = 0;
 };
 }
 
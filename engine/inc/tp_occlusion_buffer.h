@@ -0,0 +1,117 @@
+#pragma once
+
+#include "tp_camera.h"
+#include "tp_scene.h"
+#include "tp_thread_pool.h"
+
+// std lib headers
+#include <cstdint>
+#include <vector>
+
+namespace teapot {
+
+struct TpOcclusionStats {
+  uint32_t occluders = 0;
+  uint32_t occluderTriangles = 0;  // set up for rasterization, after near plane rejection
+  uint32_t tested = 0;
+  uint32_t culled = 0;
+  double rasterizeMs = 0.0;
+  double testMs = 0.0;
+
+  float cullRate() const { return tested > 0 ? static_cast<float>(culled) / static_cast<float>(tested) : 0.f; }
+};
+
+/*
+ * Software occlusion culling on the CPU, for devices where GPU culling is itself expensive
+ * (software Vulkan such as lavapipe). Entities whose model has an occluder mesh
+ * (TpModel::setOccluderMesh) are rasterized into a small depth buffer holding the nearest
+ * occluder depth per pixel, then entity world bounds are tested against it before any command
+ * is recorded.
+ *
+ * The buffer is stored in tiles of TILE_WIDTH x TILE_HEIGHT pixels. Rasterization and testing
+ * run on the thread pool a tile at a time, four pixels per SSE2 instruction on x86-64, and every
+ * tile keeps its farthest depth so most tests are decided without touching pixels. Occluders
+ * are rasterized at pixel centers, so an entity peeking past an occluder's silhouette by less
+ * than a pixel of this buffer may be culled.
+ */
+class TpOcclusionBuffer {
+ public:
+  static constexpr uint32_t TILE_WIDTH = 32;
+  static constexpr uint32_t TILE_HEIGHT = 8;
+  static constexpr uint32_t DEFAULT_WIDTH = 256;
+  static constexpr uint32_t DEFAULT_HEIGHT = 128;
+  static constexpr uint32_t DEFAULT_MAX_OCCLUDERS = 32;
+
+  // throws std::invalid_argument unless the size is a non-zero multiple of the tile size
+  explicit TpOcclusionBuffer(uint32_t width = DEFAULT_WIDTH, uint32_t height = DEFAULT_HEIGHT);
+
+  TpOcclusionBuffer(const TpOcclusionBuffer &) = delete;
+  TpOcclusionBuffer &operator=(const TpOcclusionBuffer &) = delete;
+
+  // Only the occluders that cover the most of the screen are rasterized.
+  void setMaxOccluders(uint32_t count) { maxOccluders = count; }
+  uint32_t getMaxOccluders() const { return maxOccluders; }
+
+  // Clears the buffer and rasterizes the occluders among the dense indices in visible (e.g. from
+  // TpScene::cull), seen through the camera.
+  void render(const TpScene &scene, const std::vector<uint32_t> &visible, const TpCamera &camera,
+              TpThreadPool *pool = nullptr);
+  // false when the box is hidden behind the occluders of the last render
+  bool isVisible(const TpAabb &worldBounds) const;
+  // Removes the entities hidden behind the occluders of the last render from visible, keeping
+  // the order of the rest.
+  void cull(const TpScene &scene, std::vector<uint32_t> &visible, TpThreadPool *pool = nullptr);
+
+  // render resets these, cull adds to them
+  const TpOcclusionStats &getStats() const { return stats; }
+
+  uint32_t getWidth() const { return width; }
+  uint32_t getHeight() const { return height; }
+  // nearest occluder depth of a pixel, 1 where nothing was rasterized; y grows downwards
+  float depthAt(uint32_t x, uint32_t y) const;
+
+ private:
+  // screen space triangle: inside where all three edge functions are >= 0, depth is a plane
+  struct Triangle {
+    float edgeX[3];
+    float edgeY[3];
+    float edgeOffset[3];
+    float depthX;
+    float depthY;
+    float depthOffset;
+    int minX;
+    int minY;
+    int maxX;  // exclusive
+    int maxY;  // exclusive
+  };
+
+  struct Occluder {
+    uint32_t index;
+    float coverage;
+  };
+
+  void setupTriangles(const TpScene &scene, const Occluder &occluder, std::vector<Triangle> &out) const;
+  void rasterizeTile(uint32_t tile);
+  float *tilePixels(uint32_t tile) { return depth.data() + static_cast<size_t>(tile) * TILE_WIDTH * TILE_HEIGHT; }
+  const float *tilePixels(uint32_t tile) const {
+    return depth.data() + static_cast<size_t>(tile) * TILE_WIDTH * TILE_HEIGHT;
+  }
+
+  uint32_t width;
+  uint32_t height;
+  uint32_t tilesX;
+  uint32_t tilesY;
+  uint32_t maxOccluders = DEFAULT_MAX_OCCLUDERS;
+  glm::mat4 viewProj{1.f};
+
+  std::vector<float> depth;  // tile after tile, rows of TILE_WIDTH within a tile
+  std::vector<float> tileMaxDepth;
+  std::vector<Occluder> occluders;
+  std::vector<std::vector<Triangle>> occluderTriangles;  // per occluder, set up in parallel
+  std::vector<Triangle> triangles;
+  std::vector<std::vector<uint32_t>> tileBins;  // per tile, the triangles touching it
+  std::vector<uint8_t> visibleFlags;
+  TpOcclusionStats stats{};
+};
+
+}  // namespace teapot
@@ -21,6 +21,8 @@ struct PipelineConfigInfo {
   VkPipelineDepthStencilStateCreateInfo depthStencilInfo;
   std::vector<VkDynamicState> dynamicStateEnables;
   VkPipelineDynamicStateCreateInfo dynamicStateInfo;
+  std::vector<VkVertexInputBindingDescription> bindingDescriptions;
+  std::vector<VkVertexInputAttributeDescription> attributeDescriptions;
   VkPipelineLayout pipelineLayout = nullptr;
   VkRenderPass renderPass = nullptr;
   uint32_t subpass = 0;
@@ -28,11 +30,17 @@ struct PipelineConfigInfo {
 
 class TpPipeline {
  public:
+  // An empty fragFilepath creates a vertex-only pipeline (depth-only passes).
   TpPipeline(
           TpDevice& device,
           const std::string& vertFilepath,
           const std::string& fragFilepath,
           const PipelineConfigInfo& configInfo);
+  // A compute pipeline.
+  TpPipeline(
+          TpDevice& device,
+          const std::string& compFilepath,
+          VkPipelineLayout pipelineLayout);
   ~TpPipeline();
 
   TpPipeline(const TpPipeline&) = delete;
@@ -42,6 +50,13 @@ class TpPipeline {
 
   static void defaultPipelineConfigInfo(
       PipelineConfigInfo& configInfo);
+  // Position-only vertex input, no color writes; depth test and write stay on.
+  static void depthOnlyPipelineConfigInfo(
+      PipelineConfigInfo& configInfo);
+  // Drops the vertex input of a config set up by one of the above; the vertex shader fetches
+  // its vertices from storage buffers by gl_VertexIndex instead.
+  static void vertexPullingConfigInfo(
+      PipelineConfigInfo& configInfo);
 
  private:
   static std::vector<char> readFile(const std::string& filepath);
@@ -51,11 +66,15 @@ class TpPipeline {
       const std::string& fragFilepath,
       const PipelineConfigInfo& configInfo);
 
+  void createComputePipeline(const std::string& compFilepath, VkPipelineLayout pipelineLayout);
+
   void createShaderModule(const std::vector<char>& code, VkShaderModule* shaderModule);
 
   TpDevice& tpDevice;
-  VkPipeline graphicsPipeline;
-  VkShaderModule vertShaderModule;
-  VkShaderModule fragShaderModule;
+  VkPipeline pipeline;
+  VkPipelineBindPoint bindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  VkShaderModule vertShaderModule = VK_NULL_HANDLE;
+  VkShaderModule fragShaderModule = VK_NULL_HANDLE;
+  VkShaderModule compShaderModule = VK_NULL_HANDLE;
 };
 }  // namespace teapot
\ No newline at end of file
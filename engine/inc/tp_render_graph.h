@@ -0,0 +1,216 @@
+#pragma once
+
+#include "tp_device.h"
+
+// std lib headers
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace teapot {
+
+using TpRgResource = uint32_t;
+using TpRgPass = uint32_t;
+
+enum class TpRgAccess {
+  ColorAttachment,  // write: rendered to as a color attachment
+  DepthAttachment,  // write: depth tested and written
+  DepthRead,        // read: depth tested without writes, e.g. EQUAL after a depth pre-pass
+  SampledFragment,  // read: sampled in a fragment shader
+  SampledCompute,   // read: sampled in a compute shader
+  StorageCompute,   // write: storage image in a compute shader
+  TransferSrc,      // read: copied from, e.g. by a readback
+  TransferDst,      // write: copied or blitted to
+};
+
+struct TpRgImageDesc {
+  VkFormat format;
+  VkExtent2D extent;
+  VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+};
+
+struct TpRgPassContext {
+  VkCommandBuffer commandBuffer;
+  VkRenderPass renderPass;  // VK_NULL_HANDLE for passes without attachments
+  uint32_t subpass;
+  VkExtent2D extent;
+};
+
+/*
+ * Frame render graph. Passes declare which images they read and write, compile() then
+ *  - culls passes whose results never reach an imported image or a side effect pass,
+ *  - merges consecutive passes that only share attachments into subpasses of one VkRenderPass,
+ *  - aliases transient images of the same shape whose lifetimes do not overlap,
+ *  - derives the layout transitions and the minimal set of barriers / subpass dependencies.
+ *
+ * Passes run in declaration order. A write without a clear value keeps the previous contents and
+ * so depends on the earlier writer. The graph is compiled once and executed every frame; imported
+ * images (e.g. the swap chain image) are rebound with setImportedImage before each execute. Call
+ * clear() and rebuild when extents change.
+ */
+class TpRenderGraph {
+ public:
+  static constexpr uint32_t INVALID = UINT32_MAX;
+
+  explicit TpRenderGraph(TpDevice &device);
+  ~TpRenderGraph();
+
+  TpRenderGraph(const TpRenderGraph &) = delete;
+  TpRenderGraph &operator=(const TpRenderGraph &) = delete;
+
+  TpRgResource createImage(const std::string &name, const TpRgImageDesc &desc);
+  // An image owned outside of the graph. Its contents are an output, so passes writing it are
+  // never culled. waitStages are the stages a semaphore wait guards (COLOR_ATTACHMENT_OUTPUT for
+  // an acquired swap chain image), the first use is ordered after them.
+  TpRgResource importImage(
+      const std::string &name,
+      const TpRgImageDesc &desc,
+      VkImageLayout initialLayout,
+      VkImageLayout finalLayout,
+      VkPipelineStageFlags waitStages = 0);
+
+  TpRgPass addPass(const std::string &name, std::function<void(const TpRgPassContext &)> execute);
+  void write(TpRgPass pass, TpRgResource resource, TpRgAccess access,
+             std::optional<VkClearValue> clearValue = std::nullopt);
+  void read(TpRgPass pass, TpRgResource resource, TpRgAccess access);
+  // keeps a pass alive even though nothing consumes its outputs (readbacks, queries)
+  void setSideEffect(TpRgPass pass);
+
+  void compile();
+  void setImportedImage(TpRgResource resource, VkImage image, VkImageView view);
+  void execute(VkCommandBuffer commandBuffer);
+  // Releases every gpu object once the submitted frames are done with it; call between frames.
+  void clear();
+
+  // valid after compile()
+  bool isCulled(TpRgPass pass) const { return passes[pass].culled; }
+  VkRenderPass getRenderPass(TpRgPass pass) const;
+  uint32_t getSubpass(TpRgPass pass) const { return passes[pass].subpass; }
+  VkImage getImage(TpRgResource resource) const;
+  VkImageView getImageView(TpRgResource resource) const;
+
+  size_t getPhysicalImageCount() const;
+  size_t getRenderPassCount() const;
+  size_t getBarrierCount() const;
+
+ private:
+  struct AccessInfo {
+    VkImageLayout layout;
+    VkPipelineStageFlags stages;
+    VkAccessFlags access;
+    VkImageUsageFlags usage;
+    bool write;
+    bool attachment;
+  };
+
+  struct ResourceUse {
+    TpRgResource resource;
+    TpRgAccess access;
+    std::optional<VkClearValue> clearValue;
+    bool preserves;  // depends on the contents written by an earlier pass
+    uint32_t readVersion;
+    uint32_t writeVersion;
+  };
+
+  // every write produces a new version of a resource, culling works on versions
+  struct Version {
+    TpRgResource resource;
+    TpRgPass writer;  // INVALID for the contents an imported image comes with
+    uint32_t refs;
+  };
+
+  struct Pass {
+    std::string name;
+    std::function<void(const TpRgPassContext &)> execute;
+    std::vector<ResourceUse> uses;
+    bool sideEffect = false;
+    bool culled = false;
+    uint32_t step = INVALID;
+    uint32_t subpass = 0;
+  };
+
+  struct Resource {
+    std::string name;
+    TpRgImageDesc desc;
+    bool imported = false;
+    VkImageLayout initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkImageLayout finalLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkPipelineStageFlags waitStages = 0;
+    uint32_t version = INVALID;
+    uint32_t physical = INVALID;
+    uint32_t firstPass = INVALID;
+    uint32_t lastPass = INVALID;
+  };
+
+  struct PhysicalImage {
+    TpRgImageDesc desc;
+    VkImageUsageFlags usage = 0;
+    VkImage image = VK_NULL_HANDLE;
+    VmaAllocation allocation = VK_NULL_HANDLE;
+    VkImageView view = VK_NULL_HANDLE;
+    bool imported = false;
+    uint32_t lastPass = INVALID;
+  };
+
+  // synchronization state of a physical image while walking the steps
+  struct ImageState {
+    VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkPipelineStageFlags writeStages = 0;
+    VkAccessFlags writeAccess = 0;
+    VkPipelineStageFlags readStages = 0;
+    VkPipelineStageFlags visibleStages = 0;
+  };
+
+  struct Barrier {
+    uint32_t physical;
+    VkImageLayout oldLayout;
+    VkImageLayout newLayout;
+    VkPipelineStageFlags srcStages;
+    VkAccessFlags srcAccess;
+    VkPipelineStageFlags dstStages;
+    VkAccessFlags dstAccess;
+  };
+
+  // one VkRenderPass with its subpasses, or a single pass without attachments
+  struct Step {
+    std::vector<TpRgPass> passes;
+    std::vector<Barrier> barriers;
+    VkRenderPass renderPass = VK_NULL_HANDLE;
+    std::vector<uint32_t> attachments;  // physical images, in attachment order
+    std::vector<VkClearValue> clearValues;
+    VkExtent2D extent{};
+    std::map<std::vector<VkImageView>, VkFramebuffer> framebuffers;
+  };
+
+  static AccessInfo accessInfo(TpRgAccess access);
+
+  void cullPasses();
+  void computeLifetimes();
+  void assignPhysicalImages();
+  void buildSteps();
+  bool canMerge(const Step &step, const Pass &pass) const;
+  void computeSynchronization();
+  void simulate(std::vector<ImageState> &states, bool createRenderPasses);
+  void recordNonAttachmentUse(Step &step, std::vector<ImageState> &states, const ResourceUse &use,
+                              bool discard);
+  void buildRenderPass(Step &step, std::vector<ImageState> &states, bool create);
+  void createPhysicalImages();
+  VkFramebuffer getFramebuffer(Step &step);
+  void recordBarriers(VkCommandBuffer commandBuffer, const std::vector<Barrier> &barriers);
+  void destroyGpuObjects();
+
+  TpDevice &tpDevice;
+
+  std::vector<Resource> resources;
+  std::vector<Version> versions;
+  std::vector<Pass> passes;
+  std::vector<PhysicalImage> physicalImages;
+  std::vector<Step> steps;
+  std::vector<Barrier> finalBarriers;
+  bool compiled = false;
+};
+
+}  // namespace teapot
@@ -6,9 +6,12 @@
 #define TEAPOT_TP_RENDERER_H
 
 #include "tp_device.h"
+#include "tp_gpu_profiler.h"
+#include "tp_render_graph.h"
 #include "tp_swap_chain.h"
 #include "tp_window.h"
 
+#include <functional>
 #include <memory>
 #include <vector>
 #include <cassert>
@@ -23,7 +26,7 @@ namespace teapot {
 
 class TpRenderer {
 public:
-  TpRenderer(TpWindow &window, TpDevice &device);
+  TpRenderer(TpWindow &window, TpDevice &device, const TpSwapChainConfig &config = {});
   ~TpRenderer();
 
   TpRenderer(const TpRenderer &) = delete;
@@ -40,6 +43,7 @@ public:
     return currentFrameIndex;
   }
 
+  // for building pipelines that draw in frame graph passes rendering to color and depth
   VkRenderPass getSwapChainRenderPass() const {
     return tpSwapChain->getRenderPass();
   }
@@ -48,21 +52,49 @@ public:
     return tpSwapChain->extentAspectRatio();
   }
 
+  VkExtent2D getSwapChainExtent() const { return tpSwapChain->getSwapChainExtent(); }
+
+  int getFramesInFlight() const { return swapChainConfig.framesInFlight; }
+  const TpSwapChainConfig &getSwapChainConfig() const { return swapChainConfig; }
+  // Present mode and image count can change at any time, frames in flight is fixed because
+  // per-frame resources (game object uniforms, profiler pools) are sized from it.
+  void setSwapChainConfig(const TpSwapChainConfig &config);
+
+  bool setGpuProfilingEnabled(bool enabled);
+  TpGpuProfiler *getGpuProfiler() const { return gpuProfiler.get(); }
+
+  // Declares the frame's passes on an empty graph, which has the acquired swap chain image imported
+  // as color and a depth image of the swap chain's extent. Called again before the next frame
+  // whenever the swap chain is recreated or rebuildFrameGraph is called, e.g. after a pass was
+  // turned on or off. An empty builder releases the graph.
+  using FrameGraphBuilder = std::function<void(TpRenderGraph &graph, TpRgResource color, TpRgResource depth)>;
+  void setFrameGraph(FrameGraphBuilder builder);
+  void rebuildFrameGraph() { frameGraphDirty = true; }
+
   VkCommandBuffer beginFrame();
   void endFrame();
-  void beginSwapChainRenderPass(VkCommandBuffer commandBuffer);
-  void endSwapChainRenderPass(VkCommandBuffer commandBuffer);
+  // Records the frame graph's passes, once per frame between beginFrame and endFrame.
+  void executeFrameGraph(VkCommandBuffer commandBuffer);
 
 private:
   void createCommandBuffers();
   void freeCommandBuffers();
 
   void recreateSwapChain();
+  void buildFrameGraph();
   teapot::TpWindow &tpWindow;
 
   teapot::TpDevice &tpDevice;
+  TpSwapChainConfig swapChainConfig;
   std::unique_ptr<teapot::TpSwapChain> tpSwapChain;
   std::vector<VkCommandBuffer> commandBuffers;
+  std::unique_ptr<TpGpuProfiler> gpuProfiler;
+
+  TpRenderGraph frameGraph;
+  FrameGraphBuilder frameGraphBuilder;
+  TpRgResource swapChainImage = TpRenderGraph::INVALID;
+  TpRgResource depthImage = TpRenderGraph::INVALID;
+  bool frameGraphDirty = false;
 
   uint32_t currentImageIndex = 0;
   int currentFrameIndex = 0;
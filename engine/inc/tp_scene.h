@@ -0,0 +1,164 @@
+#pragma once
+
+#include "tp_bounds.h"
+#include "tp_bvh.h"
+#include "tp_model.h"
+#include "tp_thread_pool.h"
+
+// std lib headers
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace teapot {
+
+// Generational handle: stays safe to hold after the entity is destroyed, isAlive then fails.
+struct TpEntity {
+  uint32_t slot = UINT32_MAX;
+  uint32_t generation = 0;
+
+  bool operator==(const TpEntity &other) const { return slot == other.slot && generation == other.generation; }
+  bool operator!=(const TpEntity &other) const { return !(*this == other); }
+};
+
+using TpModelHandle = uint32_t;
+
+/*
+ * Scene storage as dense structure-of-arrays components. Entity i of every array belongs to
+ * the same entity; destroying one moves the last entity into its place, so dense indices are
+ * only stable until the next destroyEntity. Systems walk the arrays directly:
+ *  - updateTransforms refreshes the world matrices and world bounds of changed subtrees,
+ *  - cull gathers the dense indices inside a frustum through a BVH over the world bounds,
+ *  - SimpleRenderSystem::prepareFrame and renderScene draw a list of dense indices.
+ *
+ * Entities can be parented. Local and world matrices are cached; the setters mark an entity
+ * dirty and updateTransforms recomputes only the dirty entities and their descendants, parents
+ * before children, so a static scene costs nothing per frame.
+ */
+class TpScene {
+ public:
+  static constexpr size_t PARALLEL_GRAIN = 256;
+
+  TpScene() = default;
+
+  TpScene(const TpScene &) = delete;
+  TpScene &operator=(const TpScene &) = delete;
+  TpScene(TpScene &&) = default;
+  TpScene &operator=(TpScene &&) = default;
+
+  TpModelHandle addModel(std::shared_ptr<TpModel> model);
+  TpModel &getModel(TpModelHandle handle) const { return *models[handle]; }
+  size_t modelCount() const { return models.size(); }
+
+  TpEntity createEntity(TpModelHandle model, TpEntity parent = {});
+  // also destroys every descendant
+  void destroyEntity(TpEntity entity);
+  bool isAlive(TpEntity entity) const;
+  void reserve(size_t count);
+
+  size_t size() const { return denseEntities.size(); }
+  // throws std::invalid_argument for dead handles
+  uint32_t indexOf(TpEntity entity) const;
+  TpEntity entityAt(uint32_t index) const { return denseEntities[index]; }
+
+  // A null parent makes the entity a root. Throws std::invalid_argument for cycles.
+  void setParent(TpEntity entity, TpEntity parent);
+  TpEntity getParent(TpEntity entity) const;
+
+  // rotation is euler angles applied y, x, z
+  void setTranslation(TpEntity entity, const glm::vec3 &translation);
+  void setRotation(TpEntity entity, const glm::vec3 &rotation);
+  void setScale(TpEntity entity, const glm::vec3 &scale);
+  const glm::vec3 &getTranslation(TpEntity entity) const { return translationArray[indexOf(entity)]; }
+  const glm::vec3 &getRotation(TpEntity entity) const { return rotationArray[indexOf(entity)]; }
+  const glm::vec3 &getScale(TpEntity entity) const { return scaleArray[indexOf(entity)]; }
+
+  // dense component arrays, size() entries each; local transforms change through the setters
+  const glm::vec3 *translations() const { return translationArray.data(); }
+  const glm::vec3 *rotations() const { return rotationArray.data(); }
+  const glm::vec3 *scales() const { return scaleArray.data(); }
+  const TpModelHandle *modelHandles() const { return modelArray.data(); }
+  // written by updateTransforms
+  const glm::mat4 *worldMatrices() const { return worldMatrixArray.data(); }
+  const TpAabb *worldBounds() const { return worldBoundsArray.data(); }
+
+  // returns the number of entities whose world matrix was recomputed
+  size_t updateTransforms(TpThreadPool *pool = nullptr);
+  // visible receives the dense indices of the entities whose world bounds touch the frustum
+  void cull(const TpFrustum &frustum, std::vector<uint32_t> &visible, TpThreadPool *pool = nullptr);
+  // Queries against entity world bounds, reporting dense indices. Like cull they see the
+  // transforms of the last updateTransforms.
+  bool raycast(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, TpRayHit &hit);
+  void overlap(const TpAabb &box, std::vector<uint32_t> &out);
+
+ private:
+  static constexpr uint32_t NONE = UINT32_MAX;
+  static constexpr uint8_t LOCAL_DIRTY = 1 << 0;
+  static constexpr uint8_t QUEUED = 1 << 1;
+
+  struct Slot {
+    uint32_t index;  // dense index while alive
+    uint32_t generation;
+  };
+
+  // hierarchy links are slots, which survive the swap-removes that move dense indices
+  struct Hierarchy {
+    uint32_t parent = NONE;
+    uint32_t firstChild = NONE;
+    uint32_t nextSibling = NONE;
+    uint32_t prevSibling = NONE;
+    uint32_t depth = 0;
+  };
+
+  template <typename F>
+  void forEachComponentArray(F &&f) {
+    f(denseEntities);
+    f(translationArray);
+    f(rotationArray);
+    f(scaleArray);
+    f(modelArray);
+    f(localMatrixArray);
+    f(worldMatrixArray);
+    f(worldBoundsArray);
+    f(hierarchyArray);
+    f(flagArray);
+  }
+
+  uint32_t denseOfSlot(uint32_t slot) const { return slots[slot].index; }
+  void markDirty(uint32_t index);
+  void link(uint32_t index, uint32_t parentSlot);
+  void unlink(uint32_t index);
+  void updateDepths(uint32_t index);
+  void removeDense(uint32_t index);
+  // rebuilds after entities were added or removed, refits after they moved
+  void updateBvh();
+
+  std::vector<std::shared_ptr<TpModel>> models;
+
+  std::vector<Slot> slots;
+  std::vector<uint32_t> freeSlots;
+
+  std::vector<TpEntity> denseEntities;
+  std::vector<glm::vec3> translationArray;
+  std::vector<glm::vec3> rotationArray;
+  std::vector<glm::vec3> scaleArray;
+  std::vector<TpModelHandle> modelArray;
+  std::vector<glm::mat4> localMatrixArray;
+  std::vector<glm::mat4> worldMatrixArray;
+  std::vector<TpAabb> worldBoundsArray;
+  std::vector<Hierarchy> hierarchyArray;
+  std::vector<uint8_t> flagArray;
+
+  std::vector<TpEntity> dirtyEntities;
+  std::vector<uint32_t> updateList;
+  std::vector<uint32_t> localUpdates;
+  std::vector<uint32_t> updateOrder;
+  std::vector<uint32_t> levelOffsets;
+  std::vector<uint32_t> traversal;
+
+  TpBvh bvh;
+  bool bvhStale = true;
+  bool boundsMoved = false;
+};
+
+}  // namespace teapot
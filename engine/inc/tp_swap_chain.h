@@ -12,25 +12,49 @@
 
 namespace teapot {
 
+enum class TpPresentMode {
+  Fifo,       // v-sync, never tears, highest latency
+  Mailbox,    // v-sync, newest frame replaces the queued one
+  Immediate,  // no v-sync, may tear, lowest latency
+};
+
+const char *presentModeName(TpPresentMode mode);
+bool parsePresentMode(const std::string &name, TpPresentMode &mode);
+
+struct TpSwapChainConfig {
+  TpPresentMode presentMode = TpPresentMode::Fifo;
+  // number of frames the cpu may record ahead of the gpu, 1 to TpSwapChain::MAX_FRAMES_IN_FLIGHT
+  int framesInFlight = 2;
+  // 0 uses the surface minimum + 1, anything else is clamped to what the surface allows
+  uint32_t minImageCount = 0;
+};
+
 class TpSwapChain {
  public:
-  static constexpr int MAX_FRAMES_IN_FLIGHT = 2;
+  static constexpr int MAX_FRAMES_IN_FLIGHT = 4;
 
-  TpSwapChain(TpDevice &deviceRef, VkExtent2D windowExtent);
-  TpSwapChain(TpDevice &deviceRef, VkExtent2D windowExtent, std::shared_ptr<TpSwapChain> previous);
+  TpSwapChain(TpDevice &deviceRef, VkExtent2D windowExtent, const TpSwapChainConfig &config = {});
+  TpSwapChain(TpDevice &deviceRef, VkExtent2D windowExtent, std::shared_ptr<TpSwapChain> previous,
+              const TpSwapChainConfig &config = {});
   ~TpSwapChain();
 
   TpSwapChain(const TpSwapChain &) = delete;
   TpSwapChain operator=(const TpSwapChain &) = delete;
 
-  VkFramebuffer getFrameBuffer(int index) { return swapChainFramebuffers[index]; }
+  // Color then depth in the chain's formats. Only used to build pipelines: it is compatible with
+  // the frame graph passes that render to the swap chain image and depth (TpRenderer::setFrameGraph).
   VkRenderPass getRenderPass() { return renderPass; }
+  // the format of the frame graph's depth, which the graph owns
+  VkFormat getDepthFormat() { return swapChainDepthFormat; }
+  VkImage getImage(int index) { return swapChainImages[index]; }
   VkImageView getImageView(int index) { return swapChainImageViews[index]; }
   size_t imageCount() { return swapChainImages.size(); }
   VkFormat getSwapChainImageFormat() { return swapChainImageFormat; }
   VkExtent2D getSwapChainExtent() { return swapChainExtent; }
   uint32_t width() { return swapChainExtent.width; }
   uint32_t height() { return swapChainExtent.height; }
+  int framesInFlight() const { return config.framesInFlight; }
+  VkPresentModeKHR getPresentMode() const { return presentMode; }
 
   float extentAspectRatio() {
     return static_cast<float>(swapChainExtent.width) / static_cast<float>(swapChainExtent.height);
@@ -49,9 +73,7 @@ class TpSwapChain {
   void init();
   void createSwapChain();
   void createImageViews();
-  void createDepthResources();
   void createRenderPass();
-  void createFramebuffers();
   void createSyncObjects();
 
   // Helper functions
@@ -65,12 +87,8 @@ class TpSwapChain {
   VkFormat swapChainDepthFormat;
   VkExtent2D swapChainExtent;
 
-  std::vector<VkFramebuffer> swapChainFramebuffers;
   VkRenderPass renderPass;
 
-  std::vector<VkImage> depthImages;
-  std::vector<VmaAllocation> depthImageAllocations;
-  std::vector<VkImageView> depthImageViews;
   std::vector<VkImage> swapChainImages;
   std::vector<VkImageView> swapChainImageViews;
 
@@ -79,11 +97,14 @@ class TpSwapChain {
 
   VkSwapchainKHR swapChain;
   std::shared_ptr<TpSwapChain> oldSwapchain;
+  TpSwapChainConfig config;
+  VkPresentModeKHR presentMode;
 
   std::vector<VkSemaphore> imageAvailableSemaphores;
   std::vector<VkSemaphore> renderFinishedSemaphores;
-  std::vector<VkFence> inFlightFences;
-  std::vector<VkFence> imagesInFlight;
+  // graphics timeline value signalled by the last submission of each frame slot / image
+  std::vector<uint64_t> frameTimelineValues;
+  std::vector<uint64_t> imageTimelineValues;
   size_t currentFrame = 0;
 };
 
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "tp_device.h"
+
+// GLM Configuration
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+
+// std lib headers
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace teapot {
+
+// where a texture was placed: a layer of one of the atlas's array images and its rect there
+struct TpTextureRef {
+  uint32_t array;
+  uint32_t layer;
+  glm::vec4 uvRect;  // offset in xy and size in zw, in normalized layer coordinates
+};
+
+struct TpTextureAtlasStats {
+  uint32_t textures = 0;
+  uint32_t arrays = 0;
+  uint32_t layers = 0;  // allocated, including spare capacity
+  uint64_t bytes = 0;
+};
+
+/*
+ * Packs RGBA8 textures into a few 2D array images, so scenes with many small textures need
+ * neither an image per texture nor a descriptor switch per object.
+ *
+ * Textures up to MAX_PACKED_SIZE on both sides are shelf-packed into PAGE_SIZE square layers,
+ * each with PADDING texels of its own edge around it so filtering never reads a neighbour.
+ * Larger textures take a whole layer of an array holding only textures of their size. Array
+ * images grow by doubling their layer count up to MAX_LAYERS; a grown array has a new image view,
+ * and the old one is destroyed once the frames in flight are done with it.
+ *
+ * Shaders sample layer at uvRect.xy + fract(uv) * uvRect.zw, which keeps repeating texture
+ * coordinates working for packed textures. Textures live as long as the atlas.
+ *
+ * Under memory pressure (TpDevice::addMemoryPressureHandler) arrays shrink to the layers in use,
+ * which again gives them new views.
+ */
+class TpTextureAtlas {
+ public:
+  static constexpr VkFormat FORMAT = VK_FORMAT_R8G8B8A8_SRGB;
+  static constexpr uint32_t PAGE_SIZE = 512;
+  static constexpr uint32_t MAX_PACKED_SIZE = 128;
+  static constexpr uint32_t PADDING = 2;
+  static constexpr uint32_t MAX_LAYERS = 64;
+
+  explicit TpTextureAtlas(TpDevice &device);
+  ~TpTextureAtlas();
+
+  TpTextureAtlas(const TpTextureAtlas &) = delete;
+  TpTextureAtlas &operator=(const TpTextureAtlas &) = delete;
+
+  // throws std::invalid_argument for an empty texture
+  TpTextureRef add(const unsigned char *rgbaPixels, uint32_t width, uint32_t height);
+  // false when the image cannot be loaded
+  bool load(const std::string &imagePath, TpTextureRef &texture);
+
+  uint32_t getArrayCount() const { return static_cast<uint32_t>(arrays.size()); }
+  // a 2D array view of all layers of the array; changes when the array grows
+  VkImageView getView(uint32_t array) const { return arrays[array].view; }
+  VkSampler getSampler() const { return sampler; }
+  TpTextureAtlasStats getStats() const;
+  // Shrinks every array to its used layers. Returns the bytes released, 0 when no array had
+  // spare layers. Runs as the atlas's memory pressure handler.
+  VkDeviceSize trim();
+
+ private:
+  struct Array {
+    uint32_t width;
+    uint32_t height;
+    bool packed;  // atlas pages rather than whole textures per layer
+    VkImage image = VK_NULL_HANDLE;
+    VmaAllocation allocation = nullptr;
+    VkImageView view = VK_NULL_HANDLE;
+    uint32_t layerCapacity = 0;
+    uint32_t layerCount = 0;
+    // the open shelf of the last page
+    uint32_t shelfX = 0;
+    uint32_t shelfY = 0;
+    uint32_t shelfHeight = 0;
+  };
+
+  void createSampler();
+  uint32_t findArray(uint32_t width, uint32_t height, bool packed);
+  // a free layer of the array, growing it when every layer is used
+  uint32_t addLayer(Array &array);
+  void resize(Array &array, uint32_t layerCapacity);
+  // finds room for a padded block on the open shelf, a new shelf or a new page
+  void placePacked(uint32_t width, uint32_t height, uint32_t &array, uint32_t &layer, uint32_t &x, uint32_t &y);
+  void upload(const Array &array, uint32_t layer, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+              const unsigned char *rgbaPixels);
+
+  TpDevice &tpDevice;
+  VkSampler sampler = VK_NULL_HANDLE;
+  std::vector<Array> arrays;
+  uint32_t textureCount = 0;
+  uint32_t memoryPressureHandler;
+};
+
+}  // namespace teapot
@@ -0,0 +1,56 @@
+#pragma once
+
+// std lib headers
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace teapot {
+
+/*
+ * Fixed set of worker threads for data-parallel loops over dense arrays. parallelFor splits
+ * [0, count) into chunks of at least `grain` items, runs them on the workers and the calling
+ * thread, and returns once every chunk is done. One loop runs at a time; calls from several
+ * threads are serialized.
+ */
+class TpThreadPool {
+ public:
+  // 0 uses hardware_concurrency - 1 workers (the caller is the last one)
+  explicit TpThreadPool(unsigned workerCount = 0);
+  ~TpThreadPool();
+
+  TpThreadPool(const TpThreadPool &) = delete;
+  TpThreadPool &operator=(const TpThreadPool &) = delete;
+
+  unsigned threadCount() const { return static_cast<unsigned>(workers.size()) + 1; }
+
+  // fn(begin, end) is called for disjoint ranges that cover [0, count)
+  void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)> &fn);
+
+ private:
+  void workerLoop();
+  void runChunks();
+
+  std::vector<std::thread> workers;
+
+  std::mutex submitMutex;  // one loop at a time
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  uint64_t generation = 0;
+  bool stopping = false;
+
+  const std::function<void(size_t, size_t)> *job = nullptr;
+  size_t jobCount = 0;
+  size_t jobChunkSize = 0;
+  size_t jobChunks = 0;
+  std::atomic<size_t> nextChunk{0};
+  size_t activeWorkers = 0;
+};
+
+}  // namespace teapot
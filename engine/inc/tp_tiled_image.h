@@ -0,0 +1,59 @@
+#pragma once
+
+// std lib headers
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace teapot {
+
+struct TpTiledImageInfo {
+  uint32_t width = 0;
+  uint32_t height = 0;
+  uint32_t tileSize = 0;  // texels of the image per tile side
+  uint32_t border = 0;    // texels of the neighbouring tiles stored around each tile
+  uint32_t mipCount = 0;  // down to the first mip that fits in a single tile
+
+  uint32_t mipWidth(uint32_t mip) const { return width >> mip > 0 ? width >> mip : 1; }
+  uint32_t mipHeight(uint32_t mip) const { return height >> mip > 0 ? height >> mip : 1; }
+  uint32_t tilesX(uint32_t mip) const { return (mipWidth(mip) + tileSize - 1) / tileSize; }
+  uint32_t tilesY(uint32_t mip) const { return (mipHeight(mip) + tileSize - 1) / tileSize; }
+  uint32_t storedTileSize() const { return tileSize + 2 * border; }
+  uint64_t tileBytes() const { return uint64_t{storedTileSize()} * storedTileSize() * 4; }
+  // the index of the first tile of a mip; tiles are stored mip by mip in row-major order
+  uint32_t firstTile(uint32_t mip) const;
+  uint32_t tileCount() const { return firstTile(mipCount); }
+};
+
+/*
+ * An RGBA8 image and its mip chain cut into fixed-size tiles, the on-disk source of a virtual
+ * texture. Tiles are stored uncompressed with their border already filled in, so one read gives
+ * a page that filters across its edges without touching its neighbours; texels past the image
+ * edge repeat the edge.
+ *
+ * Reads open the file themselves and may run on several threads at once.
+ */
+class TpTiledImage {
+ public:
+  static constexpr uint32_t TILE_SIZE = 128;
+  static constexpr uint32_t BORDER = 4;
+
+  // Box-filters the mip chain and writes it tiled. Throws std::invalid_argument for an empty
+  // image and std::runtime_error when the file cannot be written.
+  static void write(const std::string &path, const unsigned char *rgbaPixels, uint32_t width, uint32_t height);
+  // write for an image file stb_image can read; false when it cannot
+  static bool convert(const std::string &imagePath, const std::string &path);
+
+  // reads the header; throws std::runtime_error for a missing or malformed file
+  explicit TpTiledImage(std::string path);
+
+  const TpTiledImageInfo &getInfo() const { return info; }
+  // fills tileBytes() of rgbaPixels; throws std::runtime_error when the read fails
+  void readTile(uint32_t tile, unsigned char *rgbaPixels) const;
+
+ private:
+  std::string path;
+  TpTiledImageInfo info;
+};
+
+}  // namespace teapot
@@ -0,0 +1,35 @@
+#pragma once
+
+// GLM Configuration
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+
+// std lib headers
+#include <cstddef>
+#include <cstdint>
+
+namespace teapot {
+
+// translate * rotateY * rotateX * rotateZ * scale, built with glm; the reference for the batch kernels
+glm::mat4 composeTransform(const glm::vec3 &translation, const glm::vec3 &rotation, const glm::vec3 &scale);
+
+/*
+ * Batched composeTransform over structure-of-arrays inputs. Uses AVX2 when the engine is built
+ * with TEAPOT_AVX2, SSE2 on other x86-64 builds and plain C++ elsewhere. Results match
+ * composeTransform to within a few ulps (sin and cos are evaluated with polynomials).
+ */
+void composeTransforms(const glm::vec3 *translations, const glm::vec3 *rotations, const glm::vec3 *scales,
+                       glm::mat4 *out, size_t count);
+// only the entries listed in indices, each read and written at the same index
+void composeTransforms(const uint32_t *indices, size_t count, const glm::vec3 *translations,
+                       const glm::vec3 *rotations, const glm::vec3 *scales, glm::mat4 *out);
+
+// the plain C++ path, kept callable for validation and the micro-benchmark
+void composeTransformsScalar(const glm::vec3 *translations, const glm::vec3 *rotations, const glm::vec3 *scales,
+                             glm::mat4 *out, size_t count);
+
+// "avx2", "sse2" or "scalar"
+const char *transformKernelName();
+
+}  // namespace teapot
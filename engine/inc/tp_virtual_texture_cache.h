@@ -0,0 +1,192 @@
+#pragma once
+
+#include "tp_device.h"
+#include "tp_swap_chain.h"
+#include "tp_tiled_image.h"
+
+// std lib headers
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace teapot {
+
+struct TpVirtualTextureStats {
+  uint32_t textures = 0;
+  uint32_t slots = 0;
+  uint32_t residentPages = 0;
+  uint32_t requestedPages = 0;  // by the feedback read in the last update
+  uint32_t pendingLoads = 0;    // queued, being read, or read and waiting for an upload
+  uint32_t uploads = 0;         // in the last update
+  uint64_t evictions = 0;
+  uint64_t cacheBytes = 0;
+  uint32_t shrinks = 0;  // under memory pressure
+};
+
+/*
+ * Virtual texturing without sparse binding: pages of TpTiledImage files are streamed into a
+ * fixed-size physical cache texture, so texture memory stays at the cache size however large
+ * the textures are.
+ *
+ * Every virtual texture has a page table with one entry per tile of every mip. An entry names
+ * the cache slot of the tile, or of its closest resident ancestor when the tile is not resident;
+ * the coarsest mip is loaded when the texture is added and never evicted, so every entry is
+ * valid. Shaders pick the mip from the texel footprint, look the page up and write the page they
+ * wanted to a per-frame feedback buffer. update reads that buffer once the frame is done, loads
+ * the missing pages from disk on worker threads and uploads finished ones, replacing the least
+ * recently requested pages when the cache is full.
+ *
+ * The page table and feedback buffers are per frame in flight and have a fixed capacity, so
+ * descriptor sets written with them stay valid. Requires fragmentStoresAndAtomics.
+ *
+ * Under memory pressure (TpDevice::addMemoryPressureHandler) the cache moves to a smaller image
+ * holding the pinned and most recently requested pages; the rest fall back to coarser mips. The
+ * view changes when it does.
+ */
+class TpVirtualTextureCache {
+ public:
+  static constexpr VkFormat FORMAT = VK_FORMAT_R8G8B8A8_SRGB;
+  static constexpr uint32_t MAX_TEXTURES = 16;
+  static constexpr uint32_t MAX_PAGES = 1u << 16;  // page table entries over all textures
+  static constexpr uint32_t MAX_UPLOADS_PER_FRAME = 16;
+  static constexpr uint32_t MAX_PENDING_LOADS = 256;
+  // one pixel of every FEEDBACK_STRIDE x FEEDBACK_STRIDE block writes feedback, a different one
+  // each frame; must match simple_shader_virtual.frag
+  static constexpr uint32_t FEEDBACK_STRIDE = 8;
+  // the cache does not shrink below this under memory pressure
+  static constexpr uint32_t MIN_SLOTS_PER_SIDE = 4;
+
+  // slotsPerSide squared pages of TpTiledImage::TILE_SIZE plus borders make up the cache
+  explicit TpVirtualTextureCache(TpDevice &device, uint32_t slotsPerSide = 16, unsigned loaderThreads = 2);
+  ~TpVirtualTextureCache();
+
+  TpVirtualTextureCache(const TpVirtualTextureCache &) = delete;
+  TpVirtualTextureCache &operator=(const TpVirtualTextureCache &) = delete;
+
+  // Opens a file written by TpTiledImage::write and loads its coarsest mip; call between frames.
+  // Throws std::runtime_error when the file cannot be read or the cache has no room for it.
+  uint32_t add(const std::string &tiledImagePath);
+
+  // Call once per frame, outside a render pass and before anything drawn with the cache, with
+  // the frame's command buffer and TpRenderer::getFrameIndex.
+  void update(VkCommandBuffer commandBuffer, int frameIndex);
+  // Makes the frame's feedback visible to update; call outside a render pass after the frame's
+  // last draw with the cache.
+  void finishFrame(VkCommandBuffer commandBuffer);
+
+  VkImageView getView() const { return view; }
+  VkSampler getSampler() const { return sampler; }
+  // the storage buffers of the shaders' PageTable and Feedback blocks
+  VkBuffer getPageTableBuffer(int frameIndex) const { return frames[frameIndex].pageTable; }
+  VkBuffer getFeedbackBuffer(int frameIndex) const { return frames[frameIndex].feedback; }
+  TpVirtualTextureStats getStats() const;
+  // Moves the cache to a smaller image that releases at least bytes where possible. Returns the
+  // bytes released, 0 when the cache is at its minimum or a frame is being recorded with it.
+  // Runs as the cache's memory pressure handler.
+  VkDeviceSize shrink(VkDeviceSize bytes);
+
+ private:
+  static constexpr uint32_t NO_PAGE = UINT32_MAX;
+
+  struct Texture {
+    std::unique_ptr<TpTiledImage> image;
+    uint32_t firstPage;
+    bool dirty;  // residency changed since the page table was built
+  };
+
+  struct Page {
+    uint32_t texture;
+    uint32_t mip;
+    uint32_t tile;  // within the texture's tiled image
+    uint32_t slot = NO_PAGE;
+    uint64_t lastRequested = 0;  // update count
+    bool loading = false;
+    bool failed = false;
+  };
+
+  struct LoadRequest {
+    uint32_t page;
+    const TpTiledImage *image;
+    uint32_t tile;
+  };
+
+  struct LoadedPage {
+    uint32_t page;
+    std::vector<unsigned char> pixels;  // empty when the read failed
+  };
+
+  struct Frame {
+    VkBuffer pageTable = VK_NULL_HANDLE;
+    VmaAllocation pageTableAllocation = nullptr;
+    void *pageTableMapped = nullptr;
+    uint64_t pageTableVersion = 0;
+    VkBuffer feedback = VK_NULL_HANDLE;
+    VmaAllocation feedbackAllocation = nullptr;
+    void *feedbackMapped = nullptr;
+    VkBuffer staging = VK_NULL_HANDLE;
+    VmaAllocation stagingAllocation = nullptr;
+    void *stagingMapped = nullptr;
+    bool submitted = false;
+    uint64_t retireValue = 0;  // graphics timeline value after which the gpu is done with it
+  };
+
+  void createCache();
+  void createSampler();
+  void createFrames();
+  void loaderLoop();
+
+  void readFeedback(Frame &frame);
+  void requestLoad(uint32_t page);
+  // returns the slot for a new page, evicting the least recently requested one when needed;
+  // NO_PAGE when every slot holds a page requested this update or a pinned one
+  uint32_t allocateSlot();
+  void evict(uint32_t slot);
+  // the region of the stored tile in the cache
+  VkBufferImageCopy slotRegion(uint32_t slot, VkDeviceSize bufferOffset) const;
+  // rebuilds the page table entries of a texture from its resident pages
+  void refreshPageTable(uint32_t texture);
+  void writePageTable(Frame &frame);
+
+  TpDevice &tpDevice;
+  uint32_t slotsPerSide;
+  uint32_t slotSize;  // stored tile size, texels
+  uint32_t memoryPressureHandler;
+  bool recording = false;  // between update and finishFrame
+
+  VkImage image = VK_NULL_HANDLE;
+  VmaAllocation imageAllocation = nullptr;
+  VkImageView view = VK_NULL_HANDLE;
+  VkSampler sampler = VK_NULL_HANDLE;
+
+  std::vector<Texture> textures;
+  std::vector<Page> pages;
+  std::vector<uint32_t> pageTable;  // entries as the shaders read them
+  std::vector<uint32_t> slotPages;  // the page in each slot or NO_PAGE
+  std::vector<bool> pinned;         // by slot
+  uint64_t pageTableVersion = 1;
+  uint64_t updateCount = 0;
+  std::vector<Frame> frames;
+  int lastFrameIndex = -1;
+
+  // loader threads
+  std::vector<std::thread> loaders;
+  std::mutex loadMutex;
+  std::condition_variable loadWake;
+  std::deque<LoadRequest> loadQueue;
+  std::vector<LoadedPage> loadedPages;
+  bool stopping = false;
+  std::vector<LoadedPage> readyPages;  // read but not yet uploaded, owned by the render thread
+
+  uint32_t pendingLoads = 0;
+  uint32_t requestedPages = 0;
+  uint32_t uploads = 0;
+  uint64_t evictions = 0;
+  uint32_t shrinks = 0;
+};
+
+}  // namespace teapot
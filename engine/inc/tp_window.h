@@ -8,7 +8,7 @@ namespace teapot {
 
 class TpWindow {
  public:
-  TpWindow(int w, int h, std::string name);
+  TpWindow(int w, int h, std::string name, bool visible = true);
   ~TpWindow();
 
   TpWindow(const TpWindow &) = delete;
@@ -28,6 +28,7 @@ class TpWindow {
   int width;
   int height;
   bool framebufferResized = false;
+  bool visible;
 
   std::string windowName;
   GLFWwindow *window;
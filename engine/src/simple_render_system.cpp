@@ -1,67 +1,218 @@
 #include "simple_render_system.h"
+#include "tp_cpu_profiler.h"
+
+#include <glm/gtc/packing.hpp>
 
 // std
+#include <algorithm>
 #include <array>
-#include <chrono>
-
 #include <stdexcept>
 
 namespace teapot {
 
+namespace {
+
+// a coarser LOD must be this much under the error limit before it replaces the current one
+constexpr float LOD_HYSTERESIS = 0.25f;
+constexpr uint32_t NO_DRAW_COMMAND = UINT32_MAX;
+// cluster culling output per frame (16 MiB); LOD 0 draws past it are drawn whole
+constexpr VkDeviceSize MAX_CLUSTER_INDICES = VkDeviceSize{1} << 22;
+// cone culling is done in object space, which keeps angles only under uniform scale
+constexpr float MAX_CONE_SCALE_RATIO = 1.01f;
+constexpr uint32_t OCCLUSION_GROUP_SIZE = 64;
+
+// Takes a set from the newest pool with room. Pools are created with FREE_DESCRIPTOR_SET, so a
+// pool that ran full takes sets again once some were freed. Null when every pool is full.
+VkDescriptorSet allocateFromPools(VkDevice device, const std::vector<VkDescriptorPool> &pools,
+                                  VkDescriptorSetLayout layout, VkDescriptorPool &pool) {
+  VkDescriptorSetAllocateInfo allocInfo{};
+  allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  allocInfo.descriptorSetCount = 1;
+  allocInfo.pSetLayouts = &layout;
+
+  for (auto it = pools.rbegin(); it != pools.rend(); ++it) {
+    allocInfo.descriptorPool = *it;
+    VkDescriptorSet set;
+    VkResult result = vkAllocateDescriptorSets(device, &allocInfo, &set);
+    if (result == VK_SUCCESS) {
+      pool = *it;
+      return set;
+    }
+    if (result != VK_ERROR_OUT_OF_POOL_MEMORY && result != VK_ERROR_FRAGMENTED_POOL) {
+      throw std::runtime_error("failed to allocate descriptor set");
+    }
+  }
+  return VK_NULL_HANDLE;
+}
+
+VkDescriptorSetLayout createStorageSetLayout(VkDevice device, uint32_t bufferCount,
+                                             VkShaderStageFlags stages = VK_SHADER_STAGE_COMPUTE_BIT) {
+  std::vector<VkDescriptorSetLayoutBinding> bindings(bufferCount);
+  for (uint32_t i = 0; i < bufferCount; i++) {
+    bindings[i].binding = i;
+    bindings[i].descriptorCount = 1;
+    bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[i].pImmutableSamplers = nullptr;
+    bindings[i].stageFlags = stages;
+  }
+
+  VkDescriptorSetLayoutCreateInfo layoutInfo{};
+  layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layoutInfo.bindingCount = bufferCount;
+  layoutInfo.pBindings = bindings.data();
+
+  VkDescriptorSetLayout layout;
+  if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &layout) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create compute descriptor layout");
+  }
+  return layout;
+}
+
+void writeStorageBuffers(VkDevice device, VkDescriptorSet set, const std::vector<VkBuffer> &buffers) {
+  std::vector<VkDescriptorBufferInfo> bufferInfos(buffers.size());
+  std::vector<VkWriteDescriptorSet> writes(buffers.size());
+  for (size_t i = 0; i < buffers.size(); i++) {
+    bufferInfos[i].buffer = buffers[i];
+    bufferInfos[i].offset = 0;
+    bufferInfos[i].range = VK_WHOLE_SIZE;
+
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].dstSet = set;
+    writes[i].dstBinding = static_cast<uint32_t>(i);
+    writes[i].dstArrayElement = 0;
+    writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writes[i].descriptorCount = 1;
+    writes[i].pBufferInfo = &bufferInfos[i];
+  }
+  vkUpdateDescriptorSets(device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+}
+
+}  // namespace
+
+// 128 bytes, the minimum maxPushConstantsSize every device guarantees. The world matrix is sent
+// as its top three rows to leave room for the texture's place in the atlas.
 struct SimplePushConstantData {
-  glm::mat4 proj{1.f};
-  glm::mat4 view{1.f};
+  glm::mat4 viewProj{1.f};
+  glm::vec4 modelRows[3];
+  uint32_t uvOffset;  // uvRect.xy and uvRect.zw of TpTextureRef, as unorm16 pairs
+  uint32_t uvScale;
+  uint32_t textureLayer;
+  uint32_t padding;
+
+  void setModel(const glm::mat4 &world) {
+    glm::mat4 rows = glm::transpose(world);
+    modelRows[0] = rows[0];
+    modelRows[1] = rows[1];
+    modelRows[2] = rows[2];
+  }
+};
+
+// matches the push block of meshlet_cull.comp
+struct ClusterCullPushConstantData {
+  glm::vec4 planes[6];
+  glm::vec4 cameraPosition;  // w is 1 when the cone test applies
+  uint32_t commandIndex;
+  uint32_t indexOffset;  // the model's first index in its geometry arena
+};
+
+// matches the push blocks of occlusion_history.comp and occlusion_cull.comp
+struct OcclusionPushConstantData {
+  glm::mat4 viewProj;
+  glm::vec2 pyramidSize;
+  uint32_t drawCount;
+  uint32_t pyramidLevels;
+};
+
+// matches DrawBounds of the occlusion shaders; one per draw, in draw order
+struct OcclusionDrawBounds {
+  glm::vec4 boundsMin;
+  glm::vec4 boundsMax;
+  uint32_t entity;
+  uint32_t padding[3];
 };
 
 SimpleRenderSystem::SimpleRenderSystem(TpDevice &device, VkRenderPass renderPass): tpDevice{device} {
   createDescriptorSetLayout();
   createPipelineLayout();
   createPipeline(renderPass);
+  createClusterCulling();
+  createOcclusionCulling();
 }
 
 
 void SimpleRenderSystem::createDescriptorSetLayout() {
-  VkDescriptorSetLayoutBinding uboLayoutBinding{};
-  uboLayoutBinding.binding = 0;
-  uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-  uboLayoutBinding.descriptorCount = 1;
-  uboLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-  uboLayoutBinding.pImmutableSamplers = nullptr;
-
-  VkDescriptorSetLayoutBinding samplerLayoutBinding{};
-  samplerLayoutBinding.binding = 1;
-  samplerLayoutBinding.descriptorCount = 1;
-  samplerLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-  samplerLayoutBinding.pImmutableSamplers = nullptr;
-  samplerLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
-
-  std::array<VkDescriptorSetLayoutBinding, 2> bindings = {uboLayoutBinding, samplerLayoutBinding};
+  // binding 0 is the texture; 1 and 2 are the page table and feedback of virtual textures, which
+  // atlas materials leave unwritten as their shader does not use them
+  std::array<VkDescriptorSetLayoutBinding, 3> bindings{};
+  for (uint32_t i = 0; i < bindings.size(); i++) {
+    bindings[i].binding = i;
+    bindings[i].descriptorCount = 1;
+    bindings[i].descriptorType = i == 0 ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[i].pImmutableSamplers = nullptr;
+    bindings[i].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+  }
 
   VkDescriptorSetLayoutCreateInfo layoutInfo{};
   layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-  layoutInfo.bindingCount = bindings.size();
+  layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
   layoutInfo.pBindings = bindings.data();
 
   if (vkCreateDescriptorSetLayout(tpDevice.device(), &layoutInfo, nullptr, &descriptorSetLayout) != VK_SUCCESS) {
     throw std::runtime_error("failed to create descriptor layout");
   }
+
+  geometrySetLayout = createStorageSetLayout(tpDevice.device(), 2, VK_SHADER_STAGE_VERTEX_BIT);
 }
 
 SimpleRenderSystem::~SimpleRenderSystem() {
+  // after the retired sets queued before, which free into these pools
+  VkDevice device = tpDevice.device();
+  tpDevice.deferDestroy(tpDevice.lastSubmittedGraphicsValue(), [device, pools = materialPools]() {
+    for (auto pool : pools) vkDestroyDescriptorPool(device, pool, nullptr);
+  });
+  for (auto &frame : indirectFrames) {
+    if (frame.indexBuffer != VK_NULL_HANDLE) {
+      vmaDestroyBuffer(tpDevice.allocator(), frame.indexBuffer, frame.indexAllocation);
+    }
+    if (frame.commandBuffer != VK_NULL_HANDLE) {
+      vmaDestroyBuffer(tpDevice.allocator(), frame.commandBuffer, frame.commandAllocation);
+    }
+    if (frame.boundsBuffer != VK_NULL_HANDLE) {
+      vmaDestroyBuffer(tpDevice.allocator(), frame.boundsBuffer, frame.boundsAllocation);
+    }
+    if (frame.uploadBuffer != VK_NULL_HANDLE) {
+      vmaDestroyBuffer(tpDevice.allocator(), frame.uploadBuffer, frame.uploadAllocation);
+    }
+  }
+  if (visibilityBuffer != VK_NULL_HANDLE) {
+    vmaDestroyBuffer(tpDevice.allocator(), visibilityBuffer, visibilityAllocation);
+  }
+  tpDevice.deferDestroy(tpDevice.lastSubmittedGraphicsValue(), [device, pools = computePools]() {
+    for (auto pool : pools) vkDestroyDescriptorPool(device, pool, nullptr);
+  });
+  vkDestroyPipelineLayout(tpDevice.device(), occlusionPipelineLayout, nullptr);
+  vkDestroyDescriptorSetLayout(tpDevice.device(), occlusionSetLayout, nullptr);
+  vkDestroyDescriptorSetLayout(tpDevice.device(), pyramidSetLayout, nullptr);
+  vkDestroyPipelineLayout(tpDevice.device(), clusterPipelineLayout, nullptr);
+  vkDestroyDescriptorSetLayout(tpDevice.device(), clusterModelSetLayout, nullptr);
+  vkDestroyDescriptorSetLayout(tpDevice.device(), clusterFrameSetLayout, nullptr);
   vkDestroyPipelineLayout(tpDevice.device(), pipelineLayout, nullptr);
   vkDestroyDescriptorSetLayout(tpDevice.device(), descriptorSetLayout, nullptr);
+  vkDestroyDescriptorSetLayout(tpDevice.device(), geometrySetLayout, nullptr);
 }
 
 void SimpleRenderSystem::createPipelineLayout() {
   VkPushConstantRange pushConstantRange{};
-  pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+  pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
   pushConstantRange.size = sizeof(SimplePushConstantData);
   pushConstantRange.offset = 0;
 
+  // set 1 is only read by the vertex pulling shaders, the others leave it unbound
+  VkDescriptorSetLayout setLayouts[] = {descriptorSetLayout, geometrySetLayout};
   VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
   pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-  pipelineLayoutInfo.setLayoutCount = 1;
-  pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
+  pipelineLayoutInfo.setLayoutCount = 2;
+  pipelineLayoutInfo.pSetLayouts = setLayouts;
   pipelineLayoutInfo.pushConstantRangeCount = 1;
   pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
   if (vkCreatePipelineLayout(tpDevice.device(), &pipelineLayoutInfo, nullptr, &pipelineLayout) !=
@@ -71,37 +222,876 @@ void SimpleRenderSystem::createPipelineLayout() {
 }
 
 void SimpleRenderSystem::createPipeline(VkRenderPass renderPass) {
-  PipelineConfigInfo pipelineConfig{};
-  TpPipeline::defaultPipelineConfigInfo(pipelineConfig);
-  pipelineConfig.renderPass = renderPass;
-  pipelineConfig.pipelineLayout = pipelineLayout;
-  tpPipeline = std::make_unique<TpPipeline>(
+  const char *fragmentShaders[PIPELINE_COUNT] = {"assets/shaders/simple_shader.frag.spv",
+                                                 "assets/shaders/simple_shader_virtual.frag.spv"};
+  for (uint32_t pipeline = 0; pipeline < PIPELINE_COUNT; pipeline++) {
+    // the virtual texture shader writes feedback, which needs fragmentStoresAndAtomics; without
+    // it no TpVirtualTextureCache can be created, so the pipeline is never used
+    if (pipeline == VIRTUAL_TEXTURE_PIPELINE && !tpDevice.supportsFragmentStores()) continue;
+    for (int pull = 0; pull < 2; pull++) {
+      for (int afterPrePass = 0; afterPrePass < 2; afterPrePass++) {
+        PipelineConfigInfo config{};
+        TpPipeline::defaultPipelineConfigInfo(config);
+        if (pull) TpPipeline::vertexPullingConfigInfo(config);
+        if (afterPrePass) {
+          config.depthStencilInfo.depthCompareOp = VK_COMPARE_OP_EQUAL;
+          config.depthStencilInfo.depthWriteEnable = VK_FALSE;
+        }
+        config.renderPass = renderPass;
+        config.pipelineLayout = pipelineLayout;
+        shadedPipelines[pipeline][pull][afterPrePass] = std::make_unique<TpPipeline>(
+                tpDevice,
+                pull ? "assets/shaders/simple_shader_pull.vert.spv" : "assets/shaders/simple_shader.vert.spv",
+                fragmentShaders[pipeline],
+                config);
+      }
+    }
+  }
+
+  PipelineConfigInfo depthConfig{};
+  TpPipeline::depthOnlyPipelineConfigInfo(depthConfig);
+  depthConfig.renderPass = renderPass;
+  depthConfig.pipelineLayout = pipelineLayout;
+  depthPrePassPipeline = std::make_unique<TpPipeline>(
+          tpDevice,
+          "assets/shaders/depth_prepass.vert.spv",
+          "",
+          depthConfig);
+
+  PipelineConfigInfo pullDepthConfig{};
+  TpPipeline::depthOnlyPipelineConfigInfo(pullDepthConfig);
+  TpPipeline::vertexPullingConfigInfo(pullDepthConfig);
+  pullDepthConfig.renderPass = renderPass;
+  pullDepthConfig.pipelineLayout = pipelineLayout;
+  pullDepthPrePassPipeline = std::make_unique<TpPipeline>(
           tpDevice,
-          "assets/shaders/simple_shader.vert.spv",
-          "assets/shaders/simple_shader.frag.spv",
-          pipelineConfig);
+          "assets/shaders/depth_prepass_pull.vert.spv",
+          "",
+          pullDepthConfig);
+}
+
+VkDescriptorSet SimpleRenderSystem::allocateMaterialSet() {
+  VkDescriptorPool pool;
+  VkDescriptorSet set = allocateFromPools(tpDevice.device(), materialPools, descriptorSetLayout, pool);
+  if (set == VK_NULL_HANDLE) {
+    std::array<VkDescriptorPoolSize, 2> poolSizes{};
+    poolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    poolSizes[0].descriptorCount = MATERIALS_PER_POOL;
+    poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    poolSizes[1].descriptorCount = 2 * MATERIALS_PER_POOL;
+
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
+    poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+    poolInfo.pPoolSizes = poolSizes.data();
+    poolInfo.maxSets = MATERIALS_PER_POOL;
+
+    if (vkCreateDescriptorPool(tpDevice.device(), &poolInfo, nullptr, &pool) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create material descriptor pool");
+    }
+    materialPools.push_back(pool);
+    set = allocateFromPools(tpDevice.device(), {pool}, descriptorSetLayout, pool);
+    if (set == VK_NULL_HANDLE) {
+      throw std::runtime_error("failed to allocate material descriptor set");
+    }
+  }
+  setPools[set] = pool;
+  return set;
+}
+
+void SimpleRenderSystem::retireSet(VkDescriptorSet set) {
+  auto it = setPools.find(set);
+  VkDescriptorPool pool = it->second;
+  setPools.erase(it);
+
+  // frames in flight may still bind it
+  VkDevice device = tpDevice.device();
+  tpDevice.deferDestroy(tpDevice.lastSubmittedGraphicsValue(), [device, pool, set]() {
+    vkFreeDescriptorSets(device, pool, 1, &set);
+  });
+}
+
+const SimpleRenderSystem::Material &SimpleRenderSystem::getMaterial(const TpModel &model) {
+  if (!model.hasTexture()) {
+    throw std::invalid_argument("model has no texture to build a material from");
+  }
+
+  const TpTextureAtlas &textures = model.getTextures();
+  uint32_t array = model.getTexture().array;
+  VkImageView view = textures.getView(array);
+  auto key = std::make_pair(&textures, array);
+  auto it = materials.find(key);
+  if (it != materials.end() && it->second.view == view) return it->second;
+
+  // The array grew or was trimmed into a new view. A frame in flight may still use the old set,
+  // so it is retired rather than rewritten; the material keeps its id and thereby its place in
+  // the draw order.
+  uint32_t id = it != materials.end() ? it->second.id : nextMaterialId++;
+  if (it != materials.end()) retireSet(it->second.descriptorSet);
+  Material material{id, allocateMaterialSet(), view};
+
+  VkDescriptorImageInfo imageInfo{};
+  imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  imageInfo.imageView = view;
+  imageInfo.sampler = textures.getSampler();
+
+  VkWriteDescriptorSet descriptorWrite{};
+  descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  descriptorWrite.dstSet = material.descriptorSet;
+  descriptorWrite.dstBinding = 0;
+  descriptorWrite.dstArrayElement = 0;
+  descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  descriptorWrite.descriptorCount = 1;
+  descriptorWrite.pImageInfo = &imageInfo;
+  vkUpdateDescriptorSets(tpDevice.device(), 1, &descriptorWrite, 0, nullptr);
+
+  return materials[key] = material;
+}
+
+const SimpleRenderSystem::VirtualMaterial &SimpleRenderSystem::getVirtualMaterial(const TpVirtualTextureCache &cache) {
+  auto it = virtualMaterials.find(&cache);
+  if (it == virtualMaterials.end()) {
+    VirtualMaterial material{nextMaterialId++, {}, {}};
+    for (auto &set : material.descriptorSets) set = allocateMaterialSet();
+    it = virtualMaterials.emplace(&cache, material).first;
+  }
+
+  // the frame that last used this set is complete, so it can be written in place
+  VirtualMaterial &material = it->second;
+  int frame = currentFrameIndex;
+  if (material.views[frame] == cache.getView()) return material;
+  material.views[frame] = cache.getView();
+
+  VkDescriptorImageInfo imageInfo{};
+  imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  imageInfo.imageView = cache.getView();
+  imageInfo.sampler = cache.getSampler();
+
+  std::array<VkDescriptorBufferInfo, 2> bufferInfos{};
+  bufferInfos[0].buffer = cache.getPageTableBuffer(frame);
+  bufferInfos[0].range = VK_WHOLE_SIZE;
+  bufferInfos[1].buffer = cache.getFeedbackBuffer(frame);
+  bufferInfos[1].range = VK_WHOLE_SIZE;
+
+  std::array<VkWriteDescriptorSet, 3> writes{};
+  for (uint32_t i = 0; i < writes.size(); i++) {
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].dstSet = material.descriptorSets[frame];
+    writes[i].dstBinding = i;
+    writes[i].dstArrayElement = 0;
+    writes[i].descriptorCount = 1;
+    if (i == 0) {
+      writes[i].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+      writes[i].pImageInfo = &imageInfo;
+    } else {
+      writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      writes[i].pBufferInfo = &bufferInfos[i - 1];
+    }
+  }
+  vkUpdateDescriptorSets(tpDevice.device(), static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+  return material;
+}
+
+void SimpleRenderSystem::createClusterCulling() {
+  clusterModelSetLayout = createStorageSetLayout(tpDevice.device(), 2);
+  clusterFrameSetLayout = createStorageSetLayout(tpDevice.device(), 2);
+
+  VkPushConstantRange pushConstantRange{};
+  pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  pushConstantRange.size = sizeof(ClusterCullPushConstantData);
+  pushConstantRange.offset = 0;
+
+  VkDescriptorSetLayout setLayouts[] = {clusterModelSetLayout, clusterFrameSetLayout};
+  VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+  pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipelineLayoutInfo.setLayoutCount = 2;
+  pipelineLayoutInfo.pSetLayouts = setLayouts;
+  pipelineLayoutInfo.pushConstantRangeCount = 1;
+  pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+  if (vkCreatePipelineLayout(tpDevice.device(), &pipelineLayoutInfo, nullptr, &clusterPipelineLayout) !=
+      VK_SUCCESS) {
+    throw std::runtime_error("failed to create cluster culling pipeline layout");
+  }
+
+  clusterCullPipeline = std::make_unique<TpPipeline>(
+          tpDevice,
+          "assets/shaders/meshlet_cull.comp.spv",
+          clusterPipelineLayout);
+}
+
+void SimpleRenderSystem::createOcclusionCulling() {
+  depthPyramid = std::make_unique<TpDepthPyramid>(tpDevice);
+  occlusionSetLayout = createStorageSetLayout(tpDevice.device(), 3);
+
+  VkDescriptorSetLayoutBinding pyramidBinding{};
+  pyramidBinding.binding = 0;
+  pyramidBinding.descriptorCount = 1;
+  pyramidBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  pyramidBinding.pImmutableSamplers = nullptr;
+  pyramidBinding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+  VkDescriptorSetLayoutCreateInfo layoutInfo{};
+  layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layoutInfo.bindingCount = 1;
+  layoutInfo.pBindings = &pyramidBinding;
+  if (vkCreateDescriptorSetLayout(tpDevice.device(), &layoutInfo, nullptr, &pyramidSetLayout) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create compute descriptor layout");
+  }
+
+  VkPushConstantRange pushConstantRange{};
+  pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  pushConstantRange.size = sizeof(OcclusionPushConstantData);
+  pushConstantRange.offset = 0;
+
+  // the history pass only uses set 0, so it runs before any pyramid exists
+  VkDescriptorSetLayout setLayouts[] = {occlusionSetLayout, pyramidSetLayout};
+  VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+  pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipelineLayoutInfo.setLayoutCount = 2;
+  pipelineLayoutInfo.pSetLayouts = setLayouts;
+  pipelineLayoutInfo.pushConstantRangeCount = 1;
+  pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+  if (vkCreatePipelineLayout(tpDevice.device(), &pipelineLayoutInfo, nullptr, &occlusionPipelineLayout) !=
+      VK_SUCCESS) {
+    throw std::runtime_error("failed to create occlusion culling pipeline layout");
+  }
+
+  occlusionHistoryPipeline = std::make_unique<TpPipeline>(
+          tpDevice,
+          "assets/shaders/occlusion_history.comp.spv",
+          occlusionPipelineLayout);
+  occlusionCullPipeline = std::make_unique<TpPipeline>(
+          tpDevice,
+          "assets/shaders/occlusion_cull.comp.spv",
+          occlusionPipelineLayout);
+}
+
+VkDescriptorSet SimpleRenderSystem::allocateComputeSet(VkDescriptorSetLayout layout) {
+  VkDescriptorPool pool;
+  VkDescriptorSet set = allocateFromPools(tpDevice.device(), computePools, layout, pool);
+  if (set == VK_NULL_HANDLE) {
+    // enough for every set to be the largest layout, three storage buffers
+    std::array<VkDescriptorPoolSize, 2> poolSizes{};
+    poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    poolSizes[0].descriptorCount = 3 * COMPUTE_SETS_PER_POOL;
+    poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    poolSizes[1].descriptorCount = COMPUTE_SETS_PER_POOL;
+
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
+    poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+    poolInfo.pPoolSizes = poolSizes.data();
+    poolInfo.maxSets = COMPUTE_SETS_PER_POOL;
+
+    if (vkCreateDescriptorPool(tpDevice.device(), &poolInfo, nullptr, &pool) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create compute descriptor pool");
+    }
+    computePools.push_back(pool);
+    set = allocateFromPools(tpDevice.device(), {pool}, layout, pool);
+    if (set == VK_NULL_HANDLE) {
+      throw std::runtime_error("failed to allocate compute descriptor set");
+    }
+  }
+  setPools[set] = pool;
+  return set;
+}
+
+VkDescriptorSet SimpleRenderSystem::getClusterModelSet(const TpModel &model) {
+  VkBuffer indexBuffer = model.getIndexBuffer();
+  VkBuffer meshletBuffer = model.getMeshletBuffer();
+  auto it = clusterModelSets.find(model.getId());
+  if (it != clusterModelSets.end() && it->second.indexBuffer == indexBuffer &&
+      it->second.meshletBuffer == meshletBuffer) {
+    return it->second.set;
+  }
+
+  // The arena replaced its index buffer or defragmentation moved a buffer. A frame in flight may
+  // still use the old set, so it is retired rather than rewritten; this only happens when arenas
+  // grow or compact and while the device defragments.
+  if (it != clusterModelSets.end()) retireSet(it->second.set);
+  VkDescriptorSet set = allocateComputeSet(clusterModelSetLayout);
+  writeStorageBuffers(tpDevice.device(), set, {meshletBuffer, indexBuffer});
+  clusterModelSets[model.getId()] = {set, indexBuffer, meshletBuffer};
+  return set;
+}
+
+VkDescriptorSet SimpleRenderSystem::getGeometrySet(const TpGeometryArena &geometry) {
+  VkBuffer vertexBuffer = geometry.getVertexBuffer();
+  VkBuffer positionBuffer = geometry.getPositionBuffer();
+  auto it = geometrySets.find(&geometry);
+  if (it != geometrySets.end() && it->second.vertexBuffer == vertexBuffer &&
+      it->second.positionBuffer == positionBuffer) {
+    return it->second.set;
+  }
+
+  // as with the cluster sets, a replaced arena buffer gets a new set and the old one is retired;
+  // defragmentation may move either buffer on its own
+  if (it != geometrySets.end()) retireSet(it->second.set);
+  VkDescriptorSet set = allocateComputeSet(geometrySetLayout);
+  writeStorageBuffers(tpDevice.device(), set, {vertexBuffer, positionBuffer});
+  geometrySets[&geometry] = {set, vertexBuffer, positionBuffer};
+  return set;
+}
+
+void SimpleRenderSystem::reserveIndirectFrame(IndirectFrame &frame, VkDeviceSize indexCount, uint32_t commandCount,
+                                              uint32_t boundsCount, VkDeviceSize uploadSize) {
+  // this frame's previous submission is complete, but the retired buffers go through the
+  // deferred queue like every other GPU resource
+  auto retire = [this](VkBuffer buffer, VmaAllocation allocation) {
+    if (buffer == VK_NULL_HANDLE) return;
+    VmaAllocator allocator = tpDevice.allocator();
+    tpDevice.deferDestroy(tpDevice.lastSubmittedGraphicsValue(), [=]() {
+      vmaDestroyBuffer(allocator, buffer, allocation);
+    });
+  };
+  bool grown = false;
+  if (indexCount > frame.indexCapacity) {
+    retire(frame.indexBuffer, frame.indexAllocation);
+    frame.indexCapacity = std::min(std::max(indexCount, 2 * frame.indexCapacity), MAX_CLUSTER_INDICES);
+    tpDevice.createBuffer(frame.indexCapacity * sizeof(uint32_t),
+                          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                          VMA_MEMORY_USAGE_GPU_ONLY,
+                          frame.indexBuffer, frame.indexAllocation);
+    grown = true;
+  }
+  if (commandCount > frame.commandCapacity) {
+    retire(frame.commandBuffer, frame.commandAllocation);
+    frame.commandCapacity = std::max(commandCount, 2 * frame.commandCapacity);
+    tpDevice.createBuffer(frame.commandCapacity * sizeof(VkDrawIndexedIndirectCommand),
+                          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                          VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                          VMA_MEMORY_USAGE_GPU_ONLY,
+                          frame.commandBuffer, frame.commandAllocation);
+    grown = true;
+  }
+  if (boundsCount > frame.boundsCapacity) {
+    retire(frame.boundsBuffer, frame.boundsAllocation);
+    frame.boundsCapacity = std::max(boundsCount, 2 * frame.boundsCapacity);
+    tpDevice.createBuffer(frame.boundsCapacity * sizeof(OcclusionDrawBounds),
+                          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                          VMA_MEMORY_USAGE_GPU_ONLY,
+                          frame.boundsBuffer, frame.boundsAllocation);
+  }
+  if (uploadSize > frame.uploadCapacity) {
+    retire(frame.uploadBuffer, frame.uploadAllocation);
+    frame.uploadCapacity = std::max(uploadSize, 2 * frame.uploadCapacity);
+    tpDevice.createBuffer(frame.uploadCapacity,
+                          VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                          VMA_MEMORY_USAGE_CPU_ONLY,
+                          frame.uploadBuffer, frame.uploadAllocation, TpMemoryClass::Staging);
+  }
+
+  // the cluster set is written once the first clustered draw has created the index buffer
+  if (frame.indexBuffer == VK_NULL_HANDLE) return;
+  if (frame.clusterSet == VK_NULL_HANDLE) frame.clusterSet = allocateComputeSet(clusterFrameSetLayout);
+  if (grown) writeStorageBuffers(tpDevice.device(), frame.clusterSet, {frame.indexBuffer, frame.commandBuffer});
+}
+
+void SimpleRenderSystem::reserveVisibility(VkCommandBuffer commandBuffer, uint32_t entityCount) {
+  if (entityCount <= visibilityCapacity) return;
+  if (visibilityBuffer != VK_NULL_HANDLE) {
+    VmaAllocator allocator = tpDevice.allocator();
+    VkBuffer buffer = visibilityBuffer;
+    VmaAllocation allocation = visibilityAllocation;
+    tpDevice.deferDestroy(tpDevice.lastSubmittedGraphicsValue(), [=]() {
+      vmaDestroyBuffer(allocator, buffer, allocation);
+    });
+  }
+  visibilityCapacity = std::max(entityCount, 2 * visibilityCapacity);
+  tpDevice.createBuffer(visibilityCapacity * sizeof(uint32_t),
+                        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                        VMA_MEMORY_USAGE_GPU_ONLY,
+                        visibilityBuffer, visibilityAllocation);
+
+  // the history is lost; nothing counts as visible until the first test
+  vkCmdFillBuffer(commandBuffer, visibilityBuffer, 0, VK_WHOLE_SIZE, 0);
+  VkMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  vkCmdPipelineBarrier(commandBuffer,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       0,
+                       1, &barrier,
+                       0, nullptr,
+                       0, nullptr);
+}
+
+void SimpleRenderSystem::writeDrawCommands(VkCommandBuffer commandBuffer, IndirectFrame &frame,
+                                           const TpScene &scene) {
+  clusteredDraws.clear();
+  const auto &items = drawList.items();
+  const TpModelHandle *modelHandles = scene.modelHandles();
+
+  // LOD 0 draws of clustered models, in draw order, until the frame's index budget runs out
+  VkDeviceSize indexCount = 0;
+  if (clusterCulling) {
+    uint32_t maxWorkGroups = tpDevice.properties.limits.maxComputeWorkGroupCount[0];
+    for (const auto &item : items) {
+      const TpModel &model = scene.getModel(modelHandles[item.index]);
+      if (lodSelection[item.index] != 0 || !model.hasMeshlets() || model.getMeshletCount() > maxWorkGroups) continue;
+      VkDeviceSize modelIndices = model.getLod(0).indexCount;
+      if (indexCount + modelIndices > MAX_CLUSTER_INDICES) break;
+
+      clusteredIndices[item.index] = 1;
+      clusteredDraws.push_back(item.index);
+      indexCount += modelIndices;
+    }
+  }
+
+  // with occlusion culling every draw has a command per phase, the second phase's after the first's
+  auto drawCount = static_cast<uint32_t>(frameOcclusion ? items.size() : clusteredDraws.size());
+  if (drawCount == 0) return;
+  VkDeviceSize boundsSize = frameOcclusion ? drawCount * sizeof(OcclusionDrawBounds) : 0;
+  VkDeviceSize commandSize = drawCount * sizeof(VkDrawIndexedIndirectCommand);
+  reserveIndirectFrame(frame, indexCount, frameOcclusion ? 2 * drawCount : drawCount,
+                       frameOcclusion ? drawCount : 0, boundsSize + commandSize);
+
+  // this frame's previous submission is complete, so its upload buffer is free to rewrite
+  void *mapped;
+  vmaMapMemory(tpDevice.allocator(), frame.uploadAllocation, &mapped);
+  if (frameOcclusion) {
+    const TpAabb *worldBounds = scene.worldBounds();
+    auto *bounds = static_cast<OcclusionDrawBounds *>(mapped);
+    for (size_t i = 0; i < items.size(); i++) {
+      const TpAabb &box = worldBounds[items[i].index];
+      bounds[i] = {glm::vec4{box.min, 1.f}, glm::vec4{box.max, 1.f}, items[i].index, {}};
+    }
+  }
+
+  // clustered draws start empty and own the range their whole LOD 0 would fill
+  auto *commands = reinterpret_cast<VkDrawIndexedIndirectCommand *>(static_cast<char *>(mapped) + boundsSize);
+  uint32_t clusterFirstIndex = 0;
+  uint32_t command = 0;
+  for (const auto &item : items) {
+    const TpModel &model = scene.getModel(modelHandles[item.index]);
+    const TpMeshRange &range = model.getMeshRange();
+    if (clusteredIndices[item.index]) {
+      commands[command] = {0, 1, clusterFirstIndex, range.vertexOffset, 0};
+      clusterFirstIndex += model.getLod(0).indexCount;
+    } else if (frameOcclusion) {
+      const TpMeshLod &lod = model.getLod(lodSelection[item.index]);
+      commands[command] = {lod.indexCount, 1, range.firstIndex + lod.firstIndex, range.vertexOffset, 0};
+    } else {
+      continue;
+    }
+    drawCommands[item.index] = command++;
+  }
+  vmaFlushAllocation(tpDevice.allocator(), frame.uploadAllocation, 0, boundsSize + commandSize);
+  vmaUnmapMemory(tpDevice.allocator(), frame.uploadAllocation);
+
+  VkBufferCopy commandCopy{boundsSize, 0, commandSize};
+  vkCmdCopyBuffer(commandBuffer, frame.uploadBuffer, frame.commandBuffer, 1, &commandCopy);
+  if (frameOcclusion) {
+    VkBufferCopy boundsCopy{0, 0, boundsSize};
+    vkCmdCopyBuffer(commandBuffer, frame.uploadBuffer, frame.boundsBuffer, 1, &boundsCopy);
+  }
+
+  // the cluster and occlusion passes patch the commands in place, the draws read them after
+  VkMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+  vkCmdPipelineBarrier(commandBuffer,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                       0,
+                       1, &barrier,
+                       0, nullptr,
+                       0, nullptr);
 }
 
-void SimpleRenderSystem::renderGameObjects(int frameIndex, VkCommandBuffer commandBuffer,
-                                           std::vector<TpGameObject> &gameObjects, const teapot::TpCamera &camera) {
-  tpPipeline->bind(commandBuffer);
+void SimpleRenderSystem::cullClusters(VkCommandBuffer commandBuffer, IndirectFrame &frame, const TpScene &scene,
+                                      const TpCamera &camera) {
+  TP_PROFILE_SCOPE("SimpleRenderSystem::cullClusters");
+  if (clusteredDraws.empty()) return;
+
+  clusterCullPipeline->bind(commandBuffer);
+  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, clusterPipelineLayout,
+                          1, 1, &frame.clusterSet,
+                          0, nullptr);
+
+  glm::vec3 cameraPosition = glm::inverse(camera.getView())[3];
+  const glm::mat4 *worldMatrices = scene.worldMatrices();
+  const TpModelHandle *modelHandles = scene.modelHandles();
+  VkDescriptorSet boundSet = VK_NULL_HANDLE;
+  ClusterCullPushConstantData push{};
+  for (uint32_t index : clusteredDraws) {
+    const TpModel &model = scene.getModel(modelHandles[index]);
+    VkDescriptorSet set = getClusterModelSet(model);
+    if (set != boundSet) {
+      vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, clusterPipelineLayout,
+                              0, 1, &set,
+                              0, nullptr);
+      boundSet = set;
+    }
 
-  for(auto& obj: gameObjects) {
-    SimplePushConstantData push{};
-    push.proj = camera.getProjection();
-    push.view = camera.getView();
+    // the frustum of viewProj * world is the view frustum in object space
+    const glm::mat4 &world = worldMatrices[index];
+    const auto &planes = TpFrustum{frameViewProj * world}.getPlanes();
+    std::copy(planes.begin(), planes.end(), push.planes);
+
+    glm::vec3 scale{glm::length(glm::vec3{world[0]}), glm::length(glm::vec3{world[1]}),
+                    glm::length(glm::vec3{world[2]})};
+    float minScale = std::min({scale.x, scale.y, scale.z});
+    float maxScale = std::max({scale.x, scale.y, scale.z});
+    bool coneTest = clusterConeCulling && minScale > 0.f && maxScale <= minScale * MAX_CONE_SCALE_RATIO &&
+                    glm::determinant(glm::mat3{world}) > 0.f;
+    push.cameraPosition = glm::vec4{glm::vec3{glm::inverse(world) * glm::vec4{cameraPosition, 1.f}},
+                                    coneTest ? 1.f : 0.f};
+    push.commandIndex = drawCommands[index];
+    push.indexOffset = model.getMeshRange().firstIndex;
+    vkCmdPushConstants(commandBuffer, clusterPipelineLayout,
+                       VK_SHADER_STAGE_COMPUTE_BIT,
+                       0,
+                       sizeof(ClusterCullPushConstantData),
+                       &push);
+
+    vkCmdDispatch(commandBuffer, model.getMeshletCount(), 1, 1);
+    stats.clustersTested += model.getMeshletCount();
+  }
+}
+
+void SimpleRenderSystem::applyVisibilityHistory(VkCommandBuffer commandBuffer, IndirectFrame &frame) {
+  auto drawCount = static_cast<uint32_t>(drawList.items().size());
+  if (drawCount == 0) return;
+
+  // the previous frame's test wrote the visibility this pass reads
+  VkMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  vkCmdPipelineBarrier(commandBuffer,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       0,
+                       1, &barrier,
+                       0, nullptr,
+                       0, nullptr);
+
+  // rewritten every frame: the visibility buffer is shared and may have been replaced
+  if (frame.occlusionSet == VK_NULL_HANDLE) frame.occlusionSet = allocateComputeSet(occlusionSetLayout);
+  writeStorageBuffers(tpDevice.device(), frame.occlusionSet,
+                      {frame.boundsBuffer, frame.commandBuffer, visibilityBuffer});
+
+  occlusionHistoryPipeline->bind(commandBuffer);
+  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, occlusionPipelineLayout,
+                          0, 1, &frame.occlusionSet,
+                          0, nullptr);
+  OcclusionPushConstantData push{};
+  push.viewProj = frameViewProj;
+  push.drawCount = drawCount;
+  vkCmdPushConstants(commandBuffer, occlusionPipelineLayout,
+                     VK_SHADER_STAGE_COMPUTE_BIT,
+                     0,
+                     sizeof(OcclusionPushConstantData),
+                     &push);
+  vkCmdDispatch(commandBuffer, (drawCount + OCCLUSION_GROUP_SIZE - 1) / OCCLUSION_GROUP_SIZE, 1, 1);
+}
 
+bool SimpleRenderSystem::cullOccluded(VkCommandBuffer commandBuffer, VkImageView depthView, VkExtent2D depthExtent) {
+  TP_PROFILE_SCOPE("SimpleRenderSystem::cullOccluded");
+  if (!frameOcclusion) return false;
+  occlusionPhase = 1;
+  auto drawCount = static_cast<uint32_t>(drawList.items().size());
+  if (drawCount == 0) return true;
+
+  depthPyramid->build(commandBuffer, currentFrameIndex, depthView, depthExtent);
+
+  IndirectFrame &frame = *currentIndirectFrame;
+  if (frame.pyramidSet == VK_NULL_HANDLE) frame.pyramidSet = allocateComputeSet(pyramidSetLayout);
+  VkDescriptorImageInfo pyramidInfo{depthPyramid->getSampler(), depthPyramid->getView(currentFrameIndex),
+                                    VK_IMAGE_LAYOUT_GENERAL};
+  VkWriteDescriptorSet pyramidWrite{};
+  pyramidWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  pyramidWrite.dstSet = frame.pyramidSet;
+  pyramidWrite.dstBinding = 0;
+  pyramidWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  pyramidWrite.descriptorCount = 1;
+  pyramidWrite.pImageInfo = &pyramidInfo;
+  vkUpdateDescriptorSets(tpDevice.device(), 1, &pyramidWrite, 0, nullptr);
+
+  occlusionCullPipeline->bind(commandBuffer);
+  VkDescriptorSet sets[] = {frame.occlusionSet, frame.pyramidSet};
+  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, occlusionPipelineLayout,
+                          0, 2, sets,
+                          0, nullptr);
+  VkExtent2D pyramidExtent = depthPyramid->getExtent(currentFrameIndex);
+  OcclusionPushConstantData push{};
+  push.viewProj = frameViewProj;
+  push.pyramidSize = glm::vec2{pyramidExtent.width, pyramidExtent.height};
+  push.drawCount = drawCount;
+  push.pyramidLevels = depthPyramid->getLevelCount(currentFrameIndex);
+  vkCmdPushConstants(commandBuffer, occlusionPipelineLayout,
+                     VK_SHADER_STAGE_COMPUTE_BIT,
+                     0,
+                     sizeof(OcclusionPushConstantData),
+                     &push);
+  vkCmdDispatch(commandBuffer, (drawCount + OCCLUSION_GROUP_SIZE - 1) / OCCLUSION_GROUP_SIZE, 1, 1);
+  stats.occlusionTested += drawCount;
+
+  // the second phase draws from the commands, the next frame reads the visibility
+  VkMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+  vkCmdPipelineBarrier(commandBuffer,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       0,
+                       1, &barrier,
+                       0, nullptr,
+                       0, nullptr);
+  return true;
+}
+
+uint8_t SimpleRenderSystem::selectLod(const TpModel &model, const glm::mat4 &world, const TpAabb &worldBounds,
+                                      const TpCamera &camera, uint8_t currentLod) const {
+  if (!lodEnabled || model.getLodCount() < 2) return 0;
+
+  float worldScale = std::max({glm::length(glm::vec3{world[0]}), glm::length(glm::vec3{world[1]}),
+                               glm::length(glm::vec3{world[2]})});
+  glm::vec3 viewCenter = camera.getView() * glm::vec4{worldBounds.center(), 1.f};
+  float distance = glm::length(viewCenter) - glm::length(worldBounds.extent());
+  if (distance <= 0.f) return 0;
+
+  // projection[1][1] / 2 turns view space size over distance into a fraction of the viewport
+  float toScreen = worldScale * 0.5f * std::abs(camera.getProjection()[1][1]) / distance;
+  for (uint32_t lod = model.getLodCount() - 1; lod > 0; lod--) {
+    float limit = lod > currentLod ? lodScreenError * (1.f - LOD_HYSTERESIS) : lodScreenError;
+    if (model.getLod(lod).error * toScreen <= limit) return static_cast<uint8_t>(lod);
+  }
+  return 0;
+}
+
+void SimpleRenderSystem::buildDrawList(const TpScene &scene, const std::vector<uint32_t> &visible,
+                                       const TpCamera &camera) {
+  TP_PROFILE_SCOPE("SimpleRenderSystem::buildDrawList");
+  drawList.clear();
+  drawList.reserve(visible.size());
+  depthDrawList.clear();
+
+  // one material lookup per model rather than per draw
+  modelMaterials.resize(scene.modelCount());
+  modelMaterialIds.resize(scene.modelCount());
+  modelTextures.resize(scene.modelCount());
+  modelPipelines.resize(scene.modelCount());
+  for (TpModelHandle handle = 0; handle < scene.modelCount(); handle++) {
+    const TpModel &model = scene.getModel(handle);
+    if (const TpVirtualTextureCache *cache = model.getVirtualTextureCache()) {
+      const VirtualMaterial &material = getVirtualMaterial(*cache);
+      modelMaterials[handle] = material.descriptorSets[currentFrameIndex];
+      modelMaterialIds[handle] = material.id;
+      modelTextures[handle] = {0, 0, model.getVirtualTexture()};
+      modelPipelines[handle] = VIRTUAL_TEXTURE_PIPELINE;
+      continue;
+    }
+    const Material &material = getMaterial(model);
+    modelMaterials[handle] = material.descriptorSet;
+    modelMaterialIds[handle] = material.id;
+    const TpTextureRef &texture = model.getTexture();
+    modelTextures[handle] = {glm::packUnorm2x16(glm::vec2{texture.uvRect}),
+                             glm::packUnorm2x16(glm::vec2{texture.uvRect.z, texture.uvRect.w}),
+                             texture.layer};
+    modelPipelines[handle] = ATLAS_PIPELINE;
+  }
+
+  const glm::mat4 &view = camera.getView();
+  const glm::mat4 *worldMatrices = scene.worldMatrices();
+  const TpAabb *worldBounds = scene.worldBounds();
+  const TpModelHandle *modelHandles = scene.modelHandles();
+  lodSelection.resize(scene.size(), 0);
+  drawCommands.resize(scene.size());
+  clusteredIndices.resize(scene.size());
+  for (uint32_t index : visible) {
+    TpModelHandle handle = modelHandles[index];
+    const TpModel &model = scene.getModel(handle);
+    uint32_t meshId = model.getId();
+    lodSelection[index] = selectLod(model, worldMatrices[index], worldBounds[index], camera, lodSelection[index]);
+    drawCommands[index] = NO_DRAW_COMMAND;
+    clusteredIndices[index] = 0;
+
+    glm::vec3 viewPosition = view * worldMatrices[index][3];
+    uint16_t depthBucket = TpSortKey::depthBucket(glm::length(viewPosition));
+    drawList.add(TpSortKey::make(sortMode, modelPipelines[handle], modelMaterialIds[handle], meshId, depthBucket), index);
+    if (depthPrePass) {
+      depthDrawList.add(TpSortKey::make(TpDrawSortMode::FrontToBack, 0, 0, meshId, depthBucket), index);
+    }
+  }
+  drawList.sort();
+  depthDrawList.sort();
+}
+
+void SimpleRenderSystem::renderDepthPrePass(VkCommandBuffer commandBuffer, const TpScene &scene,
+                                            const glm::mat4 &viewProj) {
+  (vertexPulling ? pullDepthPrePassPipeline : depthPrePassPipeline)->bind(commandBuffer);
+  stats.pipelineBinds++;
+
+  SimplePushConstantData push{};
+  push.viewProj = viewProj;
+
+  const glm::mat4 *worldMatrices = scene.worldMatrices();
+  const TpModelHandle *modelHandles = scene.modelHandles();
+  const TpGeometryArena *boundGeometry = nullptr;
+  boundIndexBuffer = VK_NULL_HANDLE;
+  for (const auto &item : depthDrawList.items()) {
+    TpModel &model = scene.getModel(modelHandles[item.index]);
+    if (&model.getGeometry() != boundGeometry) {
+      bindGeometry(commandBuffer, model.getGeometry(), true);
+      boundGeometry = &model.getGeometry();
+      stats.prePassMeshBinds++;
+    }
+    bindDrawIndices(commandBuffer, model, clusteredIndices[item.index]);
+
+    push.setModel(worldMatrices[item.index]);
     vkCmdPushConstants(commandBuffer, pipelineLayout,
-                       VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+                       VK_SHADER_STAGE_VERTEX_BIT,
                        0,
                        sizeof(SimplePushConstantData),
                        &push);
 
-//    updateUbo(commandBuffer, uboBuffer, uboAllocation, descSet, obj, camera);
+    drawItem(commandBuffer, model, item.index);
+    stats.prePassDrawCalls++;
+  }
+}
+
+void SimpleRenderSystem::bindGeometry(VkCommandBuffer commandBuffer, const TpGeometryArena &geometry,
+                                      bool positionsOnly) {
+  if (vertexPulling) {
+    VkDescriptorSet set = getGeometrySet(geometry);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout,
+                            1, 1, &set,
+                            0, nullptr);
+    vkCmdBindIndexBuffer(commandBuffer, geometry.getIndexBuffer(), 0, VK_INDEX_TYPE_UINT32);
+  } else if (positionsOnly) {
+    geometry.bindPositions(commandBuffer);
+  } else {
+    geometry.bind(commandBuffer);
+  }
+  boundIndexBuffer = geometry.getIndexBuffer();
+}
+
+void SimpleRenderSystem::bindDrawIndices(VkCommandBuffer commandBuffer, const TpModel &model, bool clustered) {
+  VkBuffer indexBuffer = clustered ? currentIndirectFrame->indexBuffer : model.getIndexBuffer();
+  if (indexBuffer == boundIndexBuffer) return;
+  vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+  boundIndexBuffer = indexBuffer;
+}
+
+void SimpleRenderSystem::drawItem(VkCommandBuffer commandBuffer, TpModel &model, uint32_t index) {
+  uint32_t command = drawCommands[index];
+  if (command == NO_DRAW_COMMAND) {
+    model.draw(commandBuffer, lodSelection[index]);
+    return;
+  }
+  // the second phase's commands follow the first's
+  command += occlusionPhase * static_cast<uint32_t>(drawList.items().size());
+  // a single draw per indirect call, so no multiDrawIndirect feature is needed
+  vkCmdDrawIndexedIndirect(commandBuffer, currentIndirectFrame->commandBuffer,
+                           command * sizeof(VkDrawIndexedIndirectCommand), 1,
+                           sizeof(VkDrawIndexedIndirectCommand));
+}
+
+void SimpleRenderSystem::prepareFrame(VkCommandBuffer commandBuffer, int frameIndex, const TpScene &scene,
+                                      const std::vector<uint32_t> &visible, const TpCamera &camera) {
+  TP_PROFILE_SCOPE("SimpleRenderSystem::prepareFrame");
+  stats = {};
+  frameOcclusion = occlusionCulling;
+  occlusionPhase = 0;
+  frameViewProj = camera.getProjection() * camera.getView();
+  currentFrameIndex = frameIndex;
+  buildDrawList(scene, visible, camera);
+
+  if (indirectFrames.size() <= static_cast<size_t>(frameIndex)) indirectFrames.resize(frameIndex + 1);
+  currentIndirectFrame = &indirectFrames[frameIndex];
+  writeDrawCommands(commandBuffer, *currentIndirectFrame, scene);
+  cullClusters(commandBuffer, *currentIndirectFrame, scene, camera);
+  if (frameOcclusion) {
+    reserveVisibility(commandBuffer, static_cast<uint32_t>(scene.size()));
+    applyVisibilityHistory(commandBuffer, *currentIndirectFrame);
+  }
+  if (clusteredDraws.empty() && !frameOcclusion) return;
+
+  // draws read the commands and indices; the occlusion test reads the first phase's commands
+  VkMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+  vkCmdPipelineBarrier(commandBuffer,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       0,
+                       1, &barrier,
+                       0, nullptr,
+                       0, nullptr);
+}
+
+void SimpleRenderSystem::renderScene(VkCommandBuffer commandBuffer, const TpScene &scene, const TpCamera &camera) {
+  TP_PROFILE_SCOPE("SimpleRenderSystem::renderScene");
+  glm::mat4 viewProj = camera.getProjection() * camera.getView();
+  if (depthPrePass) {
+    renderDepthPrePass(commandBuffer, scene, viewProj);
+  }
+
+  SimplePushConstantData push{};
+  push.viewProj = viewProj;
+
+  const glm::mat4 *worldMatrices = scene.worldMatrices();
+  const TpModelHandle *modelHandles = scene.modelHandles();
+  uint32_t boundPipeline = PIPELINE_COUNT;
+  VkDescriptorSet boundMaterial = VK_NULL_HANDLE;
+  const TpGeometryArena *boundGeometry = nullptr;
+  boundIndexBuffer = VK_NULL_HANDLE;
+  for (const auto &item : drawList.items()) {
+    TpModelHandle handle = modelHandles[item.index];
+    TpModel &model = scene.getModel(handle);
+
+    // the pipeline is the top of the key, so every sort mode keeps draws of one pipeline together
+    uint32_t pipeline = TpSortKey::pipeline(item.key);
+    if (pipeline != boundPipeline) {
+      shadedPipelines[pipeline][vertexPulling][depthPrePass]->bind(commandBuffer);
+      boundPipeline = pipeline;
+      stats.pipelineBinds++;
+    }
+
+    VkDescriptorSet material = modelMaterials[handle];
+    if (material != boundMaterial) {
+      vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout,
+                              0, 1, &material,
+                              0, nullptr);
+      boundMaterial = material;
+      stats.materialBinds++;
+    }
+    // models of one arena share its buffers, so a scene from a single arena binds them once
+    if (&model.getGeometry() != boundGeometry) {
+      bindGeometry(commandBuffer, model.getGeometry(), false);
+      boundGeometry = &model.getGeometry();
+      stats.meshBinds++;
+    }
+    bool clustered = clusteredIndices[item.index];
+    bindDrawIndices(commandBuffer, model, clustered);
+
+    const ModelTexture &texture = modelTextures[handle];
+    push.setModel(worldMatrices[item.index]);
+    push.uvOffset = texture.uvOffset;
+    push.uvScale = texture.uvScale;
+    push.textureLayer = texture.layer;
+    vkCmdPushConstants(commandBuffer, pipelineLayout,
+                       VK_SHADER_STAGE_VERTEX_BIT,
+                       0,
+                       sizeof(SimplePushConstantData),
+                       &push);
 
-    obj.bind(frameIndex, pipelineLayout, commandBuffer);
-    obj.draw(commandBuffer);
+    drawItem(commandBuffer, model, item.index);
+    stats.recordedDraws++;
+    if (occlusionPhase > 0) continue;
+    if (clustered) stats.clusteredDrawCalls++;
+    stats.triangles += model.getLod(lodSelection[item.index]).indexCount / 3;
   }
 }
 
-}  // namespace teapot
\ No newline at end of file
+}  // namespace teapot
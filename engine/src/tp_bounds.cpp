@@ -0,0 +1,72 @@
+#include "tp_bounds.h"
+
+namespace teapot {
+
+TpAabb TpAabb::transformed(const glm::mat4 &transform) const {
+  if (isEmpty()) return *this;
+
+  glm::vec3 c = transform * glm::vec4{center(), 1.f};
+  glm::vec3 e = extent();
+  glm::vec3 worldExtent{
+      glm::abs(transform[0][0]) * e.x + glm::abs(transform[1][0]) * e.y + glm::abs(transform[2][0]) * e.z,
+      glm::abs(transform[0][1]) * e.x + glm::abs(transform[1][1]) * e.y + glm::abs(transform[2][1]) * e.z,
+      glm::abs(transform[0][2]) * e.x + glm::abs(transform[1][2]) * e.y + glm::abs(transform[2][2]) * e.z};
+  return {c - worldExtent, c + worldExtent};
+}
+
+bool TpAabb::intersectRay(const glm::vec3 &origin, const glm::vec3 &inverseDirection, float maxDistance,
+                          float &distance) const {
+  glm::vec3 t0 = (min - origin) * inverseDirection;
+  glm::vec3 t1 = (max - origin) * inverseDirection;
+  glm::vec3 tMin = glm::min(t0, t1);
+  glm::vec3 tMax = glm::max(t0, t1);
+  float enter = glm::max(glm::max(tMin.x, tMin.y), glm::max(tMin.z, 0.f));
+  float leave = glm::min(glm::min(tMax.x, tMax.y), glm::min(tMax.z, maxDistance));
+  distance = enter;
+  return enter <= leave;
+}
+
+TpFrustum::TpFrustum(const glm::mat4 &viewProj) {
+  glm::vec4 row0{viewProj[0][0], viewProj[1][0], viewProj[2][0], viewProj[3][0]};
+  glm::vec4 row1{viewProj[0][1], viewProj[1][1], viewProj[2][1], viewProj[3][1]};
+  glm::vec4 row2{viewProj[0][2], viewProj[1][2], viewProj[2][2], viewProj[3][2]};
+  glm::vec4 row3{viewProj[0][3], viewProj[1][3], viewProj[2][3], viewProj[3][3]};
+
+  planes[0] = row3 + row0;  // left
+  planes[1] = row3 - row0;  // right
+  planes[2] = row3 + row1;  // top / bottom, y points down in clip space
+  planes[3] = row3 - row1;
+  planes[4] = row2;         // near, depth is [0, 1]
+  planes[5] = row3 - row2;  // far
+
+  for (auto &plane : planes) {
+    plane /= glm::length(glm::vec3{plane});
+  }
+}
+
+bool TpFrustum::intersects(const TpAabb &box) const {
+  glm::vec3 c = box.center();
+  glm::vec3 e = box.extent();
+  for (const auto &plane : planes) {
+    glm::vec3 normal{plane};
+    float radius = glm::dot(e, glm::abs(normal));
+    if (glm::dot(normal, c) + plane.w < -radius) return false;
+  }
+  return true;
+}
+
+TpFrustumTest TpFrustum::classify(const TpAabb &box) const {
+  glm::vec3 c = box.center();
+  glm::vec3 e = box.extent();
+  auto result = TpFrustumTest::Inside;
+  for (const auto &plane : planes) {
+    glm::vec3 normal{plane};
+    float radius = glm::dot(e, glm::abs(normal));
+    float distance = glm::dot(normal, c) + plane.w;
+    if (distance < -radius) return TpFrustumTest::Outside;
+    if (distance < radius) result = TpFrustumTest::Intersects;
+  }
+  return result;
+}
+
+}  // namespace teapot
@@ -0,0 +1,303 @@
+#include "tp_bvh.h"
+#include "tp_cpu_profiler.h"
+
+// std
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <numeric>
+
+namespace teapot {
+
+namespace {
+
+constexpr int BIN_COUNT = 16;
+// cost of visiting a node relative to testing one primitive box
+constexpr float TRAVERSAL_COST = 1.f;
+// below this many primitives a parallel cull is not worth the task setup
+constexpr size_t PARALLEL_CULL_THRESHOLD = 16384;
+
+struct Bin {
+  TpAabb bounds;
+  uint32_t count = 0;
+};
+
+}  // namespace
+
+void TpBvh::clear() {
+  nodes.clear();
+  primitives.clear();
+  sahCost = 0.f;
+  builtSahCost = 0.f;
+}
+
+void TpBvh::build(const TpAabb *bounds, size_t count) {
+  TP_PROFILE_SCOPE("TpBvh::build");
+  clear();
+  if (count == 0) return;
+
+  primitives.resize(count);
+  std::iota(primitives.begin(), primitives.end(), 0u);
+  std::vector<glm::vec3> centroids(count);
+  for (size_t i = 0; i < count; i++) centroids[i] = bounds[i].center();
+
+  nodes.reserve(2 * count / MAX_LEAF_SIZE + 1);
+  nodes.push_back({{}, 0, static_cast<uint32_t>(count)});
+  std::vector<uint32_t> stack{0};
+  while (!stack.empty()) {
+    uint32_t nodeIndex = stack.back();
+    stack.pop_back();
+    uint32_t first = nodes[nodeIndex].first;
+    uint32_t primitiveCount = nodes[nodeIndex].count;
+    auto begin = primitives.begin() + first;
+    auto end = begin + primitiveCount;
+
+    TpAabb nodeBounds;
+    TpAabb centroidBounds;
+    for (auto it = begin; it != end; ++it) {
+      nodeBounds.expand(bounds[*it]);
+      centroidBounds.expand(centroids[*it]);
+    }
+    nodes[nodeIndex].bounds = nodeBounds;
+    if (primitiveCount == 1) continue;
+
+    // binned SAH over the centroid bounds: the cheapest plane between bins on any axis
+    int bestAxis = -1;
+    int bestSplit = 0;
+    float bestCost = std::numeric_limits<float>::max();
+    glm::vec3 centroidSize = centroidBounds.max - centroidBounds.min;
+    for (int axis = 0; axis < 3; axis++) {
+      if (centroidSize[axis] <= 0.f) continue;
+      float scale = BIN_COUNT / centroidSize[axis];
+      auto binOf = [&](uint32_t primitive) {
+        int bin = static_cast<int>((centroids[primitive][axis] - centroidBounds.min[axis]) * scale);
+        return std::min(bin, BIN_COUNT - 1);
+      };
+
+      std::array<Bin, BIN_COUNT> bins{};
+      for (auto it = begin; it != end; ++it) {
+        auto &bin = bins[binOf(*it)];
+        bin.bounds.expand(bounds[*it]);
+        bin.count++;
+      }
+
+      // costs of everything right of each plane, then sweep from the left
+      std::array<float, BIN_COUNT> rightCost{};
+      TpAabb right;
+      uint32_t rightCount = 0;
+      for (int plane = BIN_COUNT - 1; plane > 0; plane--) {
+        right.expand(bins[plane].bounds);
+        rightCount += bins[plane].count;
+        rightCost[plane] = right.surfaceArea() * rightCount;
+      }
+      TpAabb left;
+      uint32_t leftCount = 0;
+      for (int plane = 1; plane < BIN_COUNT; plane++) {
+        left.expand(bins[plane - 1].bounds);
+        leftCount += bins[plane - 1].count;
+        float cost = left.surfaceArea() * leftCount + rightCost[plane];
+        if (leftCount > 0 && leftCount < primitiveCount && cost < bestCost) {
+          bestCost = cost;
+          bestAxis = axis;
+          bestSplit = plane;
+        }
+      }
+    }
+
+    // without a usable plane (all centroids in one spot) halve by index so leaves stay small
+    auto middle = begin + primitiveCount / 2;
+    if (bestAxis >= 0) {
+      float leafCost = nodeBounds.surfaceArea() * primitiveCount;
+      float splitCost = TRAVERSAL_COST * nodeBounds.surfaceArea() + bestCost;
+      if (primitiveCount <= MAX_LEAF_SIZE && splitCost >= leafCost) continue;
+
+      float scale = BIN_COUNT / centroidSize[bestAxis];
+      middle = std::partition(begin, end, [&](uint32_t primitive) {
+        int bin = static_cast<int>((centroids[primitive][bestAxis] - centroidBounds.min[bestAxis]) * scale);
+        return std::min(bin, BIN_COUNT - 1) < bestSplit;
+      });
+    } else if (primitiveCount <= MAX_LEAF_SIZE) {
+      continue;
+    }
+
+    auto leftChild = static_cast<uint32_t>(nodes.size());
+    auto leftCount = static_cast<uint32_t>(middle - begin);
+    nodes.push_back({{}, first, leftCount});
+    nodes.push_back({{}, first + leftCount, primitiveCount - leftCount});
+    nodes[nodeIndex].first = leftChild;
+    nodes[nodeIndex].count = 0;
+    stack.push_back(leftChild);
+    stack.push_back(leftChild + 1);
+  }
+
+  sahCost = computeSahCost();
+  builtSahCost = sahCost;
+}
+
+void TpBvh::refit(const TpAabb *bounds) {
+  TP_PROFILE_SCOPE("TpBvh::refit");
+  for (size_t i = nodes.size(); i-- > 0;) {
+    auto &node = nodes[i];
+    TpAabb nodeBounds;
+    if (node.count > 0) {
+      for (uint32_t k = node.first; k < node.first + node.count; k++) nodeBounds.expand(bounds[primitives[k]]);
+    } else {
+      nodeBounds = nodes[node.first].bounds;
+      nodeBounds.expand(nodes[node.first + 1].bounds);
+    }
+    node.bounds = nodeBounds;
+  }
+  sahCost = computeSahCost();
+}
+
+float TpBvh::computeSahCost() const {
+  if (nodes.empty() || nodes[0].bounds.surfaceArea() <= 0.f) return 0.f;
+  float cost = 0.f;
+  for (const auto &node : nodes) {
+    cost += node.bounds.surfaceArea() * (node.count > 0 ? static_cast<float>(node.count) : TRAVERSAL_COST);
+  }
+  return cost / nodes[0].bounds.surfaceArea();
+}
+
+void TpBvh::appendSubtree(uint32_t node, std::vector<uint32_t> &out) const {
+  std::vector<uint32_t> stack{node};
+  while (!stack.empty()) {
+    const auto &current = nodes[stack.back()];
+    stack.pop_back();
+    if (current.count > 0) {
+      out.insert(out.end(), primitives.begin() + current.first, primitives.begin() + current.first + current.count);
+    } else {
+      stack.push_back(current.first);
+      stack.push_back(current.first + 1);
+    }
+  }
+}
+
+void TpBvh::cullSubtree(uint32_t root, const TpFrustum &frustum, const TpAabb *bounds,
+                        std::vector<uint32_t> &out) const {
+  std::vector<uint32_t> stack{root};
+  while (!stack.empty()) {
+    uint32_t nodeIndex = stack.back();
+    stack.pop_back();
+    const auto &node = nodes[nodeIndex];
+
+    auto test = frustum.classify(node.bounds);
+    if (test == TpFrustumTest::Outside) continue;
+    if (test == TpFrustumTest::Inside) {
+      appendSubtree(nodeIndex, out);
+    } else if (node.count > 0) {
+      for (uint32_t k = node.first; k < node.first + node.count; k++) {
+        if (frustum.intersects(bounds[primitives[k]])) out.push_back(primitives[k]);
+      }
+    } else {
+      stack.push_back(node.first);
+      stack.push_back(node.first + 1);
+    }
+  }
+}
+
+void TpBvh::cullFrustum(const TpFrustum &frustum, const TpAabb *bounds, std::vector<uint32_t> &out,
+                        TpThreadPool *pool) const {
+  if (nodes.empty()) return;
+  if (pool == nullptr || pool->threadCount() == 1 || primitives.size() < PARALLEL_CULL_THRESHOLD) {
+    cullSubtree(0, frustum, bounds, out);
+    return;
+  }
+
+  // open up the top of the tree until there are a few subtrees per thread
+  std::vector<uint32_t> roots{0};
+  size_t targetRoots = static_cast<size_t>(pool->threadCount()) * 4;
+  bool expanded = true;
+  while (expanded && roots.size() < targetRoots) {
+    expanded = false;
+    std::vector<uint32_t> next;
+    for (uint32_t root : roots) {
+      const auto &node = nodes[root];
+      if (node.count > 0) {
+        next.push_back(root);
+      } else {
+        expanded = true;
+        if (frustum.classify(node.bounds) != TpFrustumTest::Outside) {
+          next.push_back(node.first);
+          next.push_back(node.first + 1);
+        }
+      }
+    }
+    roots.swap(next);
+  }
+
+  std::vector<std::vector<uint32_t>> results(roots.size());
+  pool->parallelFor(roots.size(), 1, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) cullSubtree(roots[i], frustum, bounds, results[i]);
+  });
+  for (const auto &result : results) out.insert(out.end(), result.begin(), result.end());
+}
+
+bool TpBvh::raycast(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, const TpAabb *bounds,
+                    TpRayHit &hit) const {
+  hit = TpRayHit{UINT32_MAX, maxDistance};
+  if (nodes.empty()) return false;
+
+  glm::vec3 inverseDirection = 1.f / direction;
+  float distance;
+  if (!nodes[0].bounds.intersectRay(origin, inverseDirection, maxDistance, distance)) return false;
+
+  struct Entry {
+    uint32_t node;
+    float distance;
+  };
+  std::vector<Entry> stack{{0, distance}};
+  while (!stack.empty()) {
+    Entry entry = stack.back();
+    stack.pop_back();
+    if (entry.distance > hit.distance) continue;
+
+    const auto &node = nodes[entry.node];
+    if (node.count > 0) {
+      for (uint32_t k = node.first; k < node.first + node.count; k++) {
+        if (bounds[primitives[k]].intersectRay(origin, inverseDirection, hit.distance, distance) &&
+            (distance < hit.distance || hit.index == UINT32_MAX)) {
+          hit = {primitives[k], distance};
+        }
+      }
+      continue;
+    }
+
+    // visit the nearer child first
+    float leftDistance;
+    float rightDistance;
+    bool leftHit = nodes[node.first].bounds.intersectRay(origin, inverseDirection, hit.distance, leftDistance);
+    bool rightHit = nodes[node.first + 1].bounds.intersectRay(origin, inverseDirection, hit.distance, rightDistance);
+    if (leftHit && rightHit) {
+      bool leftFirst = leftDistance <= rightDistance;
+      stack.push_back(leftFirst ? Entry{node.first + 1, rightDistance} : Entry{node.first, leftDistance});
+      stack.push_back(leftFirst ? Entry{node.first, leftDistance} : Entry{node.first + 1, rightDistance});
+    } else if (leftHit) {
+      stack.push_back({node.first, leftDistance});
+    } else if (rightHit) {
+      stack.push_back({node.first + 1, rightDistance});
+    }
+  }
+  return hit.index != UINT32_MAX;
+}
+
+void TpBvh::overlap(const TpAabb &box, const TpAabb *bounds, std::vector<uint32_t> &out) const {
+  if (nodes.empty()) return;
+  std::vector<uint32_t> stack{0};
+  while (!stack.empty()) {
+    const auto &node = nodes[stack.back()];
+    stack.pop_back();
+    if (!node.bounds.overlaps(box)) continue;
+
+    if (node.count > 0) {
+      for (uint32_t k = node.first; k < node.first + node.count; k++) {
+        if (bounds[primitives[k]].overlaps(box)) out.push_back(primitives[k]);
+      }
+    } else {
+      stack.push_back(node.first);
+      stack.push_back(node.first + 1);
+    }
+  }
+}
+
+}  // namespace teapot
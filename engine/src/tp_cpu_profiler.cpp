@@ -0,0 +1,180 @@
+#include "tp_cpu_profiler.h"
+
+// std
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace teapot {
+
+std::atomic<bool> TpCpuProfiler::enabledFlag{false};
+
+namespace {
+
+struct CpuEvent {
+  const char *name;
+  uint64_t startNs;
+  uint64_t endNs;
+  bool instant;
+};
+
+// A ring slot guarded by its own sequence: odd while the owner writes event n into it (2n + 1),
+// 2n + 2 once that event is complete. The fields are relaxed atomics so a reader racing the
+// owner reads stale values rather than undefined ones, and the sequence tells it to drop them.
+struct EventSlot {
+  std::atomic<uint64_t> sequence{0};
+  std::atomic<const char *> name{nullptr};
+  std::atomic<uint64_t> startNs{0};
+  std::atomic<uint64_t> endNs{0};
+  std::atomic<bool> instant{false};
+};
+
+// Only the owning thread writes events and advances written, so recording takes no lock. Readers
+// copy the slots of the published range and drop those the owner rewrote during the copy.
+struct ThreadBuffer {
+  uint32_t threadId;
+  std::unique_ptr<EventSlot[]> slots = std::make_unique<EventSlot[]>(TpCpuProfiler::EVENTS_PER_THREAD);
+  std::atomic<uint64_t> written{0};  // events ever pushed
+  std::atomic<uint64_t> cleared{0};  // written when clear was last called
+
+  void push(const CpuEvent &event) {
+    uint64_t index = written.load(std::memory_order_relaxed);
+    EventSlot &slot = slots[index % TpCpuProfiler::EVENTS_PER_THREAD];
+    slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.name.store(event.name, std::memory_order_relaxed);
+    slot.startNs.store(event.startNs, std::memory_order_relaxed);
+    slot.endNs.store(event.endNs, std::memory_order_relaxed);
+    slot.instant.store(event.instant, std::memory_order_relaxed);
+    slot.sequence.store(2 * index + 2, std::memory_order_release);
+    written.store(index + 1, std::memory_order_release);
+  }
+
+  std::vector<CpuEvent> snapshot() const {
+    uint64_t size = TpCpuProfiler::EVENTS_PER_THREAD;
+    uint64_t end = written.load(std::memory_order_acquire);
+    uint64_t begin = std::max(cleared.load(std::memory_order_relaxed), end > size ? end - size : 0);
+    std::vector<CpuEvent> copied;
+    copied.reserve(static_cast<size_t>(end - begin));
+    for (uint64_t i = begin; i < end; i++) {
+      const EventSlot &slot = slots[i % size];
+      // anything but 2i + 2 is a later event being written or already written over event i
+      if (slot.sequence.load(std::memory_order_acquire) != 2 * i + 2) continue;
+      CpuEvent event{slot.name.load(std::memory_order_relaxed), slot.startNs.load(std::memory_order_relaxed),
+                     slot.endNs.load(std::memory_order_relaxed), slot.instant.load(std::memory_order_relaxed)};
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.sequence.load(std::memory_order_relaxed) != 2 * i + 2) continue;
+      copied.push_back(event);
+    }
+    return copied;
+  }
+};
+
+struct Registry {
+  std::mutex mutex;
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+  uint32_t nextThreadId = 1;
+};
+
+Registry &registry() {
+  static Registry instance;
+  return instance;
+}
+
+ThreadBuffer &threadBuffer() {
+  thread_local std::shared_ptr<ThreadBuffer> buffer = [] {
+    auto created = std::make_shared<ThreadBuffer>();
+
+    auto &reg = registry();
+    std::lock_guard<std::mutex> lock{reg.mutex};
+    created->threadId = reg.nextThreadId++;
+    reg.buffers.push_back(created);
+    return created;
+  }();
+  return *buffer;
+}
+
+void writeEscaped(std::ostream &out, const char *text) {
+  for (const char *c = text; *c != '\0'; c++) {
+    switch (*c) {
+      case '"': out << "\\\""; break;
+      case '\\': out << "\\\\"; break;
+      case '\n': out << "\\n"; break;
+      default:
+        if (static_cast<unsigned char>(*c) < 0x20) {
+          char escaped[8];
+          std::snprintf(escaped, sizeof(escaped), "\\u%04x", *c);
+          out << escaped;
+        } else {
+          out << *c;
+        }
+    }
+  }
+}
+
+}  // namespace
+
+void TpCpuProfiler::recordZone(const char *name, uint64_t startNs, uint64_t endNs) {
+  threadBuffer().push({name, startNs, endNs, false});
+}
+
+void TpCpuProfiler::markFrame() {
+  if (!isEnabled()) return;
+  uint64_t timestamp = now();
+  threadBuffer().push({"Frame", timestamp, timestamp, true});
+}
+
+bool TpCpuProfiler::exportChromeTrace(const std::string &filePath) {
+  std::ofstream out{filePath};
+  if (!out.is_open()) return false;
+
+  auto &reg = registry();
+  std::lock_guard<std::mutex> registryLock{reg.mutex};
+
+  // Chrome wants microseconds; rebase on the oldest event to keep the numbers readable.
+  uint64_t origin = UINT64_MAX;
+  std::vector<std::pair<uint32_t, std::vector<CpuEvent>>> snapshots;
+  for (auto &buffer : reg.buffers) {
+    std::vector<CpuEvent> events = buffer->snapshot();
+    for (const auto &event : events) origin = std::min(origin, event.startNs);
+    snapshots.emplace_back(buffer->threadId, std::move(events));
+  }
+
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  char number[64];
+  for (const auto &snapshot : snapshots) {
+    for (const auto &event : snapshot.second) {
+      out << (first ? "\n" : ",\n");
+      first = false;
+
+      out << "{\"name\":\"";
+      writeEscaped(out, event.name);
+      std::snprintf(number, sizeof(number), "%.3f", static_cast<double>(event.startNs - origin) / 1000.0);
+      out << "\",\"cat\":\"teapot\",\"pid\":1,\"tid\":" << snapshot.first << ",\"ts\":" << number;
+      if (event.instant) {
+        out << ",\"ph\":\"i\",\"s\":\"g\"}";
+      } else {
+        std::snprintf(number, sizeof(number), "%.3f", static_cast<double>(event.endNs - event.startNs) / 1000.0);
+        out << ",\"ph\":\"X\",\"dur\":" << number << "}";
+      }
+    }
+  }
+  out << "\n]}\n";
+  return out.good();
+}
+
+void TpCpuProfiler::clear() {
+  auto &reg = registry();
+  std::lock_guard<std::mutex> registryLock{reg.mutex};
+  // the owners keep writing, so clearing only moves where snapshots start
+  for (auto &buffer : reg.buffers) {
+    buffer->cleared.store(buffer->written.load(std::memory_order_acquire), std::memory_order_relaxed);
+  }
+}
+
+}  // namespace teapot
@@ -0,0 +1,300 @@
+#include "tp_depth_pyramid.h"
+#include "tp_swap_chain.h"
+
+// std
+#include <algorithm>
+#include <stdexcept>
+
+namespace teapot {
+
+namespace {
+
+constexpr uint32_t REDUCE_GROUP_SIZE = 8;
+
+// matches the push block of depth_pyramid.comp
+struct ReducePushConstantData {
+  uint32_t sourceSize[2];
+  uint32_t destinationSize[2];
+};
+
+uint32_t previousPowerOfTwo(uint32_t value) {
+  uint32_t result = 1;
+  while (result * 2 <= value) result *= 2;
+  return result;
+}
+
+}  // namespace
+
+TpDepthPyramid::TpDepthPyramid(TpDevice &device) : tpDevice{device} {
+  createDescriptorSetLayout();
+  createPipeline();
+  createSampler();
+}
+
+TpDepthPyramid::~TpDepthPyramid() {
+  for (auto &frame : frames) {
+    for (auto view : frame.levelViews) vkDestroyImageView(tpDevice.device(), view, nullptr);
+    if (frame.image != VK_NULL_HANDLE) {
+      vkDestroyImageView(tpDevice.device(), frame.view, nullptr);
+      vmaDestroyImage(tpDevice.allocator(), frame.image, frame.allocation);
+    }
+  }
+  vkDestroySampler(tpDevice.device(), sampler, nullptr);
+  vkDestroyDescriptorPool(tpDevice.device(), descriptorPool, nullptr);
+  vkDestroyPipelineLayout(tpDevice.device(), pipelineLayout, nullptr);
+  vkDestroyDescriptorSetLayout(tpDevice.device(), descriptorSetLayout, nullptr);
+}
+
+void TpDepthPyramid::createDescriptorSetLayout() {
+  std::array<VkDescriptorSetLayoutBinding, 2> bindings{};
+  bindings[0].binding = 0;
+  bindings[0].descriptorCount = 1;
+  bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  bindings[1].binding = 1;
+  bindings[1].descriptorCount = 1;
+  bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+  VkDescriptorSetLayoutCreateInfo layoutInfo{};
+  layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+  layoutInfo.pBindings = bindings.data();
+  if (vkCreateDescriptorSetLayout(tpDevice.device(), &layoutInfo, nullptr, &descriptorSetLayout) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create depth pyramid descriptor layout");
+  }
+
+  // a set per level of every frame in flight, allocated once
+  constexpr uint32_t maxSets = TpSwapChain::MAX_FRAMES_IN_FLIGHT * MAX_LEVELS;
+  std::array<VkDescriptorPoolSize, 2> poolSizes{};
+  poolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  poolSizes[0].descriptorCount = maxSets;
+  poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  poolSizes[1].descriptorCount = maxSets;
+
+  VkDescriptorPoolCreateInfo poolInfo{};
+  poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+  poolInfo.pPoolSizes = poolSizes.data();
+  poolInfo.maxSets = maxSets;
+  if (vkCreateDescriptorPool(tpDevice.device(), &poolInfo, nullptr, &descriptorPool) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create depth pyramid descriptor pool");
+  }
+}
+
+void TpDepthPyramid::createPipeline() {
+  VkPushConstantRange pushConstantRange{};
+  pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  pushConstantRange.size = sizeof(ReducePushConstantData);
+  pushConstantRange.offset = 0;
+
+  VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+  pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipelineLayoutInfo.setLayoutCount = 1;
+  pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
+  pipelineLayoutInfo.pushConstantRangeCount = 1;
+  pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+  if (vkCreatePipelineLayout(tpDevice.device(), &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create depth pyramid pipeline layout");
+  }
+
+  reducePipeline = std::make_unique<TpPipeline>(
+          tpDevice,
+          "assets/shaders/depth_pyramid.comp.spv",
+          pipelineLayout);
+}
+
+void TpDepthPyramid::createSampler() {
+  // texels are fetched, never filtered
+  VkSamplerCreateInfo samplerInfo{};
+  samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  samplerInfo.magFilter = VK_FILTER_NEAREST;
+  samplerInfo.minFilter = VK_FILTER_NEAREST;
+  samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerInfo.minLod = 0.0f;
+  samplerInfo.maxLod = static_cast<float>(MAX_LEVELS);
+  if (vkCreateSampler(tpDevice.device(), &samplerInfo, nullptr, &sampler) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create depth pyramid sampler");
+  }
+}
+
+void TpDepthPyramid::allocateDescriptorSets(Frame &frame) {
+  std::array<VkDescriptorSetLayout, MAX_LEVELS> layouts;
+  layouts.fill(descriptorSetLayout);
+
+  VkDescriptorSetAllocateInfo allocInfo{};
+  allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  allocInfo.descriptorPool = descriptorPool;
+  allocInfo.descriptorSetCount = MAX_LEVELS;
+  allocInfo.pSetLayouts = layouts.data();
+  if (vkAllocateDescriptorSets(tpDevice.device(), &allocInfo, frame.descriptorSets.data()) != VK_SUCCESS) {
+    throw std::runtime_error("failed to allocate depth pyramid descriptor sets");
+  }
+}
+
+void TpDepthPyramid::createImage(Frame &frame, VkExtent2D extent) {
+  frame.extent = extent;
+  frame.levelCount = 1;
+  while ((extent.width >> frame.levelCount) > 0 || (extent.height >> frame.levelCount) > 0) frame.levelCount++;
+
+  VkImageCreateInfo imageInfo{};
+  imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  imageInfo.imageType = VK_IMAGE_TYPE_2D;
+  imageInfo.extent.width = extent.width;
+  imageInfo.extent.height = extent.height;
+  imageInfo.extent.depth = 1;
+  imageInfo.mipLevels = frame.levelCount;
+  imageInfo.arrayLayers = 1;
+  imageInfo.format = VK_FORMAT_R32_SFLOAT;
+  imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+  imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+  imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+  imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  tpDevice.createImageWithInfo(imageInfo, VMA_MEMORY_USAGE_GPU_ONLY, frame.image, frame.allocation);
+
+  VkImageViewCreateInfo viewInfo{};
+  viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  viewInfo.image = frame.image;
+  viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  viewInfo.format = VK_FORMAT_R32_SFLOAT;
+  viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  viewInfo.subresourceRange.baseMipLevel = 0;
+  viewInfo.subresourceRange.levelCount = frame.levelCount;
+  viewInfo.subresourceRange.baseArrayLayer = 0;
+  viewInfo.subresourceRange.layerCount = 1;
+  if (vkCreateImageView(tpDevice.device(), &viewInfo, nullptr, &frame.view) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create depth pyramid view");
+  }
+
+  frame.levelViews.resize(frame.levelCount);
+  for (uint32_t level = 0; level < frame.levelCount; level++) {
+    viewInfo.subresourceRange.baseMipLevel = level;
+    viewInfo.subresourceRange.levelCount = 1;
+    if (vkCreateImageView(tpDevice.device(), &viewInfo, nullptr, &frame.levelViews[level]) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create depth pyramid level view");
+    }
+  }
+
+  // level 0's source is the depth attachment, written by build
+  for (uint32_t level = 0; level < frame.levelCount; level++) {
+    VkDescriptorImageInfo sourceInfo{sampler, level > 0 ? frame.levelViews[level - 1] : VK_NULL_HANDLE,
+                                     VK_IMAGE_LAYOUT_GENERAL};
+    VkDescriptorImageInfo destinationInfo{VK_NULL_HANDLE, frame.levelViews[level], VK_IMAGE_LAYOUT_GENERAL};
+
+    std::array<VkWriteDescriptorSet, 2> writes{};
+    writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[0].dstSet = frame.descriptorSets[level];
+    writes[0].dstBinding = 0;
+    writes[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    writes[0].descriptorCount = 1;
+    writes[0].pImageInfo = &sourceInfo;
+    writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[1].dstSet = frame.descriptorSets[level];
+    writes[1].dstBinding = 1;
+    writes[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    writes[1].descriptorCount = 1;
+    writes[1].pImageInfo = &destinationInfo;
+    vkUpdateDescriptorSets(tpDevice.device(), level > 0 ? 2 : 1, level > 0 ? writes.data() : &writes[1], 0, nullptr);
+  }
+}
+
+void TpDepthPyramid::destroyImage(Frame &frame) {
+  if (frame.image == VK_NULL_HANDLE) return;
+  VkDevice device = tpDevice.device();
+  VmaAllocator allocator = tpDevice.allocator();
+  VkImage image = frame.image;
+  VmaAllocation allocation = frame.allocation;
+  std::vector<VkImageView> views = frame.levelViews;
+  views.push_back(frame.view);
+  tpDevice.deferDestroy(tpDevice.lastSubmittedGraphicsValue(), [=]() {
+    for (auto view : views) vkDestroyImageView(device, view, nullptr);
+    vmaDestroyImage(allocator, image, allocation);
+  });
+  frame.image = VK_NULL_HANDLE;
+  frame.view = VK_NULL_HANDLE;
+  frame.levelViews.clear();
+}
+
+void TpDepthPyramid::build(VkCommandBuffer commandBuffer, int frameIndex, VkImageView depthView,
+                           VkExtent2D depthExtent) {
+  if (frames.size() <= static_cast<size_t>(frameIndex)) frames.resize(frameIndex + 1);
+  Frame &frame = frames[frameIndex];
+  if (frame.descriptorSets[0] == VK_NULL_HANDLE) allocateDescriptorSets(frame);
+
+  VkExtent2D extent{previousPowerOfTwo(depthExtent.width), previousPowerOfTwo(depthExtent.height)};
+  if (frame.image == VK_NULL_HANDLE || extent.width != frame.extent.width || extent.height != frame.extent.height) {
+    destroyImage(frame);
+    createImage(frame, extent);
+  }
+
+  // the depth image changes with the swap chain, so level 0 is pointed at it every frame
+  VkDescriptorImageInfo depthInfo{sampler, depthView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+  VkWriteDescriptorSet depthWrite{};
+  depthWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  depthWrite.dstSet = frame.descriptorSets[0];
+  depthWrite.dstBinding = 0;
+  depthWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  depthWrite.descriptorCount = 1;
+  depthWrite.pImageInfo = &depthInfo;
+  vkUpdateDescriptorSets(tpDevice.device(), 1, &depthWrite, 0, nullptr);
+
+  // every level is rewritten, so the old contents are discarded
+  VkImageMemoryBarrier toGeneral{};
+  toGeneral.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  toGeneral.srcAccessMask = 0;
+  toGeneral.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  toGeneral.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  toGeneral.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+  toGeneral.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  toGeneral.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  toGeneral.image = frame.image;
+  toGeneral.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, frame.levelCount, 0, 1};
+  vkCmdPipelineBarrier(commandBuffer,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       0,
+                       0, nullptr,
+                       0, nullptr,
+                       1, &toGeneral);
+
+  reducePipeline->bind(commandBuffer);
+  VkMemoryBarrier levelBarrier{};
+  levelBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  levelBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  levelBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+  ReducePushConstantData push{{depthExtent.width, depthExtent.height}, {extent.width, extent.height}};
+  for (uint32_t level = 0; level < frame.levelCount; level++) {
+    push.destinationSize[0] = std::max(extent.width >> level, 1u);
+    push.destinationSize[1] = std::max(extent.height >> level, 1u);
+
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout,
+                            0, 1, &frame.descriptorSets[level],
+                            0, nullptr);
+    vkCmdPushConstants(commandBuffer, pipelineLayout,
+                       VK_SHADER_STAGE_COMPUTE_BIT,
+                       0,
+                       sizeof(ReducePushConstantData),
+                       &push);
+    vkCmdDispatch(commandBuffer,
+                  (push.destinationSize[0] + REDUCE_GROUP_SIZE - 1) / REDUCE_GROUP_SIZE,
+                  (push.destinationSize[1] + REDUCE_GROUP_SIZE - 1) / REDUCE_GROUP_SIZE,
+                  1);
+    vkCmdPipelineBarrier(commandBuffer,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0,
+                         1, &levelBarrier,
+                         0, nullptr,
+                         0, nullptr);
+
+    push.sourceSize[0] = push.destinationSize[0];
+    push.sourceSize[1] = push.destinationSize[1];
+  }
+}
+
+}  // namespace teapot
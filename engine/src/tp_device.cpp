@@ -1,13 +1,67 @@
 #include "tp_device.h"
+#include "tp_image_layout.h"
 
 // std headers
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <set>
+#include <stdexcept>
 #include <unordered_set>
 
 namespace teapot {
 
+namespace {
+
+// how often defragmentStep looks at the static geometry pool when not defragmenting
+constexpr uint32_t FRAGMENTATION_CHECK_INTERVAL = 120;
+// the pool is defragmented above this fragmentation, when at least this much is free
+constexpr float DEFRAGMENT_FRAGMENTATION = 0.5f;
+constexpr VkDeviceSize DEFRAGMENT_MIN_FREE_BYTES = VkDeviceSize{16} << 20;
+// a pass waits for its copies, so it is kept short; allocations larger than this stay where
+// they are
+constexpr VkDeviceSize DEFRAGMENT_BYTES_PER_PASS = VkDeviceSize{32} << 20;
+constexpr uint32_t DEFRAGMENT_ALLOCATIONS_PER_PASS = 16;
+
+// the usage the owners of a class allocate with, which also picks the memory type of its pool
+VmaMemoryUsage memoryClassUsage(TpMemoryClass memoryClass) {
+  switch (memoryClass) {
+    case TpMemoryClass::Dynamic:
+      return VMA_MEMORY_USAGE_CPU_TO_GPU;
+    case TpMemoryClass::Staging:
+      return VMA_MEMORY_USAGE_CPU_ONLY;
+    default:
+      return VMA_MEMORY_USAGE_GPU_ONLY;
+  }
+}
+
+VkBufferUsageFlags memoryClassBufferUsage(TpMemoryClass memoryClass) {
+  switch (memoryClass) {
+    case TpMemoryClass::StaticGeometry:
+      return VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+             VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+             VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    case TpMemoryClass::Dynamic:
+      return VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+             VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+    default:
+      return VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  }
+}
+
+}  // namespace
+
+const char *memoryClassName(TpMemoryClass memoryClass) {
+  switch (memoryClass) {
+    case TpMemoryClass::Default: return "default";
+    case TpMemoryClass::StaticGeometry: return "staticGeometry";
+    case TpMemoryClass::Textures: return "textures";
+    case TpMemoryClass::Dynamic: return "dynamic";
+    case TpMemoryClass::Staging: return "staging";
+  }
+  return "unknown";
+}
+
 // local callback functions
 static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(
     VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
@@ -55,10 +109,24 @@ TpDevice::TpDevice(TpWindow &window) : window{window} {
   createLogicalDevice();
   initializeAllocator();
   createCommandPool();
+  createGraphicsTimeline();
 }
 
 TpDevice::~TpDevice() {
+  vkDeviceWaitIdle(device_);
+  while (!deferredDestruction.empty()) {
+    auto pending = std::move(deferredDestruction);
+    deferredDestruction.clear();
+    for (auto &entry : pending) {
+      entry.second();
+    }
+  }
+
+  vkDestroySemaphore(device_, graphicsTimeline, nullptr);
   vkDestroyCommandPool(device_, commandPool, nullptr);
+  for (VmaPool pool : memoryPools) {
+    if (pool != VK_NULL_HANDLE) vmaDestroyPool(allocator_, pool);
+  }
   vmaDestroyAllocator(allocator_);
   vkDestroyDevice(device_, nullptr);
 
@@ -150,14 +218,23 @@ void TpDevice::createLogicalDevice() {
     queueCreateInfos.push_back(queueCreateInfo);
   }
 
+  VkPhysicalDeviceFeatures supportedFeatures;
+  vkGetPhysicalDeviceFeatures(physicalDevices[0], &supportedFeatures);
+  fragmentStores = supportedFeatures.fragmentStoresAndAtomics == VK_TRUE;
+
   VkPhysicalDeviceFeatures deviceFeatures = {};
   deviceFeatures.samplerAnisotropy = VK_TRUE;
+  deviceFeatures.fragmentStoresAndAtomics = supportedFeatures.fragmentStoresAndAtomics;
+
+  VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineFeatures{};
+  timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+  timelineFeatures.timelineSemaphore = VK_TRUE;
 
   VkDeviceGroupDeviceCreateInfo groupDeviceCreateInfo{};
   groupDeviceCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_GROUP_DEVICE_CREATE_INFO;
   groupDeviceCreateInfo.physicalDeviceCount = physicalDevices.size();
   groupDeviceCreateInfo.pPhysicalDevices = physicalDevices.data();
-  groupDeviceCreateInfo.pNext = nullptr;
+  groupDeviceCreateInfo.pNext = &timelineFeatures;
 
   VkDeviceCreateInfo createInfo = {};
   createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -166,8 +243,13 @@ void TpDevice::createLogicalDevice() {
   createInfo.pQueueCreateInfos = queueCreateInfos.data();
 
   createInfo.pEnabledFeatures = &deviceFeatures;
-  createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-  createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+  std::vector<const char *> enabledExtensions = deviceExtensions;
+  // VMA reads the budget through vkGetPhysicalDeviceMemoryProperties2, core since Vulkan 1.1
+  memoryBudget = properties.apiVersion >= VK_API_VERSION_1_1 &&
+                 checkOptionalExtensionSupport(physicalDevices[0], VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+  if (memoryBudget) enabledExtensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+  createInfo.enabledExtensionCount = static_cast<uint32_t>(enabledExtensions.size());
+  createInfo.ppEnabledExtensionNames = enabledExtensions.data();
 
   createInfo.pNext = &groupDeviceCreateInfo;
 
@@ -186,6 +268,14 @@ void TpDevice::createLogicalDevice() {
 
   vkGetDeviceQueue(device_, indices.graphicsFamily, 0, &graphicsQueue_);
   vkGetDeviceQueue(device_, indices.presentFamily, 0, &presentQueue_);
+
+  waitSemaphoresKHR = (PFN_vkWaitSemaphoresKHR)vkGetDeviceProcAddr(device_, "vkWaitSemaphoresKHR");
+  getSemaphoreCounterValueKHR = (PFN_vkGetSemaphoreCounterValueKHR)vkGetDeviceProcAddr(
+      device_,
+      "vkGetSemaphoreCounterValueKHR");
+  if (waitSemaphoresKHR == nullptr || getSemaphoreCounterValueKHR == nullptr) {
+    throw std::runtime_error("failed to load VK_KHR_timeline_semaphore functions!");
+  }
 }
 
 void TpDevice::createCommandPool() {
@@ -202,6 +292,21 @@ void TpDevice::createCommandPool() {
   }
 }
 
+void TpDevice::createGraphicsTimeline() {
+  VkSemaphoreTypeCreateInfoKHR typeInfo{};
+  typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+  typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+  typeInfo.initialValue = 0;
+
+  VkSemaphoreCreateInfo semaphoreInfo{};
+  semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  semaphoreInfo.pNext = &typeInfo;
+
+  if (vkCreateSemaphore(device_, &semaphoreInfo, nullptr, &graphicsTimeline) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create graphics timeline semaphore!");
+  }
+}
+
 void TpDevice::createSurface() { window.createWindowSurface(instance, &surface_); }
 
 bool TpDevice::isDeviceSuitable(VkPhysicalDevice device) {
@@ -219,7 +324,30 @@ bool TpDevice::isDeviceSuitable(VkPhysicalDevice device) {
   vkGetPhysicalDeviceFeatures(device, &supportedFeatures);
 
   return indices.isComplete() && extensionsSupported && swapChainAdequate &&
-         supportedFeatures.samplerAnisotropy;
+         supportedFeatures.samplerAnisotropy && checkTimelineSemaphoreSupport(device);
+}
+
+bool TpDevice::checkTimelineSemaphoreSupport(VkPhysicalDevice device) {
+  VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineFeatures{};
+  timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+
+  VkPhysicalDeviceFeatures2 features{};
+  features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  features.pNext = &timelineFeatures;
+  vkGetPhysicalDeviceFeatures2(device, &features);
+
+  return timelineFeatures.timelineSemaphore == VK_TRUE;
+}
+
+bool TpDevice::checkOptionalExtensionSupport(VkPhysicalDevice device, const char *extension) {
+  uint32_t extensionCount;
+  vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
+  std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+  vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
+
+  return std::any_of(availableExtensions.begin(), availableExtensions.end(), [extension](const auto &available) {
+    return std::strcmp(available.extensionName, extension) == 0;
+  });
 }
 
 void TpDevice::populateDebugMessengerCreateInfo(VkDebugUtilsMessengerCreateInfoEXT &createInfo) {
@@ -383,6 +511,17 @@ SwapChainSupportDetails TpDevice::querySwapChainSupport(VkPhysicalDevice device)
   return details;
 }
 
+uint32_t TpDevice::graphicsTimestampValidBits() {
+  QueueFamilyIndices indices = findPhysicalQueueFamilies();
+
+  uint32_t queueFamilyCount = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevices[0], &queueFamilyCount, nullptr);
+  std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevices[0], &queueFamilyCount, queueFamilies.data());
+
+  return queueFamilies[indices.graphicsFamily].timestampValidBits;
+}
+
 VkFormat TpDevice::findSupportedFormat(
     const std::vector<VkFormat> &candidates, VkImageTiling tiling, VkFormatFeatureFlags features) {
   for (VkFormat format : candidates) {
@@ -412,12 +551,24 @@ uint32_t TpDevice::findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags pro
   throw std::runtime_error("failed to find suitable memory type!");
 }
 
+bool TpDevice::supportsLazilyAllocatedMemory() {
+  VkPhysicalDeviceMemoryProperties memProperties;
+  vkGetPhysicalDeviceMemoryProperties(physicalDevices[0], &memProperties);
+  for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+    if (memProperties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) {
+      return true;
+    }
+  }
+  return false;
+}
+
 void TpDevice::createBuffer(
     VkDeviceSize size,
     VkBufferUsageFlags usage,
     VmaMemoryUsage vmaUsage,
     VkBuffer &buffer,
-    VmaAllocation &allocation) {
+    VmaAllocation &allocation,
+    TpMemoryClass memoryClass) {
   VkBufferCreateInfo bufferInfo{};
   bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
   bufferInfo.size = size;
@@ -426,20 +577,49 @@ void TpDevice::createBuffer(
 
   VmaAllocationCreateInfo vmaCreateInfo{};
   vmaCreateInfo.usage = vmaUsage;
+  vmaCreateInfo.pool = findBufferPool(memoryClass, bufferInfo, vmaUsage);
 
-  vmaCreateBuffer(allocator_, &bufferInfo, &vmaCreateInfo, &buffer, &allocation, nullptr);
+  VkResult result = vmaCreateBuffer(allocator_, &bufferInfo, &vmaCreateInfo, &buffer, &allocation, nullptr);
+  // pools have no dedicated allocations, so a buffer larger than a block only fits outside
+  if (result != VK_SUCCESS && vmaCreateInfo.pool != VK_NULL_HANDLE) {
+    vmaCreateInfo.pool = VK_NULL_HANDLE;
+    result = vmaCreateBuffer(allocator_, &bufferInfo, &vmaCreateInfo, &buffer, &allocation, nullptr);
+  }
+  if (result == VK_ERROR_OUT_OF_DEVICE_MEMORY && recoverFailedAllocation(size)) {
+    result = vmaCreateBuffer(allocator_, &bufferInfo, &vmaCreateInfo, &buffer, &allocation, nullptr);
+    if (result == VK_SUCCESS) memoryPressureStats.recoveredAllocations++;
+  }
+  if (result != VK_SUCCESS) {
+    throw std::runtime_error("failed to create buffer!");
+  }
 }
 
 void TpDevice::createImageWithInfo(
         const VkImageCreateInfo &imageInfo,
         VmaMemoryUsage usage,
         VkImage &image,
-        VmaAllocation &imageAllocation) {
+        VmaAllocation &imageAllocation,
+        TpMemoryClass memoryClass) {
 
   VmaAllocationCreateInfo allocationCreateInfo{};
   allocationCreateInfo.usage = usage;
+  allocationCreateInfo.pool = findImagePool(memoryClass, imageInfo, usage);
 
-  vmaCreateImage(allocator_, &imageInfo, &allocationCreateInfo, &image, &imageAllocation, nullptr);
+  VkResult result = vmaCreateImage(allocator_, &imageInfo, &allocationCreateInfo, &image, &imageAllocation, nullptr);
+  if (result != VK_SUCCESS && allocationCreateInfo.pool != VK_NULL_HANDLE) {
+    allocationCreateInfo.pool = VK_NULL_HANDLE;
+    result = vmaCreateImage(allocator_, &imageInfo, &allocationCreateInfo, &image, &imageAllocation, nullptr);
+  }
+  // the handlers release whole resources, so a size assuming 4 byte texels is close enough
+  VkDeviceSize bytes = VkDeviceSize{imageInfo.extent.width} * imageInfo.extent.height * imageInfo.extent.depth *
+                       imageInfo.arrayLayers * imageInfo.samples * 4;
+  if (result == VK_ERROR_OUT_OF_DEVICE_MEMORY && recoverFailedAllocation(bytes)) {
+    result = vmaCreateImage(allocator_, &imageInfo, &allocationCreateInfo, &image, &imageAllocation, nullptr);
+    if (result == VK_SUCCESS) memoryPressureStats.recoveredAllocations++;
+  }
+  if (result != VK_SUCCESS) {
+    throw std::runtime_error("failed to create image!");
+  }
 
 //  if (vkCreateImage(device_, &imageInfo, nullptr, &image) != VK_SUCCESS) {
 //    throw std::runtime_error("failed to create image!");
@@ -480,21 +660,128 @@ VkCommandBuffer TpDevice::beginSingleTimeCommands() {
   return commandBuffer;
 }
 
-void TpDevice::endSingleTimeCommands(VkCommandBuffer commandBuffer) {
+uint64_t TpDevice::endSingleTimeCommands(VkCommandBuffer commandBuffer) {
+  // nothing waits for the commands, so later submissions see their writes through this
+  VkMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+  vkCmdPipelineBarrier(commandBuffer,
+                       VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                       0,
+                       1, &barrier,
+                       0, nullptr,
+                       0, nullptr);
   vkEndCommandBuffer(commandBuffer);
 
+  uint64_t value = submitGraphics(&commandBuffer, 1);
+  VkDevice device = device_;
+  VkCommandPool pool = commandPool;
+  deferDestroy(value, [device, pool, commandBuffer]() { vkFreeCommandBuffers(device, pool, 1, &commandBuffer); });
+  // loading before the first frame would otherwise hold every staging buffer until it renders
+  collectDeferredDestruction();
+  return value;
+}
+
+uint64_t TpDevice::submitGraphics(
+    const VkCommandBuffer *commandBuffers,
+    uint32_t commandBufferCount,
+    VkSemaphore waitSemaphore,
+    VkPipelineStageFlags waitStage,
+    VkSemaphore signalSemaphore) {
+  uint64_t signalValue = graphicsTimelineValue + 1;
+
+  // binary semaphores ignore their entry in the value arrays
+  VkSemaphore signalSemaphores[] = {graphicsTimeline, signalSemaphore};
+  uint64_t signalValues[] = {signalValue, 0};
+  uint64_t waitValues[] = {0};
+
+  VkTimelineSemaphoreSubmitInfoKHR timelineInfo{};
+  timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+  timelineInfo.signalSemaphoreValueCount = signalSemaphore == VK_NULL_HANDLE ? 1 : 2;
+  timelineInfo.pSignalSemaphoreValues = signalValues;
+
   VkSubmitInfo submitInfo{};
   submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &commandBuffer;
+  submitInfo.pNext = &timelineInfo;
+  submitInfo.commandBufferCount = commandBufferCount;
+  submitInfo.pCommandBuffers = commandBuffers;
+  submitInfo.signalSemaphoreCount = timelineInfo.signalSemaphoreValueCount;
+  submitInfo.pSignalSemaphores = signalSemaphores;
+
+  if (waitSemaphore != VK_NULL_HANDLE) {
+    timelineInfo.waitSemaphoreValueCount = 1;
+    timelineInfo.pWaitSemaphoreValues = waitValues;
+    submitInfo.waitSemaphoreCount = 1;
+    submitInfo.pWaitSemaphores = &waitSemaphore;
+    submitInfo.pWaitDstStageMask = &waitStage;
+  }
 
-  vkQueueSubmit(graphicsQueue_, 1, &submitInfo, VK_NULL_HANDLE);
-  vkQueueWaitIdle(graphicsQueue_);
+  if (vkQueueSubmit(graphicsQueue_, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+    throw std::runtime_error("failed to submit to the graphics queue!");
+  }
 
-  vkFreeCommandBuffers(device_, commandPool, 1, &commandBuffer);
+  graphicsTimelineValue = signalValue;
+  return signalValue;
 }
 
-void TpDevice::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
+void TpDevice::waitForGraphicsValue(uint64_t value) {
+  if (isGraphicsValueComplete(value)) return;
+
+  VkSemaphoreWaitInfoKHR waitInfo{};
+  waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+  waitInfo.semaphoreCount = 1;
+  waitInfo.pSemaphores = &graphicsTimeline;
+  waitInfo.pValues = &value;
+
+  if (waitSemaphoresKHR(device_, &waitInfo, UINT64_MAX) != VK_SUCCESS) {
+    throw std::runtime_error("failed to wait for the graphics timeline!");
+  }
+  graphicsCompletedValue = std::max(graphicsCompletedValue, value);
+}
+
+bool TpDevice::isGraphicsValueComplete(uint64_t value) {
+  // the cached value avoids a driver call for work that is long finished
+  return value <= graphicsCompletedValue || value <= completedGraphicsValue();
+}
+
+void TpDevice::deferDestroy(uint64_t graphicsValue, std::function<void()> destroy) {
+  deferredDestruction.emplace_back(graphicsValue, std::move(destroy));
+}
+
+void TpDevice::collectDeferredDestruction() {
+  if (deferredDestruction.empty()) return;
+
+  uint64_t completed = completedGraphicsValue();
+  // entries are few and not necessarily ordered by value, so just sweep them all
+  std::vector<std::function<void()>> ready;
+  size_t kept = 0;
+  for (size_t i = 0; i < deferredDestruction.size(); i++) {
+    if (deferredDestruction[i].first <= completed) {
+      ready.push_back(std::move(deferredDestruction[i].second));
+    } else {
+      if (kept != i) deferredDestruction[kept] = std::move(deferredDestruction[i]);
+      kept++;
+    }
+  }
+  deferredDestruction.resize(kept);
+
+  // run after the sweep so a destructor may defer more work
+  for (auto &destroy : ready) {
+    destroy();
+  }
+}
+
+uint64_t TpDevice::completedGraphicsValue() {
+  uint64_t value = 0;
+  if (getSemaphoreCounterValueKHR(device_, graphicsTimeline, &value) != VK_SUCCESS) {
+    throw std::runtime_error("failed to query the graphics timeline!");
+  }
+  graphicsCompletedValue = std::max(graphicsCompletedValue, value);
+  return graphicsCompletedValue;
+}
+
+uint64_t TpDevice::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
   VkCommandBuffer commandBuffer = beginSingleTimeCommands();
 
   VkBufferCopy copyRegion{};
@@ -503,10 +790,10 @@ void TpDevice::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize s
   copyRegion.size = size;
   vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
 
-  endSingleTimeCommands(commandBuffer);
+  return endSingleTimeCommands(commandBuffer);
 }
 
-void TpDevice::copyBufferToImage(
+uint64_t TpDevice::copyBufferToImage(
     VkBuffer buffer, VkImage image, uint32_t width, uint32_t height, uint32_t layerCount) {
   VkCommandBuffer commandBuffer = beginSingleTimeCommands();
 
@@ -530,10 +817,10 @@ void TpDevice::copyBufferToImage(
       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
       1,
       &region);
-  endSingleTimeCommands(commandBuffer);
+  return endSingleTimeCommands(commandBuffer);
 }
 
-void TpDevice::transitionImageLayout(VkImage image, VkFormat format,
+uint64_t TpDevice::transitionImageLayout(VkImage image, VkFormat format,
                                      VkImageLayout oldLayout, VkImageLayout newLayout) {
   VkCommandBuffer cmdBuffer = beginSingleTimeCommands();
 
@@ -546,53 +833,344 @@ void TpDevice::transitionImageLayout(VkImage image, VkFormat format,
   barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
 
   barrier.image = image;
-  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  barrier.subresourceRange.aspectMask = getImageAspect(format);
   barrier.subresourceRange.baseMipLevel = 0;
   barrier.subresourceRange.levelCount = 1;
   barrier.subresourceRange.baseArrayLayer = 0;
   barrier.subresourceRange.layerCount = 1;
 
-  barrier.srcAccessMask = 0; // TODO
-  barrier.dstAccessMask = 0; // TODO
-
-  VkPipelineStageFlags sourceStage;
-  VkPipelineStageFlags destinationStage;
-  if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
-    barrier.srcAccessMask = 0;
-    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-
-    sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-    destinationStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-  } else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
-    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-    sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    destinationStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-  } else {
-    throw std::invalid_argument("unsupported layout transition!");
-  }
+  TpImageLayoutInfo source = getImageLayoutInfo(oldLayout);
+  TpImageLayoutInfo destination = getImageLayoutInfo(newLayout);
+  barrier.srcAccessMask = source.access;
+  barrier.dstAccessMask = destination.access;
 
   vkCmdPipelineBarrier(
           cmdBuffer,
-          sourceStage, destinationStage,
+          source.stages, destination.stages,
           0,
           0, nullptr,
           0, nullptr,
           1, &barrier
   );
 
-  endSingleTimeCommands(cmdBuffer);
+  return endSingleTimeCommands(cmdBuffer);
 }
 
 void TpDevice::initializeAllocator() {
   VmaAllocatorCreateInfo allocatorInfo = {};
+  // the instance's version; at 1.0 VMA would look for the KHR entry points of the budget query,
+  // whose instance extension is not enabled
   allocatorInfo.vulkanApiVersion = VK_API_VERSION_1_1;
   allocatorInfo.physicalDevice = physicalDevices[0];
   allocatorInfo.device = device_;
   allocatorInfo.instance = instance;
+  if (memoryBudget) allocatorInfo.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
+
+  if (vmaCreateAllocator(&allocatorInfo, &allocator_) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create memory allocator!");
+  }
+  createMemoryPools();
+}
+
+void TpDevice::createMemoryPools() {
+  // VMA picks each pool's memory type for a representative resource of its class
+  VkBufferCreateInfo bufferInfo{};
+  bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferInfo.size = 65536;
+  bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  VkImageCreateInfo imageInfo{};
+  imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  imageInfo.imageType = VK_IMAGE_TYPE_2D;
+  imageInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+  imageInfo.extent = {256, 256, 1};
+  imageInfo.mipLevels = 1;
+  imageInfo.arrayLayers = 1;
+  imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+  imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+  imageInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+  imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+  for (size_t i = 0; i < MEMORY_CLASS_COUNT; i++) {
+    auto memoryClass = static_cast<TpMemoryClass>(i);
+    if (memoryClass == TpMemoryClass::Default) continue;
+
+    VmaAllocationCreateInfo allocationInfo{};
+    allocationInfo.usage = memoryClassUsage(memoryClass);
+    VkResult result;
+    if (memoryClass == TpMemoryClass::Textures) {
+      result = vmaFindMemoryTypeIndexForImageInfo(allocator_, &imageInfo, &allocationInfo, &memoryPoolTypes[i]);
+    } else {
+      bufferInfo.usage = memoryClassBufferUsage(memoryClass);
+      result = vmaFindMemoryTypeIndexForBufferInfo(allocator_, &bufferInfo, &allocationInfo, &memoryPoolTypes[i]);
+    }
+    // the class then allocates from the default pools
+    if (result != VK_SUCCESS) continue;
+
+    VmaPoolCreateInfo poolInfo{};
+    poolInfo.memoryTypeIndex = memoryPoolTypes[i];
+    if (vmaCreatePool(allocator_, &poolInfo, &memoryPools[i]) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create memory pool!");
+    }
+  }
+}
+
+VmaPool TpDevice::findBufferPool(TpMemoryClass memoryClass, const VkBufferCreateInfo &bufferInfo,
+                                 VmaMemoryUsage usage) {
+  size_t index = static_cast<size_t>(memoryClass);
+  if (memoryPools[index] == VK_NULL_HANDLE) return VK_NULL_HANDLE;
+
+  // VMA allocates from a pool's memory type without checking that the resource accepts it
+  VmaAllocationCreateInfo allocationInfo{};
+  allocationInfo.usage = usage;
+  uint32_t memoryType;
+  if (vmaFindMemoryTypeIndexForBufferInfo(allocator_, &bufferInfo, &allocationInfo, &memoryType) != VK_SUCCESS ||
+      memoryType != memoryPoolTypes[index]) {
+    return VK_NULL_HANDLE;
+  }
+  return memoryPools[index];
+}
+
+VmaPool TpDevice::findImagePool(TpMemoryClass memoryClass, const VkImageCreateInfo &imageInfo,
+                                VmaMemoryUsage usage) {
+  size_t index = static_cast<size_t>(memoryClass);
+  if (memoryPools[index] == VK_NULL_HANDLE) return VK_NULL_HANDLE;
+
+  VmaAllocationCreateInfo allocationInfo{};
+  allocationInfo.usage = usage;
+  uint32_t memoryType;
+  if (vmaFindMemoryTypeIndexForImageInfo(allocator_, &imageInfo, &allocationInfo, &memoryType) != VK_SUCCESS ||
+      memoryType != memoryPoolTypes[index]) {
+    return VK_NULL_HANDLE;
+  }
+  return memoryPools[index];
+}
+
+TpMemoryPoolStats TpDevice::getMemoryPoolStats(TpMemoryClass memoryClass) const {
+  TpMemoryPoolStats stats{};
+  VmaPool pool = memoryPools[static_cast<size_t>(memoryClass)];
+  if (pool == VK_NULL_HANDLE) return stats;
+
+  VmaPoolStats poolStats{};
+  vmaGetPoolStats(allocator_, pool, &poolStats);
+  stats.blockBytes = poolStats.size;
+  stats.usedBytes = poolStats.size - poolStats.unusedSize;
+  stats.allocations = static_cast<uint32_t>(poolStats.allocationCount);
+  stats.blocks = static_cast<uint32_t>(poolStats.blockCount);
+  stats.freeRanges = static_cast<uint32_t>(poolStats.unusedRangeCount);
+  stats.largestFreeRange = poolStats.unusedRangeSizeMax;
+  if (poolStats.unusedSize > 0) {
+    stats.fragmentation = 1.f - static_cast<float>(static_cast<double>(poolStats.unusedRangeSizeMax) /
+                                                   static_cast<double>(poolStats.unusedSize));
+  }
+  return stats;
+}
+
+void TpDevice::trackMovableBuffer(VkBuffer buffer, VmaAllocation allocation, VkDeviceSize size,
+                                  VkBufferUsageFlags usage, MovedBufferHandler moved) {
+  movableBuffers.push_back({buffer, allocation, size, usage, std::move(moved)});
+}
+
+void TpDevice::untrackMovableBuffer(VmaAllocation allocation) {
+  movableBuffers.erase(
+      std::remove_if(movableBuffers.begin(), movableBuffers.end(),
+                     [allocation](const MovableBuffer &entry) { return entry.allocation == allocation; }),
+      movableBuffers.end());
+}
+
+void TpDevice::defragmentStep() {
+  if (movableBuffers.empty()) {
+    defragmenting = false;
+    return;
+  }
+  if (!defragmenting && automaticDefragmentation &&
+      ++framesSinceFragmentationCheck >= FRAGMENTATION_CHECK_INTERVAL) {
+    framesSinceFragmentationCheck = 0;
+    TpMemoryPoolStats pool = getMemoryPoolStats(TpMemoryClass::StaticGeometry);
+    // a layout the last passes could not improve is left alone until allocations change
+    bool changed = pool.allocations != defragmentedPool.allocations || pool.usedBytes != defragmentedPool.usedBytes;
+    defragmenting = changed && pool.fragmentation > DEFRAGMENT_FRAGMENTATION &&
+                    pool.blockBytes - pool.usedBytes >= DEFRAGMENT_MIN_FREE_BYTES;
+  }
+  if (!defragmenting) return;
+
+  // Every submission so far may use the buffers that move, and the old buffers are destroyed as
+  // soon as the pass ends. VMA keeps the pool locked from begin to end, so the pass cannot span
+  // frames and ends by waiting for its copies, which would wait for everything queued before
+  // them. So a pass only runs once all of that has retired, and a GPU that stays busy is left
+  // alone until it has some slack.
+  if (!isGraphicsValueComplete(lastSubmittedGraphicsValue())) return;
+
+  std::vector<VmaAllocation> allocations(movableBuffers.size());
+  std::vector<VkBool32> changed(movableBuffers.size(), VK_FALSE);
+  for (size_t i = 0; i < movableBuffers.size(); i++) allocations[i] = movableBuffers[i].allocation;
+
+  // device local memory is not host visible, so everything moves by copies on the GPU
+  VmaDefragmentationInfo2 defragmentationInfo{};
+  defragmentationInfo.allocationCount = static_cast<uint32_t>(allocations.size());
+  defragmentationInfo.pAllocations = allocations.data();
+  defragmentationInfo.pAllocationsChanged = changed.data();
+  defragmentationInfo.maxCpuBytesToMove = 0;
+  defragmentationInfo.maxCpuAllocationsToMove = 0;
+  defragmentationInfo.maxGpuBytesToMove = DEFRAGMENT_BYTES_PER_PASS;
+  defragmentationInfo.maxGpuAllocationsToMove = DEFRAGMENT_ALLOCATIONS_PER_PASS;
+
+  // the copies write over memory earlier frames read vertices, indices and meshlets from
+  VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+  VkMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+  vkCmdPipelineBarrier(commandBuffer,
+                       VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       0,
+                       1, &barrier,
+                       0, nullptr,
+                       0, nullptr);
+
+  defragmentationInfo.commandBuffer = commandBuffer;
+  VmaDefragmentationStats passStats{};
+  VmaDefragmentationContext context = VK_NULL_HANDLE;
+  VkResult result = vmaDefragmentationBegin(allocator_, &defragmentationInfo, &passStats, &context);
+
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+  vkCmdPipelineBarrier(commandBuffer,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       0,
+                       1, &barrier,
+                       0, nullptr,
+                       0, nullptr);
+  // VK_NOT_READY means the copies are recorded and end has to wait for them; everything queued
+  // before has retired, so this only waits for the copies
+  waitForGraphicsValue(endSingleTimeCommands(commandBuffer));
+  if (result != VK_SUCCESS && result != VK_NOT_READY) {
+    throw std::runtime_error("failed to defragment memory!");
+  }
+  if (vmaDefragmentationEnd(allocator_, context) != VK_SUCCESS) {
+    throw std::runtime_error("failed to defragment memory!");
+  }
+
+  // the contents moved, but buffers stay bound to where they were created
+  std::vector<size_t> moved;
+  for (size_t i = 0; i < movableBuffers.size(); i++) {
+    if (!changed[i]) continue;
+    MovableBuffer &entry = movableBuffers[i];
+    vkDestroyBuffer(device_, entry.buffer, nullptr);
+
+    VkBufferCreateInfo bufferInfo{};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = entry.size;
+    bufferInfo.usage = entry.usage;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    if (vkCreateBuffer(device_, &bufferInfo, nullptr, &entry.buffer) != VK_SUCCESS) {
+      throw std::runtime_error("failed to recreate moved buffer!");
+    }
+    if (vmaBindBufferMemory(allocator_, entry.allocation, entry.buffer) != VK_SUCCESS) {
+      throw std::runtime_error("failed to bind moved buffer!");
+    }
+    moved.push_back(i);
+  }
+  // called last, an owner may track or untrack buffers
+  std::vector<std::pair<MovedBufferHandler, VkBuffer>> handlers;
+  for (size_t i : moved) handlers.emplace_back(movableBuffers[i].moved, movableBuffers[i].buffer);
+  for (auto &handler : handlers) handler.first(handler.second);
+
+  defragmentationStats.passes++;
+  defragmentationStats.allocationsMoved += passStats.allocationsMoved;
+  defragmentationStats.bytesMoved += passStats.bytesMoved;
+  defragmentationStats.bytesFreed += passStats.bytesFreed;
+  defragmentationStats.blocksFreed += passStats.deviceMemoryBlocksFreed;
+  if (passStats.allocationsMoved == 0) {
+    defragmenting = false;
+    defragmentedPool = getMemoryPoolStats(TpMemoryClass::StaticGeometry);
+  }
+}
+
+std::vector<TpMemoryHeapBudget> TpDevice::getMemoryBudget() const {
+  const VkPhysicalDeviceMemoryProperties *memoryProperties;
+  vmaGetMemoryProperties(allocator_, &memoryProperties);
+  VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+  vmaGetBudget(allocator_, budgets);
+
+  std::vector<TpMemoryHeapBudget> heaps(memoryProperties->memoryHeapCount);
+  for (uint32_t i = 0; i < memoryProperties->memoryHeapCount; i++) {
+    heaps[i].budget = budgets[i].budget;
+    heaps[i].usage = budgets[i].usage;
+    heaps[i].blockBytes = budgets[i].blockBytes;
+    heaps[i].allocationBytes = budgets[i].allocationBytes;
+    heaps[i].deviceLocal = (memoryProperties->memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) != 0;
+    if (heaps[i].deviceLocal && memoryBudgetCap > 0) heaps[i].budget = std::min(heaps[i].budget, memoryBudgetCap);
+  }
+  return heaps;
+}
 
-  vmaCreateAllocator(&allocatorInfo, &allocator_);
+void TpDevice::updateMemoryBudget() {
+  // a new frame index makes VMA fetch the budget from the driver again
+  vmaSetCurrentFrameIndex(allocator_, ++memoryFrame);
+  if (!isGraphicsValueComplete(memoryReleaseValue)) return;
+
+  VkDeviceSize excess = 0;
+  for (const auto &heap : getMemoryBudget()) {
+    auto softLimit = static_cast<VkDeviceSize>(static_cast<double>(heap.budget) * memorySoftLimit);
+    if (heap.deviceLocal && heap.usage > softLimit) excess = std::max(excess, heap.usage - softLimit);
+  }
+  if (excess > 0) relieveMemoryPressure(excess);
+}
+
+void TpDevice::setMemorySoftLimit(float fractionOfBudget) {
+  if (fractionOfBudget <= 0.f || fractionOfBudget > 1.f) {
+    throw std::invalid_argument("memory soft limit must be in (0, 1]");
+  }
+  memorySoftLimit = fractionOfBudget;
+}
+
+uint32_t TpDevice::addMemoryPressureHandler(MemoryPressureHandler handler) {
+  memoryPressureHandlers.emplace_back(nextMemoryPressureHandler, std::move(handler));
+  return nextMemoryPressureHandler++;
+}
+
+void TpDevice::removeMemoryPressureHandler(uint32_t handler) {
+  memoryPressureHandlers.erase(
+      std::remove_if(memoryPressureHandlers.begin(), memoryPressureHandlers.end(),
+                     [handler](const auto &entry) { return entry.first == handler; }),
+      memoryPressureHandlers.end());
+}
+
+VkDeviceSize TpDevice::relieveMemoryPressure(VkDeviceSize bytes) {
+  // a handler whose own allocation fails must not end up in the handlers again
+  if (relievingMemory || bytes == 0) return 0;
+  relievingMemory = true;
+  memoryPressureStats.events++;
+  memoryPressureStats.requestedBytes += bytes;
+
+  VkDeviceSize released = 0;
+  // copied, as a handler may add or remove handlers
+  auto handlers = memoryPressureHandlers;
+  for (auto &handler : handlers) {
+    if (released >= bytes) break;
+    released += handler.second(bytes - released);
+  }
+
+  relievingMemory = false;
+  memoryPressureStats.releasedBytes += released;
+  if (released > 0) memoryReleaseValue = lastSubmittedGraphicsValue();
+  return released;
+}
+
+bool TpDevice::recoverFailedAllocation(VkDeviceSize bytes) {
+  memoryPressureStats.failedAllocations++;
+  if (relieveMemoryPressure(bytes) == 0) return false;
+
+  // the released memory is only freed once nothing in flight uses it
+  waitForGraphicsValue(memoryReleaseValue);
+  collectDeferredDestruction();
+  return true;
 }
 
 VkImageView TpDevice::createImageView(VkImage image, VkFormat format) {
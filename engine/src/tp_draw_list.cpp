@@ -0,0 +1,84 @@
+#include "tp_draw_list.h"
+#include "tp_cpu_profiler.h"
+
+// std
+#include <array>
+#include <cstring>
+
+namespace teapot {
+
+const char *drawSortModeName(TpDrawSortMode mode) {
+  switch (mode) {
+    case TpDrawSortMode::State: return "state";
+    case TpDrawSortMode::FrontToBack: return "front-to-back";
+  }
+  return "unknown";
+}
+
+bool parseDrawSortMode(const std::string &name, TpDrawSortMode &mode) {
+  for (auto candidate : {TpDrawSortMode::State, TpDrawSortMode::FrontToBack}) {
+    if (name == drawSortModeName(candidate)) {
+      mode = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+uint64_t TpSortKey::make(TpDrawSortMode mode, uint32_t pipeline, uint32_t material, uint32_t mesh,
+                         uint16_t depthBucket) {
+  uint64_t key = static_cast<uint64_t>(pipeline & (MAX_PIPELINES - 1)) << 56;
+  uint64_t materialBits = material & (MAX_MATERIALS - 1);
+  uint64_t meshBits = mesh & (MAX_MESHES - 1);
+
+  switch (mode) {
+    case TpDrawSortMode::State:
+      return key | materialBits << 36 | meshBits << 16 | depthBucket;
+    case TpDrawSortMode::FrontToBack:
+      return key | static_cast<uint64_t>(depthBucket) << 40 | materialBits << 20 | meshBits;
+  }
+  return key;
+}
+
+uint16_t TpSortKey::depthBucket(float viewDistance) {
+  if (!(viewDistance > 0.f)) return 0;
+  uint32_t bits;
+  std::memcpy(&bits, &viewDistance, sizeof(bits));
+  return static_cast<uint16_t>(bits >> 16);
+}
+
+void TpDrawList::sort() {
+  TP_PROFILE_SCOPE("TpDrawList::sort");
+  size_t count = drawItems.size();
+  if (count < 2) return;
+  scratch.resize(count);
+
+  // all eight histograms in one sweep over the keys
+  std::array<std::array<uint32_t, 256>, 8> histograms{};
+  for (const auto &item : drawItems) {
+    for (int digit = 0; digit < 8; digit++) {
+      histograms[digit][(item.key >> (digit * 8)) & 0xff]++;
+    }
+  }
+
+  for (int digit = 0; digit < 8; digit++) {
+    auto &histogram = histograms[digit];
+    uint32_t firstBucket = static_cast<uint32_t>(drawItems[0].key >> (digit * 8)) & 0xff;
+    if (histogram[firstBucket] == count) continue;
+
+    uint32_t offset = 0;
+    for (auto &bucket : histogram) {
+      uint32_t size = bucket;
+      bucket = offset;
+      offset += size;
+    }
+
+    int shift = digit * 8;
+    for (const auto &item : drawItems) {
+      scratch[histogram[(item.key >> shift) & 0xff]++] = item;
+    }
+    drawItems.swap(scratch);
+  }
+}
+
+}  // namespace teapot
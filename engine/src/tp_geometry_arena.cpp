@@ -0,0 +1,374 @@
+#include "tp_geometry_arena.h"
+#include "tp_cpu_profiler.h"
+
+// std
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+
+namespace teapot {
+
+namespace {
+
+// Every stream is also a storage buffer: vertex pulling shaders read the vertices and cluster
+// culling reads meshlet triangles straight from the indices.
+constexpr VkBufferUsageFlags VERTEX_STREAM_USAGE = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                                                   VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                                   VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                                                   VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+constexpr VkBufferUsageFlags INDEX_STREAM_USAGE = VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+                                                  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                                  VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                                                  VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+// later vertex fetches, index fetches and shader reads see the copied geometry
+void geometryWriteBarrier(VkCommandBuffer commandBuffer) {
+  VkMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+  vkCmdPipelineBarrier(commandBuffer,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       0,
+                       1, &barrier,
+                       0, nullptr,
+                       0, nullptr);
+}
+
+// doubles capacity until count more elements fit after used
+uint32_t grownCapacity(uint32_t capacity, uint32_t used, uint32_t count) {
+  uint64_t needed = static_cast<uint64_t>(used) + count;
+  uint64_t grown = std::max<uint64_t>(capacity, 1);
+  while (grown < needed) grown *= 2;
+  if (grown > UINT32_MAX) throw std::runtime_error("geometry arena cannot grow past 2^32 elements");
+  return static_cast<uint32_t>(grown);
+}
+
+}  // namespace
+
+void TpGeometryArena::FreeList::reset(uint32_t capacity, uint32_t used) {
+  blocks.clear();
+  capacity_ = capacity;
+  freeCount_ = capacity - used;
+  if (used < capacity) blocks.emplace(used, capacity - used);
+}
+
+bool TpGeometryArena::FreeList::allocate(uint32_t count, uint32_t &offset) {
+  auto best = blocks.end();
+  for (auto it = blocks.begin(); it != blocks.end(); ++it) {
+    if (it->second < count || (best != blocks.end() && it->second >= best->second)) continue;
+    best = it;
+    if (it->second == count) break;
+  }
+  if (best == blocks.end()) return false;
+
+  offset = best->first;
+  uint32_t remaining = best->second - count;
+  blocks.erase(best);
+  if (remaining > 0) blocks.emplace(offset + count, remaining);
+  freeCount_ -= count;
+  return true;
+}
+
+void TpGeometryArena::FreeList::release(uint32_t offset, uint32_t count) {
+  freeCount_ += count;
+  // merge with the free neighbours on both sides
+  auto next = blocks.lower_bound(offset);
+  if (next != blocks.end() && offset + count == next->first) {
+    count += next->second;
+    next = blocks.erase(next);
+  }
+  if (next != blocks.begin()) {
+    auto previous = std::prev(next);
+    if (previous->first + previous->second == offset) {
+      previous->second += count;
+      return;
+    }
+  }
+  blocks.emplace_hint(next, offset, count);
+}
+
+uint32_t TpGeometryArena::FreeList::largestBlock() const {
+  uint32_t largest = 0;
+  for (const auto &block : blocks) largest = std::max(largest, block.second);
+  return largest;
+}
+
+TpGeometryArena::TpGeometryArena(TpDevice &device, uint32_t vertexStride, uint32_t vertexCapacity,
+                                 uint32_t indexCapacity)
+    : tpDevice{device}, vertexStride{vertexStride} {
+  if (vertexStride == 0 || vertexCapacity == 0 || indexCapacity == 0) {
+    throw std::invalid_argument("geometry arena stride and capacities must be non-zero");
+  }
+  buffers = createBuffers(vertexCapacity, indexCapacity);
+  vertexFreeList.reset(vertexCapacity, 0);
+  indexFreeList.reset(indexCapacity, 0);
+  trackBuffers();
+  memoryPressureHandler = tpDevice.addMemoryPressureHandler([this](VkDeviceSize) { return trim(); });
+}
+
+TpGeometryArena::~TpGeometryArena() {
+  tpDevice.removeMemoryPressureHandler(memoryPressureHandler);
+  untrackBuffers(buffers);
+  destroyBuffers(buffers);
+}
+
+TpGeometryArena::Buffers TpGeometryArena::createBuffers(uint32_t vertexCapacity, uint32_t indexCapacity) {
+  Buffers created;
+  tpDevice.createBuffer(VkDeviceSize{vertexCapacity} * vertexStride, VERTEX_STREAM_USAGE,
+                        VMA_MEMORY_USAGE_GPU_ONLY,
+                        created.vertex, created.vertexAllocation, TpMemoryClass::StaticGeometry);
+  tpDevice.createBuffer(VkDeviceSize{vertexCapacity} * sizeof(glm::vec3), VERTEX_STREAM_USAGE,
+                        VMA_MEMORY_USAGE_GPU_ONLY,
+                        created.position, created.positionAllocation, TpMemoryClass::StaticGeometry);
+  tpDevice.createBuffer(VkDeviceSize{indexCapacity} * sizeof(uint32_t), INDEX_STREAM_USAGE,
+                        VMA_MEMORY_USAGE_GPU_ONLY,
+                        created.index, created.indexAllocation, TpMemoryClass::StaticGeometry);
+  return created;
+}
+
+void TpGeometryArena::trackBuffers() {
+  // defragmentation moves them like a rebuild would, only without changing any range
+  VkDeviceSize vertexCapacity = vertexFreeList.capacity();
+  tpDevice.trackMovableBuffer(buffers.vertex, buffers.vertexAllocation, vertexCapacity * vertexStride,
+                              VERTEX_STREAM_USAGE, [this](VkBuffer moved) {
+                                buffers.vertex = moved;
+                                generation++;
+                              });
+  tpDevice.trackMovableBuffer(buffers.position, buffers.positionAllocation, vertexCapacity * sizeof(glm::vec3),
+                              VERTEX_STREAM_USAGE, [this](VkBuffer moved) {
+                                buffers.position = moved;
+                                generation++;
+                              });
+  tpDevice.trackMovableBuffer(buffers.index, buffers.indexAllocation,
+                              VkDeviceSize{indexFreeList.capacity()} * sizeof(uint32_t),
+                              INDEX_STREAM_USAGE, [this](VkBuffer moved) {
+                                buffers.index = moved;
+                                generation++;
+                              });
+}
+
+void TpGeometryArena::untrackBuffers(const Buffers &tracked) {
+  tpDevice.untrackMovableBuffer(tracked.vertexAllocation);
+  tpDevice.untrackMovableBuffer(tracked.positionAllocation);
+  tpDevice.untrackMovableBuffer(tracked.indexAllocation);
+}
+
+void TpGeometryArena::destroyBuffers(const Buffers &old) {
+  vmaDestroyBuffer(tpDevice.allocator(), old.vertex, old.vertexAllocation);
+  vmaDestroyBuffer(tpDevice.allocator(), old.position, old.positionAllocation);
+  vmaDestroyBuffer(tpDevice.allocator(), old.index, old.indexAllocation);
+}
+
+TpMeshHandle TpGeometryArena::allocate(const void *vertices, const glm::vec3 *positions, uint32_t vertexCount,
+                                       const uint32_t *indices, uint32_t indexCount) {
+  TP_PROFILE_SCOPE("TpGeometryArena::allocate");
+  if (vertexCount == 0 || indexCount == 0) {
+    throw std::invalid_argument("a mesh needs vertices and indices");
+  }
+  reclaimFrees();
+  reserve(vertexCount, indexCount);
+  uint32_t firstVertex = 0;
+  uint32_t firstIndex = 0;
+  vertexFreeList.allocate(vertexCount, firstVertex);
+  indexFreeList.allocate(indexCount, firstIndex);
+
+  // one staging buffer and one submission for all three streams
+  VkDeviceSize vertexBytes = VkDeviceSize{vertexCount} * vertexStride;
+  VkDeviceSize positionBytes = VkDeviceSize{vertexCount} * sizeof(glm::vec3);
+  VkDeviceSize indexBytes = VkDeviceSize{indexCount} * sizeof(uint32_t);
+  VkDeviceSize stagingSize = vertexBytes + positionBytes + indexBytes;
+  VkBuffer stagingBuffer;
+  VmaAllocation stagingAllocation;
+  tpDevice.createBuffer(stagingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                        VMA_MEMORY_USAGE_CPU_ONLY,
+                        stagingBuffer, stagingAllocation, TpMemoryClass::Staging);
+  void *mapped;
+  vmaMapMemory(tpDevice.allocator(), stagingAllocation, &mapped);
+  auto *bytes = static_cast<unsigned char *>(mapped);
+  std::memcpy(bytes, vertices, static_cast<size_t>(vertexBytes));
+  std::memcpy(bytes + vertexBytes, positions, static_cast<size_t>(positionBytes));
+  std::memcpy(bytes + vertexBytes + positionBytes, indices, static_cast<size_t>(indexBytes));
+  vmaFlushAllocation(tpDevice.allocator(), stagingAllocation, 0, stagingSize);
+  vmaUnmapMemory(tpDevice.allocator(), stagingAllocation);
+
+  VkCommandBuffer commandBuffer = tpDevice.beginSingleTimeCommands();
+  VkBufferCopy vertexCopy{0, VkDeviceSize{firstVertex} * vertexStride, vertexBytes};
+  VkBufferCopy positionCopy{vertexBytes, VkDeviceSize{firstVertex} * sizeof(glm::vec3), positionBytes};
+  VkBufferCopy indexCopy{vertexBytes + positionBytes, VkDeviceSize{firstIndex} * sizeof(uint32_t), indexBytes};
+  vkCmdCopyBuffer(commandBuffer, stagingBuffer, buffers.vertex, 1, &vertexCopy);
+  vkCmdCopyBuffer(commandBuffer, stagingBuffer, buffers.position, 1, &positionCopy);
+  vkCmdCopyBuffer(commandBuffer, stagingBuffer, buffers.index, 1, &indexCopy);
+  geometryWriteBarrier(commandBuffer);
+  VmaAllocator allocator = tpDevice.allocator();
+  tpDevice.deferDestroy(tpDevice.endSingleTimeCommands(commandBuffer), [=]() {
+    vmaDestroyBuffer(allocator, stagingBuffer, stagingAllocation);
+  });
+
+  TpMeshHandle mesh;
+  if (!freeHandles.empty()) {
+    mesh = freeHandles.back();
+    freeHandles.pop_back();
+  } else {
+    mesh = static_cast<TpMeshHandle>(meshes.size());
+    meshes.emplace_back();
+  }
+  meshes[mesh] = {{static_cast<int32_t>(firstVertex), firstIndex, vertexCount, indexCount}, true};
+  return mesh;
+}
+
+void TpGeometryArena::free(TpMeshHandle mesh) {
+  meshes[mesh].live = false;
+  pendingFrees.emplace_back(tpDevice.lastSubmittedGraphicsValue(), mesh);
+}
+
+void TpGeometryArena::reclaimFrees() {
+  auto reclaimed = std::remove_if(pendingFrees.begin(), pendingFrees.end(), [this](const auto &pending) {
+    if (!tpDevice.isGraphicsValueComplete(pending.first)) return false;
+    const TpMeshRange &range = meshes[pending.second].range;
+    vertexFreeList.release(static_cast<uint32_t>(range.vertexOffset), range.vertexCount);
+    indexFreeList.release(range.firstIndex, range.indexCount);
+    freeHandles.push_back(pending.second);
+    return true;
+  });
+  pendingFrees.erase(reclaimed, pendingFrees.end());
+}
+
+void TpGeometryArena::reserve(uint32_t vertexCount, uint32_t indexCount) {
+  if (vertexFreeList.largestBlock() >= vertexCount && indexFreeList.largestBlock() >= indexCount) return;
+
+  // meshes waiting to be freed are not copied, so compaction reclaims them too
+  uint32_t liveVertices;
+  uint32_t liveIndices;
+  countLive(liveVertices, liveIndices);
+  uint32_t vertexCapacity = vertexFreeList.capacity();
+  uint32_t indexCapacity = indexFreeList.capacity();
+  if (vertexCapacity - liveVertices >= vertexCount && indexCapacity - liveIndices >= indexCount) {
+    defragment();
+    return;
+  }
+  rebuild(grownCapacity(vertexCapacity, liveVertices, vertexCount),
+          grownCapacity(indexCapacity, liveIndices, indexCount));
+  growCount++;
+}
+
+void TpGeometryArena::defragment() {
+  rebuild(vertexFreeList.capacity(), indexFreeList.capacity());
+  defragmentCount++;
+}
+
+VkDeviceSize TpGeometryArena::trim() {
+  uint32_t liveVertices;
+  uint32_t liveIndices;
+  countLive(liveVertices, liveIndices);
+  // buffers cannot be empty
+  uint32_t vertexCapacity = std::max(liveVertices, 1u);
+  uint32_t indexCapacity = std::max(liveIndices, 1u);
+  uint32_t spareVertices = vertexFreeList.capacity() - vertexCapacity;
+  uint32_t spareIndices = indexFreeList.capacity() - indexCapacity;
+  if (spareVertices == 0 && spareIndices == 0) return 0;
+
+  rebuild(vertexCapacity, indexCapacity);
+  trimCount++;
+  return VkDeviceSize{spareVertices} * (vertexStride + sizeof(glm::vec3)) +
+         VkDeviceSize{spareIndices} * sizeof(uint32_t);
+}
+
+void TpGeometryArena::countLive(uint32_t &vertices, uint32_t &indices) const {
+  vertices = 0;
+  indices = 0;
+  for (const auto &mesh : meshes) {
+    if (!mesh.live) continue;
+    vertices += mesh.range.vertexCount;
+    indices += mesh.range.indexCount;
+  }
+}
+
+void TpGeometryArena::rebuild(uint32_t vertexCapacity, uint32_t indexCapacity) {
+  TP_PROFILE_SCOPE("TpGeometryArena::rebuild");
+  Buffers rebuilt = createBuffers(vertexCapacity, indexCapacity);
+
+  std::vector<VkBufferCopy> vertexCopies;
+  std::vector<VkBufferCopy> positionCopies;
+  std::vector<VkBufferCopy> indexCopies;
+  uint32_t nextVertex = 0;
+  uint32_t nextIndex = 0;
+  for (auto &mesh : meshes) {
+    if (!mesh.live) continue;
+    TpMeshRange &range = mesh.range;
+    auto firstVertex = static_cast<VkDeviceSize>(range.vertexOffset);
+    vertexCopies.push_back({firstVertex * vertexStride, VkDeviceSize{nextVertex} * vertexStride,
+                            VkDeviceSize{range.vertexCount} * vertexStride});
+    positionCopies.push_back({firstVertex * sizeof(glm::vec3), VkDeviceSize{nextVertex} * sizeof(glm::vec3),
+                              VkDeviceSize{range.vertexCount} * sizeof(glm::vec3)});
+    indexCopies.push_back({VkDeviceSize{range.firstIndex} * sizeof(uint32_t), VkDeviceSize{nextIndex} * sizeof(uint32_t),
+                           VkDeviceSize{range.indexCount} * sizeof(uint32_t)});
+    range.vertexOffset = static_cast<int32_t>(nextVertex);
+    range.firstIndex = nextIndex;
+    nextVertex += range.vertexCount;
+    nextIndex += range.indexCount;
+  }
+
+  if (!vertexCopies.empty()) {
+    VkCommandBuffer commandBuffer = tpDevice.beginSingleTimeCommands();
+    vkCmdCopyBuffer(commandBuffer, buffers.vertex, rebuilt.vertex,
+                    static_cast<uint32_t>(vertexCopies.size()), vertexCopies.data());
+    vkCmdCopyBuffer(commandBuffer, buffers.position, rebuilt.position,
+                    static_cast<uint32_t>(positionCopies.size()), positionCopies.data());
+    vkCmdCopyBuffer(commandBuffer, buffers.index, rebuilt.index,
+                    static_cast<uint32_t>(indexCopies.size()), indexCopies.data());
+    geometryWriteBarrier(commandBuffer);
+    tpDevice.endSingleTimeCommands(commandBuffer);
+  }
+
+  // frames in flight still draw from the old buffers
+  Buffers retired = buffers;
+  untrackBuffers(retired);
+  VmaAllocator allocator = tpDevice.allocator();
+  tpDevice.deferDestroy(tpDevice.lastSubmittedGraphicsValue(), [=]() {
+    vmaDestroyBuffer(allocator, retired.vertex, retired.vertexAllocation);
+    vmaDestroyBuffer(allocator, retired.position, retired.positionAllocation);
+    vmaDestroyBuffer(allocator, retired.index, retired.indexAllocation);
+  });
+  buffers = rebuilt;
+
+  vertexFreeList.reset(vertexCapacity, nextVertex);
+  indexFreeList.reset(indexCapacity, nextIndex);
+  for (const auto &pending : pendingFrees) freeHandles.push_back(pending.second);
+  pendingFrees.clear();
+  trackBuffers();
+  generation++;
+}
+
+void TpGeometryArena::bind(VkCommandBuffer commandBuffer) const {
+  VkBuffer vertexBuffers[] = {buffers.vertex};
+  VkDeviceSize offsets[] = {0};
+  vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+  vkCmdBindIndexBuffer(commandBuffer, buffers.index, 0, VK_INDEX_TYPE_UINT32);
+}
+
+void TpGeometryArena::bindPositions(VkCommandBuffer commandBuffer) const {
+  VkBuffer vertexBuffers[] = {buffers.position};
+  VkDeviceSize offsets[] = {0};
+  vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+  vkCmdBindIndexBuffer(commandBuffer, buffers.index, 0, VK_INDEX_TYPE_UINT32);
+}
+
+TpGeometryStats TpGeometryArena::getStats() const {
+  TpGeometryStats stats{};
+  for (const auto &mesh : meshes) stats.meshes += mesh.live ? 1 : 0;
+  stats.vertexCapacity = vertexFreeList.capacity();
+  stats.vertexUsed = vertexFreeList.capacity() - vertexFreeList.freeCount();
+  stats.indexCapacity = indexFreeList.capacity();
+  stats.indexUsed = indexFreeList.capacity() - indexFreeList.freeCount();
+  stats.freeBlocks = vertexFreeList.blockCount() + indexFreeList.blockCount();
+  stats.grows = growCount;
+  stats.defragmentations = defragmentCount;
+  stats.trims = trimCount;
+  return stats;
+}
+
+}  // namespace teapot
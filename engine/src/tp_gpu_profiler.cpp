@@ -0,0 +1,170 @@
+#include "tp_gpu_profiler.h"
+
+// std
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace teapot {
+
+TpGpuProfiler::TpGpuProfiler(TpDevice &device, int framesInFlight) : tpDevice{device} {
+  if (!isSupported(device)) {
+    throw std::runtime_error("timestamp queries are not supported on the graphics queue!");
+  }
+
+  uint32_t validBits = device.graphicsTimestampValidBits();
+  timestampMask = validBits >= 64 ? UINT64_MAX : ((uint64_t{1} << validBits) - 1);
+  nsPerTick = static_cast<double>(device.properties.limits.timestampPeriod);
+
+  createQueryPools(framesInFlight);
+}
+
+TpGpuProfiler::~TpGpuProfiler() {
+  for (auto &frame : frames) {
+    vkDestroyQueryPool(tpDevice.device(), frame.queryPool, nullptr);
+  }
+}
+
+bool TpGpuProfiler::isSupported(TpDevice &device) {
+  return device.properties.limits.timestampComputeAndGraphics == VK_TRUE &&
+         device.graphicsTimestampValidBits() > 0;
+}
+
+void TpGpuProfiler::createQueryPools(int framesInFlight) {
+  frames.resize(framesInFlight);
+
+  VkQueryPoolCreateInfo poolInfo{};
+  poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  poolInfo.queryCount = MAX_ZONES_PER_FRAME * 2;
+
+  for (auto &frame : frames) {
+    if (vkCreateQueryPool(tpDevice.device(), &poolInfo, nullptr, &frame.queryPool) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create timestamp query pool!");
+    }
+    frame.zones.reserve(MAX_ZONES_PER_FRAME);
+  }
+}
+
+void TpGpuProfiler::beginFrame(VkCommandBuffer commandBuffer, int frameIndex) {
+  currentFrame = &frames[frameIndex];
+
+  // The timeline value of this slot has been waited on, so its previous results are ready.
+  if (currentFrame->pending) {
+    collectResults(*currentFrame);
+  }
+
+  vkCmdResetQueryPool(commandBuffer, currentFrame->queryPool, 0, MAX_ZONES_PER_FRAME * 2);
+  currentFrame->zones.clear();
+  currentFrame->queryCount = 0;
+  currentFrame->pending = false;
+
+  frameZone = beginZone(commandBuffer, FRAME_ZONE_NAME);
+}
+
+void TpGpuProfiler::endFrame(VkCommandBuffer commandBuffer) {
+  endZone(commandBuffer, frameZone);
+  frameZone = INVALID_ZONE;
+  currentFrame->pending = true;
+  currentFrame = nullptr;
+}
+
+uint32_t TpGpuProfiler::beginZone(VkCommandBuffer commandBuffer, const char *name) {
+  if (currentFrame == nullptr || currentFrame->queryCount + 2 > MAX_ZONES_PER_FRAME * 2) {
+    return INVALID_ZONE;
+  }
+
+  uint32_t zone = static_cast<uint32_t>(currentFrame->zones.size());
+  uint32_t query = currentFrame->queryCount;
+  currentFrame->queryCount += 2;
+  currentFrame->zones.push_back({name, query, query + 1});
+
+  vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, currentFrame->queryPool, query);
+  return zone;
+}
+
+void TpGpuProfiler::endZone(VkCommandBuffer commandBuffer, uint32_t zone) {
+  if (currentFrame == nullptr || zone == INVALID_ZONE) return;
+
+  vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, currentFrame->queryPool,
+                      currentFrame->zones[zone].endQuery);
+}
+
+void TpGpuProfiler::collectResults(FrameQueries &frame) {
+  frame.pending = false;
+  if (frame.queryCount == 0) return;
+
+  std::vector<uint64_t> timestamps(frame.queryCount);
+  VkResult result = vkGetQueryPoolResults(
+      tpDevice.device(), frame.queryPool, 0, frame.queryCount,
+      timestamps.size() * sizeof(uint64_t), timestamps.data(), sizeof(uint64_t),
+      VK_QUERY_RESULT_64_BIT);
+  if (result != VK_SUCCESS) return;
+
+  // Zones that share a name within one frame (e.g. a system invoked twice) are summed.
+  lastFrameTimings.clear();
+  for (const auto &zone : frame.zones) {
+    uint64_t begin = timestamps[zone.beginQuery] & timestampMask;
+    uint64_t end = timestamps[zone.endQuery] & timestampMask;
+    double ms = static_cast<double>((end - begin) & timestampMask) * nsPerTick / 1e6;
+
+    auto it = std::find_if(lastFrameTimings.begin(), lastFrameTimings.end(),
+                           [&](const auto &timing) { return timing.first == zone.name; });
+    if (it == lastFrameTimings.end()) {
+      lastFrameTimings.emplace_back(zone.name, ms);
+    } else {
+      it->second += ms;
+    }
+  }
+
+  for (const auto &timing : lastFrameTimings) {
+    recordSample(timing.first, timing.second);
+  }
+  resolvedFrameCount++;
+}
+
+void TpGpuProfiler::recordSample(const std::string &name, double ms) {
+  auto &history = histories[name];
+  if (history.samples.size() < HISTORY_LENGTH) {
+    history.samples.push_back(ms);
+  } else {
+    history.samples[history.next] = ms;
+  }
+  history.next = (history.next + 1) % HISTORY_LENGTH;
+}
+
+TpGpuTimingStats TpGpuProfiler::getStats(const std::string &name) const {
+  TpGpuTimingStats stats{};
+  auto it = histories.find(name);
+  if (it == histories.end() || it->second.samples.empty()) return stats;
+
+  std::vector<double> sorted = it->second.samples;
+  std::sort(sorted.begin(), sorted.end());
+
+  double sum = 0.0;
+  for (double sample : sorted) sum += sample;
+
+  // nearest-rank percentiles
+  auto percentile = [&](double p) {
+    size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * static_cast<double>(sorted.size())));
+    return sorted[std::max<size_t>(rank, 1) - 1];
+  };
+
+  stats.sampleCount = sorted.size();
+  stats.averageMs = sum / static_cast<double>(sorted.size());
+  stats.p50Ms = percentile(50.0);
+  stats.p95Ms = percentile(95.0);
+  stats.p99Ms = percentile(99.0);
+  return stats;
+}
+
+std::vector<std::string> TpGpuProfiler::getZoneNames() const {
+  std::vector<std::string> names;
+  names.reserve(histories.size());
+  for (const auto &entry : histories) {
+    names.push_back(entry.first);
+  }
+  return names;
+}
+
+}  // namespace teapot
@@ -0,0 +1,299 @@
+#include "tp_mesh_simplify.h"
+#include "tp_cpu_profiler.h"
+
+// std
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+
+namespace teapot {
+
+namespace {
+
+constexpr uint32_t NONE = UINT32_MAX;
+// border planes are weighted by the squared edge length times this
+constexpr double BORDER_WEIGHT = 10.0;
+
+// symmetric 4x4 plane quadric, upper triangle only; weight is the sum of the plane scales
+struct Quadric {
+  double a00 = 0, a01 = 0, a02 = 0, a03 = 0, a11 = 0, a12 = 0, a13 = 0, a22 = 0, a23 = 0, a33 = 0;
+  double weight = 0;
+
+  void addPlane(const glm::dvec3 &n, double d, double scale) {
+    a00 += scale * n.x * n.x;
+    a01 += scale * n.x * n.y;
+    a02 += scale * n.x * n.z;
+    a03 += scale * n.x * d;
+    a11 += scale * n.y * n.y;
+    a12 += scale * n.y * n.z;
+    a13 += scale * n.y * d;
+    a22 += scale * n.z * n.z;
+    a23 += scale * n.z * d;
+    a33 += scale * d * d;
+    weight += scale;
+  }
+
+  Quadric &operator+=(const Quadric &o) {
+    a00 += o.a00, a01 += o.a01, a02 += o.a02, a03 += o.a03, a11 += o.a11;
+    a12 += o.a12, a13 += o.a13, a22 += o.a22, a23 += o.a23, a33 += o.a33;
+    weight += o.weight;
+    return *this;
+  }
+
+  // sum of the weighted squared distances of p to the planes
+  double evaluate(const glm::dvec3 &p) const {
+    double value = a00 * p.x * p.x + 2 * a01 * p.x * p.y + 2 * a02 * p.x * p.z + 2 * a03 * p.x +
+                   a11 * p.y * p.y + 2 * a12 * p.y * p.z + 2 * a13 * p.y + a22 * p.z * p.z + 2 * a23 * p.z + a33;
+    return std::max(value, 0.0);
+  }
+};
+
+struct Collapse {
+  double cost;
+  uint32_t from;
+  uint32_t to;
+  uint32_t fromVersion;
+  uint32_t toVersion;
+
+  bool operator>(const Collapse &other) const { return cost > other.cost; }
+};
+
+struct PositionHash {
+  size_t operator()(const glm::vec3 &p) const {
+    uint32_t bits[3];
+    std::memcpy(bits, &p, sizeof(bits));
+    return (bits[0] * 73856093u) ^ (bits[1] * 19349663u) ^ (bits[2] * 83492791u);
+  }
+};
+
+uint64_t edgeKey(uint32_t a, uint32_t b) {
+  return a < b ? (static_cast<uint64_t>(a) << 32) | b : (static_cast<uint64_t>(b) << 32) | a;
+}
+
+}  // namespace
+
+std::vector<uint32_t> simplifyMesh(const glm::vec3 *positions, size_t vertexCount,
+                                   const std::vector<uint32_t> &indices, size_t targetIndexCount, float &error) {
+  TP_PROFILE_SCOPE("simplifyMesh");
+  error = 0.f;
+  if (indices.size() <= targetIndexCount) return indices;
+
+  // vertices sharing a position form one class; the classes are what collapses
+  std::vector<uint32_t> classOf(vertexCount);
+  std::vector<glm::vec3> classPositions;
+  {
+    std::unordered_map<glm::vec3, uint32_t, PositionHash> lookup;
+    for (size_t v = 0; v < vertexCount; v++) {
+      auto inserted = lookup.emplace(positions[v], static_cast<uint32_t>(classPositions.size()));
+      if (inserted.second) classPositions.push_back(positions[v]);
+      classOf[v] = inserted.first->second;
+    }
+  }
+  size_t classCount = classPositions.size();
+
+  std::vector<uint32_t> triangles = indices;
+  size_t triangleCount = triangles.size() / 3;
+  std::vector<uint8_t> triangleAlive(triangleCount, 1);
+  size_t liveTriangles = triangleCount;
+  auto classAt = [&](size_t triangle, int corner) { return classOf[triangles[triangle * 3 + corner]]; };
+
+  std::vector<std::vector<uint32_t>> classTriangles(classCount);
+  std::vector<std::vector<uint32_t>> classVertices(classCount);
+  std::vector<Quadric> quadrics(classCount);
+  std::unordered_map<uint64_t, uint32_t> edgeUses;
+  for (size_t t = 0; t < triangleCount; t++) {
+    uint32_t c0 = classAt(t, 0), c1 = classAt(t, 1), c2 = classAt(t, 2);
+    if (c0 == c1 || c1 == c2 || c0 == c2) {
+      triangleAlive[t] = 0;
+      liveTriangles--;
+      continue;
+    }
+
+    glm::dvec3 p0 = classPositions[c0], p1 = classPositions[c1], p2 = classPositions[c2];
+    glm::dvec3 normal = glm::cross(p1 - p0, p2 - p0);
+    double doubleArea = glm::length(normal);
+    Quadric quadric;
+    if (doubleArea > 0) {
+      normal /= doubleArea;
+      quadric.addPlane(normal, -glm::dot(normal, p0), doubleArea * 0.5);
+    }
+    for (int corner = 0; corner < 3; corner++) {
+      uint32_t vertex = triangles[t * 3 + corner];
+      uint32_t c = classOf[vertex];
+      quadrics[c] += quadric;
+      classTriangles[c].push_back(static_cast<uint32_t>(t));
+      if (std::find(classVertices[c].begin(), classVertices[c].end(), vertex) == classVertices[c].end()) {
+        classVertices[c].push_back(vertex);
+      }
+      edgeUses[edgeKey(c, classAt(t, (corner + 1) % 3))]++;
+    }
+  }
+
+  // planes perpendicular to the surface along open edges keep borders from shrinking
+  for (size_t t = 0; t < triangleCount; t++) {
+    if (!triangleAlive[t]) continue;
+    glm::dvec3 p[3];
+    for (int corner = 0; corner < 3; corner++) p[corner] = classPositions[classAt(t, corner)];
+    glm::dvec3 normal = glm::cross(p[1] - p[0], p[2] - p[0]);
+    if (glm::length(normal) == 0) continue;
+    normal = glm::normalize(normal);
+
+    for (int corner = 0; corner < 3; corner++) {
+      uint32_t a = classAt(t, corner);
+      uint32_t b = classAt(t, (corner + 1) % 3);
+      if (edgeUses[edgeKey(a, b)] != 1) continue;
+      glm::dvec3 edge = p[(corner + 1) % 3] - p[corner];
+      glm::dvec3 borderNormal = glm::normalize(glm::cross(edge, normal));
+      double d = -glm::dot(borderNormal, p[corner]);
+      double scale = BORDER_WEIGHT * glm::dot(edge, edge);
+      quadrics[a].addPlane(borderNormal, d, scale);
+      quadrics[b].addPlane(borderNormal, d, scale);
+    }
+  }
+
+  std::vector<uint32_t> versions(classCount, 0);
+  std::vector<uint8_t> classAlive(classCount, 1);
+  std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> queue;
+  auto pushCandidates = [&](uint32_t a, uint32_t b) {
+    Quadric combined = quadrics[a];
+    combined += quadrics[b];
+    queue.push({combined.evaluate(classPositions[b]), a, b, versions[a], versions[b]});
+    queue.push({combined.evaluate(classPositions[a]), b, a, versions[b], versions[a]});
+  };
+  for (const auto &edge : edgeUses) {
+    pushCandidates(static_cast<uint32_t>(edge.first >> 32), static_cast<uint32_t>(edge.first & 0xffffffffu));
+  }
+  edgeUses.clear();
+
+  size_t targetTriangles = targetIndexCount / 3;
+  double maxError = 0;
+  std::vector<std::pair<uint32_t, uint32_t>> remap;
+  while (liveTriangles > targetTriangles && !queue.empty()) {
+    Collapse collapse = queue.top();
+    queue.pop();
+    uint32_t from = collapse.from;
+    uint32_t to = collapse.to;
+    if (!classAlive[from] || !classAlive[to] || versions[from] != collapse.fromVersion ||
+        versions[to] != collapse.toVersion) {
+      continue;
+    }
+
+    // every vertex of `from` moves to a vertex of `to` it shares an edge with, so the
+    // attributes on each side of a seam stay on their side
+    remap.clear();
+    bool valid = true;
+    for (uint32_t fromVertex : classVertices[from]) {
+      bool referenced = false;
+      uint32_t toVertex = NONE;
+      for (uint32_t t : classTriangles[from]) {
+        if (!triangleAlive[t]) continue;
+        const uint32_t *corners = &triangles[t * 3];
+        if (corners[0] != fromVertex && corners[1] != fromVertex && corners[2] != fromVertex) continue;
+        referenced = true;
+        for (int corner = 0; corner < 3; corner++) {
+          if (classOf[corners[corner]] == to) toVertex = corners[corner];
+        }
+        if (toVertex != NONE) break;
+      }
+      if (!referenced) continue;
+      if (toVertex == NONE) {
+        valid = false;
+        break;
+      }
+      remap.emplace_back(fromVertex, toVertex);
+    }
+
+    // triangles that survive must not turn over
+    for (size_t i = 0; valid && i < classTriangles[from].size(); i++) {
+      uint32_t t = classTriangles[from][i];
+      if (!triangleAlive[t]) continue;
+      glm::vec3 before[3];
+      glm::vec3 after[3];
+      bool degenerates = false;
+      for (int corner = 0; corner < 3; corner++) {
+        uint32_t c = classAt(t, corner);
+        degenerates |= c == to;
+        before[corner] = classPositions[c];
+        after[corner] = c == from ? classPositions[to] : before[corner];
+      }
+      if (degenerates) continue;
+      glm::vec3 normalBefore = glm::cross(before[1] - before[0], before[2] - before[0]);
+      glm::vec3 normalAfter = glm::cross(after[1] - after[0], after[2] - after[0]);
+      valid = glm::dot(normalBefore, normalAfter) > 0.f;
+    }
+    if (!valid) continue;
+
+    for (uint32_t t : classTriangles[from]) {
+      if (!triangleAlive[t]) continue;
+      uint32_t *corners = &triangles[t * 3];
+      bool degenerates = false;
+      for (int corner = 0; corner < 3; corner++) {
+        if (classOf[corners[corner]] == to) {
+          degenerates = true;
+        } else if (classOf[corners[corner]] == from) {
+          for (const auto &pair : remap) {
+            if (pair.first == corners[corner]) corners[corner] = pair.second;
+          }
+        }
+      }
+      if (degenerates) {
+        triangleAlive[t] = 0;
+        liveTriangles--;
+      } else {
+        classTriangles[to].push_back(t);
+      }
+    }
+    classTriangles[from].clear();
+    classTriangles[from].shrink_to_fit();
+    classAlive[from] = 0;
+
+    quadrics[to] += quadrics[from];
+    maxError = std::max(maxError, std::sqrt(collapse.cost / std::max(quadrics[to].weight, 1e-12)));
+    versions[to]++;
+
+    auto &toTriangles = classTriangles[to];
+    toTriangles.erase(std::remove_if(toTriangles.begin(), toTriangles.end(),
+                                     [&](uint32_t t) { return !triangleAlive[t]; }),
+                      toTriangles.end());
+    for (uint32_t t : toTriangles) {
+      for (int corner = 0; corner < 3; corner++) {
+        uint32_t neighbor = classAt(t, corner);
+        if (neighbor != to) pushCandidates(to, neighbor);
+      }
+    }
+  }
+
+  std::vector<uint32_t> result;
+  result.reserve(liveTriangles * 3);
+  for (size_t t = 0; t < triangleCount; t++) {
+    if (triangleAlive[t]) result.insert(result.end(), triangles.begin() + t * 3, triangles.begin() + t * 3 + 3);
+  }
+  error = static_cast<float>(maxError);
+  return result;
+}
+
+void buildMeshLods(const glm::vec3 *positions, size_t vertexCount, const std::vector<uint32_t> &indices,
+                   std::vector<uint32_t> &lodIndices, std::vector<TpMeshLod> &lods) {
+  TP_PROFILE_SCOPE("buildMeshLods");
+  lodIndices = indices;
+  lods.assign(1, {0, static_cast<uint32_t>(indices.size()), 0.f});
+
+  // each level is simplified from the previous one, so the errors add up
+  std::vector<uint32_t> current = indices;
+  float error = 0.f;
+  while (lods.size() < MAX_MESH_LODS && current.size() / 6 >= MIN_LOD_TRIANGLES) {
+    float stepError;
+    std::vector<uint32_t> next = simplifyMesh(positions, vertexCount, current, current.size() / 6 * 3, stepError);
+    if (next.empty() || next.size() * 10 > current.size() * 9) break;
+
+    error += stepError;
+    lods.push_back({static_cast<uint32_t>(lodIndices.size()), static_cast<uint32_t>(next.size()), error});
+    lodIndices.insert(lodIndices.end(), next.begin(), next.end());
+    current.swap(next);
+  }
+}
+
+}  // namespace teapot
@@ -0,0 +1,186 @@
+#include "tp_meshlet.h"
+#include "tp_bounds.h"
+#include "tp_cpu_profiler.h"
+
+// std
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace teapot {
+
+namespace {
+
+constexpr uint32_t NONE = UINT32_MAX;
+
+struct PositionHash {
+  size_t operator()(const glm::vec3 &p) const {
+    uint32_t bits[3];
+    std::memcpy(bits, &p, sizeof(bits));
+    return (bits[0] * 73856093u) ^ (bits[1] * 19349663u) ^ (bits[2] * 83492791u);
+  }
+};
+
+TpMeshlet boundMeshlet(const glm::vec3 *positions, const uint32_t *indices, uint32_t firstIndex, uint32_t indexCount) {
+  TpMeshlet meshlet{};
+  meshlet.firstIndex = firstIndex;
+  meshlet.indexCount = indexCount;
+
+  TpAabb box;
+  for (uint32_t i = firstIndex; i < firstIndex + indexCount; i++) box.expand(positions[indices[i]]);
+  glm::vec3 center = box.center();
+  float radius = 0.f;
+  for (uint32_t i = firstIndex; i < firstIndex + indexCount; i++) {
+    radius = std::max(radius, glm::length(positions[indices[i]] - center));
+  }
+  meshlet.sphere = glm::vec4{center, radius};
+
+  // the axis is the mean facing; the cutoff comes from the triangle furthest off it
+  std::vector<glm::vec3> normals;
+  normals.reserve(indexCount / 3);
+  glm::vec3 axis{0.f};
+  for (uint32_t i = firstIndex; i < firstIndex + indexCount; i += 3) {
+    const glm::vec3 &a = positions[indices[i]];
+    glm::vec3 normal = glm::cross(positions[indices[i + 1]] - a, positions[indices[i + 2]] - a);
+    float length = glm::length(normal);
+    if (length <= 0.f) continue;
+    normals.push_back(normal / length);
+    axis += normals.back();
+  }
+  meshlet.cone = glm::vec4{0.f, 0.f, 1.f, 1.f};
+  float axisLength = glm::length(axis);
+  if (normals.empty() || axisLength <= 1e-6f) return meshlet;
+
+  axis /= axisLength;
+  float minDot = 1.f;
+  for (const auto &normal : normals) minDot = std::min(minDot, glm::dot(normal, axis));
+  // past a hemisphere some triangle faces every viewer
+  if (minDot <= 0.f) return meshlet;
+  meshlet.cone = glm::vec4{axis, std::sqrt(1.f - minDot * minDot)};
+  return meshlet;
+}
+
+}  // namespace
+
+void buildMeshlets(const glm::vec3 *positions, size_t vertexCount, const std::vector<uint32_t> &indices,
+                   uint32_t maxVertices, uint32_t maxTriangles,
+                   std::vector<TpMeshlet> &meshlets, std::vector<uint32_t> &meshletIndices) {
+  TP_PROFILE_SCOPE("buildMeshlets");
+  if (maxVertices < 3 || maxTriangles < 1) {
+    throw std::invalid_argument("meshlets need room for at least one triangle");
+  }
+  meshlets.clear();
+  meshletIndices.clear();
+  meshletIndices.reserve(indices.size());
+
+  // triangles around each position, so clusters grow across UV seams
+  std::vector<uint32_t> classOf(vertexCount);
+  uint32_t classCount = 0;
+  {
+    std::unordered_map<glm::vec3, uint32_t, PositionHash> lookup;
+    for (size_t v = 0; v < vertexCount; v++) {
+      auto inserted = lookup.emplace(positions[v], classCount);
+      if (inserted.second) classCount++;
+      classOf[v] = inserted.first->second;
+    }
+  }
+  size_t triangleCount = indices.size() / 3;
+  std::vector<uint32_t> classTriangleOffsets(classCount + 1, 0);
+  for (uint32_t index : indices) classTriangleOffsets[classOf[index] + 1]++;
+  for (uint32_t c = 0; c < classCount; c++) classTriangleOffsets[c + 1] += classTriangleOffsets[c];
+  std::vector<uint32_t> classTriangles(classTriangleOffsets.back());
+  {
+    std::vector<uint32_t> cursor(classTriangleOffsets.begin(), classTriangleOffsets.end() - 1);
+    for (size_t i = 0; i < triangleCount * 3; i++) {
+      classTriangles[cursor[classOf[indices[i]]]++] = static_cast<uint32_t>(i / 3);
+    }
+  }
+
+  std::vector<uint8_t> used(triangleCount, 0);
+  // stamped with the meshlet number, so nothing needs clearing between meshlets
+  std::vector<uint32_t> vertexStamp(vertexCount, NONE);
+  std::vector<uint32_t> classStamp(classCount, NONE);
+  std::vector<uint32_t> candidates;
+  size_t nextSeed = 0;
+
+  uint32_t meshletNumber = 0;
+  uint32_t firstIndex = 0;
+  uint32_t meshletVertices = 0;
+  uint32_t meshletTriangles = 0;
+  auto newVertices = [&](size_t triangle) {
+    uint32_t count = 0;
+    for (int corner = 0; corner < 3; corner++) {
+      uint32_t v = indices[triangle * 3 + corner];
+      // a triangle may repeat a vertex; count it once
+      bool repeated = (corner > 0 && v == indices[triangle * 3]) || (corner > 1 && v == indices[triangle * 3 + 1]);
+      if (vertexStamp[v] != meshletNumber && !repeated) count++;
+    }
+    return count;
+  };
+  auto finishMeshlet = [&]() {
+    auto indexCount = static_cast<uint32_t>(meshletIndices.size()) - firstIndex;
+    meshlets.push_back(boundMeshlet(positions, meshletIndices.data(), firstIndex, indexCount));
+    firstIndex += indexCount;
+    meshletNumber++;
+    meshletVertices = 0;
+    meshletTriangles = 0;
+    candidates.clear();
+  };
+
+  for (size_t placed = 0; placed < triangleCount; placed++) {
+    // the adjacent triangle adding the fewest vertices; culled entries are dropped on the way
+    size_t best = NONE;
+    uint32_t bestNew = 4;
+    for (size_t k = 0; k < candidates.size();) {
+      uint32_t triangle = candidates[k];
+      if (used[triangle]) {
+        candidates[k] = candidates.back();
+        candidates.pop_back();
+        continue;
+      }
+      uint32_t added = newVertices(triangle);
+      if (meshletVertices + added <= maxVertices && (added < bestNew || (added == bestNew && triangle < best))) {
+        best = triangle;
+        bestNew = added;
+      }
+      k++;
+    }
+
+    if (best == NONE) {
+      // Nothing adjacent fits. A full meshlet is closed and the next one starts next to it; a
+      // meshlet that ran out of neighbours continues in index order, which exporters tend to
+      // keep spatially coherent.
+      if (!candidates.empty()) {
+        best = candidates.front();
+        finishMeshlet();
+      } else {
+        while (used[nextSeed]) nextSeed++;
+        best = nextSeed;
+        if (meshletVertices + newVertices(best) > maxVertices) finishMeshlet();
+      }
+      bestNew = newVertices(best);
+    }
+
+    used[best] = 1;
+    meshletVertices += bestNew;
+    meshletTriangles++;
+    for (int corner = 0; corner < 3; corner++) {
+      uint32_t v = indices[best * 3 + corner];
+      meshletIndices.push_back(v);
+      vertexStamp[v] = meshletNumber;
+      uint32_t c = classOf[v];
+      if (classStamp[c] == meshletNumber) continue;
+      classStamp[c] = meshletNumber;
+      for (uint32_t k = classTriangleOffsets[c]; k < classTriangleOffsets[c + 1]; k++) {
+        if (!used[classTriangles[k]]) candidates.push_back(classTriangles[k]);
+      }
+    }
+
+    if (meshletTriangles == maxTriangles) finishMeshlet();
+  }
+  if (meshletTriangles > 0) finishMeshlet();
+}
+
+}  // namespace teapot
@@ -2,221 +2,205 @@
 // Created by user on 6/27/2021.
 //
 #include "tp_model.h"
+#include "tp_cpu_profiler.h"
 
 #include <cstring>
 #include <cassert>
 #include <stdexcept>
 #include <array>
+#include <atomic>
+#include <unordered_map>
 #include <tp_swap_chain.h>
 
 #include "tiny_obj_loader.h"
-#include "stb_image.h"
 
 namespace teapot {
 
+namespace {
 
-TpModel::TpModel(TpDevice &device,
+// smaller meshes are cheaper to draw whole than to cull cluster by cluster
+constexpr size_t MIN_MESHLET_MODEL_TRIANGLES = 4 * MESHLET_MAX_TRIANGLES;
+
+uint32_t nextId() {
+  static std::atomic<uint32_t> currentId{0};
+  return currentId++;
+}
+
+}  // namespace
+
+TpModel::TpModel(TpDevice &device, TpGeometryArena &geometry, TpTextureAtlas &textures,
                  const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices,
-                 const std::string &texture): tpDevice(device) {
-  createTextureImage(texture);
-  if (textureImage != nullptr) {
-    createTextureImageView();
-    createTextureSampler();
+                 const std::string &texture)
+    : tpDevice(device), geometry(geometry), textures(textures), id{nextId()} {
+  TP_PROFILE_SCOPE("TpModel::TpModel");
+  textured = textures.load(texture, this->texture);
+  if (!textured) {
+    printf("Failed to load texture\n");
   }
-  createVertexBuffers(vertices);
-  createIndexBuffer(indices);
+  createMesh(vertices, indices);
 }
 
-std::shared_ptr<TpModel> TpModel::loadObjFile(TpDevice &device,
+TpModel::TpModel(TpDevice &device, TpGeometryArena &geometry, TpTextureAtlas &textures,
+                 const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices,
+                 const unsigned char *rgbaPixels, uint32_t texWidth, uint32_t texHeight)
+    : tpDevice(device), geometry(geometry), textures(textures), id{nextId()} {
+  TP_PROFILE_SCOPE("TpModel::TpModel");
+  texture = textures.add(rgbaPixels, texWidth, texHeight);
+  textured = true;
+  createMesh(vertices, indices);
+}
+
+TpModel::TpModel(TpDevice &device, TpGeometryArena &geometry, TpTextureAtlas &textures,
+                 const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices,
+                 const TpTextureRef &texture)
+    : tpDevice(device), geometry(geometry), textures(textures), id{nextId()}, textured{true}, texture{texture} {
+  TP_PROFILE_SCOPE("TpModel::TpModel");
+  createMesh(vertices, indices);
+}
+
+std::shared_ptr<TpModel> TpModel::loadObjFile(TpDevice &device, TpGeometryArena &geometry, TpTextureAtlas &textures,
                                               const std::string& objFilePath,
-                                              const std::string &texturePath) {
+                                              const std::string &texturePath,
+                                              bool occluder) {
+  TP_PROFILE_SCOPE("TpModel::loadObjFile");
   tinyobj::attrib_t attrib;
   std::vector<tinyobj::shape_t> shapes;
   std::vector<tinyobj::material_t> materials;
   std::string err;
 
-  if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &err, objFilePath.c_str())) {
-    throw std::runtime_error(err);
+  {
+    TP_PROFILE_SCOPE("tinyobj::LoadObj");
+    if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &err, objFilePath.c_str())) {
+      throw std::runtime_error(err);
+    }
   }
 
   std::vector<Vertex> vertices;
   std::vector<uint32_t> indices;
+  // OBJ indexes positions and texcoords separately; share a vertex wherever both match so the
+  // simplifier sees a connected mesh
+  std::unordered_map<uint64_t, uint32_t> uniqueVertices;
 
   for (const auto& shape : shapes) {
     for (const auto& index : shape.mesh.indices) {
-      Vertex vertex{};
-
-      vertex.position = {
-              attrib.vertices[3 * index.vertex_index + 0],
-              attrib.vertices[3 * index.vertex_index + 1],
-              attrib.vertices[3 * index.vertex_index + 2]
-      };
-
-      vertex.texCoord = {
-              attrib.texcoords[2 * index.texcoord_index + 0],
-              -attrib.texcoords[2 * index.texcoord_index + 1]
-      };
-
-      vertex.color = {0.f, 0.5f, 1.0f};
-
-      vertices.push_back(vertex);
-      indices.push_back(indices.size());
+      uint64_t key = (static_cast<uint64_t>(static_cast<uint32_t>(index.vertex_index)) << 32) |
+                     static_cast<uint32_t>(index.texcoord_index);
+      auto inserted = uniqueVertices.emplace(key, static_cast<uint32_t>(vertices.size()));
+      if (inserted.second) {
+        Vertex vertex{};
+
+        vertex.position = {
+                attrib.vertices[3 * index.vertex_index + 0],
+                attrib.vertices[3 * index.vertex_index + 1],
+                attrib.vertices[3 * index.vertex_index + 2]
+        };
+
+        vertex.texCoord = {
+                attrib.texcoords[2 * index.texcoord_index + 0],
+                -attrib.texcoords[2 * index.texcoord_index + 1]
+        };
+
+        vertex.color = {0.f, 0.5f, 1.0f};
+
+        vertices.push_back(vertex);
+      }
+      indices.push_back(inserted.first->second);
     }
   }
 
-  return std::make_shared<TpModel>(device, vertices, indices, texturePath);
+  auto model = std::make_shared<TpModel>(device, geometry, textures, vertices, indices, texturePath);
+  if (occluder) {
+    // the OBJ positions as they are, without the texcoord splits
+    auto mesh = std::make_shared<TpOccluderMesh>();
+    mesh->positions.resize(attrib.vertices.size() / 3);
+    std::memcpy(mesh->positions.data(), attrib.vertices.data(), mesh->positions.size() * sizeof(glm::vec3));
+    for (const auto &shape : shapes) {
+      for (const auto &index : shape.mesh.indices) mesh->indices.push_back(static_cast<uint32_t>(index.vertex_index));
+    }
+    model->setOccluderMesh(std::move(mesh));
+  }
+  return model;
 }
 
 TpModel::~TpModel() {
-  vmaDestroyBuffer(tpDevice.allocator(), vertexBuffer, vertexBufferAllocation);
-  vmaDestroyBuffer(tpDevice.allocator(), indexBuffer, indexBufferAllocation);
-  if (textureImage != nullptr) {
-    vmaDestroyImage(tpDevice.allocator(), textureImage, textureImageAllocation);
-    vkDestroyImageView(tpDevice.device(), textureImageView, nullptr);
-    vkDestroySampler(tpDevice.device(), textureSampler, nullptr);
+  geometry.free(mesh);
+  if (meshletBuffer != VK_NULL_HANDLE) {
+    tpDevice.untrackMovableBuffer(meshletBufferAllocation);
+    vmaDestroyBuffer(tpDevice.allocator(), meshletBuffer, meshletBufferAllocation);
   }
 }
 
 
-void TpModel::createVertexBuffers(const std::vector<Vertex> &vertices) {
-  vertexCount = static_cast<uint32_t>(vertices.size());
-  assert(vertexCount >= 3 && "Vertex count must be at least 3");
-  VkDeviceSize bufferSize = sizeof(vertices[0]) * vertexCount;
-
+void TpModel::createDeviceBuffer(const void *data, VkDeviceSize size, VkBufferUsageFlags usage,
+                                 VkBuffer &buffer, VmaAllocation &allocation) {
   VkBuffer stagingBuffer;
   VmaAllocation stagingAlloc;
-  tpDevice.createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                        VMA_MEMORY_USAGE_CPU_TO_GPU,
-                        stagingBuffer, stagingAlloc);
-  void *data;
-  vmaMapMemory(tpDevice.allocator(), stagingAlloc, &data);
-  memcpy(data, vertices.data(), bufferSize);
-  vmaFlushAllocation(tpDevice.allocator(), stagingAlloc, 0, bufferSize);
+  tpDevice.createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                        VMA_MEMORY_USAGE_CPU_ONLY,
+                        stagingBuffer, stagingAlloc, TpMemoryClass::Staging);
+  void *mapped;
+  vmaMapMemory(tpDevice.allocator(), stagingAlloc, &mapped);
+  memcpy(mapped, data, static_cast<size_t>(size));
+  vmaFlushAllocation(tpDevice.allocator(), stagingAlloc, 0, size);
   vmaUnmapMemory(tpDevice.allocator(), stagingAlloc);
 
-  tpDevice.createBuffer(bufferSize,
-                        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+  tpDevice.createBuffer(size, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
                         VMA_MEMORY_USAGE_GPU_ONLY,
-                        vertexBuffer, vertexBufferAllocation);
-  tpDevice.copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
-  vmaDestroyBuffer(tpDevice.allocator(), stagingBuffer, stagingAlloc);
-}
-
-void TpModel::createIndexBuffer(const std::vector<uint32_t> &indices) {
-  indexCount = static_cast<uint32_t>(indices.size());
-  VkDeviceSize indexBufferSize = sizeof(indices[0]) * indexCount;
-
-  VkBuffer stagingBuffer;
-  VmaAllocation stagingBufferAllocation;
-  tpDevice.createBuffer(indexBufferSize,
-                        VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                        VMA_MEMORY_USAGE_CPU_TO_GPU,
-                        stagingBuffer, stagingBufferAllocation);
-
-  void *data;
-  vmaMapMemory(tpDevice.allocator(), stagingBufferAllocation, &data);
-  memcpy(data, indices.data(), (size_t) indexBufferSize);
-  vmaUnmapMemory(tpDevice.allocator(), stagingBufferAllocation);
-
-  tpDevice.createBuffer(indexBufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                        VMA_MEMORY_USAGE_GPU_ONLY, indexBuffer, indexBufferAllocation);
-
-  tpDevice.copyBuffer(stagingBuffer, indexBuffer, indexBufferSize);
-  vmaDestroyBuffer(tpDevice.allocator(), stagingBuffer, stagingBufferAllocation);
+                        buffer, allocation, TpMemoryClass::StaticGeometry);
+  VmaAllocator allocator = tpDevice.allocator();
+  tpDevice.deferDestroy(tpDevice.copyBuffer(stagingBuffer, buffer, size), [=]() {
+    vmaDestroyBuffer(allocator, stagingBuffer, stagingAlloc);
+  });
 }
 
-void TpModel::createTextureImage(const std::string& imagePath) {
-  int texWidth, texHeight, texChannels;
-  stbi_uc* pixels = stbi_load(imagePath.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
-
-  VkDeviceSize imageSize = texWidth * texHeight * 4;
+void TpModel::createMesh(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices) {
+  auto vertexCount = static_cast<uint32_t>(vertices.size());
+  assert(vertexCount >= 3 && "Vertex count must be at least 3");
 
-  if (!pixels) {
-    printf("Failed to load texture\n");
-    return;
+  // Depth-only passes fetch 12 bytes per vertex instead of the whole interleaved vertex.
+  std::vector<glm::vec3> positions(vertexCount);
+  for (uint32_t i = 0; i < vertexCount; i++) {
+    positions[i] = vertices[i].position;
+    bounds.expand(vertices[i].position);
   }
 
-  VkBuffer stagingBuffer;
-  VmaAllocation stagingBufferAllocation;
-  tpDevice.createBuffer(imageSize,
-                        VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                        VMA_MEMORY_USAGE_CPU_TO_GPU,
-                        stagingBuffer, stagingBufferAllocation);
-
-  void *data;
-  vmaMapMemory(tpDevice.allocator(), stagingBufferAllocation, &data);
-  memcpy(data, pixels, (size_t) imageSize);
-  vmaUnmapMemory(tpDevice.allocator(), stagingBufferAllocation);
-  stbi_image_free(pixels);
-
-  VkImageCreateInfo imageInfo{};
-  imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-  imageInfo.imageType = VK_IMAGE_TYPE_2D;
-  imageInfo.extent.width = static_cast<uint32_t>(texWidth);
-  imageInfo.extent.height = static_cast<uint32_t>(texHeight);
-  imageInfo.extent.depth = 1;
-  imageInfo.mipLevels = 1;
-  imageInfo.arrayLayers = 1;
-  imageInfo.format = VK_FORMAT_R8G8B8A8_SRGB;
-  imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-  imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-
-  imageInfo.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
-  imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-  imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-  imageInfo.flags = 0; // Optional
-
-  tpDevice.createImageWithInfo(imageInfo, VMA_MEMORY_USAGE_GPU_ONLY, textureImage, textureImageAllocation);
-
-  tpDevice.transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
-    VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-  tpDevice.copyBufferToImage(stagingBuffer, textureImage, texWidth, texHeight, 1);
-  tpDevice.transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
-                                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-
-  vmaDestroyBuffer(tpDevice.allocator(), stagingBuffer, stagingBufferAllocation);
-}
-
-void TpModel::createTextureImageView() {
-  textureImageView = tpDevice.createImageView(textureImage, VK_FORMAT_R8G8B8A8_SRGB);
-}
+  // LOD 0 is stored in meshlet order, so the meshlet ranges index it directly
+  std::vector<TpMeshlet> meshlets;
+  std::vector<uint32_t> meshletIndices;
+  if (indices.size() / 3 >= MIN_MESHLET_MODEL_TRIANGLES) {
+    buildMeshlets(positions.data(), positions.size(), indices, MESHLET_MAX_VERTICES, MESHLET_MAX_TRIANGLES,
+                  meshlets, meshletIndices);
+  }
 
-void TpModel::createTextureSampler() {
-  VkSamplerCreateInfo samplerInfo{};
-  samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-  samplerInfo.magFilter = VK_FILTER_LINEAR;
-  samplerInfo.minFilter = VK_FILTER_LINEAR;
-  samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-  samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-  samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-  samplerInfo.anisotropyEnable = VK_TRUE;
-  samplerInfo.maxAnisotropy = 8;
-  samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
-  samplerInfo.unnormalizedCoordinates = VK_FALSE;
-  samplerInfo.compareEnable = VK_FALSE;
-  samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
-  samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
-  samplerInfo.mipLodBias = 0.0f;
-  samplerInfo.minLod = 0.0f;
-  samplerInfo.maxLod = 0.0f;
-  if (vkCreateSampler(tpDevice.device(), &samplerInfo, nullptr, &textureSampler) != VK_SUCCESS) {
-    throw std::runtime_error("failed to create texture sampler!");
+  std::vector<uint32_t> lodIndices;
+  buildMeshLods(positions.data(), positions.size(), meshlets.empty() ? indices : meshletIndices, lodIndices, lods);
+  mesh = geometry.allocate(vertices.data(), positions.data(), vertexCount,
+                           lodIndices.data(), static_cast<uint32_t>(lodIndices.size()));
+
+  if (!meshlets.empty()) {
+    meshletCount = static_cast<uint32_t>(meshlets.size());
+    VkDeviceSize meshletBytes = sizeof(meshlets[0]) * meshlets.size();
+    createDeviceBuffer(meshlets.data(), meshletBytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                       meshletBuffer, meshletBufferAllocation);
+    // cluster culling sets compare the buffer, so a moved one just gets a new set
+    tpDevice.trackMovableBuffer(meshletBuffer, meshletBufferAllocation, meshletBytes,
+                                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                [this](VkBuffer moved) { meshletBuffer = moved; });
   }
 }
 
-/*
- * bind the vertex buffer with binding / binding descriptions
- */
 void TpModel::bind(VkCommandBuffer commandBuffer) {
+  geometry.bind(commandBuffer);
+}
 
-  VkBuffer buffers[] = {vertexBuffer};
-  VkDeviceSize offsets[] = {0};
-  vkCmdBindVertexBuffers(commandBuffer, 0, 1, buffers, offsets);
-  vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+void TpModel::bindPositions(VkCommandBuffer commandBuffer) {
+  geometry.bindPositions(commandBuffer);
 }
 
-void TpModel::draw(VkCommandBuffer commandBuffer) {
-  vkCmdDrawIndexed(commandBuffer, indexCount, 1, 0, 0, 0);
+void TpModel::draw(VkCommandBuffer commandBuffer, uint32_t lod) {
+  const TpMeshRange &range = getMeshRange();
+  vkCmdDrawIndexed(commandBuffer, lods[lod].indexCount, 1, range.firstIndex + lods[lod].firstIndex,
+                   range.vertexOffset, 0);
 }
 
 
@@ -251,6 +235,27 @@ std::vector<VkVertexInputAttributeDescription> Vertex::getAttributeDescriptions(
   return attributeDescriptions;
 }
 
+std::vector<VkVertexInputBindingDescription> Vertex::getPositionBindingDescriptions() {
+  std::vector<VkVertexInputBindingDescription> bindingDescriptions(1);
+
+  bindingDescriptions[0].binding = 0;
+  bindingDescriptions[0].stride = sizeof(glm::vec3);
+  bindingDescriptions[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+  return bindingDescriptions;
+}
+
+std::vector<VkVertexInputAttributeDescription> Vertex::getPositionAttributeDescriptions() {
+  std::vector<VkVertexInputAttributeDescription> attributeDescriptions(1);
+
+  attributeDescriptions[0].binding = 0;
+  attributeDescriptions[0].location = 0;
+  attributeDescriptions[0].format = VK_FORMAT_R32G32B32_SFLOAT;
+  attributeDescriptions[0].offset = 0;
+
+  return attributeDescriptions;
+}
+
 
 }
 
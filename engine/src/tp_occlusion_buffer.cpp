@@ -0,0 +1,323 @@
+#include "tp_occlusion_buffer.h"
+#include "tp_cpu_profiler.h"
+
+// std
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TP_OCCLUSION_SSE2
+#endif
+
+namespace teapot {
+
+namespace {
+
+// below this many pixels of doubled area a triangle covers no pixel center worth the setup
+constexpr float MIN_TRIANGLE_AREA = 1e-6f;
+constexpr size_t TILE_GRAIN = 4;
+
+double elapsedMs(uint64_t startNs) {
+  return static_cast<double>(TpCpuProfiler::now() - startNs) * 1e-6;
+}
+
+// screen position in buffer pixels; w is 0 when the point is in front of the near plane
+glm::vec4 toScreen(const glm::vec4 &clip, float width, float height) {
+  if (clip.z < 0.f) return glm::vec4{0.f};
+  float inverseW = 1.f / clip.w;
+  return {(clip.x * inverseW * 0.5f + 0.5f) * width, (clip.y * inverseW * 0.5f + 0.5f) * height,
+          clip.z * inverseW, 1.f};
+}
+
+int clampToInt(float value, int limit) {
+  return static_cast<int>(std::min(std::max(value, 0.f), static_cast<float>(limit)));
+}
+
+// Keeps the nearer of the stored depth and the triangle's plane for the pixel centers of
+// [x0, x1) inside the triangle. row starts at screen column rowX, a multiple of 4.
+template <typename Triangle>
+void rasterizeRow(float *row, int rowX, int x0, int x1, float centerY, const Triangle &t) {
+#if defined(TP_OCCLUSION_SSE2)
+  // lanes left of x0 or right of x1 are outside the bounding box, so outside the triangle
+  __m128 laneOffsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+  __m128 edgeX0 = _mm_set1_ps(t.edgeX[0]);
+  __m128 edgeX1 = _mm_set1_ps(t.edgeX[1]);
+  __m128 edgeX2 = _mm_set1_ps(t.edgeX[2]);
+  __m128 rowEdge0 = _mm_set1_ps(t.edgeY[0] * centerY + t.edgeOffset[0]);
+  __m128 rowEdge1 = _mm_set1_ps(t.edgeY[1] * centerY + t.edgeOffset[1]);
+  __m128 rowEdge2 = _mm_set1_ps(t.edgeY[2] * centerY + t.edgeOffset[2]);
+  __m128 depthX = _mm_set1_ps(t.depthX);
+  __m128 rowDepth = _mm_set1_ps(t.depthY * centerY + t.depthOffset);
+  __m128 zero = _mm_setzero_ps();
+  for (int x = x0 & ~3; x < x1; x += 4) {
+    __m128 centerX = _mm_add_ps(_mm_set1_ps(static_cast<float>(x)), laneOffsets);
+    __m128 inside = _mm_and_ps(
+        _mm_and_ps(_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeX0, centerX), rowEdge0), zero),
+                   _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeX1, centerX), rowEdge1), zero)),
+        _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeX2, centerX), rowEdge2), zero));
+    if (_mm_movemask_ps(inside) == 0) continue;
+    __m128 z = _mm_add_ps(_mm_mul_ps(depthX, centerX), rowDepth);
+    float *pixels = row + (x - rowX);
+    __m128 stored = _mm_loadu_ps(pixels);
+    __m128 nearer = _mm_min_ps(stored, z);
+    _mm_storeu_ps(pixels, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, stored)));
+  }
+#else
+  for (int x = x0; x < x1; x++) {
+    float centerX = static_cast<float>(x) + 0.5f;
+    bool inside = true;
+    for (int e = 0; e < 3; e++) {
+      inside = inside && t.edgeX[e] * centerX + t.edgeY[e] * centerY + t.edgeOffset[e] >= 0.f;
+    }
+    if (!inside) continue;
+    float &pixel = row[x - rowX];
+    pixel = std::min(pixel, t.depthX * centerX + t.depthY * centerY + t.depthOffset);
+  }
+#endif
+}
+
+// true when a pixel of [x0, x1) is not nearer than depth
+bool rowVisible(const float *row, int rowX, int x0, int x1, float depth) {
+#if defined(TP_OCCLUSION_SSE2)
+  __m128 laneOffsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+  __m128 first = _mm_set1_ps(static_cast<float>(x0));
+  __m128 last = _mm_set1_ps(static_cast<float>(x1));
+  __m128 threshold = _mm_set1_ps(depth);
+  for (int x = x0 & ~3; x < x1; x += 4) {
+    __m128 centerX = _mm_add_ps(_mm_set1_ps(static_cast<float>(x)), laneOffsets);
+    __m128 inRange = _mm_and_ps(_mm_cmpge_ps(centerX, first), _mm_cmplt_ps(centerX, last));
+    __m128 farther = _mm_cmpge_ps(_mm_loadu_ps(row + (x - rowX)), threshold);
+    if (_mm_movemask_ps(_mm_and_ps(inRange, farther)) != 0) return true;
+  }
+  return false;
+#else
+  for (int x = x0; x < x1; x++) {
+    if (row[x - rowX] >= depth) return true;
+  }
+  return false;
+#endif
+}
+
+}  // namespace
+
+TpOcclusionBuffer::TpOcclusionBuffer(uint32_t width, uint32_t height) : width{width}, height{height} {
+  if (width == 0 || height == 0 || width % TILE_WIDTH != 0 || height % TILE_HEIGHT != 0) {
+    throw std::invalid_argument("occlusion buffer size must be a multiple of the tile size");
+  }
+  tilesX = width / TILE_WIDTH;
+  tilesY = height / TILE_HEIGHT;
+  depth.assign(static_cast<size_t>(width) * height, 1.f);
+  tileMaxDepth.assign(static_cast<size_t>(tilesX) * tilesY, 1.f);
+  tileBins.resize(tileMaxDepth.size());
+}
+
+float TpOcclusionBuffer::depthAt(uint32_t x, uint32_t y) const {
+  uint32_t tile = (y / TILE_HEIGHT) * tilesX + x / TILE_WIDTH;
+  return tilePixels(tile)[(y % TILE_HEIGHT) * TILE_WIDTH + x % TILE_WIDTH];
+}
+
+void TpOcclusionBuffer::setupTriangles(const TpScene &scene, const Occluder &occluder,
+                                       std::vector<Triangle> &out) const {
+  out.clear();
+  const TpOccluderMesh &mesh = *scene.getModel(scene.modelHandles()[occluder.index]).getOccluderMesh();
+  glm::mat4 transform = viewProj * scene.worldMatrices()[occluder.index];
+  auto screenWidth = static_cast<float>(width);
+  auto screenHeight = static_cast<float>(height);
+
+  std::vector<glm::vec4> screen(mesh.positions.size());
+  for (size_t i = 0; i < mesh.positions.size(); i++) {
+    screen[i] = toScreen(transform * glm::vec4{mesh.positions[i], 1.f}, screenWidth, screenHeight);
+  }
+
+  out.reserve(mesh.indices.size() / 3);
+  for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+    const glm::vec4 &v0 = screen[mesh.indices[i]];
+    const glm::vec4 &v1 = screen[mesh.indices[i + 1]];
+    const glm::vec4 &v2 = screen[mesh.indices[i + 2]];
+    // dropping triangles that cross the near plane only loses occlusion
+    if (v0.w == 0.f || v1.w == 0.f || v2.w == 0.f) continue;
+
+    float area = (v1.x - v0.x) * (v2.y - v0.y) - (v2.x - v0.x) * (v1.y - v0.y);
+    if (std::abs(area) < MIN_TRIANGLE_AREA) continue;
+
+    Triangle triangle{};
+    triangle.minX = clampToInt(std::floor(std::min({v0.x, v1.x, v2.x})), static_cast<int>(width));
+    triangle.minY = clampToInt(std::floor(std::min({v0.y, v1.y, v2.y})), static_cast<int>(height));
+    triangle.maxX = clampToInt(std::ceil(std::max({v0.x, v1.x, v2.x})), static_cast<int>(width));
+    triangle.maxY = clampToInt(std::ceil(std::max({v0.y, v1.y, v2.y})), static_cast<int>(height));
+    if (triangle.minX >= triangle.maxX || triangle.minY >= triangle.maxY) continue;
+
+    // edges oriented so the inside is positive whatever the winding
+    float sign = area > 0.f ? 1.f : -1.f;
+    const glm::vec4 *corners[3] = {&v0, &v1, &v2};
+    for (int e = 0; e < 3; e++) {
+      const glm::vec4 &a = *corners[e];
+      const glm::vec4 &b = *corners[(e + 1) % 3];
+      triangle.edgeX[e] = sign * (a.y - b.y);
+      triangle.edgeY[e] = sign * (b.x - a.x);
+      triangle.edgeOffset[e] = sign * (b.y * a.x - b.x * a.y);
+    }
+
+    // z / w is linear in screen space
+    triangle.depthX = ((v1.z - v0.z) * (v2.y - v0.y) - (v2.z - v0.z) * (v1.y - v0.y)) / area;
+    triangle.depthY = ((v1.x - v0.x) * (v2.z - v0.z) - (v2.x - v0.x) * (v1.z - v0.z)) / area;
+    triangle.depthOffset = v0.z - triangle.depthX * v0.x - triangle.depthY * v0.y;
+    out.push_back(triangle);
+  }
+}
+
+void TpOcclusionBuffer::rasterizeTile(uint32_t tile) {
+  float *pixels = tilePixels(tile);
+  std::fill(pixels, pixels + TILE_WIDTH * TILE_HEIGHT, 1.f);
+
+  auto tileX = static_cast<int>((tile % tilesX) * TILE_WIDTH);
+  auto tileY = static_cast<int>((tile / tilesX) * TILE_HEIGHT);
+  for (uint32_t index : tileBins[tile]) {
+    const Triangle &triangle = triangles[index];
+    int x0 = std::max(triangle.minX, tileX);
+    int x1 = std::min(triangle.maxX, tileX + static_cast<int>(TILE_WIDTH));
+    int y0 = std::max(triangle.minY, tileY);
+    int y1 = std::min(triangle.maxY, tileY + static_cast<int>(TILE_HEIGHT));
+    for (int y = y0; y < y1; y++) {
+      rasterizeRow(pixels + (y - tileY) * TILE_WIDTH, tileX, x0, x1, static_cast<float>(y) + 0.5f, triangle);
+    }
+  }
+  tileMaxDepth[tile] = *std::max_element(pixels, pixels + TILE_WIDTH * TILE_HEIGHT);
+}
+
+void TpOcclusionBuffer::render(const TpScene &scene, const std::vector<uint32_t> &visible, const TpCamera &camera,
+                               TpThreadPool *pool) {
+  TP_PROFILE_SCOPE("TpOcclusionBuffer::render");
+  uint64_t startNs = TpCpuProfiler::now();
+  stats = {};
+  viewProj = camera.getProjection() * camera.getView();
+
+  // the occluders whose bounds can cover the most of the screen: radius over distance
+  occluders.clear();
+  const glm::mat4 &view = camera.getView();
+  const TpAabb *worldBounds = scene.worldBounds();
+  const TpModelHandle *modelHandles = scene.modelHandles();
+  for (uint32_t index : visible) {
+    if (scene.getModel(modelHandles[index]).getOccluderMesh() == nullptr) continue;
+    const TpAabb &box = worldBounds[index];
+    float distance = glm::length(glm::vec3{view * glm::vec4{box.center(), 1.f}});
+    occluders.push_back({index, glm::length(box.extent()) / std::max(distance, 1e-3f)});
+  }
+  auto occluderCount = std::min(occluders.size(), static_cast<size_t>(maxOccluders));
+  std::partial_sort(occluders.begin(), occluders.begin() + occluderCount, occluders.end(),
+                    [](const Occluder &a, const Occluder &b) { return a.coverage > b.coverage; });
+  occluders.resize(occluderCount);
+
+  occluderTriangles.resize(occluderCount);
+  auto setup = [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) setupTriangles(scene, occluders[i], occluderTriangles[i]);
+  };
+  if (pool != nullptr) {
+    pool->parallelFor(occluderCount, 1, setup);
+  } else {
+    setup(0, occluderCount);
+  }
+
+  // binned in occluder order, so every tile sees its triangles in the same order on any thread count
+  triangles.clear();
+  for (auto &bin : tileBins) bin.clear();
+  for (size_t i = 0; i < occluderCount; i++) {
+    for (const auto &triangle : occluderTriangles[i]) {
+      auto index = static_cast<uint32_t>(triangles.size());
+      triangles.push_back(triangle);
+      for (int ty = triangle.minY / static_cast<int>(TILE_HEIGHT);
+           ty * static_cast<int>(TILE_HEIGHT) < triangle.maxY; ty++) {
+        for (int tx = triangle.minX / static_cast<int>(TILE_WIDTH);
+             tx * static_cast<int>(TILE_WIDTH) < triangle.maxX; tx++) {
+          tileBins[ty * tilesX + tx].push_back(index);
+        }
+      }
+    }
+  }
+
+  auto rasterize = [&](size_t begin, size_t end) {
+    for (size_t tile = begin; tile < end; tile++) rasterizeTile(static_cast<uint32_t>(tile));
+  };
+  if (pool != nullptr) {
+    pool->parallelFor(tileBins.size(), TILE_GRAIN, rasterize);
+  } else {
+    rasterize(0, tileBins.size());
+  }
+
+  stats.occluders = static_cast<uint32_t>(occluderCount);
+  stats.occluderTriangles = static_cast<uint32_t>(triangles.size());
+  stats.rasterizeMs = elapsedMs(startNs);
+}
+
+bool TpOcclusionBuffer::isVisible(const TpAabb &worldBounds) const {
+  // the nearest depth of the box and the pixels its projection touches
+  auto screenWidth = static_cast<float>(width);
+  auto screenHeight = static_cast<float>(height);
+  glm::vec2 screenMin{std::numeric_limits<float>::max()};
+  glm::vec2 screenMax{std::numeric_limits<float>::lowest()};
+  float nearest = std::numeric_limits<float>::max();
+  for (int corner = 0; corner < 8; corner++) {
+    glm::vec3 position{corner & 1 ? worldBounds.max.x : worldBounds.min.x,
+                       corner & 2 ? worldBounds.max.y : worldBounds.min.y,
+                       corner & 4 ? worldBounds.max.z : worldBounds.min.z};
+    glm::vec4 screen = toScreen(viewProj * glm::vec4{position, 1.f}, screenWidth, screenHeight);
+    // boxes reaching the near plane are in front of every occluder
+    if (screen.w == 0.f) return true;
+    screenMin = glm::min(screenMin, glm::vec2{screen});
+    screenMax = glm::max(screenMax, glm::vec2{screen});
+    nearest = std::min(nearest, screen.z);
+  }
+  int x0 = clampToInt(std::floor(screenMin.x), static_cast<int>(width));
+  int y0 = clampToInt(std::floor(screenMin.y), static_cast<int>(height));
+  int x1 = clampToInt(std::ceil(screenMax.x), static_cast<int>(width));
+  int y1 = clampToInt(std::ceil(screenMax.y), static_cast<int>(height));
+  // off screen; frustum culling decides
+  if (x0 >= x1 || y0 >= y1) return true;
+
+  for (int ty = y0 / static_cast<int>(TILE_HEIGHT); ty * static_cast<int>(TILE_HEIGHT) < y1; ty++) {
+    for (int tx = x0 / static_cast<int>(TILE_WIDTH); tx * static_cast<int>(TILE_WIDTH) < x1; tx++) {
+      uint32_t tile = ty * tilesX + tx;
+      // every pixel of the tile is nearer
+      if (tileMaxDepth[tile] < nearest) continue;
+
+      const float *pixels = tilePixels(tile);
+      int tileX = tx * static_cast<int>(TILE_WIDTH);
+      int tileY = ty * static_cast<int>(TILE_HEIGHT);
+      int rowX0 = std::max(x0, tileX);
+      int rowX1 = std::min(x1, tileX + static_cast<int>(TILE_WIDTH));
+      for (int y = std::max(y0, tileY); y < std::min(y1, tileY + static_cast<int>(TILE_HEIGHT)); y++) {
+        if (rowVisible(pixels + (y - tileY) * TILE_WIDTH, tileX, rowX0, rowX1, nearest)) return true;
+      }
+    }
+  }
+  return false;
+}
+
+void TpOcclusionBuffer::cull(const TpScene &scene, std::vector<uint32_t> &visible, TpThreadPool *pool) {
+  TP_PROFILE_SCOPE("TpOcclusionBuffer::cull");
+  uint64_t startNs = TpCpuProfiler::now();
+  const TpAabb *worldBounds = scene.worldBounds();
+  visibleFlags.resize(visible.size());
+  auto test = [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) visibleFlags[i] = isVisible(worldBounds[visible[i]]) ? 1 : 0;
+  };
+  if (pool != nullptr) {
+    pool->parallelFor(visible.size(), TpScene::PARALLEL_GRAIN, test);
+  } else {
+    test(0, visible.size());
+  }
+
+  size_t kept = 0;
+  for (size_t i = 0; i < visible.size(); i++) {
+    if (visibleFlags[i]) visible[kept++] = visible[i];
+  }
+  stats.tested += static_cast<uint32_t>(visible.size());
+  stats.culled += static_cast<uint32_t>(visible.size() - kept);
+  visible.resize(kept);
+  stats.testMs += elapsedMs(startNs);
+}
+
+}  // namespace teapot
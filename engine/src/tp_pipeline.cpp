@@ -18,10 +18,19 @@ TpPipeline::TpPipeline(
   createGraphicsPipeline(vertFilepath, fragFilepath, configInfo);
 }
 
+TpPipeline::TpPipeline(
+        TpDevice& device,
+        const std::string& compFilepath,
+        VkPipelineLayout pipelineLayout)
+    : tpDevice{device}, bindPoint{VK_PIPELINE_BIND_POINT_COMPUTE} {
+  createComputePipeline(compFilepath, pipelineLayout);
+}
+
 TpPipeline::~TpPipeline() {
   vkDestroyShaderModule(tpDevice.device(), vertShaderModule, nullptr);
   vkDestroyShaderModule(tpDevice.device(), fragShaderModule, nullptr);
-  vkDestroyPipeline(tpDevice.device(), graphicsPipeline, nullptr);
+  vkDestroyShaderModule(tpDevice.device(), compShaderModule, nullptr);
+  vkDestroyPipeline(tpDevice.device(), pipeline, nullptr);
 }
 
 std::vector<char> TpPipeline::readFile(const std::string& filepath) {
@@ -53,10 +62,11 @@ void TpPipeline::createGraphicsPipeline(
       "Cannot create graphics pipeline: no renderPass provided in configInfo");
 
   auto vertCode = readFile(vertFilepath);
-  auto fragCode = readFile(fragFilepath);
-
   createShaderModule(vertCode, &vertShaderModule);
-  createShaderModule(fragCode, &fragShaderModule);
+  if (!fragFilepath.empty()) {
+    auto fragCode = readFile(fragFilepath);
+    createShaderModule(fragCode, &fragShaderModule);
+  }
 
   VkPipelineShaderStageCreateInfo shaderStages[2];
   shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -74,8 +84,8 @@ void TpPipeline::createGraphicsPipeline(
   shaderStages[1].pNext = nullptr;
   shaderStages[1].pSpecializationInfo = nullptr;
 
-  auto bindingDescs = Vertex::getBindingDescriptions();
-  auto attrDescs = Vertex::getAttributeDescriptions();
+  const auto &bindingDescs = configInfo.bindingDescriptions;
+  const auto &attrDescs = configInfo.attributeDescriptions;
 
   VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
   vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
@@ -86,7 +96,7 @@ void TpPipeline::createGraphicsPipeline(
 
   VkGraphicsPipelineCreateInfo pipelineInfo{};
   pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-  pipelineInfo.stageCount = 2;
+  pipelineInfo.stageCount = fragShaderModule != VK_NULL_HANDLE ? 2 : 1;
   pipelineInfo.pStages = shaderStages;
   pipelineInfo.pVertexInputState = &vertexInputInfo;
   pipelineInfo.pInputAssemblyState = &configInfo.inputAssemblyInfo;
@@ -110,11 +120,40 @@ void TpPipeline::createGraphicsPipeline(
           1,
           &pipelineInfo,
           nullptr,
-          &graphicsPipeline) != VK_SUCCESS) {
+          &pipeline) != VK_SUCCESS) {
     throw std::runtime_error("failed to create graphics pipeline");
   }
 }
 
+void TpPipeline::createComputePipeline(const std::string& compFilepath, VkPipelineLayout pipelineLayout) {
+  assert(
+      pipelineLayout != VK_NULL_HANDLE &&
+      "Cannot create compute pipeline: no pipelineLayout provided");
+
+  auto compCode = readFile(compFilepath);
+  createShaderModule(compCode, &compShaderModule);
+
+  VkComputePipelineCreateInfo pipelineInfo{};
+  pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipelineInfo.stage.module = compShaderModule;
+  pipelineInfo.stage.pName = "main";
+  pipelineInfo.layout = pipelineLayout;
+  pipelineInfo.basePipelineIndex = -1;
+  pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+
+  if (vkCreateComputePipelines(
+          tpDevice.device(),
+          VK_NULL_HANDLE,
+          1,
+          &pipelineInfo,
+          nullptr,
+          &pipeline) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create compute pipeline");
+  }
+}
+
 void TpPipeline::createShaderModule(const std::vector<char>& code, VkShaderModule* shaderModule) {
   VkShaderModuleCreateInfo createInfo{};
   createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
@@ -127,7 +166,7 @@ void TpPipeline::createShaderModule(const std::vector<char>& code, VkShaderModul
 }
 
 void TpPipeline::bind(VkCommandBuffer commandBuffer) {
-  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+  vkCmdBindPipeline(commandBuffer, bindPoint, pipeline);
 }
 
 void TpPipeline::defaultPipelineConfigInfo(
@@ -200,6 +239,26 @@ void TpPipeline::defaultPipelineConfigInfo(
   configInfo.dynamicStateInfo.dynamicStateCount =
           static_cast<uint32_t>(configInfo.dynamicStateEnables.size());
   configInfo.dynamicStateInfo.flags = 0;
+
+  configInfo.bindingDescriptions = Vertex::getBindingDescriptions();
+  configInfo.attributeDescriptions = Vertex::getAttributeDescriptions();
+}
+
+void TpPipeline::depthOnlyPipelineConfigInfo(
+    PipelineConfigInfo& configInfo) {
+  defaultPipelineConfigInfo(configInfo);
+
+  // without a fragment shader the color outputs are undefined, so they must not be written
+  configInfo.colorBlendAttachment.colorWriteMask = 0;
+
+  configInfo.bindingDescriptions = Vertex::getPositionBindingDescriptions();
+  configInfo.attributeDescriptions = Vertex::getPositionAttributeDescriptions();
+}
+
+void TpPipeline::vertexPullingConfigInfo(
+    PipelineConfigInfo& configInfo) {
+  configInfo.bindingDescriptions.clear();
+  configInfo.attributeDescriptions.clear();
 }
 
 }  // namespace teapot
\ No newline at end of file
@@ -0,0 +1,826 @@
+#include "tp_render_graph.h"
+#include "tp_cpu_profiler.h"
+#include "tp_image_layout.h"
+
+// std
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+namespace teapot {
+
+namespace {
+
+constexpr VkAccessFlags WRITE_ACCESS_MASK =
+    VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+    VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+
+constexpr VkImageUsageFlags ATTACHMENT_USAGE_MASK =
+    VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+    VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
+
+bool sameShape(const TpRgImageDesc &a, const TpRgImageDesc &b) {
+  return a.format == b.format && a.extent.width == b.extent.width &&
+         a.extent.height == b.extent.height && a.samples == b.samples;
+}
+
+}  // namespace
+
+TpRenderGraph::TpRenderGraph(TpDevice &device) : tpDevice{device} {}
+
+TpRenderGraph::~TpRenderGraph() { destroyGpuObjects(); }
+
+TpRenderGraph::AccessInfo TpRenderGraph::accessInfo(TpRgAccess access) {
+  switch (access) {
+    case TpRgAccess::ColorAttachment:
+      return {VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+              VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+              VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, true, true};
+    case TpRgAccess::DepthAttachment:
+      return {VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+              VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+              VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+              VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, true, true};
+    case TpRgAccess::DepthRead:
+      return {VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+              VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+              VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT,
+              VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, false, true};
+    case TpRgAccess::SampledFragment:
+      return {VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+              VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_USAGE_SAMPLED_BIT, false, false};
+    case TpRgAccess::SampledCompute:
+      return {VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+              VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_USAGE_SAMPLED_BIT, false, false};
+    case TpRgAccess::StorageCompute:
+      return {VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+              VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_IMAGE_USAGE_STORAGE_BIT, true, false};
+    case TpRgAccess::TransferSrc:
+      return {VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT,
+              VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_USAGE_TRANSFER_SRC_BIT, false, false};
+    case TpRgAccess::TransferDst:
+      return {VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT,
+              VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_USAGE_TRANSFER_DST_BIT, true, false};
+  }
+  throw std::invalid_argument("unknown render graph access!");
+}
+
+// -- declaration ---------------------------------------------------------------------------------
+
+TpRgResource TpRenderGraph::createImage(const std::string &name, const TpRgImageDesc &desc) {
+  Resource resource{};
+  resource.name = name;
+  resource.desc = desc;
+  resources.push_back(resource);
+  return static_cast<TpRgResource>(resources.size() - 1);
+}
+
+TpRgResource TpRenderGraph::importImage(
+    const std::string &name,
+    const TpRgImageDesc &desc,
+    VkImageLayout initialLayout,
+    VkImageLayout finalLayout,
+    VkPipelineStageFlags waitStages) {
+  Resource resource{};
+  resource.name = name;
+  resource.desc = desc;
+  resource.imported = true;
+  resource.initialLayout = initialLayout;
+  resource.finalLayout = finalLayout;
+  resource.waitStages = waitStages;
+  resources.push_back(resource);
+
+  auto handle = static_cast<TpRgResource>(resources.size() - 1);
+  if (initialLayout != VK_IMAGE_LAYOUT_UNDEFINED) {
+    versions.push_back({handle, INVALID, 0});
+    resources[handle].version = static_cast<uint32_t>(versions.size() - 1);
+  }
+  return handle;
+}
+
+TpRgPass TpRenderGraph::addPass(const std::string &name, std::function<void(const TpRgPassContext &)> execute) {
+  Pass pass{};
+  pass.name = name;
+  pass.execute = std::move(execute);
+  passes.push_back(std::move(pass));
+  return static_cast<TpRgPass>(passes.size() - 1);
+}
+
+void TpRenderGraph::write(TpRgPass pass, TpRgResource resource, TpRgAccess access,
+                          std::optional<VkClearValue> clearValue) {
+  if (!accessInfo(access).write) {
+    throw std::invalid_argument("render graph write declared with a read access!");
+  }
+  for (const auto &use : passes[pass].uses) {
+    if (use.resource == resource) {
+      throw std::invalid_argument("render graph pass " + passes[pass].name + " uses " +
+                                  resources[resource].name + " twice!");
+    }
+  }
+
+  auto &res = resources[resource];
+  ResourceUse use{resource, access, clearValue, false, INVALID, INVALID};
+  use.preserves = !clearValue.has_value() && res.version != INVALID;
+  if (use.preserves) use.readVersion = res.version;
+
+  versions.push_back({resource, pass, 0});
+  use.writeVersion = static_cast<uint32_t>(versions.size() - 1);
+  res.version = use.writeVersion;
+
+  passes[pass].uses.push_back(use);
+}
+
+void TpRenderGraph::read(TpRgPass pass, TpRgResource resource, TpRgAccess access) {
+  if (accessInfo(access).write) {
+    throw std::invalid_argument("render graph read declared with a write access!");
+  }
+  for (const auto &use : passes[pass].uses) {
+    if (use.resource == resource) {
+      throw std::invalid_argument("render graph pass " + passes[pass].name + " uses " +
+                                  resources[resource].name + " twice!");
+    }
+  }
+
+  auto &res = resources[resource];
+  if (res.version == INVALID) {
+    throw std::invalid_argument("render graph pass " + passes[pass].name + " reads " + res.name +
+                                " before anything writes it!");
+  }
+  passes[pass].uses.push_back({resource, access, std::nullopt, true, res.version, INVALID});
+}
+
+void TpRenderGraph::setSideEffect(TpRgPass pass) { passes[pass].sideEffect = true; }
+
+// -- compilation ---------------------------------------------------------------------------------
+
+void TpRenderGraph::compile() {
+  TP_PROFILE_SCOPE("TpRenderGraph::compile");
+  if (compiled) {
+    destroyGpuObjects();
+    steps.clear();
+    finalBarriers.clear();
+    physicalImages.clear();
+    for (auto &resource : resources) {
+      resource.physical = INVALID;
+      resource.firstPass = INVALID;
+      resource.lastPass = INVALID;
+    }
+  }
+
+  cullPasses();
+  computeLifetimes();
+  assignPhysicalImages();
+  buildSteps();
+  computeSynchronization();
+  createPhysicalImages();
+  compiled = true;
+}
+
+void TpRenderGraph::cullPasses() {
+  for (auto &version : versions) version.refs = 0;
+  std::vector<uint32_t> passRefs(passes.size(), 0);
+
+  for (size_t p = 0; p < passes.size(); p++) {
+    passes[p].culled = false;
+    for (const auto &use : passes[p].uses) {
+      if (use.readVersion != INVALID) versions[use.readVersion].refs++;
+      if (use.writeVersion != INVALID) passRefs[p]++;
+    }
+  }
+  // whatever ends up in an imported image leaves the graph
+  for (const auto &resource : resources) {
+    if (resource.imported && resource.version != INVALID) versions[resource.version].refs++;
+  }
+
+  std::vector<uint32_t> unreferenced;
+  auto cull = [&](TpRgPass p) {
+    passes[p].culled = true;
+    for (const auto &use : passes[p].uses) {
+      if (use.readVersion != INVALID && --versions[use.readVersion].refs == 0) {
+        unreferenced.push_back(use.readVersion);
+      }
+    }
+  };
+
+  for (size_t p = 0; p < passes.size(); p++) {
+    if (passRefs[p] == 0 && !passes[p].sideEffect) cull(static_cast<TpRgPass>(p));
+  }
+  for (size_t v = 0; v < versions.size(); v++) {
+    if (versions[v].refs == 0 && versions[v].writer != INVALID) unreferenced.push_back(static_cast<uint32_t>(v));
+  }
+
+  while (!unreferenced.empty()) {
+    uint32_t v = unreferenced.back();
+    unreferenced.pop_back();
+    TpRgPass writer = versions[v].writer;
+    if (writer == INVALID || passes[writer].culled) continue;
+    if (--passRefs[writer] == 0 && !passes[writer].sideEffect) cull(writer);
+  }
+}
+
+void TpRenderGraph::computeLifetimes() {
+  for (size_t p = 0; p < passes.size(); p++) {
+    if (passes[p].culled) continue;
+    for (const auto &use : passes[p].uses) {
+      auto &resource = resources[use.resource];
+      if (resource.firstPass == INVALID) resource.firstPass = static_cast<uint32_t>(p);
+      resource.lastPass = static_cast<uint32_t>(p);
+    }
+  }
+}
+
+void TpRenderGraph::assignPhysicalImages() {
+  std::vector<VkImageUsageFlags> usages(resources.size(), 0);
+  for (const auto &pass : passes) {
+    if (pass.culled) continue;
+    for (const auto &use : pass.uses) usages[use.resource] |= accessInfo(use.access).usage;
+  }
+
+  std::vector<TpRgResource> order;
+  for (size_t r = 0; r < resources.size(); r++) {
+    if (resources[r].imported) {
+      PhysicalImage physical{};
+      physical.desc = resources[r].desc;
+      physical.imported = true;
+      physical.lastPass = resources[r].lastPass;
+      physicalImages.push_back(physical);
+      resources[r].physical = static_cast<uint32_t>(physicalImages.size() - 1);
+    } else if (resources[r].firstPass != INVALID) {
+      order.push_back(static_cast<TpRgResource>(r));
+    }
+  }
+  std::sort(order.begin(), order.end(), [&](TpRgResource a, TpRgResource b) {
+    return resources[a].firstPass < resources[b].firstPass;
+  });
+
+  // Greedy aliasing: a transient image takes over any image of the same shape whose last user
+  // runs before its first one.
+  for (TpRgResource r : order) {
+    auto &resource = resources[r];
+    uint32_t chosen = INVALID;
+    for (size_t i = 0; i < physicalImages.size(); i++) {
+      const auto &physical = physicalImages[i];
+      if (!physical.imported && physical.lastPass < resource.firstPass && sameShape(physical.desc, resource.desc)) {
+        chosen = static_cast<uint32_t>(i);
+        break;
+      }
+    }
+    if (chosen == INVALID) {
+      PhysicalImage physical{};
+      physical.desc = resource.desc;
+      physicalImages.push_back(physical);
+      chosen = static_cast<uint32_t>(physicalImages.size() - 1);
+    }
+    physicalImages[chosen].usage |= usages[r];
+    physicalImages[chosen].lastPass = resource.lastPass;
+    resource.physical = chosen;
+  }
+}
+
+bool TpRenderGraph::canMerge(const Step &step, const Pass &pass) const {
+  if (step.attachments.empty()) return false;
+  const auto &stepDesc = physicalImages[step.attachments[0]].desc;
+
+  for (const auto &use : pass.uses) {
+    const auto &resource = resources[use.resource];
+    auto info = accessInfo(use.access);
+    if (info.attachment &&
+        (resource.desc.extent.width != step.extent.width || resource.desc.extent.height != step.extent.height ||
+         resource.desc.samples != stepDesc.samples)) {
+      return false;
+    }
+
+    for (TpRgPass other : step.passes) {
+      for (const auto &otherUse : passes[other].uses) {
+        if (resources[otherUse.resource].physical != resource.physical) continue;
+        // an aliased image changes owner in between, which needs a barrier
+        if (otherUse.resource != use.resource) return false;
+        auto otherInfo = accessInfo(otherUse.access);
+        if (info.attachment && otherInfo.attachment) continue;
+        // sampling something the pass renders to needs a barrier, so does a second layout
+        if (info.attachment != otherInfo.attachment || info.write || otherInfo.write ||
+            info.layout != otherInfo.layout) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+void TpRenderGraph::buildSteps() {
+  for (size_t p = 0; p < passes.size(); p++) {
+    auto &pass = passes[p];
+    if (pass.culled) continue;
+
+    bool graphics = std::any_of(pass.uses.begin(), pass.uses.end(),
+                                [](const ResourceUse &use) { return accessInfo(use.access).attachment; });
+    if (!graphics || steps.empty() || !canMerge(steps.back(), pass)) {
+      steps.emplace_back();
+    }
+
+    auto &step = steps.back();
+    pass.step = static_cast<uint32_t>(steps.size() - 1);
+    pass.subpass = static_cast<uint32_t>(step.passes.size());
+    step.passes.push_back(static_cast<TpRgPass>(p));
+
+    for (const auto &use : pass.uses) {
+      if (!accessInfo(use.access).attachment) continue;
+      uint32_t physical = resources[use.resource].physical;
+      if (std::find(step.attachments.begin(), step.attachments.end(), physical) == step.attachments.end()) {
+        if (step.attachments.empty()) step.extent = resources[use.resource].desc.extent;
+        step.attachments.push_back(physical);
+      }
+    }
+  }
+}
+
+void TpRenderGraph::computeSynchronization() {
+  auto initialStates = [&]() {
+    std::vector<ImageState> states(physicalImages.size());
+    for (const auto &resource : resources) {
+      if (!resource.imported) continue;
+      auto &state = states[resource.physical];
+      state.layout = resource.initialLayout;
+      state.readStages = resource.waitStages;
+      if (resource.initialLayout != VK_IMAGE_LAYOUT_UNDEFINED) {
+        auto info = getImageLayoutInfo(resource.initialLayout);
+        state.writeAccess = info.access & WRITE_ACCESS_MASK;
+        state.writeStages = state.writeAccess != 0 ? info.stages : 0;
+        state.readStages |= info.stages;
+      }
+    }
+    return states;
+  };
+
+  // Transient images are reused every frame, so the first use has to wait for the previous
+  // frame's last one: run once to find the end state and start the real pass from it.
+  auto previousFrame = initialStates();
+  simulate(previousFrame, false);
+
+  auto states = initialStates();
+  for (size_t i = 0; i < physicalImages.size(); i++) {
+    if (!physicalImages[i].imported) states[i] = previousFrame[i];
+  }
+  simulate(states, true);
+}
+
+void TpRenderGraph::simulate(std::vector<ImageState> &states, bool createRenderPasses) {
+  for (auto &step : steps) {
+    step.barriers.clear();
+    for (TpRgPass p : step.passes) {
+      for (const auto &use : passes[p].uses) {
+        if (accessInfo(use.access).attachment) continue;
+        bool discard = resources[use.resource].firstPass == p && !use.preserves;
+        recordNonAttachmentUse(step, states, use, discard);
+      }
+    }
+    if (!step.attachments.empty()) buildRenderPass(step, states, createRenderPasses);
+  }
+
+  finalBarriers.clear();
+  for (const auto &resource : resources) {
+    if (!resource.imported || resource.finalLayout == VK_IMAGE_LAYOUT_UNDEFINED) continue;
+    auto &state = states[resource.physical];
+    if (state.layout == resource.finalLayout) continue;
+
+    auto info = getImageLayoutInfo(resource.finalLayout);
+    VkPipelineStageFlags src = state.writeStages | state.readStages;
+    finalBarriers.push_back({resource.physical, state.layout, resource.finalLayout,
+                             src != 0 ? src : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, state.writeAccess,
+                             info.stages, info.access});
+    state.layout = resource.finalLayout;
+  }
+}
+
+void TpRenderGraph::recordNonAttachmentUse(Step &step, std::vector<ImageState> &states,
+                                           const ResourceUse &use, bool discard) {
+  auto info = accessInfo(use.access);
+  uint32_t physical = resources[use.resource].physical;
+  auto &state = states[physical];
+
+  VkImageLayout oldLayout = discard ? VK_IMAGE_LAYOUT_UNDEFINED : state.layout;
+  bool layoutChange = oldLayout != info.layout;
+
+  if (!info.write && !layoutChange) {
+    // read after read, or the write has already been made visible to these stages
+    if (state.writeStages == 0 || (info.stages & ~state.visibleStages) == 0) {
+      state.readStages |= info.stages;
+      return;
+    }
+    step.barriers.push_back({physical, oldLayout, info.layout, state.writeStages, state.writeAccess,
+                             info.stages, info.access});
+    state.visibleStages |= info.stages;
+    state.readStages |= info.stages;
+    return;
+  }
+
+  VkPipelineStageFlags src = state.writeStages | state.readStages;
+  step.barriers.push_back({physical, oldLayout, info.layout,
+                           src != 0 ? src : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, state.writeAccess,
+                           info.stages, info.access});
+  state.layout = info.layout;
+  if (info.write) {
+    state.writeStages = info.stages;
+    state.writeAccess = info.access & WRITE_ACCESS_MASK;
+    state.readStages = 0;
+    state.visibleStages = 0;
+  } else {
+    state.readStages = info.stages;
+    state.visibleStages = info.stages;
+  }
+}
+
+void TpRenderGraph::buildRenderPass(Step &step, std::vector<ImageState> &states, bool create) {
+  struct SubpassUse {
+    uint32_t subpass;
+    const ResourceUse *use;
+  };
+
+  uint32_t subpassCount = static_cast<uint32_t>(step.passes.size());
+  std::vector<VkAttachmentDescription> descriptions(step.attachments.size());
+  std::vector<std::vector<VkAttachmentReference>> colorRefs(subpassCount);
+  std::vector<VkAttachmentReference> depthRefs(subpassCount, {VK_ATTACHMENT_UNUSED, VK_IMAGE_LAYOUT_UNDEFINED});
+  std::vector<std::vector<uint32_t>> preserveRefs(subpassCount);
+  std::map<std::pair<uint32_t, uint32_t>, VkSubpassDependency> dependencies;
+  step.clearValues.assign(step.attachments.size(), VkClearValue{});
+
+  auto dependency = [&](uint32_t src, uint32_t dst) -> VkSubpassDependency & {
+    auto &dep = dependencies[{src, dst}];
+    dep.srcSubpass = src;
+    dep.dstSubpass = dst;
+    if (src != VK_SUBPASS_EXTERNAL) dep.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+    return dep;
+  };
+
+  for (size_t a = 0; a < step.attachments.size(); a++) {
+    uint32_t physical = step.attachments[a];
+    auto &state = states[physical];
+
+    std::vector<SubpassUse> uses;
+    for (uint32_t s = 0; s < subpassCount; s++) {
+      for (const auto &use : passes[step.passes[s]].uses) {
+        if (resources[use.resource].physical == physical) uses.push_back({s, &use});
+      }
+    }
+
+    const ResourceUse &first = *uses.front().use;
+    const ResourceUse &last = *uses.back().use;
+    const auto &resource = resources[first.resource];
+    TpRgPass lastPassInStep = step.passes[uses.back().subpass];
+    bool discard = resource.firstPass == step.passes[uses.front().subpass] && !first.preserves;
+
+    auto &description = descriptions[a];
+    description.format = resource.desc.format;
+    description.samples = resource.desc.samples;
+    description.initialLayout = discard ? VK_IMAGE_LAYOUT_UNDEFINED : state.layout;
+    if (first.clearValue.has_value()) {
+      description.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+      step.clearValues[a] = *first.clearValue;
+    } else {
+      description.loadOp = discard ? VK_ATTACHMENT_LOAD_OP_DONT_CARE : VK_ATTACHMENT_LOAD_OP_LOAD;
+    }
+    bool usedLater = resource.imported || resource.lastPass > lastPassInStep;
+    description.storeOp = usedLater ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    description.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    description.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+
+    // the imported image leaves the graph in its final layout straight out of the render pass
+    bool lastUse = resource.lastPass == lastPassInStep;
+    description.finalLayout = resource.imported && lastUse && resource.finalLayout != VK_IMAGE_LAYOUT_UNDEFINED
+                              ? resource.finalLayout
+                              : accessInfo(last.access).layout;
+
+    auto firstInfo = accessInfo(first.access);
+    auto &external = dependency(VK_SUBPASS_EXTERNAL, uses.front().subpass);
+    VkPipelineStageFlags src = state.writeStages | state.readStages;
+    external.srcStageMask |= src != 0 ? src : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+    external.srcAccessMask |= state.writeAccess;
+    external.dstStageMask |= firstInfo.stages;
+    external.dstAccessMask |= firstInfo.access;
+
+    for (size_t u = 0; u < uses.size(); u++) {
+      auto info = accessInfo(uses[u].use->access);
+      VkAttachmentReference ref{static_cast<uint32_t>(a), info.layout};
+      if (uses[u].use->access == TpRgAccess::ColorAttachment) {
+        colorRefs[uses[u].subpass].push_back(ref);
+      } else {
+        depthRefs[uses[u].subpass] = ref;
+      }
+
+      if (u > 0) {
+        auto previous = accessInfo(uses[u - 1].use->access);
+        auto &internal = dependency(uses[u - 1].subpass, uses[u].subpass);
+        internal.srcStageMask |= previous.stages;
+        internal.srcAccessMask |= previous.access & WRITE_ACCESS_MASK;
+        internal.dstStageMask |= info.stages;
+        internal.dstAccessMask |= info.access;
+
+        for (uint32_t s = uses[u - 1].subpass + 1; s < uses[u].subpass; s++) {
+          preserveRefs[s].push_back(static_cast<uint32_t>(a));
+        }
+      }
+
+      if (info.write) {
+        state.writeStages = info.stages;
+        state.writeAccess = info.access & WRITE_ACCESS_MASK;
+        state.readStages = 0;
+        state.visibleStages = 0;
+      } else {
+        state.readStages |= info.stages;
+        state.visibleStages |= info.stages;
+      }
+    }
+    state.layout = description.finalLayout;
+  }
+
+  if (!create) return;
+
+  std::vector<VkSubpassDescription> subpasses(subpassCount);
+  for (uint32_t s = 0; s < subpassCount; s++) {
+    subpasses[s].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpasses[s].colorAttachmentCount = static_cast<uint32_t>(colorRefs[s].size());
+    subpasses[s].pColorAttachments = colorRefs[s].data();
+    subpasses[s].pDepthStencilAttachment =
+        depthRefs[s].attachment != VK_ATTACHMENT_UNUSED ? &depthRefs[s] : nullptr;
+    subpasses[s].preserveAttachmentCount = static_cast<uint32_t>(preserveRefs[s].size());
+    subpasses[s].pPreserveAttachments = preserveRefs[s].data();
+  }
+
+  std::vector<VkSubpassDependency> dependencyList;
+  for (const auto &entry : dependencies) dependencyList.push_back(entry.second);
+
+  VkRenderPassCreateInfo renderPassInfo{};
+  renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+  renderPassInfo.attachmentCount = static_cast<uint32_t>(descriptions.size());
+  renderPassInfo.pAttachments = descriptions.data();
+  renderPassInfo.subpassCount = subpassCount;
+  renderPassInfo.pSubpasses = subpasses.data();
+  renderPassInfo.dependencyCount = static_cast<uint32_t>(dependencyList.size());
+  renderPassInfo.pDependencies = dependencyList.data();
+
+  if (vkCreateRenderPass(tpDevice.device(), &renderPassInfo, nullptr, &step.renderPass) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create render graph render pass!");
+  }
+}
+
+void TpRenderGraph::createPhysicalImages() {
+  bool lazyMemory = tpDevice.supportsLazilyAllocatedMemory();
+
+  for (auto &physical : physicalImages) {
+    if (physical.imported) continue;
+
+    // images only ever used as attachments never need to leave tile memory
+    bool transient = (physical.usage & ~ATTACHMENT_USAGE_MASK) == 0;
+
+    VkImageCreateInfo imageInfo{};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.extent = {physical.desc.extent.width, physical.desc.extent.height, 1};
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.format = physical.desc.format;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    imageInfo.usage = physical.usage | (transient ? VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT : 0);
+    imageInfo.samples = physical.desc.samples;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    tpDevice.createImageWithInfo(
+        imageInfo,
+        transient && lazyMemory ? VMA_MEMORY_USAGE_GPU_LAZILY_ALLOCATED : VMA_MEMORY_USAGE_GPU_ONLY,
+        physical.image,
+        physical.allocation);
+
+    // depth/stencil images are viewed (and sampled) through their depth aspect
+    VkImageAspectFlags aspect = getImageAspect(physical.desc.format);
+    if (aspect & VK_IMAGE_ASPECT_DEPTH_BIT) aspect = VK_IMAGE_ASPECT_DEPTH_BIT;
+
+    VkImageViewCreateInfo viewInfo{};
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.image = physical.image;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.format = physical.desc.format;
+    viewInfo.subresourceRange.aspectMask = aspect;
+    viewInfo.subresourceRange.baseMipLevel = 0;
+    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.baseArrayLayer = 0;
+    viewInfo.subresourceRange.layerCount = 1;
+
+    if (vkCreateImageView(tpDevice.device(), &viewInfo, nullptr, &physical.view) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create render graph image view!");
+    }
+  }
+}
+
+// -- execution -----------------------------------------------------------------------------------
+
+void TpRenderGraph::setImportedImage(TpRgResource resource, VkImage image, VkImageView view) {
+  auto &res = resources[resource];
+  if (!res.imported) {
+    throw std::invalid_argument("render graph resource " + res.name + " is not imported!");
+  }
+  if (res.physical == INVALID) return;
+  physicalImages[res.physical].image = image;
+  physicalImages[res.physical].view = view;
+}
+
+void TpRenderGraph::execute(VkCommandBuffer commandBuffer) {
+  TP_PROFILE_SCOPE("TpRenderGraph::execute");
+  if (!compiled) {
+    throw std::runtime_error("render graph executed before compile!");
+  }
+
+  for (auto &step : steps) {
+    recordBarriers(commandBuffer, step.barriers);
+
+    if (step.renderPass == VK_NULL_HANDLE) {
+      const auto &pass = passes[step.passes[0]];
+      if (pass.execute) pass.execute({commandBuffer, VK_NULL_HANDLE, 0, {}});
+      continue;
+    }
+
+    VkRenderPassBeginInfo renderPassInfo{};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    renderPassInfo.renderPass = step.renderPass;
+    renderPassInfo.framebuffer = getFramebuffer(step);
+    renderPassInfo.renderArea.offset = {0, 0};
+    renderPassInfo.renderArea.extent = step.extent;
+    renderPassInfo.clearValueCount = static_cast<uint32_t>(step.clearValues.size());
+    renderPassInfo.pClearValues = step.clearValues.data();
+    vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+    VkViewport viewport{};
+    viewport.x = 0.0f;
+    viewport.y = 0.0f;
+    viewport.width = static_cast<float>(step.extent.width);
+    viewport.height = static_cast<float>(step.extent.height);
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+    VkRect2D scissor{{0, 0}, step.extent};
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+    for (uint32_t s = 0; s < step.passes.size(); s++) {
+      if (s > 0) vkCmdNextSubpass(commandBuffer, VK_SUBPASS_CONTENTS_INLINE);
+      const auto &pass = passes[step.passes[s]];
+      if (pass.execute) pass.execute({commandBuffer, step.renderPass, s, step.extent});
+    }
+    vkCmdEndRenderPass(commandBuffer);
+  }
+
+  recordBarriers(commandBuffer, finalBarriers);
+}
+
+void TpRenderGraph::recordBarriers(VkCommandBuffer commandBuffer, const std::vector<Barrier> &barriers) {
+  if (barriers.empty()) return;
+
+  std::vector<VkImageMemoryBarrier> imageBarriers;
+  imageBarriers.reserve(barriers.size());
+  VkPipelineStageFlags srcStages = 0;
+  VkPipelineStageFlags dstStages = 0;
+
+  for (const auto &barrier : barriers) {
+    const auto &physical = physicalImages[barrier.physical];
+    if (physical.image == VK_NULL_HANDLE) {
+      throw std::runtime_error("render graph image has not been bound!");
+    }
+
+    VkImageMemoryBarrier imageBarrier{};
+    imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    imageBarrier.srcAccessMask = barrier.srcAccess;
+    imageBarrier.dstAccessMask = barrier.dstAccess;
+    imageBarrier.oldLayout = barrier.oldLayout;
+    imageBarrier.newLayout = barrier.newLayout;
+    imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrier.image = physical.image;
+    imageBarrier.subresourceRange.aspectMask = getImageAspect(physical.desc.format);
+    imageBarrier.subresourceRange.baseMipLevel = 0;
+    imageBarrier.subresourceRange.levelCount = 1;
+    imageBarrier.subresourceRange.baseArrayLayer = 0;
+    imageBarrier.subresourceRange.layerCount = 1;
+    imageBarriers.push_back(imageBarrier);
+
+    srcStages |= barrier.srcStages;
+    dstStages |= barrier.dstStages;
+  }
+
+  vkCmdPipelineBarrier(
+      commandBuffer,
+      srcStages, dstStages,
+      0,
+      0, nullptr,
+      0, nullptr,
+      static_cast<uint32_t>(imageBarriers.size()), imageBarriers.data());
+}
+
+VkFramebuffer TpRenderGraph::getFramebuffer(Step &step) {
+  std::vector<VkImageView> views;
+  views.reserve(step.attachments.size());
+  for (uint32_t physical : step.attachments) {
+    if (physicalImages[physical].view == VK_NULL_HANDLE) {
+      throw std::runtime_error("render graph attachment has not been bound!");
+    }
+    views.push_back(physicalImages[physical].view);
+  }
+
+  // imported views change every frame (one per swap chain image), so framebuffers are cached
+  auto it = step.framebuffers.find(views);
+  if (it != step.framebuffers.end()) return it->second;
+
+  VkFramebufferCreateInfo framebufferInfo{};
+  framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+  framebufferInfo.renderPass = step.renderPass;
+  framebufferInfo.attachmentCount = static_cast<uint32_t>(views.size());
+  framebufferInfo.pAttachments = views.data();
+  framebufferInfo.width = step.extent.width;
+  framebufferInfo.height = step.extent.height;
+  framebufferInfo.layers = 1;
+
+  VkFramebuffer framebuffer;
+  if (vkCreateFramebuffer(tpDevice.device(), &framebufferInfo, nullptr, &framebuffer) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create render graph framebuffer!");
+  }
+  step.framebuffers.emplace(std::move(views), framebuffer);
+  return framebuffer;
+}
+
+// -- queries / teardown --------------------------------------------------------------------------
+
+VkRenderPass TpRenderGraph::getRenderPass(TpRgPass pass) const {
+  if (passes[pass].step == INVALID || passes[pass].culled) return VK_NULL_HANDLE;
+  return steps[passes[pass].step].renderPass;
+}
+
+VkImage TpRenderGraph::getImage(TpRgResource resource) const {
+  uint32_t physical = resources[resource].physical;
+  return physical == INVALID ? VK_NULL_HANDLE : physicalImages[physical].image;
+}
+
+VkImageView TpRenderGraph::getImageView(TpRgResource resource) const {
+  uint32_t physical = resources[resource].physical;
+  return physical == INVALID ? VK_NULL_HANDLE : physicalImages[physical].view;
+}
+
+size_t TpRenderGraph::getPhysicalImageCount() const {
+  return std::count_if(physicalImages.begin(), physicalImages.end(),
+                       [](const PhysicalImage &physical) { return !physical.imported; });
+}
+
+size_t TpRenderGraph::getRenderPassCount() const {
+  return std::count_if(steps.begin(), steps.end(),
+                       [](const Step &step) { return step.renderPass != VK_NULL_HANDLE; });
+}
+
+size_t TpRenderGraph::getBarrierCount() const {
+  size_t count = finalBarriers.size();
+  for (const auto &step : steps) count += step.barriers.size();
+  return count;
+}
+
+void TpRenderGraph::clear() {
+  destroyGpuObjects();
+  resources.clear();
+  versions.clear();
+  passes.clear();
+  physicalImages.clear();
+  steps.clear();
+  finalBarriers.clear();
+  compiled = false;
+}
+
+void TpRenderGraph::destroyGpuObjects() {
+  std::vector<VkRenderPass> renderPasses;
+  std::vector<VkFramebuffer> framebuffers;
+  std::vector<PhysicalImage> images;
+
+  for (auto &step : steps) {
+    if (step.renderPass != VK_NULL_HANDLE) renderPasses.push_back(step.renderPass);
+    for (const auto &entry : step.framebuffers) framebuffers.push_back(entry.second);
+    step.renderPass = VK_NULL_HANDLE;
+    step.framebuffers.clear();
+  }
+  for (auto &physical : physicalImages) {
+    if (physical.imported || physical.image == VK_NULL_HANDLE) continue;
+    images.push_back(physical);
+    physical.image = VK_NULL_HANDLE;
+    physical.allocation = VK_NULL_HANDLE;
+    physical.view = VK_NULL_HANDLE;
+  }
+  if (renderPasses.empty() && framebuffers.empty() && images.empty()) return;
+
+  // frames that were already submitted may still be using them
+  VkDevice device = tpDevice.device();
+  VmaAllocator allocator = tpDevice.allocator();
+  tpDevice.deferDestroy(tpDevice.lastSubmittedGraphicsValue(), [=]() {
+    for (auto framebuffer : framebuffers) vkDestroyFramebuffer(device, framebuffer, nullptr);
+    for (auto renderPass : renderPasses) vkDestroyRenderPass(device, renderPass, nullptr);
+    for (const auto &physical : images) {
+      vkDestroyImageView(device, physical.view, nullptr);
+      vmaDestroyImage(allocator, physical.image, physical.allocation);
+    }
+  });
+}
+
+}  // namespace teapot
@@ -1,12 +1,13 @@
 #include "tp_renderer.h"
+#include "tp_cpu_profiler.h"
 
 // std
-#include <array>
 #include <stdexcept>
 
 namespace teapot {
 
-TpRenderer::TpRenderer(TpWindow &window, TpDevice &device): tpWindow{window}, tpDevice{device} {
+TpRenderer::TpRenderer(TpWindow &window, TpDevice &device, const TpSwapChainConfig &config)
+    : tpWindow{window}, tpDevice{device}, swapChainConfig{config}, frameGraph{device} {
   recreateSwapChain();
 
 //  createUniformBuffers();
@@ -25,7 +26,7 @@ TpRenderer::~TpRenderer() {
 }
 
 void TpRenderer::createCommandBuffers() {
-  commandBuffers.resize(TpSwapChain::MAX_FRAMES_IN_FLIGHT);
+  commandBuffers.resize(swapChainConfig.framesInFlight);
 
   VkCommandBufferAllocateInfo allocInfo{};
   allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -45,25 +46,85 @@ void TpRenderer::freeCommandBuffers() {
 }
 
 void TpRenderer::recreateSwapChain() {
+  TP_PROFILE_SCOPE("TpRenderer::recreateSwapChain");
   auto extent = tpWindow.getExtent();
   while (extent.width == 0 || extent.height == 0) {
     extent = tpWindow.getExtent();
     glfwWaitEvents();
   }
 
-  vkDeviceWaitIdle(tpDevice.device());
   if (tpSwapChain == nullptr) {
-    tpSwapChain = std::make_unique<TpSwapChain>(tpDevice, extent);
+    tpSwapChain = std::make_unique<TpSwapChain>(tpDevice, extent, swapChainConfig);
   } else {
+    // No device idle: the new chain takes over the old one's render pass and frame pacing, and
+    // whatever is left is destroyed once the frames using it have retired.
     std::shared_ptr<TpSwapChain> oldChain = std::move(tpSwapChain);
-    tpSwapChain = std::make_unique<TpSwapChain>(tpDevice, extent, oldChain);
+    tpSwapChain = std::make_unique<TpSwapChain>(tpDevice, extent, oldChain, swapChainConfig);
     if (!oldChain->compareSwapFormats(*tpSwapChain)) {
       throw std::runtime_error("Swap chain image(or color depth) has changed");
     }
+
+    // The old chain's semaphores may still be waited on by a queued present, which has no
+    // completion signal of its own; give it framesInFlight more frames to drain.
+    uint64_t retireValue = tpDevice.lastSubmittedGraphicsValue() + swapChainConfig.framesInFlight;
+    tpDevice.deferDestroy(retireValue, [oldChain]() mutable { oldChain.reset(); });
+  }
+  // the graph's framebuffers and image descriptions are sized for the old chain
+  frameGraphDirty = true;
+}
+
+void TpRenderer::setFrameGraph(FrameGraphBuilder builder) {
+  assert(!isFrameStarted && "Can not change the frame graph while a frame is in progress");
+  frameGraphBuilder = std::move(builder);
+  frameGraphDirty = true;
+  if (!frameGraphBuilder) frameGraph.clear();
+}
+
+void TpRenderer::buildFrameGraph() {
+  TP_PROFILE_SCOPE("TpRenderer::buildFrameGraph");
+  frameGraph.clear();
+  VkExtent2D extent = tpSwapChain->getSwapChainExtent();
+  swapChainImage = frameGraph.importImage(
+      "SwapChain",
+      {tpSwapChain->getSwapChainImageFormat(), extent},
+      VK_IMAGE_LAYOUT_UNDEFINED,
+      VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+      VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+  // Owned by the graph: transient, and on tile based gpus never backed by memory, unless a pass
+  // such as the occlusion test samples it after the pass that renders it.
+  depthImage = frameGraph.createImage("Depth", {tpSwapChain->getDepthFormat(), extent});
+  frameGraphBuilder(frameGraph, swapChainImage, depthImage);
+  frameGraph.compile();
+  frameGraphDirty = false;
+}
+
+void TpRenderer::setSwapChainConfig(const TpSwapChainConfig &config) {
+  assert(!isFrameStarted && "Can not change the swap chain while a frame is in progress");
+  if (config.framesInFlight != swapChainConfig.framesInFlight) {
+    throw std::runtime_error("frames in flight can only be set when the renderer is created");
+  }
+
+  swapChainConfig = config;
+  recreateSwapChain();
+}
+
+bool TpRenderer::setGpuProfilingEnabled(bool enabled) {
+  assert(!isFrameStarted && "Can not toggle the gpu profiler while a frame is in progress");
+  if (enabled == (gpuProfiler != nullptr)) return true;
+
+  if (enabled) {
+    if (!TpGpuProfiler::isSupported(tpDevice)) return false;
+    gpuProfiler = std::make_unique<TpGpuProfiler>(tpDevice, swapChainConfig.framesInFlight);
+  } else {
+    // query pools may still be referenced by frames in flight
+    vkDeviceWaitIdle(tpDevice.device());
+    gpuProfiler.reset();
   }
+  return true;
 }
 
 VkCommandBuffer TpRenderer::beginFrame() {
+  TP_PROFILE_SCOPE("TpRenderer::beginFrame");
   assert(!isFrameStarted && "can't call if already in progress");
   auto result = tpSwapChain->acquireNextImage(&currentImageIndex);
 
@@ -77,6 +138,16 @@ VkCommandBuffer TpRenderer::beginFrame() {
   }
 
   isFrameStarted = true;
+  tpDevice.collectDeferredDestruction();
+  // may release or move memory, which copies and waits, so both run before recording starts
+  tpDevice.updateMemoryBudget();
+  tpDevice.defragmentStep();
+
+  if (frameGraphBuilder) {
+    if (frameGraphDirty) buildFrameGraph();
+    frameGraph.setImportedImage(swapChainImage, tpSwapChain->getImage(static_cast<int>(currentImageIndex)),
+                                tpSwapChain->getImageView(static_cast<int>(currentImageIndex)));
+  }
 
   auto commandBuffer = getCurrentCommandBuffer();
   VkCommandBufferBeginInfo beginInfo{};
@@ -85,12 +156,15 @@ VkCommandBuffer TpRenderer::beginFrame() {
   if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
     throw std::runtime_error("failed to begin recording command buffer!");
   }
+  if (gpuProfiler) gpuProfiler->beginFrame(commandBuffer, currentFrameIndex);
   return commandBuffer;
 }
 
 void TpRenderer::endFrame() {
+  TP_PROFILE_SCOPE("TpRenderer::endFrame");
   assert(isFrameStarted && "can't end while frame is not in progress");
   auto commandBuffer = getCurrentCommandBuffer();
+  if (gpuProfiler) gpuProfiler->endFrame(commandBuffer);
   if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
     throw std::runtime_error("failed to record command buffer!");
   }
@@ -104,44 +178,15 @@ void TpRenderer::endFrame() {
   }
 
   isFrameStarted = false;
-  currentFrameIndex = (currentFrameIndex + 1) % TpSwapChain::MAX_FRAMES_IN_FLIGHT;
+  TP_PROFILE_FRAME();
+  currentFrameIndex = (currentFrameIndex + 1) % swapChainConfig.framesInFlight;
 }
 
-void TpRenderer::beginSwapChainRenderPass(VkCommandBuffer commandBuffer) {
+void TpRenderer::executeFrameGraph(VkCommandBuffer commandBuffer) {
   assert(isFrameStarted && "Gotta start frame");
   assert(commandBuffer == getCurrentCommandBuffer() && "can't draw on a different frame");
-
-  VkRenderPassBeginInfo renderPassInfo{};
-  renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-  renderPassInfo.renderPass = tpSwapChain->getRenderPass();
-  renderPassInfo.framebuffer = tpSwapChain->getFrameBuffer(static_cast<int>(currentImageIndex));
-
-  renderPassInfo.renderArea.offset = {0, 0};
-  renderPassInfo.renderArea.extent = tpSwapChain->getSwapChainExtent();
-
-  std::array<VkClearValue, 2> clearValues{};
-  clearValues[0].color = {0.1f, 0.1f, 0.1f, 1.0f};
-  clearValues[1].depthStencil = {1.0f, 0};
-  renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
-  renderPassInfo.pClearValues = clearValues.data();
-
-  vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
-
-  VkViewport viewport{};
-  viewport.x = 0.0f;
-  viewport.y = 0.0f;
-  viewport.width = static_cast<float>(tpSwapChain->getSwapChainExtent().width);
-  viewport.height = static_cast<float>(tpSwapChain->getSwapChainExtent().height);
-  viewport.minDepth = 0.0f;
-  viewport.maxDepth = 1.0f;
-  VkRect2D scissor{{0, 0}, tpSwapChain->getSwapChainExtent()};
-  vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
-  vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+  assert(frameGraphBuilder && "no frame graph was set");
+  frameGraph.execute(commandBuffer);
 }
 
-void TpRenderer::endSwapChainRenderPass(VkCommandBuffer commandBuffer) {
-  vkCmdEndRenderPass(commandBuffer);
-}
-
-
 }  // namespace teapot
\ No newline at end of file
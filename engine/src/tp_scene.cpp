@@ -0,0 +1,309 @@
+#include "tp_scene.h"
+#include "tp_cpu_profiler.h"
+#include "tp_transform.h"
+
+// std
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+namespace teapot {
+
+TpModelHandle TpScene::addModel(std::shared_ptr<TpModel> model) {
+  models.push_back(std::move(model));
+  return static_cast<TpModelHandle>(models.size() - 1);
+}
+
+TpEntity TpScene::createEntity(TpModelHandle model, TpEntity parent) {
+  if (model >= models.size()) {
+    throw std::invalid_argument("unknown model handle");
+  }
+  uint32_t parentSlot = NONE;
+  if (parent.slot != NONE) {
+    indexOf(parent);
+    parentSlot = parent.slot;
+  }
+
+  uint32_t slot;
+  if (!freeSlots.empty()) {
+    slot = freeSlots.back();
+    freeSlots.pop_back();
+  } else {
+    slot = static_cast<uint32_t>(slots.size());
+    slots.push_back({0, 0});
+  }
+
+  auto index = static_cast<uint32_t>(denseEntities.size());
+  slots[slot].index = index;
+  TpEntity entity{slot, slots[slot].generation};
+
+  denseEntities.push_back(entity);
+  translationArray.emplace_back(0.f);
+  rotationArray.emplace_back(0.f);
+  scaleArray.emplace_back(1.f);
+  modelArray.push_back(model);
+  localMatrixArray.emplace_back(1.f);
+  worldMatrixArray.emplace_back(1.f);
+  worldBoundsArray.push_back(models[model]->getBounds());
+  hierarchyArray.emplace_back();
+  flagArray.push_back(0);
+
+  if (parentSlot != NONE) link(index, parentSlot);
+  markDirty(index);
+  bvhStale = true;
+  return entity;
+}
+
+void TpScene::destroyEntity(TpEntity entity) {
+  uint32_t index = indexOf(entity);
+  unlink(index);
+
+  // gather the subtree first, removing entries moves dense indices around
+  std::vector<uint32_t> subtree{entity.slot};
+  for (size_t i = 0; i < subtree.size(); i++) {
+    const auto &hierarchy = hierarchyArray[denseOfSlot(subtree[i])];
+    for (uint32_t child = hierarchy.firstChild; child != NONE;
+         child = hierarchyArray[denseOfSlot(child)].nextSibling) {
+      subtree.push_back(child);
+    }
+  }
+
+  for (uint32_t slot : subtree) {
+    removeDense(denseOfSlot(slot));
+    slots[slot].generation++;
+    freeSlots.push_back(slot);
+  }
+  bvhStale = true;
+}
+
+void TpScene::removeDense(uint32_t index) {
+  auto last = static_cast<uint32_t>(denseEntities.size() - 1);
+  if (index != last) {
+    forEachComponentArray([&](auto &array) { array[index] = array[last]; });
+    slots[denseEntities[index].slot].index = index;
+  }
+  forEachComponentArray([](auto &array) { array.pop_back(); });
+}
+
+bool TpScene::isAlive(TpEntity entity) const {
+  return entity.slot < slots.size() && slots[entity.slot].generation == entity.generation;
+}
+
+void TpScene::reserve(size_t count) {
+  slots.reserve(count);
+  forEachComponentArray([&](auto &array) { array.reserve(count); });
+}
+
+uint32_t TpScene::indexOf(TpEntity entity) const {
+  if (!isAlive(entity)) {
+    throw std::invalid_argument("entity handle is stale");
+  }
+  return slots[entity.slot].index;
+}
+
+void TpScene::setParent(TpEntity entity, TpEntity parent) {
+  uint32_t index = indexOf(entity);
+  uint32_t parentSlot = NONE;
+  if (parent.slot != NONE) {
+    // walking up from the new parent must not reach the entity itself
+    for (uint32_t ancestor = denseEntities[indexOf(parent)].slot; ancestor != NONE;
+         ancestor = hierarchyArray[denseOfSlot(ancestor)].parent) {
+      if (ancestor == entity.slot) {
+        throw std::invalid_argument("setParent would create a cycle");
+      }
+    }
+    parentSlot = parent.slot;
+  }
+
+  unlink(index);
+  if (parentSlot != NONE) link(index, parentSlot);
+  markDirty(index);
+}
+
+TpEntity TpScene::getParent(TpEntity entity) const {
+  uint32_t parent = hierarchyArray[indexOf(entity)].parent;
+  return parent == NONE ? TpEntity{} : denseEntities[denseOfSlot(parent)];
+}
+
+void TpScene::setTranslation(TpEntity entity, const glm::vec3 &translation) {
+  uint32_t index = indexOf(entity);
+  translationArray[index] = translation;
+  markDirty(index);
+}
+
+void TpScene::setRotation(TpEntity entity, const glm::vec3 &rotation) {
+  uint32_t index = indexOf(entity);
+  rotationArray[index] = rotation;
+  markDirty(index);
+}
+
+void TpScene::setScale(TpEntity entity, const glm::vec3 &scale) {
+  uint32_t index = indexOf(entity);
+  scaleArray[index] = scale;
+  markDirty(index);
+}
+
+void TpScene::markDirty(uint32_t index) {
+  if (flagArray[index] & LOCAL_DIRTY) return;
+  flagArray[index] |= LOCAL_DIRTY;
+  dirtyEntities.push_back(denseEntities[index]);
+}
+
+void TpScene::link(uint32_t index, uint32_t parentSlot) {
+  uint32_t slot = denseEntities[index].slot;
+  auto &parent = hierarchyArray[denseOfSlot(parentSlot)];
+  auto &hierarchy = hierarchyArray[index];
+
+  hierarchy.parent = parentSlot;
+  hierarchy.prevSibling = NONE;
+  hierarchy.nextSibling = parent.firstChild;
+  if (parent.firstChild != NONE) {
+    hierarchyArray[denseOfSlot(parent.firstChild)].prevSibling = slot;
+  }
+  parent.firstChild = slot;
+  updateDepths(index);
+}
+
+void TpScene::unlink(uint32_t index) {
+  auto &hierarchy = hierarchyArray[index];
+  if (hierarchy.parent == NONE) return;
+
+  if (hierarchy.prevSibling != NONE) {
+    hierarchyArray[denseOfSlot(hierarchy.prevSibling)].nextSibling = hierarchy.nextSibling;
+  } else {
+    hierarchyArray[denseOfSlot(hierarchy.parent)].firstChild = hierarchy.nextSibling;
+  }
+  if (hierarchy.nextSibling != NONE) {
+    hierarchyArray[denseOfSlot(hierarchy.nextSibling)].prevSibling = hierarchy.prevSibling;
+  }
+  hierarchy.parent = NONE;
+  hierarchy.prevSibling = NONE;
+  hierarchy.nextSibling = NONE;
+  updateDepths(index);
+}
+
+void TpScene::updateDepths(uint32_t index) {
+  traversal.clear();
+  traversal.push_back(index);
+  while (!traversal.empty()) {
+    uint32_t current = traversal.back();
+    traversal.pop_back();
+
+    auto &hierarchy = hierarchyArray[current];
+    hierarchy.depth = hierarchy.parent == NONE ? 0 : hierarchyArray[denseOfSlot(hierarchy.parent)].depth + 1;
+    for (uint32_t child = hierarchy.firstChild; child != NONE;
+         child = hierarchyArray[denseOfSlot(child)].nextSibling) {
+      traversal.push_back(denseOfSlot(child));
+    }
+  }
+}
+
+size_t TpScene::updateTransforms(TpThreadPool *pool) {
+  TP_PROFILE_SCOPE("TpScene::updateTransforms");
+  if (dirtyEntities.empty()) return 0;
+
+  // a dirty entity invalidates the world matrix of its whole subtree
+  updateList.clear();
+  uint32_t maxDepth = 0;
+  for (const auto &entity : dirtyEntities) {
+    if (!isAlive(entity)) continue;
+
+    traversal.clear();
+    traversal.push_back(denseOfSlot(entity.slot));
+    while (!traversal.empty()) {
+      uint32_t current = traversal.back();
+      traversal.pop_back();
+      // a queued entity had its subtree queued along with it
+      if (flagArray[current] & QUEUED) continue;
+
+      flagArray[current] |= QUEUED;
+      updateList.push_back(current);
+      const auto &hierarchy = hierarchyArray[current];
+      maxDepth = std::max(maxDepth, hierarchy.depth);
+      for (uint32_t child = hierarchy.firstChild; child != NONE;
+           child = hierarchyArray[denseOfSlot(child)].nextSibling) {
+        traversal.push_back(denseOfSlot(child));
+      }
+    }
+  }
+  dirtyEntities.clear();
+
+  // counting sort by depth, every level only reads the world matrices of the one above
+  levelOffsets.assign(maxDepth + 2, 0);
+  for (uint32_t index : updateList) levelOffsets[hierarchyArray[index].depth + 1]++;
+  for (size_t level = 1; level < levelOffsets.size(); level++) levelOffsets[level] += levelOffsets[level - 1];
+  updateOrder.resize(updateList.size());
+  {
+    std::vector<uint32_t> cursor(levelOffsets.begin(), levelOffsets.end() - 1);
+    for (uint32_t index : updateList) updateOrder[cursor[hierarchyArray[index].depth]++] = index;
+  }
+
+  // local matrices do not depend on each other, compose them all in one batch first
+  localUpdates.clear();
+  for (uint32_t index : updateList) {
+    if (flagArray[index] & LOCAL_DIRTY) localUpdates.push_back(index);
+  }
+  auto compose = [&](size_t begin, size_t end) {
+    composeTransforms(localUpdates.data() + begin, end - begin, translationArray.data(), rotationArray.data(),
+                      scaleArray.data(), localMatrixArray.data());
+  };
+  if (pool != nullptr) {
+    pool->parallelFor(localUpdates.size(), PARALLEL_GRAIN, compose);
+  } else {
+    compose(0, localUpdates.size());
+  }
+
+  for (uint32_t level = 0; level <= maxDepth; level++) {
+    uint32_t first = levelOffsets[level];
+    auto update = [&](size_t begin, size_t end) {
+      for (size_t k = first + begin; k < first + end; k++) {
+        uint32_t index = updateOrder[k];
+        uint32_t parent = hierarchyArray[index].parent;
+        worldMatrixArray[index] = parent == NONE
+                                  ? localMatrixArray[index]
+                                  : worldMatrixArray[denseOfSlot(parent)] * localMatrixArray[index];
+        worldBoundsArray[index] = models[modelArray[index]]->getBounds().transformed(worldMatrixArray[index]);
+        flagArray[index] = 0;
+      }
+    };
+
+    size_t count = levelOffsets[level + 1] - first;
+    if (pool != nullptr) {
+      pool->parallelFor(count, PARALLEL_GRAIN, update);
+    } else {
+      update(0, count);
+    }
+  }
+  boundsMoved = true;
+  return updateList.size();
+}
+
+void TpScene::updateBvh() {
+  if (bvhStale) {
+    bvh.build(worldBoundsArray.data(), size());
+  } else if (boundsMoved) {
+    bvh.refit(worldBoundsArray.data());
+    if (bvh.needsRebuild()) bvh.build(worldBoundsArray.data(), size());
+  }
+  bvhStale = false;
+  boundsMoved = false;
+}
+
+void TpScene::cull(const TpFrustum &frustum, std::vector<uint32_t> &visible, TpThreadPool *pool) {
+  TP_PROFILE_SCOPE("TpScene::cull");
+  updateBvh();
+  visible.clear();
+  bvh.cullFrustum(frustum, worldBoundsArray.data(), visible, pool);
+}
+
+bool TpScene::raycast(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, TpRayHit &hit) {
+  updateBvh();
+  return bvh.raycast(origin, direction, maxDistance, worldBoundsArray.data(), hit);
+}
+
+void TpScene::overlap(const TpAabb &box, std::vector<uint32_t> &out) {
+  updateBvh();
+  bvh.overlap(box, worldBoundsArray.data(), out);
+}
+
+}  // namespace teapot
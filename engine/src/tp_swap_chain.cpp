@@ -1,7 +1,9 @@
 #include "tp_swap_chain.h"
+#include "tp_cpu_profiler.h"
 
 
 // std
+#include <algorithm>
 #include <array>
 #include <cstdlib>
 #include <cstring>
@@ -9,27 +11,51 @@
 #include <limits>
 #include <set>
 #include <stdexcept>
+#include <string>
 
 namespace teapot {
 
-TpSwapChain::TpSwapChain(TpDevice &deviceRef, VkExtent2D extent)
-        : device{deviceRef}, windowExtent{extent} {
+const char *presentModeName(TpPresentMode mode) {
+  switch (mode) {
+    case TpPresentMode::Fifo: return "fifo";
+    case TpPresentMode::Mailbox: return "mailbox";
+    case TpPresentMode::Immediate: return "immediate";
+  }
+  return "unknown";
+}
+
+bool parsePresentMode(const std::string &name, TpPresentMode &mode) {
+  for (auto candidate : {TpPresentMode::Fifo, TpPresentMode::Mailbox, TpPresentMode::Immediate}) {
+    if (name == presentModeName(candidate)) {
+      mode = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+TpSwapChain::TpSwapChain(TpDevice &deviceRef, VkExtent2D extent, const TpSwapChainConfig &config)
+        : device{deviceRef}, windowExtent{extent}, config{config} {
   init();
 }
 
 
-TpSwapChain::TpSwapChain(TpDevice &deviceRef, VkExtent2D extent, std::shared_ptr<TpSwapChain> previous) :
-        device{deviceRef}, windowExtent{extent}, oldSwapchain{previous} {
+TpSwapChain::TpSwapChain(TpDevice &deviceRef, VkExtent2D extent, std::shared_ptr<TpSwapChain> previous,
+                         const TpSwapChainConfig &config) :
+        device{deviceRef}, windowExtent{extent}, oldSwapchain{previous}, config{config} {
   init();
   oldSwapchain = nullptr;
 }
 
 void TpSwapChain::init() {
+  if (config.framesInFlight < 1 || config.framesInFlight > MAX_FRAMES_IN_FLIGHT) {
+    throw std::runtime_error("frames in flight must be between 1 and " +
+                             std::to_string(MAX_FRAMES_IN_FLIGHT));
+  }
+
   createSwapChain();
   createImageViews();
   createRenderPass();
-  createDepthResources();
-  createFramebuffers();
   createSyncObjects();
 }
 
@@ -44,33 +70,23 @@ TpSwapChain::~TpSwapChain() {
     swapChain = nullptr;
   }
 
-  for (int i = 0; i < depthImages.size(); i++) {
-    vkDestroyImageView(device.device(), depthImageViews[i], nullptr);
-    vmaDestroyImage(device.allocator(), depthImages[i], depthImageAllocations[i]);
-  }
-
-  for (auto framebuffer : swapChainFramebuffers) {
-    vkDestroyFramebuffer(device.device(), framebuffer, nullptr);
-  }
-
   vkDestroyRenderPass(device.device(), renderPass, nullptr);
 
   // cleanup synchronization objects
-  for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+  for (size_t i = 0; i < frameTimelineValues.size(); i++) {
     vkDestroySemaphore(device.device(), renderFinishedSemaphores[i], nullptr);
     vkDestroySemaphore(device.device(), imageAvailableSemaphores[i], nullptr);
-    vkDestroyFence(device.device(), inFlightFences[i], nullptr);
   }
 }
 
 VkResult TpSwapChain::acquireNextImage(uint32_t *imageIndex) {
-  vkWaitForFences(
-          device.device(),
-          1,
-          &inFlightFences[currentFrame],
-          VK_TRUE,
-          std::numeric_limits<uint64_t>::max());
+  TP_PROFILE_SCOPE("TpSwapChain::acquireNextImage");
+  {
+    TP_PROFILE_SCOPE("vkWaitSemaphores (frame in flight)");
+    device.waitForGraphicsValue(frameTimelineValues[currentFrame]);
+  }
 
+  TP_PROFILE_SCOPE("vkAcquireNextImageKHR");
   VkResult result = vkAcquireNextImageKHR(
           device.device(),
           swapChain,
@@ -83,31 +99,23 @@ VkResult TpSwapChain::acquireNextImage(uint32_t *imageIndex) {
 }
 
 VkResult TpSwapChain::submitCommandBuffers(const VkCommandBuffer *buffers, uint32_t *imageIndex) {
-  if (imagesInFlight[*imageIndex] != VK_NULL_HANDLE) {
-    vkWaitForFences(device.device(), 1, &imagesInFlight[*imageIndex], VK_TRUE, UINT64_MAX);
+  TP_PROFILE_SCOPE("TpSwapChain::submitCommandBuffers");
+  if (imageTimelineValues[*imageIndex] != 0) {
+    TP_PROFILE_SCOPE("vkWaitSemaphores (image in flight)");
+    device.waitForGraphicsValue(imageTimelineValues[*imageIndex]);
   }
-  imagesInFlight[*imageIndex] = inFlightFences[currentFrame];
-
-  VkSubmitInfo submitInfo = {};
-  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-
-  VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[currentFrame]};
-  VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-  submitInfo.waitSemaphoreCount = 1;
-  submitInfo.pWaitSemaphores = waitSemaphores;
-  submitInfo.pWaitDstStageMask = waitStages;
-
-  submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = buffers;
 
   VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
-  submitInfo.signalSemaphoreCount = 1;
-  submitInfo.pSignalSemaphores = signalSemaphores;
-
-  vkResetFences(device.device(), 1, &inFlightFences[currentFrame]);
-  if (vkQueueSubmit(device.graphicsQueue(), 1, &submitInfo, inFlightFences[currentFrame]) !=
-      VK_SUCCESS) {
-    throw std::runtime_error("failed to submit draw command buffer!");
+  {
+    TP_PROFILE_SCOPE("vkQueueSubmit");
+    uint64_t value = device.submitGraphics(
+            buffers,
+            1,
+            imageAvailableSemaphores[currentFrame],
+            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+            renderFinishedSemaphores[currentFrame]);
+    frameTimelineValues[currentFrame] = value;
+    imageTimelineValues[*imageIndex] = value;
   }
 
   VkPresentInfoKHR presentInfo = {};
@@ -122,9 +130,10 @@ VkResult TpSwapChain::submitCommandBuffers(const VkCommandBuffer *buffers, uint3
 
   presentInfo.pImageIndices = imageIndex;
 
+  TP_PROFILE_SCOPE("vkQueuePresentKHR");
   auto result = vkQueuePresentKHR(device.presentQueue(), &presentInfo);
 
-  currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+  currentFrame = (currentFrame + 1) % config.framesInFlight;
 
   return result;
 }
@@ -133,10 +142,12 @@ void TpSwapChain::createSwapChain() {
   SwapChainSupportDetails swapChainSupport = device.getSwapChainSupport();
 
   VkSurfaceFormatKHR surfaceFormat = chooseSwapSurfaceFormat(swapChainSupport.formats);
-  VkPresentModeKHR presentMode = chooseSwapPresentMode(swapChainSupport.presentModes);
+  presentMode = chooseSwapPresentMode(swapChainSupport.presentModes);
   VkExtent2D extent = chooseSwapExtent(swapChainSupport.capabilities);
 
-  uint32_t imageCount = swapChainSupport.capabilities.minImageCount + 1;
+  uint32_t imageCount = config.minImageCount == 0
+                        ? swapChainSupport.capabilities.minImageCount + 1
+                        : std::max(config.minImageCount, swapChainSupport.capabilities.minImageCount);
   if (swapChainSupport.capabilities.maxImageCount > 0 &&
       imageCount > swapChainSupport.capabilities.maxImageCount) {
     imageCount = swapChainSupport.capabilities.maxImageCount;
@@ -202,8 +213,20 @@ void TpSwapChain::createImageViews() {
 }
 
 void TpSwapChain::createRenderPass() {
+  swapChainDepthFormat = findDepthFormat();
+
+  // Same attachment formats means the old pass, and every pipeline built against it, stays valid.
+  if (oldSwapchain != nullptr && oldSwapchain->renderPass != VK_NULL_HANDLE &&
+      compareSwapFormats(*oldSwapchain)) {
+    renderPass = oldSwapchain->renderPass;
+    oldSwapchain->renderPass = VK_NULL_HANDLE;
+    return;
+  }
+
+  // Never begun: frames render through the renderer's frame graph, whose passes only differ from
+  // this one in load/store ops, layouts and dependencies, none of which affect compatibility.
   VkAttachmentDescription depthAttachment{};
-  depthAttachment.format = findDepthFormat();
+  depthAttachment.format = swapChainDepthFormat;
   depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
   depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
   depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
@@ -236,15 +259,6 @@ void TpSwapChain::createRenderPass() {
   subpass.pColorAttachments = &colorAttachmentRef;
   subpass.pDepthStencilAttachment = &depthAttachmentRef;
 
-  VkSubpassDependency dependency = {};
-
-  dependency.dstSubpass = 0;
-  dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
-  dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-  dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-  dependency.srcAccessMask = 0;
-  dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-
   std::array<VkAttachmentDescription, 2> attachments = {colorAttachment, depthAttachment};
   VkRenderPassCreateInfo renderPassInfo = {};
   renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
@@ -252,107 +266,34 @@ void TpSwapChain::createRenderPass() {
   renderPassInfo.pAttachments = attachments.data();
   renderPassInfo.subpassCount = 1;
   renderPassInfo.pSubpasses = &subpass;
-  renderPassInfo.dependencyCount = 1;
-  renderPassInfo.pDependencies = &dependency;
 
   if (vkCreateRenderPass(device.device(), &renderPassInfo, nullptr, &renderPass) != VK_SUCCESS) {
     throw std::runtime_error("failed to create render pass!");
   }
 }
 
-void TpSwapChain::createFramebuffers() {
-  swapChainFramebuffers.resize(imageCount());
-  for (size_t i = 0; i < imageCount(); i++) {
-    std::array<VkImageView, 2> attachments = {swapChainImageViews[i], depthImageViews[i]};
-
-    VkExtent2D swapChainExtent = getSwapChainExtent();
-    VkFramebufferCreateInfo framebufferInfo = {};
-    framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-    framebufferInfo.renderPass = renderPass;
-    framebufferInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
-    framebufferInfo.pAttachments = attachments.data();
-    framebufferInfo.width = swapChainExtent.width;
-    framebufferInfo.height = swapChainExtent.height;
-    framebufferInfo.layers = 1;
-
-    if (vkCreateFramebuffer(
-            device.device(),
-            &framebufferInfo,
-            nullptr,
-            &swapChainFramebuffers[i]) != VK_SUCCESS) {
-      throw std::runtime_error("failed to create framebuffer!");
-    }
-  }
-}
-
-void TpSwapChain::createDepthResources() {
-  VkFormat depthFormat = findDepthFormat();
-  swapChainDepthFormat = depthFormat;
-  VkExtent2D swapChainExtent = getSwapChainExtent();
-
-  depthImages.resize(imageCount());
-  depthImageAllocations.resize(imageCount());
-  depthImageViews.resize(imageCount());
-
-  for (int i = 0; i < depthImages.size(); i++) {
-    VkImageCreateInfo imageInfo{};
-    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    imageInfo.imageType = VK_IMAGE_TYPE_2D;
-    imageInfo.extent.width = swapChainExtent.width;
-    imageInfo.extent.height = swapChainExtent.height;
-    imageInfo.extent.depth = 1;
-    imageInfo.mipLevels = 1;
-    imageInfo.arrayLayers = 1;
-    imageInfo.format = depthFormat;
-    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    imageInfo.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
-    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    imageInfo.flags = 0;
-
-    device.createImageWithInfo(
-            imageInfo,
-            VMA_MEMORY_USAGE_GPU_ONLY,
-            depthImages[i],
-            depthImageAllocations[i]);
-
-    VkImageViewCreateInfo viewInfo{};
-    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-    viewInfo.image = depthImages[i];
-    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    viewInfo.format = depthFormat;
-    viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-    viewInfo.subresourceRange.baseMipLevel = 0;
-    viewInfo.subresourceRange.levelCount = 1;
-    viewInfo.subresourceRange.baseArrayLayer = 0;
-    viewInfo.subresourceRange.layerCount = 1;
-
-    if (vkCreateImageView(device.device(), &viewInfo, nullptr, &depthImageViews[i]) != VK_SUCCESS) {
-      throw std::runtime_error("failed to create texture image view!");
-    }
-  }
-}
-
 void TpSwapChain::createSyncObjects() {
-  imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-  renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-  inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
-  imagesInFlight.resize(imageCount(), VK_NULL_HANDLE);
+  imageAvailableSemaphores.resize(config.framesInFlight);
+  renderFinishedSemaphores.resize(config.framesInFlight);
+  // 0 is the timeline's initial value, so a fresh slot never waits
+  frameTimelineValues.resize(config.framesInFlight, 0);
+  imageTimelineValues.resize(imageCount(), 0);
+
+  // Carry the frame pacing over so the renderer's per-frame command buffers are still only
+  // reused once the gpu is done with them.
+  if (oldSwapchain != nullptr && oldSwapchain->frameTimelineValues.size() == frameTimelineValues.size()) {
+    frameTimelineValues = oldSwapchain->frameTimelineValues;
+    currentFrame = oldSwapchain->currentFrame;
+  }
 
   VkSemaphoreCreateInfo semaphoreInfo = {};
   semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-  VkFenceCreateInfo fenceInfo = {};
-  fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-  fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-
-  for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+  for (size_t i = 0; i < frameTimelineValues.size(); i++) {
     if (vkCreateSemaphore(device.device(), &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) !=
         VK_SUCCESS ||
         vkCreateSemaphore(device.device(), &semaphoreInfo, nullptr, &renderFinishedSemaphores[i]) !=
-        VK_SUCCESS ||
-        vkCreateFence(device.device(), &fenceInfo, nullptr, &inFlightFences[i]) != VK_SUCCESS) {
+        VK_SUCCESS) {
       throw std::runtime_error("failed to create synchronization objects for a frame!");
     }
   }
@@ -372,21 +313,23 @@ VkSurfaceFormatKHR TpSwapChain::chooseSwapSurfaceFormat(
 
 VkPresentModeKHR TpSwapChain::chooseSwapPresentMode(
         const std::vector<VkPresentModeKHR> &availablePresentModes) {
-//  for (const auto &availablePresentMode : availablePresentModes) {
-//    if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR) {
-//      std::cout << "Present mode: Mailbox" << std::endl;
-//      return availablePresentMode;
-//    }
-//  }
-
-//   for (const auto &availablePresentMode : availablePresentModes) {
-//     if (availablePresentMode == VK_PRESENT_MODE_IMMEDIATE_KHR) {
-//       std::cout << "Present mode: Immediate" << std::endl;
-//       return availablePresentMode;
-//     }
-//   }
-
-  std::cout << "Present mode: V-Sync" << std::endl;
+  VkPresentModeKHR requested = VK_PRESENT_MODE_FIFO_KHR;
+  switch (config.presentMode) {
+    case TpPresentMode::Fifo: requested = VK_PRESENT_MODE_FIFO_KHR; break;
+    case TpPresentMode::Mailbox: requested = VK_PRESENT_MODE_MAILBOX_KHR; break;
+    case TpPresentMode::Immediate: requested = VK_PRESENT_MODE_IMMEDIATE_KHR; break;
+  }
+
+  for (const auto &availablePresentMode : availablePresentModes) {
+    if (availablePresentMode == requested) {
+      std::cout << "Present mode: " << presentModeName(config.presentMode) << std::endl;
+      return availablePresentMode;
+    }
+  }
+
+  // FIFO is the only mode the spec guarantees
+  std::cout << "Present mode: " << presentModeName(config.presentMode)
+            << " not supported, falling back to V-Sync" << std::endl;
   return VK_PRESENT_MODE_FIFO_KHR;
 }
 
@@ -410,7 +353,7 @@ VkFormat TpSwapChain::findDepthFormat() {
   return device.findSupportedFormat(
           {VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT},
           VK_IMAGE_TILING_OPTIMAL,
-          VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT);
+          VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT);
 }
 
 }  // namespace teapot
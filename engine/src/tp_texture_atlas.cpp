@@ -0,0 +1,306 @@
+#include "tp_texture_atlas.h"
+#include "tp_cpu_profiler.h"
+#include "tp_image_layout.h"
+
+#include "stb_image.h"
+
+// std
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace teapot {
+
+namespace {
+
+void layerBarrier(VkCommandBuffer commandBuffer, VkImage image, uint32_t baseLayer, uint32_t layerCount,
+                  VkImageLayout oldLayout, VkImageLayout newLayout) {
+  TpImageLayoutInfo source = getImageLayoutInfo(oldLayout);
+  TpImageLayoutInfo destination = getImageLayoutInfo(newLayout);
+
+  VkImageMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.oldLayout = oldLayout;
+  barrier.newLayout = newLayout;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = image;
+  barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, baseLayer, layerCount};
+  barrier.srcAccessMask = source.access;
+  barrier.dstAccessMask = destination.access;
+  vkCmdPipelineBarrier(commandBuffer,
+                       source.stages, destination.stages,
+                       0,
+                       0, nullptr,
+                       0, nullptr,
+                       1, &barrier);
+}
+
+// the texture with its edge texels repeated padding times on every side
+std::vector<unsigned char> padTexture(const unsigned char *rgbaPixels, uint32_t width, uint32_t height,
+                                      uint32_t padding) {
+  uint32_t paddedWidth = width + 2 * padding;
+  uint32_t paddedHeight = height + 2 * padding;
+  std::vector<unsigned char> padded(static_cast<size_t>(paddedWidth) * paddedHeight * 4);
+  for (uint32_t y = 0; y < paddedHeight; y++) {
+    uint32_t sourceY = std::min(std::max(y, padding) - padding, height - 1);
+    for (uint32_t x = 0; x < paddedWidth; x++) {
+      uint32_t sourceX = std::min(std::max(x, padding) - padding, width - 1);
+      std::memcpy(&padded[(static_cast<size_t>(y) * paddedWidth + x) * 4],
+                  &rgbaPixels[(static_cast<size_t>(sourceY) * width + sourceX) * 4], 4);
+    }
+  }
+  return padded;
+}
+
+}  // namespace
+
+TpTextureAtlas::TpTextureAtlas(TpDevice &device) : tpDevice{device} {
+  createSampler();
+  memoryPressureHandler = tpDevice.addMemoryPressureHandler([this](VkDeviceSize) { return trim(); });
+}
+
+TpTextureAtlas::~TpTextureAtlas() {
+  tpDevice.removeMemoryPressureHandler(memoryPressureHandler);
+  for (auto &array : arrays) {
+    if (array.image == VK_NULL_HANDLE) continue;
+    vkDestroyImageView(tpDevice.device(), array.view, nullptr);
+    vmaDestroyImage(tpDevice.allocator(), array.image, array.allocation);
+  }
+  vkDestroySampler(tpDevice.device(), sampler, nullptr);
+}
+
+void TpTextureAtlas::createSampler() {
+  VkSamplerCreateInfo samplerInfo{};
+  samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  samplerInfo.magFilter = VK_FILTER_LINEAR;
+  samplerInfo.minFilter = VK_FILTER_LINEAR;
+  samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+  samplerInfo.anisotropyEnable = VK_TRUE;
+  samplerInfo.maxAnisotropy = 8;
+  samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+  samplerInfo.unnormalizedCoordinates = VK_FALSE;
+  samplerInfo.compareEnable = VK_FALSE;
+  samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
+  samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+  samplerInfo.mipLodBias = 0.0f;
+  samplerInfo.minLod = 0.0f;
+  samplerInfo.maxLod = 0.0f;
+  if (vkCreateSampler(tpDevice.device(), &samplerInfo, nullptr, &sampler) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create texture sampler!");
+  }
+}
+
+TpTextureRef TpTextureAtlas::add(const unsigned char *rgbaPixels, uint32_t width, uint32_t height) {
+  TP_PROFILE_SCOPE("TpTextureAtlas::add");
+  if (width == 0 || height == 0) {
+    throw std::invalid_argument("texture must not be empty");
+  }
+
+  TpTextureRef texture{};
+  if (width <= MAX_PACKED_SIZE && height <= MAX_PACKED_SIZE) {
+    std::vector<unsigned char> padded = padTexture(rgbaPixels, width, height, PADDING);
+    uint32_t x = 0;
+    uint32_t y = 0;
+    placePacked(width + 2 * PADDING, height + 2 * PADDING, texture.array, texture.layer, x, y);
+    upload(arrays[texture.array], texture.layer, x, y, width + 2 * PADDING, height + 2 * PADDING, padded.data());
+    auto page = static_cast<float>(PAGE_SIZE);
+    texture.uvRect = {static_cast<float>(x + PADDING) / page, static_cast<float>(y + PADDING) / page,
+                      static_cast<float>(width) / page, static_cast<float>(height) / page};
+  } else {
+    texture.array = findArray(width, height, false);
+    texture.layer = addLayer(arrays[texture.array]);
+    upload(arrays[texture.array], texture.layer, 0, 0, width, height, rgbaPixels);
+    texture.uvRect = {0.f, 0.f, 1.f, 1.f};
+  }
+  textureCount++;
+  return texture;
+}
+
+bool TpTextureAtlas::load(const std::string &imagePath, TpTextureRef &texture) {
+  int texWidth, texHeight, texChannels;
+  stbi_uc *pixels = stbi_load(imagePath.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
+  if (!pixels) return false;
+
+  texture = add(pixels, static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight));
+  stbi_image_free(pixels);
+  return true;
+}
+
+uint32_t TpTextureAtlas::findArray(uint32_t width, uint32_t height, bool packed) {
+  for (size_t i = 0; i < arrays.size(); i++) {
+    const Array &array = arrays[i];
+    if (array.width == width && array.height == height && array.packed == packed && array.layerCount < MAX_LAYERS) {
+      return static_cast<uint32_t>(i);
+    }
+  }
+  Array array{};
+  array.width = width;
+  array.height = height;
+  array.packed = packed;
+  arrays.push_back(array);
+  return static_cast<uint32_t>(arrays.size() - 1);
+}
+
+uint32_t TpTextureAtlas::addLayer(Array &array) {
+  if (array.layerCount == array.layerCapacity) {
+    resize(array, std::min(std::max(2 * array.layerCapacity, 1u), MAX_LAYERS));
+  }
+  return array.layerCount++;
+}
+
+void TpTextureAtlas::resize(Array &array, uint32_t layerCapacity) {
+  TP_PROFILE_SCOPE("TpTextureAtlas::resize");
+  VkImageCreateInfo imageInfo{};
+  imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  imageInfo.imageType = VK_IMAGE_TYPE_2D;
+  imageInfo.extent = {array.width, array.height, 1};
+  imageInfo.mipLevels = 1;
+  imageInfo.arrayLayers = layerCapacity;
+  imageInfo.format = FORMAT;
+  imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+  imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  imageInfo.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+  imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+
+  VkImage image;
+  VmaAllocation allocation;
+  tpDevice.createImageWithInfo(imageInfo, VMA_MEMORY_USAGE_GPU_ONLY, image, allocation, TpMemoryClass::Textures);
+
+  // the used layers move over, the new ones stay undefined until a texture is uploaded
+  VkCommandBuffer commandBuffer = tpDevice.beginSingleTimeCommands();
+  layerBarrier(commandBuffer, image, 0, layerCapacity,
+               VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+  if (array.layerCount > 0) {
+    layerBarrier(commandBuffer, array.image, 0, array.layerCount,
+                 VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+    VkImageCopy region{};
+    region.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, array.layerCount};
+    region.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, array.layerCount};
+    region.extent = {array.width, array.height, 1};
+    vkCmdCopyImage(commandBuffer,
+                   array.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                   image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                   1, &region);
+  }
+  layerBarrier(commandBuffer, image, 0, layerCapacity,
+               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+  tpDevice.endSingleTimeCommands(commandBuffer);
+
+  if (array.image != VK_NULL_HANDLE) {
+    // frames in flight still sample the old view
+    VkDevice device = tpDevice.device();
+    VmaAllocator allocator = tpDevice.allocator();
+    VkImage oldImage = array.image;
+    VmaAllocation oldAllocation = array.allocation;
+    VkImageView oldView = array.view;
+    tpDevice.deferDestroy(tpDevice.lastSubmittedGraphicsValue(), [=]() {
+      vkDestroyImageView(device, oldView, nullptr);
+      vmaDestroyImage(allocator, oldImage, oldAllocation);
+    });
+  }
+
+  VkImageViewCreateInfo viewInfo{};
+  viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  viewInfo.image = image;
+  viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+  viewInfo.format = FORMAT;
+  viewInfo.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, layerCapacity};
+  if (vkCreateImageView(tpDevice.device(), &viewInfo, nullptr, &array.view) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create texture array view");
+  }
+  array.image = image;
+  array.allocation = allocation;
+  array.layerCapacity = layerCapacity;
+}
+
+void TpTextureAtlas::placePacked(uint32_t width, uint32_t height, uint32_t &arrayIndex, uint32_t &layer,
+                                 uint32_t &x, uint32_t &y) {
+  // only the last page of the last packed array is open, earlier pages are never revisited
+  auto open = std::find_if(arrays.rbegin(), arrays.rend(), [](const Array &array) { return array.packed; });
+  if (open != arrays.rend() && open->layerCount > 0) {
+    Array &array = *open;
+    if (array.shelfX + width > PAGE_SIZE && array.shelfY + array.shelfHeight + height <= PAGE_SIZE) {
+      array.shelfY += array.shelfHeight;
+      array.shelfX = 0;
+      array.shelfHeight = 0;
+    }
+    if (array.shelfX + width <= PAGE_SIZE && array.shelfY + height <= PAGE_SIZE) {
+      arrayIndex = static_cast<uint32_t>(std::distance(arrays.begin(), open.base()) - 1);
+      layer = array.layerCount - 1;
+      x = array.shelfX;
+      y = array.shelfY;
+      array.shelfX += width;
+      array.shelfHeight = std::max(array.shelfHeight, height);
+      return;
+    }
+  }
+
+  arrayIndex = findArray(PAGE_SIZE, PAGE_SIZE, true);
+  Array &array = arrays[arrayIndex];
+  layer = addLayer(array);
+  x = 0;
+  y = 0;
+  array.shelfX = width;
+  array.shelfY = 0;
+  array.shelfHeight = height;
+}
+
+void TpTextureAtlas::upload(const Array &array, uint32_t layer, uint32_t x, uint32_t y, uint32_t width,
+                            uint32_t height, const unsigned char *rgbaPixels) {
+  VkDeviceSize size = VkDeviceSize{width} * height * 4;
+  VkBuffer stagingBuffer;
+  VmaAllocation stagingAllocation;
+  tpDevice.createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                        VMA_MEMORY_USAGE_CPU_ONLY,
+                        stagingBuffer, stagingAllocation, TpMemoryClass::Staging);
+  void *mapped;
+  vmaMapMemory(tpDevice.allocator(), stagingAllocation, &mapped);
+  std::memcpy(mapped, rgbaPixels, static_cast<size_t>(size));
+  vmaFlushAllocation(tpDevice.allocator(), stagingAllocation, 0, size);
+  vmaUnmapMemory(tpDevice.allocator(), stagingAllocation);
+
+  // the rest of the layer keeps its contents through the transitions
+  VkCommandBuffer commandBuffer = tpDevice.beginSingleTimeCommands();
+  layerBarrier(commandBuffer, array.image, layer, 1,
+               VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+  VkBufferImageCopy region{};
+  region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, layer, 1};
+  region.imageOffset = {static_cast<int32_t>(x), static_cast<int32_t>(y), 0};
+  region.imageExtent = {width, height, 1};
+  vkCmdCopyBufferToImage(commandBuffer, stagingBuffer, array.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                         1, &region);
+  layerBarrier(commandBuffer, array.image, layer, 1,
+               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+  VmaAllocator allocator = tpDevice.allocator();
+  tpDevice.deferDestroy(tpDevice.endSingleTimeCommands(commandBuffer), [=]() {
+    vmaDestroyBuffer(allocator, stagingBuffer, stagingAllocation);
+  });
+}
+
+VkDeviceSize TpTextureAtlas::trim() {
+  VkDeviceSize released = 0;
+  for (auto &array : arrays) {
+    // the open shelf is on the last used layer, so packing continues where it left off
+    if (array.layerCount == 0 || array.layerCount == array.layerCapacity) continue;
+    released += VkDeviceSize{array.width} * array.height * 4 * (array.layerCapacity - array.layerCount);
+    resize(array, array.layerCount);
+  }
+  return released;
+}
+
+TpTextureAtlasStats TpTextureAtlas::getStats() const {
+  TpTextureAtlasStats stats{};
+  stats.textures = textureCount;
+  stats.arrays = static_cast<uint32_t>(arrays.size());
+  for (const auto &array : arrays) {
+    stats.layers += array.layerCapacity;
+    stats.bytes += static_cast<uint64_t>(array.width) * array.height * 4 * array.layerCapacity;
+  }
+  return stats;
+}
+
+}  // namespace teapot
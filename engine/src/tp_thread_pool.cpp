@@ -0,0 +1,90 @@
+#include "tp_thread_pool.h"
+#include "tp_cpu_profiler.h"
+
+// std
+#include <algorithm>
+
+namespace teapot {
+
+TpThreadPool::TpThreadPool(unsigned workerCount) {
+  if (workerCount == 0) {
+    unsigned hardware = std::thread::hardware_concurrency();
+    workerCount = hardware > 1 ? hardware - 1 : 0;
+  }
+  workers.reserve(workerCount);
+  for (unsigned i = 0; i < workerCount; i++) {
+    workers.emplace_back([this] { workerLoop(); });
+  }
+}
+
+TpThreadPool::~TpThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock{mutex};
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto &worker : workers) worker.join();
+}
+
+void TpThreadPool::parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)> &fn) {
+  if (count == 0) return;
+  grain = std::max<size_t>(grain, 1);
+
+  // a few chunks per thread so uneven chunks still balance out
+  size_t chunkSize = std::max(grain, count / (static_cast<size_t>(threadCount()) * 4) + 1);
+  size_t chunks = (count + chunkSize - 1) / chunkSize;
+  if (workers.empty() || chunks == 1) {
+    fn(0, count);
+    return;
+  }
+
+  std::lock_guard<std::mutex> submitLock{submitMutex};
+  {
+    std::lock_guard<std::mutex> lock{mutex};
+    job = &fn;
+    jobCount = count;
+    jobChunkSize = chunkSize;
+    jobChunks = chunks;
+    nextChunk.store(0, std::memory_order_relaxed);
+    activeWorkers = workers.size();
+    generation++;
+  }
+  wake.notify_all();
+
+  runChunks();
+
+  // fn lives on this stack frame, so wait until no worker can still be inside it
+  std::unique_lock<std::mutex> lock{mutex};
+  done.wait(lock, [this] { return activeWorkers == 0; });
+  job = nullptr;
+}
+
+void TpThreadPool::runChunks() {
+  for (size_t chunk = nextChunk.fetch_add(1, std::memory_order_relaxed); chunk < jobChunks;
+       chunk = nextChunk.fetch_add(1, std::memory_order_relaxed)) {
+    size_t begin = chunk * jobChunkSize;
+    (*job)(begin, std::min(begin + jobChunkSize, jobCount));
+  }
+}
+
+void TpThreadPool::workerLoop() {
+  uint64_t seenGeneration = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock{mutex};
+      wake.wait(lock, [&] { return stopping || generation != seenGeneration; });
+      if (stopping) return;
+      seenGeneration = generation;
+    }
+
+    {
+      TP_PROFILE_SCOPE("TpThreadPool::worker");
+      runChunks();
+    }
+
+    std::lock_guard<std::mutex> lock{mutex};
+    if (--activeWorkers == 0) done.notify_one();
+  }
+}
+
+}  // namespace teapot
@@ -0,0 +1,132 @@
+#include "tp_tiled_image.h"
+#include "tp_cpu_profiler.h"
+
+#include "stb_image.h"
+
+// std
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <utility>
+
+namespace teapot {
+
+namespace {
+
+constexpr uint32_t MAGIC = 0x49545054;  // "TPTI"
+constexpr uint32_t VERSION = 1;
+constexpr uint32_t HEADER_WORDS = 8;
+constexpr uint64_t HEADER_BYTES = HEADER_WORDS * sizeof(uint32_t);
+
+// 2x2 box filter; odd edges repeat their last texel
+std::vector<unsigned char> downsample(const std::vector<unsigned char> &source, uint32_t width, uint32_t height,
+                                      uint32_t halfWidth, uint32_t halfHeight) {
+  std::vector<unsigned char> half(static_cast<size_t>(halfWidth) * halfHeight * 4);
+  for (uint32_t y = 0; y < halfHeight; y++) {
+    uint32_t y0 = std::min(2 * y, height - 1);
+    uint32_t y1 = std::min(2 * y + 1, height - 1);
+    for (uint32_t x = 0; x < halfWidth; x++) {
+      uint32_t x0 = std::min(2 * x, width - 1);
+      uint32_t x1 = std::min(2 * x + 1, width - 1);
+      for (uint32_t c = 0; c < 4; c++) {
+        uint32_t sum = source[(static_cast<size_t>(y0) * width + x0) * 4 + c] +
+                       source[(static_cast<size_t>(y0) * width + x1) * 4 + c] +
+                       source[(static_cast<size_t>(y1) * width + x0) * 4 + c] +
+                       source[(static_cast<size_t>(y1) * width + x1) * 4 + c];
+        half[(static_cast<size_t>(y) * halfWidth + x) * 4 + c] = static_cast<unsigned char>((sum + 2) / 4);
+      }
+    }
+  }
+  return half;
+}
+
+}  // namespace
+
+uint32_t TpTiledImageInfo::firstTile(uint32_t mip) const {
+  uint32_t first = 0;
+  for (uint32_t m = 0; m < mip; m++) first += tilesX(m) * tilesY(m);
+  return first;
+}
+
+void TpTiledImage::write(const std::string &path, const unsigned char *rgbaPixels, uint32_t width,
+                         uint32_t height) {
+  TP_PROFILE_SCOPE("TpTiledImage::write");
+  if (width == 0 || height == 0) {
+    throw std::invalid_argument("tiled image must not be empty");
+  }
+
+  TpTiledImageInfo info{width, height, TILE_SIZE, BORDER, 1};
+  while (info.mipWidth(info.mipCount - 1) > TILE_SIZE || info.mipHeight(info.mipCount - 1) > TILE_SIZE) {
+    info.mipCount++;
+  }
+
+  std::ofstream file{path, std::ios::binary | std::ios::trunc};
+  uint32_t header[HEADER_WORDS] = {MAGIC, VERSION, width, height, info.tileSize, info.border, info.mipCount, 0};
+  file.write(reinterpret_cast<const char *>(header), sizeof(header));
+
+  uint32_t stored = info.storedTileSize();
+  std::vector<unsigned char> tile(info.tileBytes());
+  std::vector<unsigned char> mip(rgbaPixels, rgbaPixels + static_cast<size_t>(width) * height * 4);
+  for (uint32_t level = 0; level < info.mipCount; level++) {
+    uint32_t mipWidth = info.mipWidth(level);
+    uint32_t mipHeight = info.mipHeight(level);
+    if (level > 0) {
+      mip = downsample(mip, info.mipWidth(level - 1), info.mipHeight(level - 1), mipWidth, mipHeight);
+    }
+
+    for (uint32_t tileY = 0; tileY < info.tilesY(level); tileY++) {
+      for (uint32_t tileX = 0; tileX < info.tilesX(level); tileX++) {
+        for (uint32_t y = 0; y < stored; y++) {
+          auto sourceY = static_cast<int64_t>(tileY) * TILE_SIZE + y - BORDER;
+          sourceY = std::min<int64_t>(std::max<int64_t>(sourceY, 0), mipHeight - 1);
+          for (uint32_t x = 0; x < stored; x++) {
+            auto sourceX = static_cast<int64_t>(tileX) * TILE_SIZE + x - BORDER;
+            sourceX = std::min<int64_t>(std::max<int64_t>(sourceX, 0), mipWidth - 1);
+            std::memcpy(&tile[(static_cast<size_t>(y) * stored + x) * 4],
+                        &mip[(static_cast<size_t>(sourceY) * mipWidth + sourceX) * 4], 4);
+          }
+        }
+        file.write(reinterpret_cast<const char *>(tile.data()), static_cast<std::streamsize>(tile.size()));
+      }
+    }
+  }
+
+  if (!file) {
+    throw std::runtime_error("failed to write tiled image " + path);
+  }
+}
+
+bool TpTiledImage::convert(const std::string &imagePath, const std::string &path) {
+  int texWidth, texHeight, texChannels;
+  stbi_uc *pixels = stbi_load(imagePath.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
+  if (!pixels) return false;
+
+  write(path, pixels, static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight));
+  stbi_image_free(pixels);
+  return true;
+}
+
+TpTiledImage::TpTiledImage(std::string path) : path{std::move(path)} {
+  std::ifstream file{this->path, std::ios::binary};
+  uint32_t header[HEADER_WORDS] = {};
+  file.read(reinterpret_cast<char *>(header), sizeof(header));
+  if (!file || header[0] != MAGIC || header[1] != VERSION) {
+    throw std::runtime_error("not a tiled image: " + this->path);
+  }
+  info = {header[2], header[3], header[4], header[5], header[6]};
+  if (info.width == 0 || info.height == 0 || info.tileSize == 0 || info.mipCount == 0) {
+    throw std::runtime_error("malformed tiled image: " + this->path);
+  }
+}
+
+void TpTiledImage::readTile(uint32_t tile, unsigned char *rgbaPixels) const {
+  std::ifstream file{path, std::ios::binary};
+  file.seekg(static_cast<std::streamoff>(HEADER_BYTES + tile * info.tileBytes()));
+  file.read(reinterpret_cast<char *>(rgbaPixels), static_cast<std::streamsize>(info.tileBytes()));
+  if (!file) {
+    throw std::runtime_error("failed to read tile of " + path);
+  }
+}
+
+}  // namespace teapot
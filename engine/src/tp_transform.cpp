@@ -0,0 +1,286 @@
+#include "tp_transform.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+// std
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TP_TRANSFORM_SSE2
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define TP_TRANSFORM_AVX2
+#endif
+
+namespace teapot {
+
+namespace {
+
+/*
+ * rotateY * rotateX * rotateZ multiplied out, columns scaled, followed by the translation:
+ * the 12 non-constant entries of the matrix in column order. T is float or a SIMD lane type.
+ */
+template <typename T>
+void composeColumns(const T &tx, const T &ty, const T &tz, const T &sinX, const T &cosX, const T &sinY,
+                    const T &cosY, const T &sinZ, const T &cosZ, const T &scaleX, const T &scaleY,
+                    const T &scaleZ, T (&columns)[12]) {
+  columns[0] = scaleX * (cosY * cosZ + sinX * sinY * sinZ);
+  columns[1] = scaleX * (cosX * sinZ);
+  columns[2] = scaleX * (cosY * sinX * sinZ - cosZ * sinY);
+  columns[3] = scaleY * (cosZ * sinX * sinY - cosY * sinZ);
+  columns[4] = scaleY * (cosX * cosZ);
+  columns[5] = scaleY * (cosY * cosZ * sinX + sinY * sinZ);
+  columns[6] = scaleZ * (cosX * sinY);
+  columns[7] = scaleZ * -sinX;
+  columns[8] = scaleZ * (cosX * cosY);
+  columns[9] = tx;
+  columns[10] = ty;
+  columns[11] = tz;
+}
+
+void composeScalar(const glm::vec3 &translation, const glm::vec3 &rotation, const glm::vec3 &scale,
+                   glm::mat4 &out) {
+  float c[12];
+  composeColumns(translation.x, translation.y, translation.z, std::sin(rotation.x), std::cos(rotation.x),
+                 std::sin(rotation.y), std::cos(rotation.y), std::sin(rotation.z), std::cos(rotation.z),
+                 scale.x, scale.y, scale.z, c);
+  out = glm::mat4{{c[0], c[1], c[2], 0.f}, {c[3], c[4], c[5], 0.f}, {c[6], c[7], c[8], 0.f},
+                  {c[9], c[10], c[11], 1.f}};
+}
+
+struct Contiguous {
+  size_t operator()(size_t i) const { return i; }
+};
+
+struct Indexed {
+  const uint32_t *indices;
+  size_t operator()(size_t i) const { return indices[i]; }
+};
+
+/*
+ * sin and cos of every lane (Cephes single precision): reduce |x| to [-pi/4, pi/4] by octant,
+ * evaluate both minimax polynomials and swap / negate per octant. Accurate to ~1e-7 for the
+ * angles a transform sees; precision drops for |x| beyond a few thousand.
+ */
+template <typename F>
+void sinCos(F x, F &sinOut, F &cosOut) {
+  using I = typename F::Int;
+  const F signMask = F::set1(-0.f);
+  F sinSign = x & signMask;
+  x = andNot(signMask, x);
+
+  // octant rounded up to even, so the remainder is centred on zero
+  I octant = F::truncate(x * F::set1(1.27323954473516f));
+  octant = andNot(I::set1(1), octant + I::set1(1));
+  F y = F::fromInt(octant);
+
+  // pi/4 split in three parts so the subtraction stays exact
+  x = x - y * F::set1(0.78515625f);
+  x = x - y * F::set1(2.4187564849853515625e-4f);
+  x = x - y * F::set1(3.77489497744594108e-8f);
+
+  F z = x * x;
+  F cosPoly = ((F::set1(2.443315711809948e-5f) * z - F::set1(1.388731625493765e-3f)) * z +
+               F::set1(4.166664568298827e-2f)) * z * z - z * F::set1(0.5f) + F::set1(1.f);
+  F sinPoly = ((F::set1(-1.9515295891e-4f) * z + F::set1(8.3321608736e-3f)) * z -
+               F::set1(1.6666654611e-1f)) * z * x + x;
+
+  F noSwap = F::isZero(octant & I::set1(2));
+  sinOut = select(noSwap, sinPoly, cosPoly) ^ sinSign ^ F::bitTwoToSign(octant & I::set1(4));
+  cosOut = select(noSwap, cosPoly, sinPoly) ^ F::bitTwoToSign(andNot(octant - I::set1(2), I::set1(4)));
+}
+
+template <typename F, typename Index>
+void composeBlock(Index index, size_t first, const glm::vec3 *translations, const glm::vec3 *rotations,
+                  const glm::vec3 *scales, glm::mat4 *out) {
+  constexpr size_t W = F::WIDTH;
+  alignas(32) float lanes[9][W];
+  for (size_t k = 0; k < W; k++) {
+    size_t i = index(first + k);
+    lanes[0][k] = translations[i].x;
+    lanes[1][k] = translations[i].y;
+    lanes[2][k] = translations[i].z;
+    lanes[3][k] = rotations[i].x;
+    lanes[4][k] = rotations[i].y;
+    lanes[5][k] = rotations[i].z;
+    lanes[6][k] = scales[i].x;
+    lanes[7][k] = scales[i].y;
+    lanes[8][k] = scales[i].z;
+  }
+
+  F sinX, cosX, sinY, cosY, sinZ, cosZ;
+  sinCos(F::load(lanes[3]), sinX, cosX);
+  sinCos(F::load(lanes[4]), sinY, cosY);
+  sinCos(F::load(lanes[5]), sinZ, cosZ);
+
+  F columns[12];
+  composeColumns(F::load(lanes[0]), F::load(lanes[1]), F::load(lanes[2]), sinX, cosX, sinY, cosY, sinZ, cosZ,
+                 F::load(lanes[6]), F::load(lanes[7]), F::load(lanes[8]), columns);
+  F::storeMatrices(columns, index, first, out);
+}
+
+#if defined(TP_TRANSFORM_SSE2)
+
+struct IntX4 {
+  __m128i v;
+  static IntX4 set1(int value) { return {_mm_set1_epi32(value)}; }
+};
+
+inline IntX4 operator+(IntX4 a, IntX4 b) { return {_mm_add_epi32(a.v, b.v)}; }
+inline IntX4 operator-(IntX4 a, IntX4 b) { return {_mm_sub_epi32(a.v, b.v)}; }
+inline IntX4 operator&(IntX4 a, IntX4 b) { return {_mm_and_si128(a.v, b.v)}; }
+inline IntX4 andNot(IntX4 a, IntX4 b) { return {_mm_andnot_si128(a.v, b.v)}; }
+
+struct FloatX4 {
+  using Int = IntX4;
+  static constexpr size_t WIDTH = 4;
+  __m128 v;
+
+  static FloatX4 set1(float value) { return {_mm_set1_ps(value)}; }
+  static FloatX4 load(const float *values) { return {_mm_load_ps(values)}; }
+  static IntX4 truncate(FloatX4 a) { return {_mm_cvttps_epi32(a.v)}; }
+  static FloatX4 fromInt(IntX4 a) { return {_mm_cvtepi32_ps(a.v)}; }
+  static FloatX4 isZero(IntX4 a) { return {_mm_castsi128_ps(_mm_cmpeq_epi32(a.v, _mm_setzero_si128()))}; }
+  static FloatX4 bitTwoToSign(IntX4 a) { return {_mm_castsi128_ps(_mm_slli_epi32(a.v, 29))}; }
+
+  // transposes four lanes of columns into four column-major matrices
+  template <typename Index>
+  static void storeMatrices(const FloatX4 (&columns)[12], Index index, size_t first, glm::mat4 *out) {
+    for (int c = 0; c < 4; c++) {
+      __m128 r0 = columns[c * 3].v;
+      __m128 r1 = columns[c * 3 + 1].v;
+      __m128 r2 = columns[c * 3 + 2].v;
+      __m128 r3 = c == 3 ? _mm_set1_ps(1.f) : _mm_setzero_ps();
+      _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+      _mm_storeu_ps(&out[index(first)][c].x, r0);
+      _mm_storeu_ps(&out[index(first + 1)][c].x, r1);
+      _mm_storeu_ps(&out[index(first + 2)][c].x, r2);
+      _mm_storeu_ps(&out[index(first + 3)][c].x, r3);
+    }
+  }
+};
+
+inline FloatX4 operator+(FloatX4 a, FloatX4 b) { return {_mm_add_ps(a.v, b.v)}; }
+inline FloatX4 operator-(FloatX4 a, FloatX4 b) { return {_mm_sub_ps(a.v, b.v)}; }
+inline FloatX4 operator*(FloatX4 a, FloatX4 b) { return {_mm_mul_ps(a.v, b.v)}; }
+inline FloatX4 operator&(FloatX4 a, FloatX4 b) { return {_mm_and_ps(a.v, b.v)}; }
+inline FloatX4 operator^(FloatX4 a, FloatX4 b) { return {_mm_xor_ps(a.v, b.v)}; }
+inline FloatX4 operator-(FloatX4 a) { return a ^ FloatX4::set1(-0.f); }
+inline FloatX4 andNot(FloatX4 a, FloatX4 b) { return {_mm_andnot_ps(a.v, b.v)}; }
+inline FloatX4 select(FloatX4 mask, FloatX4 a, FloatX4 b) {
+  return {_mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v))};
+}
+
+#endif
+
+#if defined(TP_TRANSFORM_AVX2)
+
+struct IntX8 {
+  __m256i v;
+  static IntX8 set1(int value) { return {_mm256_set1_epi32(value)}; }
+};
+
+inline IntX8 operator+(IntX8 a, IntX8 b) { return {_mm256_add_epi32(a.v, b.v)}; }
+inline IntX8 operator-(IntX8 a, IntX8 b) { return {_mm256_sub_epi32(a.v, b.v)}; }
+inline IntX8 operator&(IntX8 a, IntX8 b) { return {_mm256_and_si256(a.v, b.v)}; }
+inline IntX8 andNot(IntX8 a, IntX8 b) { return {_mm256_andnot_si256(a.v, b.v)}; }
+
+struct FloatX8 {
+  using Int = IntX8;
+  static constexpr size_t WIDTH = 8;
+  __m256 v;
+
+  static FloatX8 set1(float value) { return {_mm256_set1_ps(value)}; }
+  static FloatX8 load(const float *values) { return {_mm256_load_ps(values)}; }
+  static IntX8 truncate(FloatX8 a) { return {_mm256_cvttps_epi32(a.v)}; }
+  static FloatX8 fromInt(IntX8 a) { return {_mm256_cvtepi32_ps(a.v)}; }
+  static FloatX8 isZero(IntX8 a) {
+    return {_mm256_castsi256_ps(_mm256_cmpeq_epi32(a.v, _mm256_setzero_si256()))};
+  }
+  static FloatX8 bitTwoToSign(IntX8 a) { return {_mm256_castsi256_ps(_mm256_slli_epi32(a.v, 29))}; }
+
+  // the stores go through the 4-wide transpose, one half at a time
+  template <typename Index>
+  static void storeMatrices(const FloatX8 (&columns)[12], Index index, size_t first, glm::mat4 *out) {
+    FloatX4 low[12];
+    FloatX4 high[12];
+    for (int i = 0; i < 12; i++) {
+      low[i] = {_mm256_castps256_ps128(columns[i].v)};
+      high[i] = {_mm256_extractf128_ps(columns[i].v, 1)};
+    }
+    FloatX4::storeMatrices(low, index, first, out);
+    FloatX4::storeMatrices(high, index, first + 4, out);
+  }
+};
+
+inline FloatX8 operator+(FloatX8 a, FloatX8 b) { return {_mm256_add_ps(a.v, b.v)}; }
+inline FloatX8 operator-(FloatX8 a, FloatX8 b) { return {_mm256_sub_ps(a.v, b.v)}; }
+inline FloatX8 operator*(FloatX8 a, FloatX8 b) { return {_mm256_mul_ps(a.v, b.v)}; }
+inline FloatX8 operator&(FloatX8 a, FloatX8 b) { return {_mm256_and_ps(a.v, b.v)}; }
+inline FloatX8 operator^(FloatX8 a, FloatX8 b) { return {_mm256_xor_ps(a.v, b.v)}; }
+inline FloatX8 operator-(FloatX8 a) { return a ^ FloatX8::set1(-0.f); }
+inline FloatX8 andNot(FloatX8 a, FloatX8 b) { return {_mm256_andnot_ps(a.v, b.v)}; }
+inline FloatX8 select(FloatX8 mask, FloatX8 a, FloatX8 b) { return {_mm256_blendv_ps(b.v, a.v, mask.v)}; }
+
+#endif
+
+template <typename Index>
+void composeRange(Index index, size_t count, const glm::vec3 *translations, const glm::vec3 *rotations,
+                  const glm::vec3 *scales, glm::mat4 *out) {
+  size_t i = 0;
+#if defined(TP_TRANSFORM_AVX2)
+  for (; i + FloatX8::WIDTH <= count; i += FloatX8::WIDTH) {
+    composeBlock<FloatX8>(index, i, translations, rotations, scales, out);
+  }
+#endif
+#if defined(TP_TRANSFORM_SSE2)
+  for (; i + FloatX4::WIDTH <= count; i += FloatX4::WIDTH) {
+    composeBlock<FloatX4>(index, i, translations, rotations, scales, out);
+  }
+#endif
+  for (; i < count; i++) {
+    size_t e = index(i);
+    composeScalar(translations[e], rotations[e], scales[e], out[e]);
+  }
+}
+
+}  // namespace
+
+glm::mat4 composeTransform(const glm::vec3 &translation, const glm::vec3 &rotation, const glm::vec3 &scale) {
+  auto transform = glm::translate(glm::mat4{1.f}, translation);
+  transform = glm::rotate(transform, rotation.y, {0, 1, 0});
+  transform = glm::rotate(transform, rotation.x, {1, 0, 0});
+  transform = glm::rotate(transform, rotation.z, {0, 0, 1});
+  return glm::scale(transform, scale);
+}
+
+void composeTransforms(const glm::vec3 *translations, const glm::vec3 *rotations, const glm::vec3 *scales,
+                       glm::mat4 *out, size_t count) {
+  composeRange(Contiguous{}, count, translations, rotations, scales, out);
+}
+
+void composeTransforms(const uint32_t *indices, size_t count, const glm::vec3 *translations,
+                       const glm::vec3 *rotations, const glm::vec3 *scales, glm::mat4 *out) {
+  composeRange(Indexed{indices}, count, translations, rotations, scales, out);
+}
+
+void composeTransformsScalar(const glm::vec3 *translations, const glm::vec3 *rotations, const glm::vec3 *scales,
+                             glm::mat4 *out, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    composeScalar(translations[i], rotations[i], scales[i], out[i]);
+  }
+}
+
+const char *transformKernelName() {
+#if defined(TP_TRANSFORM_AVX2)
+  return "avx2";
+#elif defined(TP_TRANSFORM_SSE2)
+  return "sse2";
+#else
+  return "scalar";
+#endif
+}
+
+}  // namespace teapot
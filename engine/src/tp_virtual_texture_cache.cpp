@@ -0,0 +1,543 @@
+#include "tp_virtual_texture_cache.h"
+#include "tp_cpu_profiler.h"
+#include "tp_image_layout.h"
+
+// std
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+namespace teapot {
+
+namespace {
+
+// PageTable in simple_shader_virtual.frag: a uvec4 of cache constants, a uvec4 per texture, the entries
+constexpr uint32_t PAGE_TABLE_HEADER_WORDS = 4 + 4 * TpVirtualTextureCache::MAX_TEXTURES;
+constexpr uint32_t ENTRY_VALID = 1u << 31;
+
+uint32_t encodeEntry(uint32_t slotX, uint32_t slotY, uint32_t mip) {
+  return ENTRY_VALID | mip << 16 | slotY << 8 | slotX;
+}
+
+void cacheBarrier(VkCommandBuffer commandBuffer, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout) {
+  TpImageLayoutInfo source = getImageLayoutInfo(oldLayout);
+  TpImageLayoutInfo destination = getImageLayoutInfo(newLayout);
+
+  VkImageMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.oldLayout = oldLayout;
+  barrier.newLayout = newLayout;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = image;
+  barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+  barrier.srcAccessMask = source.access;
+  barrier.dstAccessMask = destination.access;
+  vkCmdPipelineBarrier(commandBuffer,
+                       source.stages, destination.stages,
+                       0,
+                       0, nullptr,
+                       0, nullptr,
+                       1, &barrier);
+}
+
+}  // namespace
+
+TpVirtualTextureCache::TpVirtualTextureCache(TpDevice &device, uint32_t slotsPerSide, unsigned loaderThreads)
+    : tpDevice{device}, slotsPerSide{slotsPerSide}, slotSize{TpTiledImage::TILE_SIZE + 2 * TpTiledImage::BORDER} {
+  if (!tpDevice.supportsFragmentStores()) {
+    throw std::runtime_error("virtual texturing needs fragmentStoresAndAtomics");
+  }
+  // entries store slot coordinates in 8 bits each
+  if (slotsPerSide < 2 || slotsPerSide > 256 ||
+      slotsPerSide * slotSize > tpDevice.properties.limits.maxImageDimension2D) {
+    throw std::invalid_argument("unsupported virtual texture cache size");
+  }
+
+  slotPages.assign(slotsPerSide * slotsPerSide, NO_PAGE);
+  pinned.assign(slotsPerSide * slotsPerSide, false);
+  createCache();
+  createSampler();
+  createFrames();
+
+  for (unsigned i = 0; i < std::max(loaderThreads, 1u); i++) {
+    loaders.emplace_back([this]() { loaderLoop(); });
+  }
+  memoryPressureHandler = tpDevice.addMemoryPressureHandler([this](VkDeviceSize bytes) { return shrink(bytes); });
+}
+
+TpVirtualTextureCache::~TpVirtualTextureCache() {
+  tpDevice.removeMemoryPressureHandler(memoryPressureHandler);
+  {
+    std::lock_guard<std::mutex> lock{loadMutex};
+    stopping = true;
+  }
+  loadWake.notify_all();
+  for (auto &loader : loaders) loader.join();
+
+  for (auto &frame : frames) {
+    vmaUnmapMemory(tpDevice.allocator(), frame.pageTableAllocation);
+    vmaDestroyBuffer(tpDevice.allocator(), frame.pageTable, frame.pageTableAllocation);
+    vmaUnmapMemory(tpDevice.allocator(), frame.feedbackAllocation);
+    vmaDestroyBuffer(tpDevice.allocator(), frame.feedback, frame.feedbackAllocation);
+    vmaUnmapMemory(tpDevice.allocator(), frame.stagingAllocation);
+    vmaDestroyBuffer(tpDevice.allocator(), frame.staging, frame.stagingAllocation);
+  }
+  vkDestroySampler(tpDevice.device(), sampler, nullptr);
+  vkDestroyImageView(tpDevice.device(), view, nullptr);
+  vmaDestroyImage(tpDevice.allocator(), image, imageAllocation);
+}
+
+void TpVirtualTextureCache::createCache() {
+  VkImageCreateInfo imageInfo{};
+  imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  imageInfo.imageType = VK_IMAGE_TYPE_2D;
+  imageInfo.extent = {slotsPerSide * slotSize, slotsPerSide * slotSize, 1};
+  imageInfo.mipLevels = 1;
+  imageInfo.arrayLayers = 1;
+  imageInfo.format = FORMAT;
+  imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+  imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  // a source too for moving the pages when the cache shrinks
+  imageInfo.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+  imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+  tpDevice.createImageWithInfo(imageInfo, VMA_MEMORY_USAGE_GPU_ONLY, image, imageAllocation, TpMemoryClass::Textures);
+  view = tpDevice.createImageView(image, FORMAT);
+
+  // uploads expect the cache to be readable between frames; empty slots are never sampled
+  VkCommandBuffer commandBuffer = tpDevice.beginSingleTimeCommands();
+  cacheBarrier(commandBuffer, image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+  tpDevice.endSingleTimeCommands(commandBuffer);
+}
+
+void TpVirtualTextureCache::createSampler() {
+  // The cache has no mips, the shader picks the page's mip itself. Anisotropic footprints would
+  // reach past the page borders, so filtering stays bilinear.
+  VkSamplerCreateInfo samplerInfo{};
+  samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  samplerInfo.magFilter = VK_FILTER_LINEAR;
+  samplerInfo.minFilter = VK_FILTER_LINEAR;
+  samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerInfo.anisotropyEnable = VK_FALSE;
+  samplerInfo.maxAnisotropy = 1;
+  samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+  samplerInfo.unnormalizedCoordinates = VK_FALSE;
+  samplerInfo.compareEnable = VK_FALSE;
+  samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
+  samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  samplerInfo.mipLodBias = 0.0f;
+  samplerInfo.minLod = 0.0f;
+  samplerInfo.maxLod = 0.0f;
+  if (vkCreateSampler(tpDevice.device(), &samplerInfo, nullptr, &sampler) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create virtual texture sampler");
+  }
+}
+
+void TpVirtualTextureCache::createFrames() {
+  VmaAllocator allocator = tpDevice.allocator();
+  VkDeviceSize pageTableSize = (PAGE_TABLE_HEADER_WORDS + VkDeviceSize{MAX_PAGES}) * sizeof(uint32_t);
+  VkDeviceSize feedbackSize = VkDeviceSize{MAX_PAGES} * sizeof(uint32_t);
+  VkDeviceSize stagingSize = MAX_UPLOADS_PER_FRAME * VkDeviceSize{slotSize} * slotSize * 4;
+
+  frames.resize(TpSwapChain::MAX_FRAMES_IN_FLIGHT);
+  for (auto &frame : frames) {
+    tpDevice.createBuffer(pageTableSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU,
+                          frame.pageTable, frame.pageTableAllocation, TpMemoryClass::Dynamic);
+    vmaMapMemory(allocator, frame.pageTableAllocation, &frame.pageTableMapped);
+
+    // read back by the cpu, so host cached
+    tpDevice.createBuffer(feedbackSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU,
+                          frame.feedback, frame.feedbackAllocation);
+    vmaMapMemory(allocator, frame.feedbackAllocation, &frame.feedbackMapped);
+    std::memset(frame.feedbackMapped, 0, static_cast<size_t>(feedbackSize));
+    vmaFlushAllocation(allocator, frame.feedbackAllocation, 0, VK_WHOLE_SIZE);
+
+    tpDevice.createBuffer(stagingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY,
+                          frame.staging, frame.stagingAllocation, TpMemoryClass::Staging);
+    vmaMapMemory(allocator, frame.stagingAllocation, &frame.stagingMapped);
+  }
+}
+
+uint32_t TpVirtualTextureCache::add(const std::string &tiledImagePath) {
+  TP_PROFILE_SCOPE("TpVirtualTextureCache::add");
+  auto tiledImage = std::make_unique<TpTiledImage>(tiledImagePath);
+  const TpTiledImageInfo &info = tiledImage->getInfo();
+  uint32_t coarsest = info.mipCount - 1;
+  if (info.tileSize != TpTiledImage::TILE_SIZE || info.border != TpTiledImage::BORDER ||
+      info.tilesX(coarsest) * info.tilesY(coarsest) != 1) {
+    throw std::runtime_error("tiled image does not match the cache layout: " + tiledImagePath);
+  }
+  if (textures.size() == MAX_TEXTURES || pages.size() + info.tileCount() > MAX_PAGES) {
+    throw std::runtime_error("virtual texture cache has no room for " + tiledImagePath);
+  }
+
+  auto texture = static_cast<uint32_t>(textures.size());
+  auto firstPage = static_cast<uint32_t>(pages.size());
+  for (uint32_t mip = 0; mip < info.mipCount; mip++) {
+    for (uint32_t tile = info.firstTile(mip); tile < info.firstTile(mip + 1); tile++) {
+      Page page{};
+      page.texture = texture;
+      page.mip = mip;
+      page.tile = tile;
+      pages.push_back(page);
+    }
+  }
+  pageTable.resize(pages.size(), 0);
+
+  // the coarsest mip is the fallback of every other page and is pinned
+  uint32_t slot = allocateSlot();
+  if (slot == NO_PAGE) {
+    pages.resize(firstPage);
+    pageTable.resize(firstPage);
+    throw std::runtime_error("virtual texture cache has no free slot for " + tiledImagePath);
+  }
+  uint32_t root = firstPage + info.firstTile(coarsest);
+  pinned[slot] = true;
+  slotPages[slot] = root;
+  pages[root].slot = slot;
+
+  // a staging buffer of its own, the frames' buffers may still be in use by frames in flight
+  VkDeviceSize tileBytes = VkDeviceSize{slotSize} * slotSize * 4;
+  VmaAllocator allocator = tpDevice.allocator();
+  VkBuffer staging;
+  VmaAllocation stagingAllocation;
+  tpDevice.createBuffer(tileBytes, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY,
+                        staging, stagingAllocation, TpMemoryClass::Staging);
+  void *mapped;
+  vmaMapMemory(allocator, stagingAllocation, &mapped);
+  tiledImage->readTile(info.firstTile(coarsest), static_cast<unsigned char *>(mapped));
+  vmaFlushAllocation(allocator, stagingAllocation, 0, VK_WHOLE_SIZE);
+  vmaUnmapMemory(allocator, stagingAllocation);
+  VkCommandBuffer commandBuffer = tpDevice.beginSingleTimeCommands();
+  VkBufferImageCopy region = slotRegion(slot, 0);
+  cacheBarrier(commandBuffer, image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+  vkCmdCopyBufferToImage(commandBuffer, staging, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+  cacheBarrier(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+  tpDevice.deferDestroy(tpDevice.endSingleTimeCommands(commandBuffer), [=]() {
+    vmaDestroyBuffer(allocator, staging, stagingAllocation);
+  });
+
+  textures.push_back({std::move(tiledImage), firstPage, true});
+  refreshPageTable(texture);
+  pageTableVersion++;
+  return texture;
+}
+
+void TpVirtualTextureCache::update(VkCommandBuffer commandBuffer, int frameIndex) {
+  TP_PROFILE_SCOPE("TpVirtualTextureCache::update");
+  updateCount++;
+  // the previous frame was submitted since the last update
+  if (lastFrameIndex >= 0) frames[lastFrameIndex].retireValue = tpDevice.lastSubmittedGraphicsValue();
+  Frame &frame = frames[frameIndex];
+  if (frame.submitted) {
+    // normally a no-op, the swap chain already waited for the frame that used these buffers
+    tpDevice.waitForGraphicsValue(frame.retireValue);
+    readFeedback(frame);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock{loadMutex};
+    for (auto &loaded : loadedPages) readyPages.push_back(std::move(loaded));
+    loadedPages.clear();
+  }
+
+  VkDeviceSize tileBytes = VkDeviceSize{slotSize} * slotSize * 4;
+  auto *staging = static_cast<unsigned char *>(frame.stagingMapped);
+  std::vector<VkBufferImageCopy> regions;
+  size_t taken = 0;
+  for (; taken < readyPages.size() && regions.size() < MAX_UPLOADS_PER_FRAME; taken++) {
+    LoadedPage &loaded = readyPages[taken];
+    Page &page = pages[loaded.page];
+    page.loading = false;
+    pendingLoads--;
+    if (loaded.pixels.empty()) {
+      page.failed = true;
+      continue;
+    }
+    // with every slot in use this frame the page is dropped, and requested again while needed
+    uint32_t slot = allocateSlot();
+    if (slot == NO_PAGE) continue;
+
+    VkDeviceSize offset = regions.size() * tileBytes;
+    std::memcpy(staging + offset, loaded.pixels.data(), static_cast<size_t>(tileBytes));
+    regions.push_back(slotRegion(slot, offset));
+    slotPages[slot] = loaded.page;
+    page.slot = slot;
+    textures[page.texture].dirty = true;
+  }
+  readyPages.erase(readyPages.begin(), readyPages.begin() + static_cast<std::ptrdiff_t>(taken));
+  uploads = static_cast<uint32_t>(regions.size());
+
+  if (!regions.empty()) {
+    vmaFlushAllocation(tpDevice.allocator(), frame.stagingAllocation, 0, VK_WHOLE_SIZE);
+    // also orders the copy after the reads of earlier frames from the slots it replaces
+    cacheBarrier(commandBuffer, image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    vkCmdCopyBufferToImage(commandBuffer, frame.staging, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           static_cast<uint32_t>(regions.size()), regions.data());
+    cacheBarrier(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+  }
+
+  for (uint32_t texture = 0; texture < textures.size(); texture++) {
+    if (!textures[texture].dirty) continue;
+    refreshPageTable(texture);
+    pageTableVersion++;
+  }
+  writePageTable(frame);
+  frame.submitted = true;
+  lastFrameIndex = frameIndex;
+  recording = true;
+}
+
+void TpVirtualTextureCache::finishFrame(VkCommandBuffer commandBuffer) {
+  recording = false;
+  VkMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  vkCmdPipelineBarrier(commandBuffer,
+                       VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                       0,
+                       1, &barrier,
+                       0, nullptr,
+                       0, nullptr);
+}
+
+void TpVirtualTextureCache::readFeedback(Frame &frame) {
+  vmaInvalidateAllocation(tpDevice.allocator(), frame.feedbackAllocation, 0, VK_WHOLE_SIZE);
+  auto *requests = static_cast<uint32_t *>(frame.feedbackMapped);
+  std::vector<uint32_t> missing;
+  requestedPages = 0;
+  for (uint32_t index = 0; index < pages.size(); index++) {
+    if (requests[index] == 0) continue;
+    requests[index] = 0;
+    requestedPages++;
+    Page &page = pages[index];
+    page.lastRequested = updateCount;
+    if (page.slot == NO_PAGE && !page.loading && !page.failed) missing.push_back(index);
+  }
+  vmaFlushAllocation(tpDevice.allocator(), frame.feedbackAllocation, 0, VK_WHOLE_SIZE);
+
+  // coarse pages first: they cover more of the screen and are the fallback of the finer ones
+  std::stable_sort(missing.begin(), missing.end(),
+                   [this](uint32_t a, uint32_t b) { return pages[a].mip > pages[b].mip; });
+  for (uint32_t page : missing) requestLoad(page);
+}
+
+void TpVirtualTextureCache::requestLoad(uint32_t index) {
+  if (pendingLoads >= MAX_PENDING_LOADS) return;
+  Page &page = pages[index];
+  page.loading = true;
+  pendingLoads++;
+  {
+    std::lock_guard<std::mutex> lock{loadMutex};
+    loadQueue.push_back({index, textures[page.texture].image.get(), page.tile});
+  }
+  loadWake.notify_one();
+}
+
+void TpVirtualTextureCache::loaderLoop() {
+  while (true) {
+    LoadRequest request{};
+    {
+      std::unique_lock<std::mutex> lock{loadMutex};
+      loadWake.wait(lock, [this]() { return stopping || !loadQueue.empty(); });
+      if (stopping) return;
+      request = loadQueue.front();
+      loadQueue.pop_front();
+    }
+
+    LoadedPage loaded{request.page, {}};
+    try {
+      loaded.pixels.resize(static_cast<size_t>(request.image->getInfo().tileBytes()));
+      request.image->readTile(request.tile, loaded.pixels.data());
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      loaded.pixels.clear();
+    }
+
+    std::lock_guard<std::mutex> lock{loadMutex};
+    loadedPages.push_back(std::move(loaded));
+  }
+}
+
+uint32_t TpVirtualTextureCache::allocateSlot() {
+  uint32_t victim = NO_PAGE;
+  uint64_t oldest = updateCount;
+  for (uint32_t slot = 0; slot < slotPages.size(); slot++) {
+    if (slotPages[slot] == NO_PAGE) return slot;
+    if (pinned[slot]) continue;
+    uint64_t lastRequested = pages[slotPages[slot]].lastRequested;
+    if (lastRequested < oldest) {
+      oldest = lastRequested;
+      victim = slot;
+    }
+  }
+  if (victim != NO_PAGE) evict(victim);
+  return victim;
+}
+
+void TpVirtualTextureCache::evict(uint32_t slot) {
+  Page &page = pages[slotPages[slot]];
+  page.slot = NO_PAGE;
+  textures[page.texture].dirty = true;
+  slotPages[slot] = NO_PAGE;
+  evictions++;
+}
+
+VkBufferImageCopy TpVirtualTextureCache::slotRegion(uint32_t slot, VkDeviceSize bufferOffset) const {
+  VkBufferImageCopy region{};
+  region.bufferOffset = bufferOffset;
+  region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+  region.imageOffset = {static_cast<int32_t>(slot % slotsPerSide * slotSize),
+                        static_cast<int32_t>(slot / slotsPerSide * slotSize), 0};
+  region.imageExtent = {slotSize, slotSize, 1};
+  return region;
+}
+
+void TpVirtualTextureCache::refreshPageTable(uint32_t texture) {
+  Texture &entry = textures[texture];
+  const TpTiledImageInfo &info = entry.image->getInfo();
+  // coarse to fine, so the fallback of a missing tile is already known; the parent of a tile is
+  // clamped like in the shader for mips whose size was rounded down
+  for (uint32_t mip = info.mipCount; mip-- > 0;) {
+    uint32_t first = entry.firstPage + info.firstTile(mip);
+    uint32_t tilesX = info.tilesX(mip);
+    for (uint32_t y = 0; y < info.tilesY(mip); y++) {
+      for (uint32_t x = 0; x < tilesX; x++) {
+        uint32_t index = first + y * tilesX + x;
+        uint32_t slot = pages[index].slot;
+        if (slot != NO_PAGE) {
+          pageTable[index] = encodeEntry(slot % slotsPerSide, slot / slotsPerSide, mip);
+        } else if (mip + 1 < info.mipCount) {
+          uint32_t parentX = std::min(x / 2, info.tilesX(mip + 1) - 1);
+          uint32_t parentY = std::min(y / 2, info.tilesY(mip + 1) - 1);
+          pageTable[index] = pageTable[entry.firstPage + info.firstTile(mip + 1) +
+                                       parentY * info.tilesX(mip + 1) + parentX];
+        } else {
+          pageTable[index] = 0;
+        }
+      }
+    }
+  }
+  entry.dirty = false;
+}
+
+void TpVirtualTextureCache::writePageTable(Frame &frame) {
+  auto *words = static_cast<uint32_t *>(frame.pageTableMapped);
+  uint32_t phase = static_cast<uint32_t>(updateCount % (FEEDBACK_STRIDE * FEEDBACK_STRIDE));
+  uint32_t header[4] = {slotsPerSide, TpTiledImage::TILE_SIZE, TpTiledImage::BORDER, phase};
+  std::memcpy(words, header, sizeof(header));
+  for (uint32_t texture = 0; texture < textures.size(); texture++) {
+    const TpTiledImageInfo &info = textures[texture].image->getInfo();
+    uint32_t *words4 = words + 4 + 4 * texture;
+    words4[0] = textures[texture].firstPage;
+    words4[1] = info.width;
+    words4[2] = info.height;
+    words4[3] = info.mipCount;
+  }
+
+  VkDeviceSize written = PAGE_TABLE_HEADER_WORDS * sizeof(uint32_t);
+  if (frame.pageTableVersion != pageTableVersion) {
+    std::memcpy(words + PAGE_TABLE_HEADER_WORDS, pageTable.data(), pageTable.size() * sizeof(uint32_t));
+    written += pageTable.size() * sizeof(uint32_t);
+    frame.pageTableVersion = pageTableVersion;
+  }
+  vmaFlushAllocation(tpDevice.allocator(), frame.pageTableAllocation, 0, written);
+}
+
+VkDeviceSize TpVirtualTextureCache::shrink(VkDeviceSize bytes) {
+  // the frame's page table and descriptor set already name the current slots and view
+  if (recording) return 0;
+
+  VkDeviceSize slotBytes = VkDeviceSize{slotSize} * slotSize * 4;
+  // room for the pinned pages and as many requested ones
+  auto minSide = static_cast<uint32_t>(std::ceil(std::sqrt(2.0 * static_cast<double>(textures.size()))));
+  minSide = std::max(minSide, MIN_SLOTS_PER_SIDE);
+  if (slotsPerSide <= minSide) return 0;
+  uint32_t side = slotsPerSide - 1;
+  while (side > minSide && VkDeviceSize{slotsPerSide * slotsPerSide - side * side} * slotBytes < bytes) side--;
+  TP_PROFILE_SCOPE("TpVirtualTextureCache::shrink");
+
+  // the pinned pages and then the most recently requested ones move to the new image
+  std::vector<uint32_t> resident;
+  for (uint32_t slot = 0; slot < slotPages.size(); slot++) {
+    if (slotPages[slot] != NO_PAGE) resident.push_back(slot);
+  }
+  std::stable_sort(resident.begin(), resident.end(), [this](uint32_t a, uint32_t b) {
+    if (pinned[a] != pinned[b]) return static_cast<bool>(pinned[a]);
+    return pages[slotPages[a]].lastRequested > pages[slotPages[b]].lastRequested;
+  });
+  size_t kept = std::min<size_t>(resident.size(), side * side);
+  for (size_t i = kept; i < resident.size(); i++) evict(resident[i]);
+
+  uint32_t oldSide = slotsPerSide;
+  VkImage oldImage = image;
+  VmaAllocation oldAllocation = imageAllocation;
+  VkImageView oldView = view;
+  slotsPerSide = side;
+  createCache();
+
+  std::vector<VkImageCopy> regions;
+  std::vector<uint32_t> keptPages(side * side, NO_PAGE);
+  std::vector<bool> keptPinned(side * side, false);
+  for (uint32_t slot = 0; slot < kept; slot++) {
+    uint32_t oldSlot = resident[slot];
+    VkImageCopy region{};
+    region.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.srcOffset = {static_cast<int32_t>(oldSlot % oldSide * slotSize),
+                        static_cast<int32_t>(oldSlot / oldSide * slotSize), 0};
+    region.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.dstOffset = slotRegion(slot, 0).imageOffset;
+    region.extent = {slotSize, slotSize, 1};
+    regions.push_back(region);
+
+    Page &page = pages[slotPages[oldSlot]];
+    page.slot = slot;
+    textures[page.texture].dirty = true;
+    keptPages[slot] = slotPages[oldSlot];
+    keptPinned[slot] = pinned[oldSlot];
+  }
+  slotPages = std::move(keptPages);
+  pinned = std::move(keptPinned);
+
+  // the old image is not moved back out of TRANSFER_SRC, it is only destroyed
+  VkCommandBuffer commandBuffer = tpDevice.beginSingleTimeCommands();
+  cacheBarrier(commandBuffer, oldImage, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+  cacheBarrier(commandBuffer, image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+  vkCmdCopyImage(commandBuffer, oldImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image,
+                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, static_cast<uint32_t>(regions.size()), regions.data());
+  cacheBarrier(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+  tpDevice.endSingleTimeCommands(commandBuffer);
+
+  // frames in flight still sample the old view
+  VkDevice device = tpDevice.device();
+  VmaAllocator allocator = tpDevice.allocator();
+  tpDevice.deferDestroy(tpDevice.lastSubmittedGraphicsValue(), [=]() {
+    vkDestroyImageView(device, oldView, nullptr);
+    vmaDestroyImage(allocator, oldImage, oldAllocation);
+  });
+  shrinks++;
+  return VkDeviceSize{oldSide * oldSide - side * side} * slotBytes;
+}
+
+TpVirtualTextureStats TpVirtualTextureCache::getStats() const {
+  TpVirtualTextureStats stats{};
+  stats.textures = static_cast<uint32_t>(textures.size());
+  stats.slots = static_cast<uint32_t>(slotPages.size());
+  stats.residentPages = static_cast<uint32_t>(
+      std::count_if(slotPages.begin(), slotPages.end(), [](uint32_t page) { return page != NO_PAGE; }));
+  stats.requestedPages = requestedPages;
+  stats.pendingLoads = pendingLoads;
+  stats.uploads = uploads;
+  stats.evictions = evictions;
+  stats.cacheBytes = uint64_t{slotsPerSide} * slotSize * slotsPerSide * slotSize * 4;
+  stats.shrinks = shrinks;
+  return stats;
+}
+
+}  // namespace teapot
@@ -5,7 +5,8 @@
 
 namespace teapot {
 
-TpWindow::TpWindow(int w, int h, std::string name) : width{w}, height{h}, windowName{name} {
+TpWindow::TpWindow(int w, int h, std::string name, bool visible)
+    : width{w}, height{h}, visible{visible}, windowName{name} {
   initWindow();
 }
 
@@ -18,6 +19,7 @@ void TpWindow::initWindow() {
   glfwInit();
   glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
   glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
+  glfwWindowHint(GLFW_VISIBLE, visible ? GLFW_TRUE : GLFW_FALSE);
 
   window = glfwCreateWindow(width, height, windowName.c_str(), nullptr, nullptr);
   glfwSetWindowUserPointer(window, this);